@@ -124,6 +124,18 @@ struct allocator_functions {
                   uint64_t count, uint64_t offset,
                   struct nbdkit_extents *extents)
   __attribute__ ((__nonnull__ (1, 4)));
+
+  /* Optional.  Return a pointer to the allocator's own storage for
+   * [offset, offset+count-1], so that the caller can write data there
+   * directly and then pass the same pointer to .write, which will
+   * not copy it.  Returns NULL if this is not possible.
+   *
+   * Only the malloc allocator implements this, and only for ranges
+   * within the size hint.  The pointer remains valid until a write
+   * beyond the size hint extends the array.
+   */
+  void *(*get_ptr) (struct allocator *a, uint64_t count, uint64_t offset)
+  __attribute__ ((__nonnull__ (1)));
 };
 
 struct allocator {
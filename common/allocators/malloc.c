@@ -195,10 +195,25 @@ m_alloc_write (struct allocator *a, const void *buf,
    * the metadata and it was acquired if we called extend().
    */
   ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&ma->lock);
-  memcpy (ma->ba.ptr + offset, buf, count);
+  /* If the data was written in place (see m_alloc_get_ptr) there is
+   * nothing to copy.
+   */
+  if (buf != ma->ba.ptr + offset)
+    memcpy (ma->ba.ptr + offset, buf, count);
   return 0;
 }
 
+static void *
+m_alloc_get_ptr (struct allocator *a, uint64_t count, uint64_t offset)
+{
+  struct m_alloc *ma = (struct m_alloc *) a;
+  ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&ma->lock);
+
+  if (offset + count > ma->ba.cap)
+    return NULL;
+  return ma->ba.ptr + offset;
+}
+
 static int
 m_alloc_fill (struct allocator *a, char c, uint64_t count, uint64_t offset)
 {
@@ -314,6 +329,7 @@ static struct allocator_functions functions = {
   .zero = m_alloc_zero,
   .blit = m_alloc_blit,
   .extents = m_alloc_extents,
+  .get_ptr = m_alloc_get_ptr,
 };
 
 static void register_malloc (void) __attribute__ ((constructor));
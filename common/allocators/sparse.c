@@ -38,10 +38,12 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
+#include <limits.h>
 #include <errno.h>
 #include <assert.h>
 
 #include <pthread.h>
+#include <sched.h>
 
 #include <nbdkit-plugin.h>
 
@@ -88,7 +90,7 @@
  * contains an ordered, non-overlapping, non-contiguous list of
  * (offset, pointer to L2 directory).
  *
- * Updating the L1 directory requires a linear scan but that operation
+ * Updating the L1 directory requires copying it but that operation
  * should be very rare.  Because the L1 directory is stored in order
  * of offset, we can use an efficient binary search for lookups.
  *
@@ -112,6 +114,36 @@
 #define SPARSE_PAGE 32768
 #define L2_SIZE     4096
 
+/* Concurrency.
+ *
+ * Reads, writes and the other operations do not take any lock.  The
+ * L1 directory is never modified once it has been published.  To
+ * insert an entry, a new copy of the L1 directory is made and
+ * published by atomically swapping the pointer in the sparse_array
+ * (if another thread got there first, we try again).  New L2
+ * directories are only published as part of a new L1 directory, and
+ * new pages are published by atomically swapping a NULL page pointer
+ * in the L2 directory.  So there is never any need for an exclusive
+ * lock to add to the array.
+ *
+ * The difficulty is freeing memory: an old L1 directory which has
+ * been replaced, or a page which has been zeroed, may still be in use
+ * by another thread.  Each operation therefore marks itself as a
+ * reader in one of the reader slots while it is accessing the array.
+ * To free memory, we first make it unreachable, then wait until every
+ * operation which might have seen it has finished (see
+ * synchronize_readers), which is a simplified form of RCU.  This only
+ * happens when a new L1 entry is created, or when a whole page is
+ * zeroed.
+ *
+ * Each thread uses one reader slot, and there are enough slots that
+ * threads rarely share one, so threads don't compete for the same
+ * cache line.  Each slot has two counters.  The epoch selects which
+ * counter new readers use.  This lets synchronize_readers wait for
+ * the old readers without being held up by new ones.
+ */
+#define NR_READER_SLOTS 64
+
 struct l2_entry {
   void *page;                /* Pointer to page (array of SPARSE_PAGE bytes).*/
 };
@@ -121,28 +153,125 @@ struct l1_entry {
   struct l2_entry *l2_dir;      /* Pointer to L2 directory (L2_SIZE entries). */
 };
 
-DEFINE_VECTOR_TYPE (l1_dir, struct l1_entry);
+/* The L1 directory, ordered by offset.  This is never modified after
+ * it has been published.
+ */
+struct l1_dir {
+  struct l1_dir *next;          /* Used to list L1 directories to free. */
+  size_t len;
+  struct l1_entry entries[];
+};
+
+struct reader_slot {
+  uint64_t readers[2];          /* Number of readers in each epoch. */
+  char padding[64 - 2 * sizeof (uint64_t)]; /* Avoid false sharing. */
+};
+
+DEFINE_VECTOR_TYPE (page_list, void *);
 
 struct sparse_array {
   struct allocator a;           /* Must come first. */
 
-  /* The shared (read) lock must be held if you just want to access
-   * the data without modifying any of the L1/L2 metadata or
-   * allocating or freeing any page.
-   *
-   * To modify the L1/L2 metadata including allocating or freeing any
-   * page you must hold the exclusive (write) lock.
-   *
-   * Because POSIX rwlocks are not upgradable this presents a problem.
-   * We solve it below by speculatively performing the request while
-   * holding the shared lock, but if we run into an operation that
-   * needs to update the metadata, we restart the entire request
-   * holding the exclusive lock.
-   */
-  pthread_rwlock_t lock;
-  l1_dir l1_dir;                /* L1 directory. */
+  struct l1_dir *l1_dir;        /* L1 directory (NULL if empty). */
+
+  /* Serializes synchronize_readers, and protects the epoch. */
+  pthread_mutex_t sync_lock;
+  unsigned epoch;
+
+  struct reader_slot slots[NR_READER_SLOTS];
 };
 
+/* The reader slot used by the current thread. */
+static __thread unsigned reader_slot = UINT_MAX;
+static unsigned next_reader_slot;
+
+/* Mark the start and end of an operation which accesses the array.
+ * Any memory seen by the operation will not be freed until it calls
+ * read_end.  The operation must not call synchronize_readers
+ * in between.
+ */
+static uint64_t *
+read_begin (struct sparse_array *sa)
+{
+  uint64_t *counter;
+  unsigned epoch;
+
+  if (reader_slot == UINT_MAX)
+    reader_slot = __atomic_fetch_add (&next_reader_slot, 1,
+                                      __ATOMIC_RELAXED) % NR_READER_SLOTS;
+
+  epoch = __atomic_load_n (&sa->epoch, __ATOMIC_RELAXED);
+  counter = &sa->slots[reader_slot].readers[epoch & 1];
+  __atomic_fetch_add (counter, 1, __ATOMIC_RELAXED);
+  /* Order the counter before any access to the array.  This pairs
+   * with the fence in synchronize_readers.
+   */
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  return counter;
+}
+
+static void
+read_end (uint64_t *counter)
+{
+  __atomic_fetch_sub (counter, 1, __ATOMIC_RELEASE);
+}
+
+/* Wait until all operations which started before this call have
+ * finished.  Anything which was made unreachable before calling this
+ * can then be freed.
+ */
+static void
+synchronize_readers (struct sparse_array *sa)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&sa->sync_lock);
+  unsigned i, epoch;
+  size_t j;
+
+  /* Flip the epoch and wait for the readers of the old epoch, twice,
+   * because a reader may have read the epoch before we flipped it but
+   * incremented its counter afterwards.
+   */
+  for (i = 0; i < 2; ++i) {
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    epoch = sa->epoch;
+    __atomic_store_n (&sa->epoch, epoch + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+    for (j = 0; j < NR_READER_SLOTS; ++j) {
+      while (__atomic_load_n (&sa->slots[j].readers[epoch & 1],
+                              __ATOMIC_ACQUIRE) > 0)
+        sched_yield ();
+    }
+  }
+}
+
+/* Free L1 directories and pages which have been made unreachable,
+ * after waiting for any operation which might still be using them.
+ * This must be called after read_end.
+ */
+static void
+free_unreachable (struct sparse_array *sa,
+                  struct l1_dir *l1_dirs, page_list *pages)
+{
+  struct l1_dir *next;
+  size_t i;
+
+  if (l1_dirs == NULL && (pages == NULL || pages->len == 0))
+    return;
+
+  synchronize_readers (sa);
+
+  for (; l1_dirs != NULL; l1_dirs = next) {
+    next = l1_dirs->next;
+    free (l1_dirs);
+  }
+  if (pages) {
+    for (i = 0; i < pages->len; ++i)
+      free (pages->ptr[i]);
+    page_list_reset (pages);
+  }
+}
+
 /* Free L1 and/or L2 directories. */
 static void
 free_l2_dir (struct l2_entry *l2_dir)
@@ -161,10 +290,12 @@ sparse_array_free (struct allocator *a)
   size_t i;
 
   if (sa) {
-    for (i = 0; i < sa->l1_dir.len; ++i)
-      free_l2_dir (sa->l1_dir.ptr[i].l2_dir);
-    free (sa->l1_dir.ptr);
-    pthread_rwlock_destroy (&sa->lock);
+    if (sa->l1_dir) {
+      for (i = 0; i < sa->l1_dir->len; ++i)
+        free_l2_dir (sa->l1_dir->entries[i].l2_dir);
+      free (sa->l1_dir);
+    }
+    pthread_mutex_destroy (&sa->sync_lock);
     free (sa);
   }
 }
@@ -176,53 +307,92 @@ sparse_array_set_size_hint (struct allocator *a, uint64_t size)
   return 0;
 }
 
-/* Comparison function used when searching through the L1 directory. */
-static int
-compare_l1_offsets (const void *offsetp, const struct l1_entry *e)
+/* Binary search of the L1 directory.  Returns the entry containing
+ * offset, or NULL if there is no such entry, in which case *pos is
+ * set to the position where the entry should be inserted.
+ */
+static struct l1_entry *
+search_l1_dir (struct l1_dir *l1_dir, uint64_t offset, size_t *pos)
 {
-  const uint64_t offset = *(uint64_t *)offsetp;
-
-  if (offset < e->offset) return -1;
-  if (offset >= e->offset + SPARSE_PAGE*L2_SIZE) return 1;
-  return 0;
+  size_t lo = 0, hi = l1_dir ? l1_dir->len : 0, mid;
+  struct l1_entry *e;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    e = &l1_dir->entries[mid];
+    if (offset < e->offset)
+      hi = mid;
+    else if (offset >= e->offset + SPARSE_PAGE*L2_SIZE)
+      lo = mid + 1;
+    else
+      return e;
+  }
+  if (pos)
+    *pos = lo;
+  return NULL;
 }
 
 /* Insert an entry in the L1 directory, keeping it ordered by offset.
- * This involves an expensive linear scan but should be very rare.
+ * This involves copying the directory but should be very rare.  The
+ * old L1 directory is added to the *unreachable list.
  */
 static int
-insert_l1_entry (struct sparse_array *sa, const struct l1_entry *entry)
+insert_l1_entry (struct sparse_array *sa, uint64_t offset,
+                 struct l1_dir **unreachable)
 {
-  size_t i;
+  struct l1_entry entry;
+  struct l1_dir *old_dir, *new_dir;
+  size_t i, len;
 
-  for (i = 0; i < sa->l1_dir.len; ++i) {
-    if (entry->offset < sa->l1_dir.ptr[i].offset) {
-      /* Insert new entry before i'th directory entry. */
-      if (l1_dir_insert (&sa->l1_dir, *entry, i) == -1) {
-        nbdkit_error ("realloc: %m");
-        return -1;
-      }
-      if (sa->a.debug)
-        nbdkit_debug ("%s: inserted new L1 entry for %" PRIu64
-                      " at l1_dir.ptr[%zu]",
-                      __func__, entry->offset, i);
+  entry.offset = offset & ~(SPARSE_PAGE*L2_SIZE-1);
+  entry.l2_dir = calloc (L2_SIZE, sizeof (struct l2_entry));
+  if (entry.l2_dir == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+
+  old_dir = __atomic_load_n (&sa->l1_dir, __ATOMIC_ACQUIRE);
+  for (;;) {
+    /* Another thread may have inserted the entry. */
+    if (search_l1_dir (old_dir, offset, &i) != NULL) {
+      free (entry.l2_dir);
       return 0;
     }
 
-    /* This should never happens since each entry in the the L1
-     * directory is supposed to be unique.
-     */
-    assert (entry->offset != sa->l1_dir.ptr[i].offset);
-  }
+    len = old_dir ? old_dir->len : 0;
+    new_dir = malloc (sizeof *new_dir + (len+1) * sizeof (struct l1_entry));
+    if (new_dir == NULL) {
+      nbdkit_error ("malloc: %m");
+      free (entry.l2_dir);
+      return -1;
+    }
+    new_dir->next = NULL;
+    new_dir->len = len+1;
+    if (len > 0) {
+      memcpy (&new_dir->entries[0], &old_dir->entries[0],
+              i * sizeof (struct l1_entry));
+      memcpy (&new_dir->entries[i+1], &old_dir->entries[i],
+              (len-i) * sizeof (struct l1_entry));
+    }
+    new_dir->entries[i] = entry;
 
-  /* Insert new entry at the end. */
-  if (l1_dir_append (&sa->l1_dir, *entry) == -1) {
-    nbdkit_error ("realloc: %m");
-    return -1;
+    if (__atomic_compare_exchange_n (&sa->l1_dir, &old_dir, new_dir, false,
+                                     __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+      break;
+
+    /* Lost the race, old_dir is now the new directory, try again. */
+    free (new_dir);
   }
+
   if (sa->a.debug)
     nbdkit_debug ("%s: inserted new L1 entry for %" PRIu64
-                  " at end of l1_dir", __func__, entry->offset);
+                  " at l1_dir->entries[%zu]",
+                  __func__, entry.offset, i);
+
+  if (old_dir) {
+    old_dir->next = *unreachable;
+    *unreachable = old_dir;
+  }
   return 0;
 }
 
@@ -231,27 +401,32 @@ insert_l1_entry (struct sparse_array *sa, const struct l1_entry *entry)
  * directory entry containing the page pointer.
  *
  * If the create flag is set then a new page and/or directory will be
- * allocated if necessary.  Use this flag when writing.
+ * allocated if necessary.  Use this flag when writing.  Any L1
+ * directory which is replaced is added to the *unreachable list,
+ * which the caller must free with free_unreachable.
  *
  * NULL may be returned normally if the page is not mapped (meaning it
  * reads as zero).  However if the create flag is set and NULL is
  * returned, this indicates an error.
+ *
+ * This must be called between read_begin and read_end.
  */
 static void *
 lookup (struct sparse_array *sa, uint64_t offset, bool create,
-        uint64_t *remaining, struct l2_entry **l2_entry)
+        uint64_t *remaining, struct l2_entry **l2_entry,
+        struct l1_dir **unreachable)
 {
   struct l1_entry *entry;
   struct l2_entry *l2_dir;
   uint64_t o;
-  void *page;
-  struct l1_entry new_entry;
+  void *page, *new_page;
 
   *remaining = SPARSE_PAGE - (offset & (SPARSE_PAGE-1));
 
  again:
   /* Search the L1 directory. */
-  entry = l1_dir_search (&sa->l1_dir, &offset, compare_l1_offsets);
+  entry = search_l1_dir (__atomic_load_n (&sa->l1_dir, __ATOMIC_ACQUIRE),
+                         offset, NULL);
 
   if (sa->a.debug) {
     if (entry)
@@ -268,15 +443,22 @@ lookup (struct sparse_array *sa, uint64_t offset, bool create,
     o = (offset - entry->offset) / SPARSE_PAGE;
     if (l2_entry)
       *l2_entry = &l2_dir[o];
-    page = l2_dir[o].page;
+    page = __atomic_load_n (&l2_dir[o].page, __ATOMIC_ACQUIRE);
     if (!page && create) {
-      /* No page allocated.  Allocate one if creating. */
-      page = calloc (SPARSE_PAGE, 1);
-      if (page == NULL) {
+      /* No page allocated.  Allocate one if creating.  If another
+       * thread allocated the page at the same time then use its page.
+       */
+      new_page = calloc (SPARSE_PAGE, 1);
+      if (new_page == NULL) {
         nbdkit_error ("calloc: %m");
         return NULL;
       }
-      l2_dir[o].page = page;
+      if (__atomic_compare_exchange_n (&l2_dir[o].page, &page, new_page,
+                                       false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        page = new_page;
+      else
+        free (new_page);
     }
     if (!page)
       return NULL;
@@ -293,17 +475,35 @@ lookup (struct sparse_array *sa, uint64_t offset, bool create,
    * allocate the L2 directory with NULL page pointers.  Then we can
    * repeat the above search to create the page.
    */
-  new_entry.offset = offset & ~(SPARSE_PAGE*L2_SIZE-1);
-  new_entry.l2_dir = calloc (L2_SIZE, sizeof (struct l2_entry));
-  if (new_entry.l2_dir == NULL) {
-    nbdkit_error ("calloc: %m");
+  if (insert_l1_entry (sa, offset, unreachable) == -1)
     return NULL;
+  goto again;
+}
+
+/* Make the whole page in *l2_entry unreachable, adding it to the list
+ * of pages to free.  If we cannot extend the list, zero the page
+ * instead.
+ */
+static void
+free_page (struct sparse_array *sa, struct l2_entry *l2_entry,
+           uint64_t offset, page_list *pages)
+{
+  void *page;
+
+  if (page_list_reserve (pages, 1) == -1) {
+    page = __atomic_load_n (&l2_entry->page, __ATOMIC_ACQUIRE);
+    if (page)
+      memset (page, 0, SPARSE_PAGE);
+    return;
   }
-  if (insert_l1_entry (sa, &new_entry) == -1) {
-    free (new_entry.l2_dir);
-    return NULL;
+
+  page = __atomic_exchange_n (&l2_entry->page, NULL, __ATOMIC_ACQ_REL);
+  if (page) {
+    if (sa->a.debug)
+      nbdkit_debug ("%s: freeing zero page at offset %" PRIu64,
+                    __func__, offset);
+    page_list_append (pages, page);
   }
-  goto again;
 }
 
 static int
@@ -311,15 +511,12 @@ sparse_array_read (struct allocator *a,
                    void *buf, uint64_t count, uint64_t offset)
 {
   struct sparse_array *sa = (struct sparse_array *) a;
-  /* Because reads never modify any metadata, it is always safe to
-   * only hold the shared (read) lock.
-   */
-  ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&sa->lock);
+  uint64_t *reader = read_begin (sa);
   uint64_t n;
   void *p;
 
   while (count > 0) {
-    p = lookup (sa, offset, false, &n, NULL);
+    p = lookup (sa, offset, false, &n, NULL, NULL);
     if (n > count)
       n = count;
 
@@ -333,29 +530,26 @@ sparse_array_read (struct allocator *a,
     offset += n;
   }
 
+  read_end (reader);
   return 0;
 }
 
-#define RESTART_EXCLUSIVE -2
-
 static int
-do_write (bool exclusive, struct sparse_array *sa,
-          const void *buf, uint64_t count, uint64_t offset)
+sparse_array_write (struct allocator *a,
+                    const void *buf, uint64_t count, uint64_t offset)
 {
+  struct sparse_array *sa = (struct sparse_array *) a;
+  uint64_t *reader = read_begin (sa);
+  struct l1_dir *unreachable = NULL;
   uint64_t n;
   void *p;
+  int r = 0;
 
   while (count > 0) {
-    if (!exclusive) {
-      /* If we only hold the shared lock, try it without allocating. */
-      p = lookup (sa, offset, false, &n, NULL);
-      if (p == NULL)
-        return RESTART_EXCLUSIVE;
-    }
-    else {
-      p = lookup (sa, offset, true, &n, NULL);
-      if (p == NULL)
-        return -1;
+    p = lookup (sa, offset, true, &n, NULL, &unreachable);
+    if (p == NULL) {
+      r = -1;
+      break;
     }
 
     if (n > count)
@@ -367,28 +561,8 @@ do_write (bool exclusive, struct sparse_array *sa,
     offset += n;
   }
 
-  return 0;
-}
-
-static int
-sparse_array_write (struct allocator *a,
-                    const void *buf, uint64_t count, uint64_t offset)
-{
-  struct sparse_array *sa = (struct sparse_array *) a;
-  int r;
-
-  /* First try the write with the shared (read) lock held. */
-  {
-    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&sa->lock);
-    r = do_write (false, sa, buf, count, offset);
-  }
-
-  /* If that failed because we need the exclusive lock, restart. */
-  if (r == RESTART_EXCLUSIVE) {
-    ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&sa->lock);
-    r = do_write (true, sa, buf, count, offset);
-  }
-
+  read_end (reader);
+  free_unreachable (sa, unreachable, NULL);
   return r;
 }
 
@@ -400,19 +574,23 @@ sparse_array_fill (struct allocator *a, char c,
                    uint64_t count, uint64_t offset)
 {
   struct sparse_array *sa = (struct sparse_array *) a;
+  uint64_t *reader;
+  struct l1_dir *unreachable = NULL;
   uint64_t n;
   void *p;
+  int r = 0;
 
   if (c == 0)
     return sparse_array_zero (a, count, offset);
 
-  /* Since fill is never called on a hot path, use the exclusive lock. */
-  ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&sa->lock);
+  reader = read_begin (sa);
 
   while (count > 0) {
-    p = lookup (sa, offset, true, &n, NULL);
-    if (p == NULL)
-      return -1;
+    p = lookup (sa, offset, true, &n, NULL, &unreachable);
+    if (p == NULL) {
+      r = -1;
+      break;
+    }
 
     if (n > count)
       n = count;
@@ -422,69 +600,48 @@ sparse_array_fill (struct allocator *a, char c,
     offset += n;
   }
 
-  return 0;
+  read_end (reader);
+  free_unreachable (sa, unreachable, NULL);
+  return r;
 }
 
 static int
-do_zero (bool exclusive, struct sparse_array *sa,
-         uint64_t count, uint64_t offset)
+sparse_array_zero (struct allocator *a, uint64_t count, uint64_t offset)
 {
+  struct sparse_array *sa = (struct sparse_array *) a;
+  uint64_t *reader = read_begin (sa);
+  page_list pages = empty_vector;
   uint64_t n;
   void *p;
   struct l2_entry *l2_entry;
 
   while (count > 0) {
-    p = lookup (sa, offset, false, &n, &l2_entry);
+    p = lookup (sa, offset, false, &n, &l2_entry, NULL);
     if (n > count)
       n = count;
 
     if (p) {
+      /* If the whole page is being zeroed, free it.  We don't free
+       * partially zeroed pages even if they become all zero, because
+       * another thread may be writing to a different part of the page
+       * at the same time.
+       */
       if (n < SPARSE_PAGE)
         memset (p, 0, n);
       else
-        assert (p == l2_entry->page);
-
-      /* If the whole page is now zero, free it. */
-      if (n >= SPARSE_PAGE || is_zero (l2_entry->page, SPARSE_PAGE)) {
-        if (!exclusive)
-          return RESTART_EXCLUSIVE;
-
-        if (sa->a.debug)
-          nbdkit_debug ("%s: freeing zero page at offset %" PRIu64,
-                        __func__, offset);
-        free (l2_entry->page);
-        l2_entry->page = NULL;
-      }
+        free_page (sa, l2_entry, offset, &pages);
     }
 
     count -= n;
     offset += n;
   }
 
+  read_end (reader);
+  free_unreachable (sa, NULL, &pages);
+  free (pages.ptr);
   return 0;
 }
 
-static int
-sparse_array_zero (struct allocator *a, uint64_t count, uint64_t offset)
-{
-  struct sparse_array *sa = (struct sparse_array *) a;
-  int r;
-
-  /* First try the zero with the shared (read) lock held. */
-  {
-    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&sa->lock);
-    r = do_zero (false, sa, count, offset);
-  }
-
-  /* If that failed because we need the exclusive lock, restart. */
-  if (r == RESTART_EXCLUSIVE) {
-    ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&sa->lock);
-    r = do_zero (true, sa, count, offset);
-  }
-
-  return r;
-}
-
 static int
 sparse_array_blit (struct allocator *a1,
                    struct allocator *a2,
@@ -492,19 +649,23 @@ sparse_array_blit (struct allocator *a1,
                    uint64_t offset1, uint64_t offset2)
 {
   struct sparse_array *sa2 = (struct sparse_array *) a2;
-  /* Since blit is never called on a hot path, use the exclusive lock. */
-  ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&sa2->lock);
+  uint64_t *reader = read_begin (sa2);
+  struct l1_dir *unreachable = NULL;
+  page_list pages = empty_vector;
   uint64_t n;
   void *p;
   struct l2_entry *l2_entry;
+  int r = 0;
 
   assert (a1 != a2);
   assert (strcmp (a2->f->type, "sparse") == 0);
 
   while (count > 0) {
-    p = lookup (sa2, offset2, true, &n, &l2_entry);
-    if (p == NULL)
-      return -1;
+    p = lookup (sa2, offset2, true, &n, &l2_entry, &unreachable);
+    if (p == NULL) {
+      r = -1;
+      break;
+    }
 
     if (n > count)
       n = count;
@@ -512,24 +673,24 @@ sparse_array_blit (struct allocator *a1,
     /* Read the source allocator (a1) directly to p which points into
      * the right place in sa2.
      */
-    if (a1->f->read (a1, p, n, offset1) == -1)
-      return -1;
-
-    /* If the whole page is now zero, free it. */
-    if (is_zero (l2_entry->page, SPARSE_PAGE)) {
-      if (sa2->a.debug)
-        nbdkit_debug ("%s: freeing zero page at offset %" PRIu64,
-                      __func__, offset2);
-      free (l2_entry->page);
-      l2_entry->page = NULL;
+    if (a1->f->read (a1, p, n, offset1) == -1) {
+      r = -1;
+      break;
     }
 
+    /* If the whole page was written and is zero, free it. */
+    if (n == SPARSE_PAGE && is_zero (p, SPARSE_PAGE))
+      free_page (sa2, l2_entry, offset2, &pages);
+
     count -= n;
     offset1 += n;
     offset2 += n;
   }
 
-  return 0;
+  read_end (reader);
+  free_unreachable (sa2, unreachable, &pages);
+  free (pages.ptr);
+  return r;
 }
 
 static int
@@ -538,16 +699,14 @@ sparse_array_extents (struct allocator *a,
                       struct nbdkit_extents *extents)
 {
   struct sparse_array *sa = (struct sparse_array *) a;
-  /* Reading extents never modifies any metadata, so it is always safe
-   * to only hold the shared (read) lock.
-   */
-  ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&sa->lock);
+  uint64_t *reader = read_begin (sa);
   uint64_t n;
   uint32_t type;
   void *p;
+  int r = 0;
 
   while (count > 0) {
-    p = lookup (sa, offset, false, &n, NULL);
+    p = lookup (sa, offset, false, &n, NULL, NULL);
 
     /* Work out the type of this extent. */
     if (p == NULL)
@@ -561,8 +720,10 @@ sparse_array_extents (struct allocator *a,
         /* Normal allocated data. */
         type = 0;
     }
-    if (nbdkit_add_extent (extents, offset, n, type) == -1)
-      return -1;
+    if (nbdkit_add_extent (extents, offset, n, type) == -1) {
+      r = -1;
+      break;
+    }
 
     if (n > count)
       n = count;
@@ -571,7 +732,8 @@ sparse_array_extents (struct allocator *a,
     offset += n;
   }
 
-  return 0;
+  read_end (reader);
+  return r;
 }
 
 static struct allocator *
@@ -590,7 +752,7 @@ sparse_array_create (const void *paramsv)
     nbdkit_error ("calloc: %m");
     return NULL;
   }
-  pthread_rwlock_init (&sa->lock, NULL);
+  pthread_mutex_init (&sa->sync_lock, NULL);
 
   return (struct allocator *) sa;
 }
@@ -59,15 +59,23 @@
 /* This is derived from the sparse array implementation - see
  * common/allocators/sparse.c for details of how it works.
  *
- * TO DO:
+ * Locking: The L1 directory is protected by an rwlock, which is only
+ * held while searching the directory or inserting an entry.  L2
+ * directories are never freed or moved once created, so they can be
+ * used after releasing the rwlock.  Each page (the L2 entry and the
+ * compressed data it points to) is protected by one of an array of
+ * page locks chosen by the page number.  Requests which touch
+ * different pages can therefore compress and decompress in parallel.
  *
- * (1) We can avoid decompressing a page if we know we are going to
- * write over / trim / zero the whole page.
+ * The zstd documentation recommends a compression context per
+ * thread.  We keep a pool of contexts (which also contain a page
+ * buffer) and each request takes one from the pool for its duration,
+ * so the pool grows to the number of threads using the allocator at
+ * the same time.
  *
- * (2) Locking is correct but very naive.  It should be possible to
- * take much more fine-grained locks.
+ * TO DO:
  *
- * (3) Better stats: Can we iterate over the page table in order to
+ * (1) Better stats: Can we iterate over the page table in order to
  * find the ratio of uncompressed : compressed?
  *
  * Once some optimizations are made it would be worth profiling to
@@ -75,6 +83,7 @@
  */
 #define ZSTD_PAGE 32768
 #define L2_SIZE   4096
+#define NR_PAGE_LOCKS 256
 
 struct l2_entry {
   void *page;                   /* Pointer to compressed data. */
@@ -87,30 +96,114 @@ struct l1_entry {
 
 DEFINE_VECTOR_TYPE (l1_dir, struct l1_entry);
 
+/* Compression context and decompression stream.  We use the
+ * streaming API for decompression because it allows us to decompress
+ * without storing the compressed size, so we need a streaming object.
+ * But in fact decompression context and stream are the same thing
+ * since zstd 1.3.0.
+ */
+struct zstd_context {
+  struct zstd_context *next;    /* Next context in the pool. */
+  ZSTD_CCtx *zcctx;
+  ZSTD_DStream *zdstrm;
+  void *buf;                    /* Uncompressed page (ZSTD_PAGE bytes). */
+};
+
 struct zstd_array {
   struct allocator a;           /* Must come first. */
-  pthread_mutex_t lock;
+
+  pthread_rwlock_t lock;        /* Protects the L1 directory. */
   l1_dir l1_dir;                /* L1 directory. */
 
-  /* Compression context and decompression stream.  We use the
-   * streaming API for decompression because it allows us to
-   * decompress without storing the compressed size, so we need a
-   * streaming object.  But in fact decompression context and stream
-   * are the same thing since zstd 1.3.0.
-   *
-   * If we ever get serious about making this allocator work well
-   * multi-threaded [at the moment the locking is too course-grained],
-   * then the zstd documentation recommends creating a context per
-   * thread.
+  /* The lock for the page at offset is
+   * page_locks[offset / ZSTD_PAGE % NR_PAGE_LOCKS].
    */
-  ZSTD_CCtx *zcctx;
-  ZSTD_DStream *zdstrm;
+  pthread_mutex_t page_locks[NR_PAGE_LOCKS];
+
+  /* Pool of contexts which are not in use. */
+  pthread_mutex_t contexts_lock;
+  struct zstd_context *contexts;
 
-  /* Collect stats when we compress a page. */
+  /* Collect stats when we compress a page.  Updated atomically. */
   uint64_t stats_uncompressed_bytes;
   uint64_t stats_compressed_bytes;
 };
 
+static void
+free_context (struct zstd_context *ctx)
+{
+  if (ctx) {
+    ZSTD_freeCCtx (ctx->zcctx);
+    ZSTD_freeDStream (ctx->zdstrm);
+    free (ctx->buf);
+    free (ctx);
+  }
+}
+
+static struct zstd_context *
+create_context (void)
+{
+  struct zstd_context *ctx;
+
+  ctx = calloc (1, sizeof *ctx);
+  if (ctx == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  ctx->buf = malloc (ZSTD_PAGE);
+  if (ctx->buf == NULL) {
+    nbdkit_error ("malloc: %m");
+    free_context (ctx);
+    return NULL;
+  }
+  ctx->zcctx = ZSTD_createCCtx ();
+  if (ctx->zcctx == NULL) {
+    nbdkit_error ("ZSTD_createCCtx: %m");
+    free_context (ctx);
+    return NULL;
+  }
+  ctx->zdstrm = ZSTD_createDStream ();
+  if (ctx->zdstrm == NULL) {
+    nbdkit_error ("ZSTD_createDStream: %m");
+    free_context (ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+/* Take a context from the pool, creating a new one if the pool is
+ * empty.  It must be returned with put_context.
+ */
+static struct zstd_context *
+get_context (struct zstd_array *za)
+{
+  struct zstd_context *ctx;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&za->contexts_lock);
+    ctx = za->contexts;
+    if (ctx)
+      za->contexts = ctx->next;
+  }
+  if (ctx == NULL)
+    ctx = create_context ();
+  return ctx;
+}
+
+static void
+put_context (struct zstd_array *za, struct zstd_context *ctx)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&za->contexts_lock);
+  ctx->next = za->contexts;
+  za->contexts = ctx;
+}
+
+static pthread_mutex_t *
+page_lock (struct zstd_array *za, uint64_t offset)
+{
+  return &za->page_locks[offset / ZSTD_PAGE % NR_PAGE_LOCKS];
+}
+
 /* Free L1 and/or L2 directories. */
 static void
 free_l2_dir (struct l2_entry *l2_dir)
@@ -126,6 +219,7 @@ static void
 zstd_array_free (struct allocator *a)
 {
   struct zstd_array *za = (struct zstd_array *) a;
+  struct zstd_context *ctx;
   size_t i;
 
   if (za) {
@@ -134,12 +228,17 @@ zstd_array_free (struct allocator *a)
                     (double) za->stats_uncompressed_bytes /
                     za->stats_compressed_bytes);
 
-    ZSTD_freeCCtx (za->zcctx);
-    ZSTD_freeDStream (za->zdstrm);
+    while ((ctx = za->contexts) != NULL) {
+      za->contexts = ctx->next;
+      free_context (ctx);
+    }
     for (i = 0; i < za->l1_dir.len; ++i)
       free_l2_dir (za->l1_dir.ptr[i].l2_dir);
     free (za->l1_dir.ptr);
-    pthread_mutex_destroy (&za->lock);
+    for (i = 0; i < NR_PAGE_LOCKS; ++i)
+      pthread_mutex_destroy (&za->page_locks[i]);
+    pthread_mutex_destroy (&za->contexts_lock);
+    pthread_rwlock_destroy (&za->lock);
     free (za);
   }
 }
@@ -164,6 +263,7 @@ compare_l1_offsets (const void *offsetp, const struct l1_entry *e)
 
 /* Insert an entry in the L1 directory, keeping it ordered by offset.
  * This involves an expensive linear scan but should be very rare.
+ * The exclusive lock must be held.
  */
 static int
 insert_l1_entry (struct zstd_array *za, const struct l1_entry *entry)
@@ -201,154 +301,133 @@ insert_l1_entry (struct zstd_array *za, const struct l1_entry *entry)
   return 0;
 }
 
-/* Look up a virtual offset.
+/* Look up a virtual offset, returning a pointer to the L2 directory
+ * entry containing the page pointer.  The page lock must be held to
+ * access the L2 entry.
  *
- * If the L2 page is mapped then this uncompresses the page into the
- * caller's buffer (of size ZSTD_PAGE), returning the address of the
- * offset, the count of bytes to the end of the page, and a pointer to
- * the L2 directory entry containing the page pointer.
- *
- * If the L2 page is not mapped this clears the caller's buffer, also
- * returning the pointer.
- *
- * To read data you don't need to do anything else.
- *
- * To write data, after updating the buffer, you must subsequently
- * call compress() below.
- *
- * This function cannot return an error.
+ * If there is no L1 directory entry covering the offset this returns
+ * NULL, unless the create flag is set in which case a new L1
+ * directory entry is allocated.  If the create flag is set and NULL
+ * is returned, this indicates an error.
  */
-static void *
-lookup_decompress (struct zstd_array *za, uint64_t offset, void *buf,
-                   uint64_t *remaining, struct l2_entry **l2_entry)
+static struct l2_entry *
+lookup (struct zstd_array *za, uint64_t offset, bool create)
 {
   struct l1_entry *entry;
-  struct l2_entry *l2_dir;
-  uint64_t o;
-  void *page;
-
-  *remaining = ZSTD_PAGE - (offset & (ZSTD_PAGE-1));
+  struct l1_entry new_entry;
 
   /* Search the L1 directory. */
-  entry = l1_dir_search (&za->l1_dir, &offset, compare_l1_offsets);
+  {
+    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&za->lock);
+    entry = l1_dir_search (&za->l1_dir, &offset, compare_l1_offsets);
+
+    if (za->a.debug) {
+      if (entry)
+        nbdkit_debug ("%s: search L1 dir: entry found: offset %" PRIu64,
+                      __func__, entry->offset);
+      else
+        nbdkit_debug ("%s: search L1 dir: no entry found", __func__);
+    }
 
-  if (za->a.debug) {
+    /* Which page in the L2 directory? */
     if (entry)
-      nbdkit_debug ("%s: search L1 dir: entry found: offset %" PRIu64,
-                    __func__, entry->offset);
-    else
-      nbdkit_debug ("%s: search L1 dir: no entry found", __func__);
+      return &entry->l2_dir[(offset - entry->offset) / ZSTD_PAGE];
   }
 
-  if (entry) {
-    l2_dir = entry->l2_dir;
-
-    /* Which page in the L2 directory? */
-    o = (offset - entry->offset) / ZSTD_PAGE;
-    if (l2_entry)
-      *l2_entry = &l2_dir[o];
-    page = l2_dir[o].page;
-
-    if (page) {
-      /* Decompress the page into the user buffer.  We assume this can
-       * never fail since the only pages we decompress are ones we
-       * have compressed.  We use the streaming API because the normal
-       * ZSTD_decompressDCtx function requires the compressed size,
-       * whereas the streaming API does not.
-       */
-      ZSTD_inBuffer inb = { .src = page, .size = SIZE_MAX, .pos = 0 };
-      ZSTD_outBuffer outb = { .dst = buf, .size = ZSTD_PAGE, .pos = 0 };
+  /* No L1 directory entry found. */
+  if (!create)
+    return NULL;
 
-      ZSTD_initDStream (za->zdstrm);
-      while (outb.pos < outb.size)
-        ZSTD_decompressStream (za->zdstrm, &outb, &inb);
-      assert (outb.pos == ZSTD_PAGE);
-    }
-    else
-      memset (buf, 0, ZSTD_PAGE);
+  /* No L1 directory entry, and we're creating, so we need to allocate
+   * a new L1 directory entry and insert it in the L1 directory, and
+   * allocate the L2 directory with NULL page pointers.  Another
+   * thread may have done this while we were not holding the lock.
+   */
+  new_entry.offset = offset & ~(ZSTD_PAGE*L2_SIZE-1);
+  new_entry.l2_dir = calloc (L2_SIZE, sizeof (struct l2_entry));
+  if (new_entry.l2_dir == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
 
-    return buf + (offset & (ZSTD_PAGE-1));
+  ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&za->lock);
+  entry = l1_dir_search (&za->l1_dir, &offset, compare_l1_offsets);
+  if (entry) {
+    free (new_entry.l2_dir);
+    return &entry->l2_dir[(offset - entry->offset) / ZSTD_PAGE];
   }
+  if (insert_l1_entry (za, &new_entry) == -1) {
+    free (new_entry.l2_dir);
+    return NULL;
+  }
+  return &new_entry.l2_dir[(offset - new_entry.offset) / ZSTD_PAGE];
+}
 
-  /* No L1 directory entry found. */
-  memset (buf, 0, ZSTD_PAGE);
-  return buf + (offset & (ZSTD_PAGE-1));
+/* Decompress the page into buf (of size ZSTD_PAGE), or clear buf if
+ * the page is not mapped.  The page lock must be held.
+ *
+ * This function cannot return an error.
+ */
+static void
+decompress (struct zstd_context *ctx, const struct l2_entry *l2_entry,
+            void *buf)
+{
+  if (l2_entry && l2_entry->page) {
+    /* Decompress the page into the buffer.  We assume this can never
+     * fail since the only pages we decompress are ones we have
+     * compressed.  We use the streaming API because the normal
+     * ZSTD_decompressDCtx function requires the compressed size,
+     * whereas the streaming API does not.
+     */
+    ZSTD_inBuffer inb = { .src = l2_entry->page, .size = SIZE_MAX, .pos = 0 };
+    ZSTD_outBuffer outb = { .dst = buf, .size = ZSTD_PAGE, .pos = 0 };
+
+    ZSTD_initDStream (ctx->zdstrm);
+    while (outb.pos < outb.size)
+      ZSTD_decompressStream (ctx->zdstrm, &outb, &inb);
+    assert (outb.pos == ZSTD_PAGE);
+  }
+  else
+    memset (buf, 0, ZSTD_PAGE);
 }
 
 /* Compress a page back after modifying it.
  *
- * This replaces a L2 page with a new version compressed from the
- * modified user buffer.
+ * This replaces the L2 page with a new version compressed from buf.
+ * The page lock must be held.
  *
- * It may fail, calling nbdkit_error and returning -1.
+ * It may fail, calling nbdkit_error and returning -1, in which case
+ * the L2 page is unchanged.
  */
 static int
-compress (struct zstd_array *za, uint64_t offset, void *buf)
+compress (struct zstd_array *za, struct zstd_context *ctx,
+          struct l2_entry *l2_entry, const void *buf)
 {
-  struct l1_entry *entry;
-  struct l2_entry *l2_dir;
-  uint64_t o;
   void *page;
-  struct l1_entry new_entry;
   size_t n;
 
- again:
-  /* Search the L1 directory. */
-  entry = l1_dir_search (&za->l1_dir, &offset, compare_l1_offsets);
-
-  if (za->a.debug) {
-    if (entry)
-      nbdkit_debug ("%s: search L1 dir: entry found: offset %" PRIu64,
-                    __func__, entry->offset);
-    else
-      nbdkit_debug ("%s: search L1 dir: no entry found", __func__);
-  }
-
-  if (entry) {
-    l2_dir = entry->l2_dir;
-
-    /* Which page in the L2 directory? */
-    o = (offset - entry->offset) / ZSTD_PAGE;
-    free (l2_dir[o].page);
-    l2_dir[o].page = NULL;
-
-    /* Allocate a new page. */
-    n = ZSTD_compressBound (ZSTD_PAGE);
-    page = malloc (n);
-    if (page == NULL) {
-      nbdkit_error ("malloc: %m");
-      return -1;
-    }
-    n = ZSTD_compressCCtx (za->zcctx, page, n,
-                           buf, ZSTD_PAGE, ZSTD_CLEVEL_DEFAULT);
-    if (ZSTD_isError (n)) {
-      nbdkit_error ("ZSTD_compressCCtx: %s", ZSTD_getErrorName (n));
-      return -1;
-    }
-    page = realloc (page, n);
-    assert (page != NULL);
-    l2_dir[o].page = page;
-    za->stats_uncompressed_bytes += ZSTD_PAGE;
-    za->stats_compressed_bytes += n;
-    return 0;
-  }
-
-  /* No L1 directory entry, so we need to allocate a new L1 directory
-   * entry and insert it in the L1 directory, and allocate the L2
-   * directory with NULL page pointers.  Then we can repeat the above
-   * search to create the page.
-   */
-  new_entry.offset = offset & ~(ZSTD_PAGE*L2_SIZE-1);
-  new_entry.l2_dir = calloc (L2_SIZE, sizeof (struct l2_entry));
-  if (new_entry.l2_dir == NULL) {
-    nbdkit_error ("calloc: %m");
+  /* Allocate a new page. */
+  n = ZSTD_compressBound (ZSTD_PAGE);
+  page = malloc (n);
+  if (page == NULL) {
+    nbdkit_error ("malloc: %m");
     return -1;
   }
-  if (insert_l1_entry (za, &new_entry) == -1) {
-    free (new_entry.l2_dir);
+  n = ZSTD_compressCCtx (ctx->zcctx, page, n,
+                         buf, ZSTD_PAGE, ZSTD_CLEVEL_DEFAULT);
+  if (ZSTD_isError (n)) {
+    nbdkit_error ("ZSTD_compressCCtx: %s", ZSTD_getErrorName (n));
+    free (page);
     return -1;
   }
-  goto again;
+  page = realloc (page, n);
+  assert (page != NULL);
+  free (l2_entry->page);
+  l2_entry->page = page;
+  __atomic_fetch_add (&za->stats_uncompressed_bytes, ZSTD_PAGE,
+                      __ATOMIC_RELAXED);
+  __atomic_fetch_add (&za->stats_compressed_bytes, n, __ATOMIC_RELAXED);
+  return 0;
 }
 
 static int
@@ -356,29 +435,41 @@ zstd_array_read (struct allocator *a,
                  void *buf, uint64_t count, uint64_t offset)
 {
   struct zstd_array *za = (struct zstd_array *) a;
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&za->lock);
-  CLEANUP_FREE void *tbuf = NULL;
+  struct zstd_context *ctx;
+  struct l2_entry *l2_entry;
   uint64_t n;
-  void *p;
 
-  tbuf = malloc (ZSTD_PAGE);
-  if (tbuf == NULL) {
-    nbdkit_error ("malloc: %m");
+  ctx = get_context (za);
+  if (ctx == NULL)
     return -1;
-  }
 
   while (count > 0) {
-    p = lookup_decompress (za, offset, tbuf, &n, NULL);
+    n = ZSTD_PAGE - (offset & (ZSTD_PAGE-1));
     if (n > count)
       n = count;
 
-    memcpy (buf, p, n);
+    l2_entry = lookup (za, offset, false);
+    if (l2_entry == NULL)
+      memset (buf, 0, n);
+    else {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (page_lock (za, offset));
+      /* If reading the whole page, decompress it straight into the
+       * caller's buffer.
+       */
+      if (n == ZSTD_PAGE)
+        decompress (ctx, l2_entry, buf);
+      else {
+        decompress (ctx, l2_entry, ctx->buf);
+        memcpy (buf, ctx->buf + (offset & (ZSTD_PAGE-1)), n);
+      }
+    }
 
     buf += n;
     count -= n;
     offset += n;
   }
 
+  put_context (za, ctx);
   return 0;
 }
 
@@ -387,33 +478,48 @@ zstd_array_write (struct allocator *a,
                   const void *buf, uint64_t count, uint64_t offset)
 {
   struct zstd_array *za = (struct zstd_array *) a;
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&za->lock);
-  CLEANUP_FREE void *tbuf = NULL;
+  struct zstd_context *ctx;
+  struct l2_entry *l2_entry;
   uint64_t n;
-  void *p;
+  int r = 0;
 
-  tbuf = malloc (ZSTD_PAGE);
-  if (tbuf == NULL) {
-    nbdkit_error ("malloc: %m");
+  ctx = get_context (za);
+  if (ctx == NULL)
     return -1;
-  }
 
   while (count > 0) {
-    p = lookup_decompress (za, offset, tbuf, &n, NULL);
-
+    n = ZSTD_PAGE - (offset & (ZSTD_PAGE-1));
     if (n > count)
       n = count;
-    memcpy (p, buf, n);
 
-    if (compress (za, offset, tbuf) == -1)
-      return -1;
+    l2_entry = lookup (za, offset, true);
+    if (l2_entry == NULL) {
+      r = -1;
+      break;
+    }
+
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (page_lock (za, offset));
+      /* We don't need to decompress the page if overwriting all of
+       * it.
+       */
+      if (n < ZSTD_PAGE)
+        decompress (ctx, l2_entry, ctx->buf);
+      memcpy (ctx->buf + (offset & (ZSTD_PAGE-1)), buf, n);
+
+      if (compress (za, ctx, l2_entry, ctx->buf) == -1) {
+        r = -1;
+        break;
+      }
+    }
 
     buf += n;
     count -= n;
     offset += n;
   }
 
-  return 0;
+  put_context (za, ctx);
+  return r;
 }
 
 static int zstd_array_zero (struct allocator *a,
@@ -424,75 +530,88 @@ zstd_array_fill (struct allocator *a, char c,
                    uint64_t count, uint64_t offset)
 {
   struct zstd_array *za = (struct zstd_array *) a;
-  CLEANUP_FREE void *tbuf = NULL;
+  struct zstd_context *ctx;
+  struct l2_entry *l2_entry;
   uint64_t n;
-  void *p;
+  int r = 0;
 
-  if (c == 0) {
-    zstd_array_zero (a, count, offset);
-    return 0;
-  }
+  if (c == 0)
+    return zstd_array_zero (a, count, offset);
 
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&za->lock);
-
-  tbuf = malloc (ZSTD_PAGE);
-  if (tbuf == NULL) {
-    nbdkit_error ("malloc: %m");
+  ctx = get_context (za);
+  if (ctx == NULL)
     return -1;
-  }
 
   while (count > 0) {
-    p = lookup_decompress (za, offset, tbuf, &n, NULL);
-
+    n = ZSTD_PAGE - (offset & (ZSTD_PAGE-1));
     if (n > count)
       n = count;
-    memset (p, c, n);
 
-    if (compress (za, offset, tbuf) == -1)
-      return -1;
+    l2_entry = lookup (za, offset, true);
+    if (l2_entry == NULL) {
+      r = -1;
+      break;
+    }
+
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (page_lock (za, offset));
+      if (n < ZSTD_PAGE)
+        decompress (ctx, l2_entry, ctx->buf);
+      memset (ctx->buf + (offset & (ZSTD_PAGE-1)), c, n);
+
+      if (compress (za, ctx, l2_entry, ctx->buf) == -1) {
+        r = -1;
+        break;
+      }
+    }
 
     count -= n;
     offset += n;
   }
 
-  return 0;
+  put_context (za, ctx);
+  return r;
 }
 
 static int
 zstd_array_zero (struct allocator *a, uint64_t count, uint64_t offset)
 {
   struct zstd_array *za = (struct zstd_array *) a;
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&za->lock);
-  CLEANUP_FREE void *tbuf = NULL;
+  struct zstd_context *ctx;
+  struct l2_entry *l2_entry;
   uint64_t n;
-  void *p;
-  struct l2_entry *l2_entry = NULL;
+  int r = 0;
 
-  tbuf = malloc (ZSTD_PAGE);
-  if (tbuf == NULL) {
-    nbdkit_error ("malloc: %m");
+  ctx = get_context (za);
+  if (ctx == NULL)
     return -1;
-  }
 
   while (count > 0) {
-    p = lookup_decompress (za, offset, tbuf, &n, &l2_entry);
-
+    n = ZSTD_PAGE - (offset & (ZSTD_PAGE-1));
     if (n > count)
       n = count;
-    memset (p, 0, n);
-
-    if (l2_entry && l2_entry->page) {
-      /* If the whole page is now zero, free it. */
-      if (n >= ZSTD_PAGE || is_zero (l2_entry->page, ZSTD_PAGE)) {
-        if (za->a.debug)
-          nbdkit_debug ("%s: freeing zero page at offset %" PRIu64,
-                        __func__, offset);
-        free (l2_entry->page);
-        l2_entry->page = NULL;
-      }
-      else {
-        if (compress (za, offset, tbuf) == -1)
-          return -1;
+
+    l2_entry = lookup (za, offset, false);
+    if (l2_entry) {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (page_lock (za, offset));
+      if (l2_entry->page) {
+        if (n < ZSTD_PAGE) {
+          decompress (ctx, l2_entry, ctx->buf);
+          memset (ctx->buf + (offset & (ZSTD_PAGE-1)), 0, n);
+        }
+
+        /* If the whole page is now zero, free it. */
+        if (n == ZSTD_PAGE || is_zero (ctx->buf, ZSTD_PAGE)) {
+          if (za->a.debug)
+            nbdkit_debug ("%s: freeing zero page at offset %" PRIu64,
+                          __func__, offset);
+          free (l2_entry->page);
+          l2_entry->page = NULL;
+        }
+        else if (compress (za, ctx, l2_entry, ctx->buf) == -1) {
+          r = -1;
+          break;
+        }
       }
     }
 
@@ -500,7 +619,8 @@ zstd_array_zero (struct allocator *a, uint64_t count, uint64_t offset)
     offset += n;
   }
 
-  return 0;
+  put_context (za, ctx);
+  return r;
 }
 
 static int
@@ -510,41 +630,52 @@ zstd_array_blit (struct allocator *a1,
                  uint64_t offset1, uint64_t offset2)
 {
   struct zstd_array *za2 = (struct zstd_array *) a2;
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&za2->lock);
-  CLEANUP_FREE void *tbuf = NULL;
+  struct zstd_context *ctx;
+  struct l2_entry *l2_entry;
   uint64_t n;
-  void *p;
+  int r = 0;
 
   assert (a1 != a2);
   assert (strcmp (a2->f->type, "zstd") == 0);
 
-  tbuf = malloc (ZSTD_PAGE);
-  if (tbuf == NULL) {
-    nbdkit_error ("malloc: %m");
+  ctx = get_context (za2);
+  if (ctx == NULL)
     return -1;
-  }
 
   while (count > 0) {
-    p = lookup_decompress (za2, offset2, tbuf, &n, NULL);
-
+    n = ZSTD_PAGE - (offset2 & (ZSTD_PAGE-1));
     if (n > count)
       n = count;
 
-    /* Read the source allocator (a1) directly to p which points into
-     * the right place in za2.
-     */
-    if (a1->f->read (a1, p, n, offset1) == -1)
-      return -1;
+    l2_entry = lookup (za2, offset2, true);
+    if (l2_entry == NULL) {
+      r = -1;
+      break;
+    }
 
-    if (compress (za2, offset2, tbuf) == -1)
-      return -1;
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (page_lock (za2, offset2));
+      if (n < ZSTD_PAGE)
+        decompress (ctx, l2_entry, ctx->buf);
+
+      /* Read the source allocator (a1) directly into the right place
+       * in the page buffer.
+       */
+      if (a1->f->read (a1, ctx->buf + (offset2 & (ZSTD_PAGE-1)),
+                       n, offset1) == -1 ||
+          compress (za2, ctx, l2_entry, ctx->buf) == -1) {
+        r = -1;
+        break;
+      }
+    }
 
     count -= n;
     offset1 += n;
     offset2 += n;
   }
 
-  return 0;
+  put_context (za2, ctx);
+  return r;
 }
 
 static int
@@ -553,36 +684,40 @@ zstd_array_extents (struct allocator *a,
                       struct nbdkit_extents *extents)
 {
   struct zstd_array *za = (struct zstd_array *) a;
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&za->lock);
-  CLEANUP_FREE void *buf = NULL;
+  struct zstd_context *ctx;
+  struct l2_entry *l2_entry;
   uint64_t n;
   uint32_t type;
-  void *p;
-  struct l2_entry *l2_entry;
+  int r = 0;
 
-  buf = malloc (ZSTD_PAGE);
-  if (buf == NULL) {
-    nbdkit_error ("malloc: %m");
+  ctx = get_context (za);
+  if (ctx == NULL)
     return -1;
-  }
 
   while (count > 0) {
-    p = lookup_decompress (za, offset, buf, &n, &l2_entry);
+    n = ZSTD_PAGE - (offset & (ZSTD_PAGE-1));
 
     /* Work out the type of this extent. */
-    if (l2_entry->page == NULL)
-      /* No backing page, so it's a hole. */
-      type = NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO;
-    else {
-      if (is_zero (p, n))
-        /* A backing page and it's all zero, it's a zero extent. */
-        type = NBDKIT_EXTENT_ZERO;
-      else
-        /* Normal allocated data. */
-        type = 0;
+    l2_entry = lookup (za, offset, false);
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (page_lock (za, offset));
+      if (l2_entry == NULL || l2_entry->page == NULL)
+        /* No backing page, so it's a hole. */
+        type = NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO;
+      else {
+        decompress (ctx, l2_entry, ctx->buf);
+        if (is_zero (ctx->buf + (offset & (ZSTD_PAGE-1)), n))
+          /* A backing page and it's all zero, it's a zero extent. */
+          type = NBDKIT_EXTENT_ZERO;
+        else
+          /* Normal allocated data. */
+          type = 0;
+      }
+    }
+    if (nbdkit_add_extent (extents, offset, n, type) == -1) {
+      r = -1;
+      break;
     }
-    if (nbdkit_add_extent (extents, offset, n, type) == -1)
-      return -1;
 
     if (n > count)
       n = count;
@@ -591,7 +726,8 @@ zstd_array_extents (struct allocator *a,
     offset += n;
   }
 
-  return 0;
+  put_context (za, ctx);
+  return r;
 }
 
 struct allocator *
@@ -599,6 +735,7 @@ zstd_array_create (const void *paramsv)
 {
   const allocator_parameters *params  = paramsv;
   struct zstd_array *za;
+  size_t i;
 
   if (params->len > 0) {
     nbdkit_error ("allocator=zstd does not take extra parameters");
@@ -611,19 +748,17 @@ zstd_array_create (const void *paramsv)
     return NULL;
   }
 
-  pthread_mutex_init (&za->lock, NULL);
+  pthread_rwlock_init (&za->lock, NULL);
+  for (i = 0; i < NR_PAGE_LOCKS; ++i)
+    pthread_mutex_init (&za->page_locks[i], NULL);
+  pthread_mutex_init (&za->contexts_lock, NULL);
 
-  za->zcctx = ZSTD_createCCtx ();
-  if (za->zcctx == NULL) {
-    nbdkit_error ("ZSTD_createCCtx: %m");
-    free (za);
-    return NULL;
-  }
-  za->zdstrm = ZSTD_createDStream ();
-  if (za->zdstrm == NULL) {
-    nbdkit_error ("ZSTD_createDStream: %m");
-    ZSTD_freeCCtx (za->zcctx);
-    free (za);
+  /* Create the first context now so we find out early if zstd
+   * doesn't work.
+   */
+  za->contexts = create_context ();
+  if (za->contexts == NULL) {
+    zstd_array_free ((struct allocator *) za);
     return NULL;
   }
 
@@ -0,0 +1,594 @@
+/* config.h.  Generated from config.h.in by configure.  */
+/* config.h.in.  Generated from configure.ac by autoheader.  */
+
+/* Define if building universal (internal helper macro) */
+/* #undef AC_APPLE_UNIVERSAL_BUILD */
+
+/* String that separates path elements. */
+#define DIR_SEPARATOR_STR "/"
+
+/* Enable special libFuzzer binary */
+/* #undef ENABLE_LIBFUZZER */
+
+/* Extension used for executables. */
+#define EXEEXT ""
+
+/* Define to 1 if you have the 'accept4' function. */
+#define HAVE_ACCEPT4 1
+
+/* Define to 1 if you have the <afunix.h> header file. */
+/* #undef HAVE_AFUNIX_H */
+
+/* Define to 1 if you have the <alloca.h> header file. */
+#define HAVE_ALLOCA_H 1
+
+/* Define to 1 if you have the <arpa/inet.h> header file. */
+#define HAVE_ARPA_INET_H 1
+
+/* __auto_type is available */
+#define HAVE_AUTO_TYPE 1
+
+/* Define to 1 if you have the <byteswap.h> header file. */
+#define HAVE_BYTESWAP_H 1
+
+/* libbz2 found at compile time. */
+/* #undef HAVE_BZLIB */
+
+/* caml_alloc_initialized_string found at compile time. */
+/* #undef HAVE_CAML_ALLOC_INITIALIZED_STRING */
+
+/* caml_shutdown found at compile time. */
+/* #undef HAVE_CAML_SHUTDOWN */
+
+/* caml/socketaddr.h found at compile time. */
+/* #undef HAVE_CAML_SOCKETADDR_H */
+
+/* caml_unix_alloc_sockaddr found at compile time. */
+/* #undef HAVE_CAML_UNIX_ALLOC_SOCKADDR */
+
+/* com_err found at compile time. */
+/* #undef HAVE_COM_ERR */
+
+/* curl found at compile time. */
+#define HAVE_CURL 1
+
+/* CURLOPT_PROTOCOLS_STR found at compile time. */
+#define HAVE_CURLOPT_PROTOCOLS_STR 1
+
+/* CURLOPT_UNIX_SOCKET_PATH found at compile time. */
+#define HAVE_CURLOPT_UNIX_SOCKET_PATH 1
+
+/* CURL_HTTP_VERSION_2TLS found at compile time. */
+#define HAVE_CURL_HTTP_VERSION_2TLS 1
+
+/* CURL_HTTP_VERSION_2_0 found at compile time. */
+#define HAVE_CURL_HTTP_VERSION_2_0 1
+
+/* CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE found at compile time. */
+#define HAVE_CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE 1
+
+/* CURL_HTTP_VERSION_3 found at compile time. */
+#define HAVE_CURL_HTTP_VERSION_3 1
+
+/* CURL_HTTP_VERSION_3ONLY found at compile time. */
+#define HAVE_CURL_HTTP_VERSION_3ONLY 1
+
+/* Define to 1 if you have the 'curl_multi_get_handles' function. */
+/* #undef HAVE_CURL_MULTI_GET_HANDLES */
+
+/* Define to 1 if you have the 'curl_version_info' function. */
+#define HAVE_CURL_VERSION_INFO 1
+
+/* Define to 1 if you have the declaration of 'program_invocation_short_name',
+   and to 0 if you don't. */
+#define HAVE_DECL_PROGRAM_INVOCATION_SHORT_NAME 1
+
+/* Define to 1 if you have the declaration of '__builtin_add_overflow(int,
+   int, int *)', and to 0 if you don't. */
+#define HAVE_DECL___BUILTIN_ADD_OVERFLOW 1
+
+/* Define to 1 if you have the declaration of '__builtin_mul_overflow(int,
+   int, int *)', and to 0 if you don't. */
+#define HAVE_DECL___BUILTIN_MUL_OVERFLOW 1
+
+/* Define to 1 if you have the 'dladdr' function. */
+#define HAVE_DLADDR 1
+
+/* Define to 1 if you have the <dlfcn.h> header file. */
+#define HAVE_DLFCN_H 1
+
+/* Define to 1 if you have the <endian.h> header file. */
+#define HAVE_ENDIAN_H 1
+
+/* environ is declared in headers */
+#define HAVE_ENVIRON_DECL 1
+
+/* ext2fs found at compile time. */
+/* #undef HAVE_EXT2FS */
+
+/* Define to 1 if you have the 'fdatasync' function. */
+#define HAVE_FDATASYNC 1
+
+/* Define to 1 if you have the 'flockfile' function. */
+#define HAVE_FLOCKFILE 1
+
+/* Define to 1 if you have the <fnmatch.h> header file. */
+#define HAVE_FNMATCH_H 1
+
+/* Define to 1 if you have the 'fsync' function. */
+#define HAVE_FSYNC 1
+
+/* Define to 1 if you have the 'funlockfile' function. */
+#define HAVE_FUNLOCKFILE 1
+
+/* Define to 1 if you have the 'getdelim' function. */
+#define HAVE_GETDELIM 1
+
+/* Define to 1 if you have the 'getline' function. */
+#define HAVE_GETLINE 1
+
+/* Define to 1 if you have the 'get_current_dir_name' function. */
+#define HAVE_GET_CURRENT_DIR_NAME 1
+
+/* gnutls found at compile time. */
+#define HAVE_GNUTLS 1
+
+/* Define to 1 if you have the 'gnutls_base64_decode2' function. */
+#define HAVE_GNUTLS_BASE64_DECODE2 1
+
+/* Define to 1 if you have the 'gnutls_certificate_set_known_dh_params'
+   function. */
+#define HAVE_GNUTLS_CERTIFICATE_SET_KNOWN_DH_PARAMS 1
+
+/* Define to 1 if you have the 'gnutls_group_get' function. */
+#define HAVE_GNUTLS_GROUP_GET 1
+
+/* Define to 1 if you have the 'gnutls_group_get_name' function. */
+#define HAVE_GNUTLS_GROUP_GET_NAME 1
+
+/* Define to 1 if you have the 'gnutls_pbkdf2' function. */
+#define HAVE_GNUTLS_PBKDF2 1
+
+/* Define to 1 if you have the <gnutls/socket.h> header file. */
+#define HAVE_GNUTLS_SOCKET_H 1
+
+/* Define to 1 if you have the 'gnutls_srp_server_get_username' function. */
+#define HAVE_GNUTLS_SRP_SERVER_GET_USERNAME 1
+
+/* Define to 1 if you have the 'gnutls_transport_is_ktls_enabled' function. */
+#define HAVE_GNUTLS_TRANSPORT_IS_KTLS_ENABLED 1
+
+/* Define to 1 if you have the <grp.h> header file. */
+#define HAVE_GRP_H 1
+
+/* Define to 1 if you have the 'inet_ntop' function. */
+#define HAVE_INET_NTOP 1
+
+/* Define to 1 if you have the 'inet_pton' function. */
+#define HAVE_INET_PTON 1
+
+/* Define to 1 if you have the <inttypes.h> header file. */
+#define HAVE_INTTYPES_H 1
+
+/* libblkio found at compile time. */
+/* #undef HAVE_LIBBLKIO */
+
+/* libguestfs found at compile time. */
+/* #undef HAVE_LIBGUESTFS */
+
+/* liblzma found at compile time. */
+#define HAVE_LIBLZMA 1
+
+/* libnbd found at compile time. */
+/* #undef HAVE_LIBNBD */
+
+/* libselinux found at compile time. */
+/* #undef HAVE_LIBSELINUX */
+
+/* libvirt found at compile time. */
+/* #undef HAVE_LIBVIRT */
+
+/* libzstd found at compile time. */
+/* #undef HAVE_LIBZSTD */
+
+/* Define to 1 if you have the <linux/fs.h> header file. */
+#define HAVE_LINUX_FS_H 1
+
+/* Define to 1 if you have the <linux/vm_sockets.h> header file. */
+#define HAVE_LINUX_VM_SOCKETS_H 1
+
+/* Define to 1 if you have the 'lua_isinteger' function. */
+/* #undef HAVE_LUA_ISINTEGER */
+
+/* Define to 1 if you have the 'lzma_lzip_decoder' function. */
+#define HAVE_LZMA_LZIP_DECODER 1
+
+/* Define to 1 if you have the <minix/config.h> header file. */
+/* #undef HAVE_MINIX_CONFIG_H */
+
+/* Define to 1 if you have the 'mkostemp' function. */
+#define HAVE_MKOSTEMP 1
+
+/* Define to 1 if you have the 'mlock' function. */
+#define HAVE_MLOCK 1
+
+/* Define to 1 if you have the 'mlockall' function. */
+#define HAVE_MLOCKALL 1
+
+/* Define to 1 if you have the 'munlock' function. */
+#define HAVE_MUNLOCK 1
+
+/* Define to 1 if you have the <netdb.h> header file. */
+#define HAVE_NETDB_H 1
+
+/* Define to 1 if you have the <netinet/in.h> header file. */
+#define HAVE_NETINET_IN_H 1
+
+/* Define to 1 if you have the <netinet/tcp.h> header file. */
+#define HAVE_NETINET_TCP_H 1
+
+/* Define to 1 if you have the 'openlog' function. */
+#define HAVE_OPENLOG 1
+
+/* Define to 1 if you have the 'open_memstream' function. */
+#define HAVE_OPEN_MEMSTREAM 1
+
+/* Define to 1 if you have the 'perl_alloc' function. */
+/* #undef HAVE_PERL_ALLOC */
+
+/* Define to 1 if you have the 'pipe' function. */
+#define HAVE_PIPE 1
+
+/* Define to 1 if you have the 'pipe2' function. */
+#define HAVE_PIPE2 1
+
+/* Define to 1 if you have the 'poll' function. */
+#define HAVE_POLL 1
+
+/* Define to 1 if you have the 'posix_fadvise' function. */
+#define HAVE_POSIX_FADVISE 1
+
+/* Define to 1 if you have the 'posix_memalign' function. */
+#define HAVE_POSIX_MEMALIGN 1
+
+/* Define to 1 if you have the 'ppoll' function. */
+#define HAVE_PPOLL 1
+
+/* Define to 1 if you have the 'pread' function. */
+#define HAVE_PREAD 1
+
+/* Define if you have POSIX threads libraries and header files. */
+#define HAVE_PTHREAD 1
+
+/* Have PTHREAD_PRIO_INHERIT. */
+#define HAVE_PTHREAD_PRIO_INHERIT 1
+
+/* Define to 1 if you have the <pwd.h> header file. */
+#define HAVE_PWD_H 1
+
+/* Define to 1 if you have the 'pwrite' function. */
+#define HAVE_PWRITE 1
+
+/* Python library found at compile time */
+/* #undef HAVE_PYTHON */
+
+/* Define to 1 if you have the 'realpath' function. */
+#define HAVE_REALPATH 1
+
+/* Define to 1 if you have the <stdatomic.h> header file. */
+#define HAVE_STDATOMIC_H 1
+
+/* Define to 1 if you have the <stdint.h> header file. */
+#define HAVE_STDINT_H 1
+
+/* Define to 1 if you have the <stdio.h> header file. */
+#define HAVE_STDIO_H 1
+
+/* Define to 1 if you have the <stdlib.h> header file. */
+#define HAVE_STDLIB_H 1
+
+/* Define to 1 if you have the <strings.h> header file. */
+#define HAVE_STRINGS_H 1
+
+/* Define to 1 if you have the <string.h> header file. */
+#define HAVE_STRING_H 1
+
+/* Define to 1 if you have the 'strndup' function. */
+#define HAVE_STRNDUP 1
+
+/* Define to 1 if 'd_type' is a member of 'struct dirent'. */
+#define HAVE_STRUCT_DIRENT_D_TYPE 1
+
+/* Define to 1 if 'uid' is a member of 'struct sockpeercred'. */
+/* #undef HAVE_STRUCT_SOCKPEERCRED_UID */
+
+/* Define to 1 if 'cache_readahead' is a member of 'struct struct_io_manager'.
+   */
+/* #undef HAVE_STRUCT_STRUCT_IO_MANAGER_CACHE_READAHEAD */
+
+/* Define to 1 if 'zeroout' is a member of 'struct struct_io_manager'. */
+/* #undef HAVE_STRUCT_STRUCT_IO_MANAGER_ZEROOUT */
+
+/* Define to 1 if 'uid' is a member of 'struct ucred'. */
+#define HAVE_STRUCT_UCRED_UID 1
+
+/* Define to 1 if you have the 'sysconf' function. */
+#define HAVE_SYSCONF 1
+
+/* Define to 1 if you have the 'syslog' function. */
+#define HAVE_SYSLOG 1
+
+/* Define to 1 if you have the <syslog.h> header file. */
+#define HAVE_SYSLOG_H 1
+
+/* Define to 1 if you have the <sys/disklabel.h> header file. */
+/* #undef HAVE_SYS_DISKLABEL_H */
+
+/* Define to 1 if you have the <sys/disk.h> header file. */
+/* #undef HAVE_SYS_DISK_H */
+
+/* Define to 1 if you have the <sys/endian.h> header file. */
+/* #undef HAVE_SYS_ENDIAN_H */
+
+/* Define to 1 if you have the <sys/ioctl.h> header file. */
+#define HAVE_SYS_IOCTL_H 1
+
+/* Define to 1 if you have the <sys/mman.h> header file. */
+#define HAVE_SYS_MMAN_H 1
+
+/* Define to 1 if you have the <sys/prctl.h> header file. */
+#define HAVE_SYS_PRCTL_H 1
+
+/* Define to 1 if you have the <sys/procctl.h> header file. */
+/* #undef HAVE_SYS_PROCCTL_H */
+
+/* Define to 1 if you have the <sys/socket.h> header file. */
+#define HAVE_SYS_SOCKET_H 1
+
+/* Define to 1 if you have the <sys/statvfs.h> header file. */
+#define HAVE_SYS_STATVFS_H 1
+
+/* Define to 1 if you have the <sys/stat.h> header file. */
+#define HAVE_SYS_STAT_H 1
+
+/* Define to 1 if you have the <sys/types.h> header file. */
+#define HAVE_SYS_TYPES_H 1
+
+/* Define to 1 if you have the <sys/ucred.h> header file. */
+/* #undef HAVE_SYS_UCRED_H */
+
+/* Define to 1 if you have the <sys/un.h> header file. */
+#define HAVE_SYS_UN_H 1
+
+/* Define to 1 if you have the <sys/vsock.h> header file. */
+/* #undef HAVE_SYS_VSOCK_H */
+
+/* Define to 1 if you have the <sys/wait.h> header file. */
+#define HAVE_SYS_WAIT_H 1
+
+/* Define to 1 if you have the <termios.h> header file. */
+#define HAVE_TERMIOS_H 1
+
+/* Define to 1 if you have the 'timer_create' function. */
+#define HAVE_TIMER_CREATE 1
+
+/* Define to 1 if you have the <unistd.h> header file. */
+#define HAVE_UNISTD_H 1
+
+/* Valgrind headers found at compile time */
+/* #undef HAVE_VALGRIND */
+
+/* Define to 1 if you have the 'valloc' function. */
+#define HAVE_VALLOC 1
+
+/* Define to 1 if vfprintf supports %m. */
+#define HAVE_VFPRINTF_PERCENT_M 1
+
+/* Define to 1 if you have the 'vsyslog' function. */
+#define HAVE_VSYSLOG 1
+
+/* Define to 1 if you have the <wchar.h> header file. */
+#define HAVE_WCHAR_H 1
+
+/* Define to 1 if you have the <winsock2.h> header file. */
+/* #undef HAVE_WINSOCK2_H */
+
+/* zlib found at compile time. */
+#define HAVE_ZLIB 1
+
+/* zlib-ng found at compile time. */
+/* #undef HAVE_ZLIB_NG */
+
+/* Program used by iso plugin to make ISOs. */
+/* #undef ISOPROG */
+
+/* ISO program behaves like xorriso. */
+/* #undef ISOPROG_IS_XORRISO */
+
+/* Temporary directory for large files */
+#define LARGE_TMPDIR "/var/tmp"
+
+/* Define to the sub-directory where libtool stores uninstalled libraries. */
+#define LT_OBJDIR ".libs/"
+
+/* Extra version information (for use by packagers) */
+#define NBDKIT_VERSION_EXTRA ""
+
+/* Name of package */
+#define PACKAGE "nbdkit"
+
+/* Define to the address where bug reports for this package should be sent. */
+#define PACKAGE_BUGREPORT ""
+
+/* Define to the full name of this package. */
+#define PACKAGE_NAME "nbdkit"
+
+/* Define to the full name and version of this package. */
+#define PACKAGE_STRING "nbdkit 1.42.2"
+
+/* Define to the one symbol short name of this package. */
+#define PACKAGE_TARNAME "nbdkit"
+
+/* Define to the home page for this package. */
+#define PACKAGE_URL ""
+
+/* Define to the version of this package. */
+#define PACKAGE_VERSION "1.42.2"
+
+/* Define to 1 if the C compiler supports function prototypes. */
+#define PROTOTYPES 1
+
+/* Define to necessary symbol if this constant uses a non-standard name on
+   your system. */
+/* #undef PTHREAD_CREATE_JOINABLE */
+
+/* The size of 'gid_t', as computed by sizeof. */
+#define SIZEOF_GID_T 4
+
+/* The size of 'long', as computed by sizeof. */
+#define SIZEOF_LONG 8
+
+/* The size of 'pid_t', as computed by sizeof. */
+#define SIZEOF_PID_T 4
+
+/* The size of 'uid_t', as computed by sizeof. */
+#define SIZEOF_UID_T 4
+
+/* Extension used for shared objects/DLLs. */
+#define SOEXT "so"
+
+/* Define to 1 if all of the C89 standard headers exist (not just the ones
+   required in a freestanding environment). This macro is provided for
+   backward compatibility; new code need not use it. */
+#define STDC_HEADERS 1
+
+/* Default TLS session priority string */
+#define TLS_PRIORITY "NORMAL"
+
+/* Enable extensions on AIX, Interix, z/OS.  */
+#ifndef _ALL_SOURCE
+# define _ALL_SOURCE 1
+#endif
+/* Enable general extensions on macOS.  */
+#ifndef _DARWIN_C_SOURCE
+# define _DARWIN_C_SOURCE 1
+#endif
+/* Enable general extensions on Solaris.  */
+#ifndef __EXTENSIONS__
+# define __EXTENSIONS__ 1
+#endif
+/* Enable GNU extensions on systems that have them.  */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE 1
+#endif
+/* Enable X/Open compliant socket functions that do not require linking
+   with -lxnet on HP-UX 11.11.  */
+#ifndef _HPUX_ALT_XOPEN_SOCKET_API
+# define _HPUX_ALT_XOPEN_SOCKET_API 1
+#endif
+/* Identify the host operating system as Minix.
+   This macro does not affect the system headers' behavior.
+   A future release of Autoconf may stop defining this macro.  */
+#ifndef _MINIX
+/* # undef _MINIX */
+#endif
+/* Enable general extensions on NetBSD.
+   Enable NetBSD compatibility extensions on Minix.  */
+#ifndef _NETBSD_SOURCE
+# define _NETBSD_SOURCE 1
+#endif
+/* Enable OpenBSD compatibility extensions on NetBSD.
+   Oddly enough, this does nothing on OpenBSD.  */
+#ifndef _OPENBSD_SOURCE
+# define _OPENBSD_SOURCE 1
+#endif
+/* Define to 1 if needed for POSIX-compatible behavior.  */
+#ifndef _POSIX_SOURCE
+/* # undef _POSIX_SOURCE */
+#endif
+/* Define to 2 if needed for POSIX-compatible behavior.  */
+#ifndef _POSIX_1_SOURCE
+/* # undef _POSIX_1_SOURCE */
+#endif
+/* Enable POSIX-compatible threading on Solaris.  */
+#ifndef _POSIX_PTHREAD_SEMANTICS
+# define _POSIX_PTHREAD_SEMANTICS 1
+#endif
+/* Enable extensions specified by ISO/IEC TS 18661-5:2014.  */
+#ifndef __STDC_WANT_IEC_60559_ATTRIBS_EXT__
+# define __STDC_WANT_IEC_60559_ATTRIBS_EXT__ 1
+#endif
+/* Enable extensions specified by ISO/IEC TS 18661-1:2014.  */
+#ifndef __STDC_WANT_IEC_60559_BFP_EXT__
+# define __STDC_WANT_IEC_60559_BFP_EXT__ 1
+#endif
+/* Enable extensions specified by ISO/IEC TS 18661-2:2015.  */
+#ifndef __STDC_WANT_IEC_60559_DFP_EXT__
+# define __STDC_WANT_IEC_60559_DFP_EXT__ 1
+#endif
+/* Enable extensions specified by C23 Annex F.  */
+#ifndef __STDC_WANT_IEC_60559_EXT__
+# define __STDC_WANT_IEC_60559_EXT__ 1
+#endif
+/* Enable extensions specified by ISO/IEC TS 18661-4:2015.  */
+#ifndef __STDC_WANT_IEC_60559_FUNCS_EXT__
+# define __STDC_WANT_IEC_60559_FUNCS_EXT__ 1
+#endif
+/* Enable extensions specified by C23 Annex H and ISO/IEC TS 18661-3:2015.  */
+#ifndef __STDC_WANT_IEC_60559_TYPES_EXT__
+# define __STDC_WANT_IEC_60559_TYPES_EXT__ 1
+#endif
+/* Enable extensions specified by ISO/IEC TR 24731-2:2010.  */
+#ifndef __STDC_WANT_LIB_EXT2__
+# define __STDC_WANT_LIB_EXT2__ 1
+#endif
+/* Enable extensions specified by ISO/IEC 24747:2009.  */
+#ifndef __STDC_WANT_MATH_SPEC_FUNCS__
+# define __STDC_WANT_MATH_SPEC_FUNCS__ 1
+#endif
+/* Enable extensions on HP NonStop.  */
+#ifndef _TANDEM_SOURCE
+# define _TANDEM_SOURCE 1
+#endif
+/* Enable X/Open extensions.  Define to 500 only if necessary
+   to make mbstate_t available.  */
+#ifndef _XOPEN_SOURCE
+/* # undef _XOPEN_SOURCE */
+#endif
+
+
+/* Version number of package */
+#define VERSION "1.42.2"
+
+/* Define WORDS_BIGENDIAN to 1 if your processor stores words with the most
+   significant byte first (like Motorola and SPARC, unlike Intel). */
+#if defined AC_APPLE_UNIVERSAL_BUILD
+# if defined __BIG_ENDIAN__
+#  define WORDS_BIGENDIAN 1
+# endif
+#else
+# ifndef WORDS_BIGENDIAN
+/* #  undef WORDS_BIGENDIAN */
+# endif
+#endif
+
+/* Number of bits in a file offset, on hosts where this is settable. */
+/* #undef _FILE_OFFSET_BITS */
+
+/* Define to 1 on platforms where this makes off_t a 64-bit type. */
+/* #undef _LARGE_FILES */
+
+/* Number of bits in time_t, on hosts where this is settable. */
+/* #undef _TIME_BITS */
+
+/* Define to 1 on platforms where this makes time_t a 64-bit type. */
+/* #undef __MINGW_USE_VC2005_COMPAT */
+
+/* Define like PROTOTYPES; this can be used by system headers. */
+#define __PROTOTYPES 1
+
+/* Host architecture. */
+#define host_cpu "x86_64"
+
+/* Host operating system. */
+#define host_os "linux-gnu"
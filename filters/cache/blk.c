@@ -46,6 +46,8 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <errno.h>
+#include <assert.h>
+#include <pthread.h>
 
 #ifdef HAVE_SYS_STATVFS_H
 #include <sys/statvfs.h>
@@ -54,24 +56,49 @@
 #include <nbdkit-filter.h>
 
 #include "bitmap.h"
+#include "cleanup.h"
 #include "minmax.h"
 #include "rounding.h"
 #include "utils.h"
+#include "vector.h"
 
 #include "cache.h"
 #include "blk.h"
 #include "lru.h"
 #include "reclaim.h"
+#include "persist.h"
+#include "ram.h"
 
 /* The cache. */
 static int fd = -1;
 
+/* This lock protects the bitmap, the LRU bitmaps and the reclaim
+ * state.  It is only held for short periods and never across I/O,
+ * so a slow read from the plugin does not stall other requests.
+ *
+ * Reading and writing the contents of blocks is serialized by the
+ * range locks below instead.  The lock order is range lock first,
+ * then this lock.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Range locks.  The cache is divided into ranges of RANGE_SIZE bytes
+ * (or one block if blocks are larger), and each range is hashed to
+ * one of NR_RANGE_LOCKS locks.  Callers hold the lock for a range
+ * while they read or modify any block in it, so requests to
+ * different ranges, including cache misses, can proceed in parallel.
+ */
+#define RANGE_SIZE (1024 * 1024)
+#define NR_RANGE_LOCKS 64
+static pthread_mutex_t range_locks[NR_RANGE_LOCKS];
+static uint64_t range_blocks;   /* blocks per range */
+
 /* Bitmap.  There are two bits per block which are updated as we read,
  * write back or write through blocks.
  *
  * 00 = not in cache
  * 01 = block cached and clean
- * 10 = <unused>
+ * 10 = block cached, being written back by the background thread
  * 11 = block cached and dirty
  *
  * Future enhancement:
@@ -88,11 +115,30 @@ static int fd = -1;
  */
 static struct bitmap bm;
 
-enum bm_entry {
-  BLOCK_NOT_CACHED = 0, /* assumed to be zero by reclaim code */
-  BLOCK_CLEAN = 1,
-  BLOCK_DIRTY = 3,
+/* Number of blocks in the BLOCK_DIRTY or BLOCK_WRITEBACK states. */
+static uint64_t nr_dirty;
+
+/* One bit per block, set when a block becomes dirty and cleared at
+ * the start of each writeback period (see writeback.c).  Dirty blocks
+ * which do not have this bit set have been dirty for at least a whole
+ * period.
+ */
+static struct bitmap dirtied_bm;
+
+/* The runs of blocks in the BLOCK_WRITEBACK state and the writeback
+ * pass which wrote each one.  The background thread and client
+ * flushes write through different contexts into the plugin, so each
+ * pass must only complete the blocks that it wrote itself.  A block
+ * written back again by another pass moves to that pass.  The runs
+ * never overlap.
+ */
+struct writeback_run {
+  uint64_t blknum, nrblocks;
+  unsigned pass;
 };
+DEFINE_VECTOR_TYPE (writeback_runs, struct writeback_run);
+static writeback_runs wb_runs = empty_vector;
+static unsigned wb_pass;
 
 static const char *
 state_to_string (enum bm_entry state)
@@ -100,21 +146,54 @@ state_to_string (enum bm_entry state)
   switch (state) {
   case BLOCK_NOT_CACHED: return "not cached";
   case BLOCK_CLEAN: return "clean";
+  case BLOCK_WRITEBACK: return "writeback";
   case BLOCK_DIRTY: return "dirty";
   default: abort ();
   }
 }
 
+static bool
+is_dirty (enum bm_entry state)
+{
+  return state == BLOCK_DIRTY || state == BLOCK_WRITEBACK;
+}
+
+/* Change the state of a block.  The lock must be held. */
+static void
+set_block_state (uint64_t blknum, enum bm_entry state)
+{
+  enum bm_entry old = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
+
+  if (is_dirty (old) && !is_dirty (state))
+    nr_dirty--;
+  else if (!is_dirty (old) && is_dirty (state))
+    nr_dirty++;
+  if (state == BLOCK_DIRTY)
+    bitmap_set_blk (&dirtied_bm, blknum, true);
+  /* Even if the block was already clean it may have been rewritten
+   * (eg. by blk_writethrough) after persist_invalidate cleared its
+   * valid bit, so it must be made valid again at the next checkpoint.
+   */
+  if (state == BLOCK_CLEAN && cache_file)
+    persist_clean (blknum);
+  bitmap_set_blk (&bm, blknum, state);
+}
+
+struct cache_stats stats;
+
 /* Extra debugging (-D cache.verbose=1). */
 NBDKIT_DLL_PUBLIC int cache_debug_verbose = 0;
 
-int
-blk_init (void)
+/* Create the unlinked temporary file used for the cache when
+ * cache-file is not set.
+ */
+static int
+create_temporary_file (void)
 {
   const char *tmpdir;
+  int tmpfd;
   size_t len;
   char *template;
-  struct statvfs statvfs;
 
   tmpdir = getenv ("TMPDIR");
   if (!tmpdir)
@@ -127,27 +206,42 @@ blk_init (void)
   snprintf (template, len, "%s/XXXXXX", tmpdir);
 
 #ifdef HAVE_MKOSTEMP
-  fd = mkostemp (template, O_CLOEXEC);
+  tmpfd = mkostemp (template, O_CLOEXEC);
 #else
   /* Not atomic, but this is only invoked during .load, so the race
    * won't affect any plugin actions trying to fork
    */
-  fd = mkstemp (template);
-  if (fd >= 0) {
-    fd = set_cloexec (fd);
-    if (fd < 0) {
+  tmpfd = mkstemp (template);
+  if (tmpfd >= 0) {
+    tmpfd = set_cloexec (tmpfd);
+    if (tmpfd < 0) {
       int e = errno;
       unlink (template);
       errno = e;
     }
   }
 #endif
-  if (fd == -1) {
+  if (tmpfd == -1) {
     nbdkit_error ("mkostemp: %s: %m", tmpdir);
     return -1;
   }
 
   unlink (template);
+  return tmpfd;
+}
+
+int
+blk_init (void)
+{
+  struct statvfs statvfs;
+  size_t i;
+
+  if (cache_file)
+    fd = persist_open ();
+  else
+    fd = create_temporary_file ();
+  if (fd == -1)
+    return -1;
 
   /* Choose the block size.
    *
@@ -157,28 +251,105 @@ blk_init (void)
    * least as large as the filesystem block size.
    */
   if (fstatvfs (fd, &statvfs) == -1) {
-    nbdkit_error ("fstatvfs: %s: %m", tmpdir);
+    nbdkit_error ("fstatvfs: %m");
     return -1;
   }
   blksize = MAX (min_block_size, statvfs.f_bsize);
   nbdkit_debug ("cache: block size: %u", blksize);
 
   bitmap_init (&bm, blksize, 2 /* bits per block */);
+  bitmap_init (&dirtied_bm, blksize, 1 /* bits per block */);
 
   lru_init ();
 
+  if (ram_init () == -1)
+    return -1;
+
+  range_blocks = MAX (1, RANGE_SIZE / blksize);
+  for (i = 0; i < NR_RANGE_LOCKS; ++i)
+    pthread_mutex_init (&range_locks[i], NULL);
+
   return 0;
 }
 
 void
 blk_free (void)
 {
-  if (fd >= 0)
+  size_t i;
+
+  if (fd >= 0) {
+    /* Record the clean blocks so they can be used after a restart. */
+    if (cache_file) {
+      persist_checkpoint (fd);
+      persist_close ();
+    }
     close (fd);
+  }
 
   bitmap_free (&bm);
+  bitmap_free (&dirtied_bm);
+  writeback_runs_reset (&wb_runs);
 
   lru_free ();
+  ram_free ();
+
+  if (range_blocks > 0) {
+    for (i = 0; i < NR_RANGE_LOCKS; ++i)
+      pthread_mutex_destroy (&range_locks[i]);
+  }
+}
+
+pthread_mutex_t *
+blk_range_lock (uint64_t blknum)
+{
+  return &range_locks[(blknum / range_blocks) % NR_RANGE_LOCKS];
+}
+
+uint64_t
+blk_range_end (uint64_t blknum)
+{
+  return (blknum / range_blocks + 1) * range_blocks;
+}
+
+/* To avoid deadlocks between threads holding more than one range
+ * lock, the locks are always acquired in index order.
+ */
+static void
+find_range_locks (uint64_t blknum, uint64_t nrblocks,
+                  bool used[NR_RANGE_LOCKS])
+{
+  uint64_t r;
+
+  const uint64_t first = blknum / range_blocks;
+  const uint64_t last = (blknum + nrblocks - 1) / range_blocks;
+
+  memset (used, 0, NR_RANGE_LOCKS * sizeof used[0]);
+  for (r = first; r <= last && r - first < NR_RANGE_LOCKS; ++r)
+    used[r % NR_RANGE_LOCKS] = true;
+}
+
+void
+blk_lock_ranges (uint64_t blknum, uint64_t nrblocks)
+{
+  bool used[NR_RANGE_LOCKS];
+  size_t i;
+
+  find_range_locks (blknum, nrblocks, used);
+  for (i = 0; i < NR_RANGE_LOCKS; ++i)
+    if (used[i])
+      pthread_mutex_lock (&range_locks[i]);
+}
+
+void
+blk_unlock_ranges (uint64_t blknum, uint64_t nrblocks)
+{
+  bool used[NR_RANGE_LOCKS];
+  size_t i;
+
+  find_range_locks (blknum, nrblocks, used);
+  for (i = 0; i < NR_RANGE_LOCKS; ++i)
+    if (used[i])
+      pthread_mutex_unlock (&range_locks[i]);
 }
 
 /* Because blk_set_size is called before the other blk_* functions
@@ -189,10 +360,17 @@ static uint64_t size = 0;
 int
 blk_set_size (uint64_t new_size)
 {
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
   size = new_size;
 
   if (bitmap_resize (&bm, size) == -1)
     return -1;
+  if (bitmap_resize (&dirtied_bm, size) == -1)
+    return -1;
+
+  if (cache_file && persist_load (fd, size, &bm) == -1)
+    return -1;
 
   if (ftruncate (fd, ROUND_UP (size, blksize)) == -1) {
     nbdkit_error ("ftruncate: %m");
@@ -201,6 +379,54 @@ blk_set_size (uint64_t new_size)
 
   if (lru_set_size (size) == -1)
     return -1;
+  if (ram_set_size (size) == -1)
+    return -1;
+
+  return 0;
+}
+
+/* Reclaim blocks from the cache if it is too large. */
+static void
+blk_reclaim (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  reclaim (fd, &bm);
+}
+
+/* Read a run of cached blocks, from RAM where possible.  Runs of
+ * blocks which are not in RAM are read from the cache file with a
+ * single pread and then copied into RAM.
+ */
+static int
+read_cached (uint64_t blknum, uint64_t nrblocks, uint8_t *block, int *err)
+{
+  uint64_t b = 0, i, n;
+
+  while (b < nrblocks) {
+    if (ram_read (blknum + b, block + blksize * b)) {
+      b++;
+      continue;
+    }
+
+    for (n = 1; b + n < nrblocks; ++n) {
+      if (ram_read (blknum + b + n, block + blksize * (b + n)))
+        break;
+    }
+
+    if (full_pread (fd, block + blksize * b, blksize * n,
+                    (blknum + b) * blksize) == -1) {
+      *err = errno;
+      nbdkit_error ("pread: %m");
+      return -1;
+    }
+    for (i = 0; i < n; ++i)
+      ram_insert (blknum + b + i, block + blksize * (b + i));
+
+    /* If the loop above stopped early, block b + n was read from RAM. */
+    b += n;
+    if (b < nrblocks)
+      b++;
+  }
 
   return 0;
 }
@@ -211,37 +437,50 @@ _blk_read_multiple (nbdkit_next *next,
                     uint8_t *block, int *err)
 {
   off_t offset = blknum * blksize;
-  bool not_cached =
-    bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED) == BLOCK_NOT_CACHED;
-  uint64_t b, runblocks;
+  bool not_cached;
+  uint64_t b, runblocks, sz;
 
   assert (nrblocks > 0);
 
-  if (cache_debug_verbose)
-    nbdkit_debug ("cache: blk_read_multiple block %" PRIu64
-                  " (offset %" PRIu64 ") is %s",
-                  blknum, (uint64_t) offset,
-                  not_cached ? "not cached" : "cached");
-
   /* Find out how many of the following blocks form a "run" with the
    * same cached/not-cached state.  We can process that many blocks in
    * one go.
+   *
+   * The state cannot change under us after we drop the lock, because
+   * the caller holds the range lock for these blocks, and reclaim
+   * skips blocks whose range lock is held.
    */
-  for (b = 1, runblocks = 1; b < nrblocks; ++b, ++runblocks) {
-    bool s =
-      bitmap_get_blk (&bm, blknum + b, BLOCK_NOT_CACHED) == BLOCK_NOT_CACHED;
-    if (not_cached != s)
-      break;
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    not_cached =
+      bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED) == BLOCK_NOT_CACHED;
+    for (b = 1, runblocks = 1; b < nrblocks; ++b, ++runblocks) {
+      bool s =
+        bitmap_get_blk (&bm, blknum + b, BLOCK_NOT_CACHED) == BLOCK_NOT_CACHED;
+      if (not_cached != s)
+        break;
+    }
+    sz = size;
+    if (not_cached)
+      stats.misses += runblocks;
+    else
+      stats.hits += runblocks;
   }
 
+  if (cache_debug_verbose)
+    nbdkit_debug ("cache: blk_read_multiple block %" PRIu64
+                  " (offset %" PRIu64 ") is %s",
+                  blknum, (uint64_t) offset,
+                  not_cached ? "not cached" : "cached");
+
   if (not_cached) {             /* Read underlying plugin. */
     unsigned n, tail = 0;
 
     assert (blksize * runblocks <= UINT_MAX);
     n = blksize * runblocks;
 
-    if (offset + n > size) {
-      tail = offset + n - size;
+    if (offset + n > sz) {
+      tail = offset + n - sz;
       n -= tail;
     }
 
@@ -266,18 +505,17 @@ _blk_read_multiple (nbdkit_next *next,
         nbdkit_error ("pwrite: %m");
         return -1;
       }
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
       for (b = 0; b < runblocks; ++b) {
-        bitmap_set_blk (&bm, blknum + b, BLOCK_CLEAN);
+        set_block_state (blknum + b, BLOCK_CLEAN);
         lru_set_recently_accessed (blknum + b);
       }
     }
   }
   else {                        /* Read cache. */
-    if (full_pread (fd, block, blksize * runblocks, offset) == -1) {
-      *err = errno;
-      nbdkit_error ("pread: %m");
+    if (read_cached (blknum, runblocks, block, err) == -1)
       return -1;
-    }
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
     for (b = 0; b < runblocks; ++b)
       lru_set_recently_accessed (blknum + b);
   }
@@ -299,7 +537,7 @@ blk_read_multiple (nbdkit_next *next,
                    uint64_t blknum, uint64_t nrblocks,
                    uint8_t *block, int *err)
 {
-  reclaim (fd, &bm);
+  blk_reclaim ();
   return _blk_read_multiple (next, blknum, nrblocks, block, err);
 }
 
@@ -315,9 +553,16 @@ blk_cache (nbdkit_next *next,
            uint64_t blknum, uint8_t *block, int *err)
 {
   off_t offset = blknum * blksize;
-  enum bm_entry state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
+  enum bm_entry state;
+  uint64_t sz;
 
-  reclaim (fd, &bm);
+  blk_reclaim ();
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
+    sz = size;
+  }
 
   if (cache_debug_verbose)
     nbdkit_debug ("cache: blk_cache block %" PRIu64
@@ -329,8 +574,8 @@ blk_cache (nbdkit_next *next,
     /* Read underlying plugin, copy to cache regardless of cache-on-read. */
     unsigned n = blksize, tail = 0;
 
-    if (offset + n > size) {
-      tail = offset + n - size;
+    if (offset + n > sz) {
+      tail = offset + n - sz;
       n -= tail;
     }
 
@@ -352,7 +597,8 @@ blk_cache (nbdkit_next *next,
       nbdkit_error ("pwrite: %m");
       return -1;
     }
-    bitmap_set_blk (&bm, blknum, BLOCK_CLEAN);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    set_block_state (blknum, BLOCK_CLEAN);
     lru_set_recently_accessed (blknum);
   }
   else {
@@ -364,6 +610,7 @@ blk_cache (nbdkit_next *next,
       return -1;
     }
 #endif
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
     lru_set_recently_accessed (blknum);
   }
   return 0;
@@ -376,28 +623,41 @@ blk_writethrough (nbdkit_next *next,
 {
   off_t offset = blknum * blksize;
   unsigned n = blksize, tail = 0;
+  uint64_t sz;
 
-  if (offset + n > size) {
-    tail = offset + n - size;
+  blk_reclaim ();
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    sz = size;
+  }
+  if (offset + n > sz) {
+    tail = offset + n - sz;
     n -= tail;
   }
 
-  reclaim (fd, &bm);
-
   if (cache_debug_verbose)
     nbdkit_debug ("cache: writethrough block %" PRIu64 " (offset %" PRIu64 ")",
                   blknum, (uint64_t) offset);
 
+  if (cache_file && persist_invalidate (blknum) == -1) {
+    *err = errno;
+    return -1;
+  }
+
   if (full_pwrite (fd, block, blksize, offset) == -1) {
     *err = errno;
     nbdkit_error ("pwrite: %m");
+    ram_remove (blknum);
     return -1;
   }
+  ram_update (blknum, block);
 
   if (next->pwrite (next, block, n, offset, flags, err) == -1)
     return -1;
 
-  bitmap_set_blk (&bm, blknum, BLOCK_CLEAN);
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  set_block_state (blknum, BLOCK_CLEAN);
   lru_set_recently_accessed (blknum);
 
   return 0;
@@ -416,36 +676,212 @@ blk_write (nbdkit_next *next,
 
   offset = blknum * blksize;
 
-  reclaim (fd, &bm);
+  blk_reclaim ();
 
   if (cache_debug_verbose)
     nbdkit_debug ("cache: writeback block %" PRIu64 " (offset %" PRIu64 ")",
                   blknum, (uint64_t) offset);
 
+  if (cache_file && persist_invalidate (blknum) == -1) {
+    *err = errno;
+    return -1;
+  }
+
   if (full_pwrite (fd, block, blksize, offset) == -1) {
     *err = errno;
     nbdkit_error ("pwrite: %m");
+    ram_remove (blknum);
     return -1;
   }
-  bitmap_set_blk (&bm, blknum, BLOCK_DIRTY);
+  ram_update (blknum, block);
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  set_block_state (blknum, BLOCK_DIRTY);
   lru_set_recently_accessed (blknum);
 
   return 0;
 }
 
+void
+blk_dirty_stats (uint64_t *dirty, uint64_t *nrblocks)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  *dirty = nr_dirty;
+  *nrblocks = DIV_ROUND_UP (size, blksize);
+}
+
+void
+blk_new_dirty_period (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  bitmap_clear (&dirtied_bm);
+}
+
+int64_t
+blk_find_dirty_run (uint64_t blknum, bool old_only, uint64_t max_blocks,
+                    uint64_t *nrblocks)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  int64_t start;
+  uint64_t n;
+
+  for (start = bitmap_next (&bm, blknum); start >= 0;
+       start = bitmap_next (&bm, start + 1)) {
+    if (is_dirty (bitmap_get_blk (&bm, start, BLOCK_NOT_CACHED)) &&
+        (!old_only || !bitmap_get_blk (&dirtied_bm, start, false)))
+      break;
+  }
+  if (start < 0)
+    return -1;
+
+  for (n = 1; n < max_blocks; ++n) {
+    if (!is_dirty (bitmap_get_blk (&bm, start + n, BLOCK_NOT_CACHED)) ||
+        (old_only && bitmap_get_blk (&dirtied_bm, start + n, false)))
+      break;
+  }
+  *nrblocks = n;
+  return start;
+}
+
+/* Record that pass wrote back [blknum, blknum+n), taking the blocks
+ * away from any other pass which wrote them earlier.  Called with the
+ * lock held.
+ */
+static int
+take_writeback_run (uint64_t blknum, uint64_t n, unsigned pass)
+{
+  const uint64_t end = blknum + n;
+  const struct writeback_run run = { .blknum = blknum, .nrblocks = n,
+                                     .pass = pass };
+  size_t i = 0;
+
+  /* At most one run is split below, so once there is room for two
+   * more runs nothing else can fail.
+   */
+  if (writeback_runs_reserve (&wb_runs, 2) == -1)
+    return -1;
+
+  while (i < wb_runs.len) {
+    struct writeback_run *w = &wb_runs.ptr[i];
+    const uint64_t wend = w->blknum + w->nrblocks;
+
+    if (wend <= blknum || w->blknum >= end)
+      i++;
+    else if (w->blknum < blknum && wend > end) {
+      const struct writeback_run tail = { .blknum = end,
+                                          .nrblocks = wend - end,
+                                          .pass = w->pass };
+      w->nrblocks = blknum - w->blknum;
+      writeback_runs_insert (&wb_runs, tail, i + 1);
+      i += 2;
+    }
+    else if (w->blknum < blknum) {
+      w->nrblocks = blknum - w->blknum;
+      i++;
+    }
+    else if (wend > end) {
+      w->nrblocks = wend - end;
+      w->blknum = end;
+      i++;
+    }
+    else
+      writeback_runs_remove (&wb_runs, i);
+  }
+
+  writeback_runs_append (&wb_runs, run);
+  return 0;
+}
+
 int
-for_each_dirty_block (block_callback f, void *vp)
+blk_writeback (nbdkit_next *next,
+               uint64_t blknum, uint64_t *nrblocks, uint8_t *block,
+               unsigned pass, int *err)
 {
-  uint64_t blknum;
-  enum bm_entry state;
+  off_t offset = blknum * blksize;
+  uint64_t b, n, sz;
+  unsigned count, tail = 0;
 
-  bitmap_for (&bm, blknum) {
-    state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
-    if (state == BLOCK_DIRTY) {
-      if (f (blknum, vp) == -1)
-        return -1;
+  /* The blocks may have been cleaned (and possibly reclaimed) since
+   * the caller found them, so only write back the leading blocks
+   * which are still dirty.
+   */
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    for (n = 0; n < *nrblocks; ++n) {
+      if (!is_dirty (bitmap_get_blk (&bm, blknum + n, BLOCK_NOT_CACHED)))
+        break;
     }
+    sz = size;
+  }
+  *nrblocks = n;
+  if (n == 0)
+    return 0;
+
+  assert (blksize * n <= UINT_MAX);
+  count = blksize * n;
+  if (offset + count > sz) {
+    tail = offset + count - sz;
+    count -= tail;
+  }
+
+  if (cache_debug_verbose)
+    nbdkit_debug ("cache: writeback %" PRIu64 " blocks "
+                  "from block %" PRIu64 " (offset %" PRIu64 ")",
+                  n, blknum, (uint64_t) offset);
+
+  if (full_pread (fd, block, count, offset) == -1) {
+    *err = errno;
+    nbdkit_error ("pread: %m");
+    return -1;
   }
 
+  if (next->pwrite (next, block, count, offset, 0, err) == -1)
+    return -1;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  if (take_writeback_run (blknum, n, pass) == -1) {
+    *err = errno;
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  for (b = 0; b < n; ++b)
+    set_block_state (blknum + b, BLOCK_WRITEBACK);
   return 0;
 }
+
+unsigned
+blk_writeback_pass (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  return ++wb_pass;
+}
+
+void
+blk_writeback_done (unsigned pass, bool ok)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  size_t i = 0;
+  uint64_t b;
+
+  while (i < wb_runs.len) {
+    const struct writeback_run w = wb_runs.ptr[i];
+
+    if (w.pass != pass) {
+      i++;
+      continue;
+    }
+    /* Blocks written to since they were written back are dirty again. */
+    for (b = w.blknum; b < w.blknum + w.nrblocks; ++b) {
+      if (bitmap_get_blk (&bm, b, BLOCK_NOT_CACHED) == BLOCK_WRITEBACK)
+        set_block_state (b, ok ? BLOCK_CLEAN : BLOCK_DIRTY);
+    }
+    writeback_runs_remove (&wb_runs, i);
+  }
+}
+
+int
+blk_checkpoint (void)
+{
+  if (!cache_file)
+    return 0;
+  return persist_checkpoint (fd);
+}
@@ -33,22 +33,81 @@
 #ifndef NBDKIT_BLK_H
 #define NBDKIT_BLK_H
 
+#include <pthread.h>
+
+/* The state of each block in the cache. */
+enum bm_entry {
+  BLOCK_NOT_CACHED = 0, /* assumed to be zero by reclaim code */
+  BLOCK_CLEAN = 1,
+  BLOCK_WRITEBACK = 2,
+  BLOCK_DIRTY = 3,
+};
+
 /* Initialize the cache and bitmap. */
 extern int blk_init (void);
 
 /* Close the cache, free the bitmap. */
 extern void blk_free (void);
 
+/* Allocate or resize the cache file and bitmap. */
+extern int blk_set_size (uint64_t new_size);
+
+/* Return the lock covering the range of blocks which contains
+ * blknum.
+ */
+extern pthread_mutex_t *blk_range_lock (uint64_t blknum);
+
+/* Return the first block after the range which contains blknum.
+ * Requests are split at this boundary so that each part only needs
+ * one range lock.
+ */
+extern uint64_t blk_range_end (uint64_t blknum);
+
+/* Lock and unlock all of the range locks covering a run of blocks. */
+extern void blk_lock_ranges (uint64_t blknum, uint64_t nrblocks);
+extern void blk_unlock_ranges (uint64_t blknum, uint64_t nrblocks);
+
+/* Return the number of dirty blocks and the total number of blocks. */
+extern void blk_dirty_stats (uint64_t *nr_dirty, uint64_t *nrblocks)
+  __attribute__ ((__nonnull__ (1, 2)));
+
+/* Start a new writeback period, see writeback.c. */
+extern void blk_new_dirty_period (void);
+
+/* Find the first run of dirty blocks at or after blknum, up to
+ * max_blocks long.  If old_only is true, only blocks which have been
+ * dirty since before the current writeback period are considered.
+ * Returns the first block of the run and sets *nrblocks, or returns
+ * -1 if there are no more dirty blocks.
+ */
+extern int64_t blk_find_dirty_run (uint64_t blknum, bool old_only,
+                                   uint64_t max_blocks, uint64_t *nrblocks)
+  __attribute__ ((__nonnull__ (4)));
+
+/* Each writeback pass (a background writeback or a client flush)
+ * gets a new pass number from blk_writeback_pass, which it passes to
+ * blk_writeback.  Call blk_writeback_done when the writes made by the
+ * pass have been flushed to the plugin ('ok' is true) or the flush
+ * failed.  This moves the blocks written back by this pass which have
+ * not been written to since from the writeback state to clean (or
+ * back to dirty).  Blocks written back again by a later pass are left
+ * for that pass to complete.
+ */
+extern unsigned blk_writeback_pass (void);
+extern void blk_writeback_done (unsigned pass, bool ok);
+
+/* If the cache is persistent (cache-file parameter), record the clean
+ * blocks in the metadata, see persist.c.
+ */
+extern int blk_checkpoint (void);
+
 /*----------------------------------------------------------------------
  * ** NOTE **
  *
- * An exclusive lock must be held when you call any function below
- * this line.
+ * The range lock (see blk_range_lock) must be held for all blocks
+ * passed to the functions below this line.
  */
 
-/* Allocate or resize the cache file and bitmap. */
-extern int blk_set_size (uint64_t new_size);
-
 /* Read a single block from the cache or plugin. If cache_on_read is set,
  * also ensure it is cached. */
 extern int blk_read (nbdkit_next *next,
@@ -85,9 +144,15 @@ extern int blk_write (nbdkit_next *next,
                       uint32_t flags, int *err)
   __attribute__ ((__nonnull__ (1, 3, 5)));
 
-/* Iterates over each dirty block in the cache. */
-typedef int (*block_callback) (uint64_t blknum, void *vp);
-extern int for_each_dirty_block (block_callback f, void *vp)
-  __attribute__ ((__nonnull__ (1)));
+/* Write back a run of dirty blocks to the plugin with a single
+ * pwrite, using 'block' (which must be large enough for the whole
+ * run) as a bounce buffer.  *nrblocks is reduced if some of the blocks
+ * are no longer dirty, and may be set to 0.  The blocks are left in
+ * the writeback state, see blk_writeback_done.
+ */
+extern int blk_writeback (nbdkit_next *next,
+                          uint64_t blknum, uint64_t *nrblocks,
+                          uint8_t *block, unsigned pass, int *err)
+  __attribute__ ((__nonnull__ (1, 3, 4, 6)));
 
 #endif /* NBDKIT_BLK_H */
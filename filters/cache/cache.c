@@ -62,31 +62,62 @@
 #include "cache.h"
 #include "blk.h"
 #include "reclaim.h"
+#include "writeback.h"
 #include "isaligned.h"
 #include "ispowerof2.h"
 #include "minmax.h"
 #include "rounding.h"
 
-/* In order to handle parallel requests safely, this lock must be held
- * when calling any blk_* functions.
- */
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-
 unsigned blksize;            /* actual block size (picked by blk.c) */
 unsigned min_block_size = 65536;
 enum cache_mode cache_mode = CACHE_MODE_WRITEBACK;
 int64_t max_size = -1;
 unsigned hi_thresh = 95, lo_thresh = 80;
+enum cache_policy cache_policy = CACHE_POLICY_LRU;
 enum cor_mode cor_mode = COR_OFF;
 const char *cor_path;
+unsigned dirty_expire, dirty_ratio;
+char *cache_file;
+const char *cache_file_id;
+int64_t ram_size;
+static FILE *stats_fp;       /* cache-stats */
+static int thread_model;     /* thread model (from .get_ready) */
 
 static int cache_flush (nbdkit_next *next, void *handle, uint32_t flags,
                         int *err);
 
+static void
+print_stats (void)
+{
+  const uint64_t reads = stats.hits + stats.misses;
+  const double hit_rate = reads ? 100.0 * stats.hits / reads : 0;
+
+  nbdkit_debug ("cache: hits: %" PRIu64 " (RAM: %" PRIu64 ")"
+                " misses: %" PRIu64
+                " (%.1f%% hit rate) evictions: %" PRIu64,
+                stats.hits, stats.ram_hits, stats.misses, hit_rate,
+                stats.evictions);
+
+  if (stats_fp) {
+    fprintf (stats_fp,
+             "block size: %u\n"
+             "hits: %" PRIu64 "\n"
+             "ram hits: %" PRIu64 "\n"
+             "misses: %" PRIu64 "\n"
+             "hit rate: %.1f%%\n"
+             "evictions: %" PRIu64 "\n",
+             blksize, stats.hits, stats.ram_hits, stats.misses, hit_rate,
+             stats.evictions);
+    fclose (stats_fp);
+  }
+}
+
 static void
 cache_unload (void)
 {
+  print_stats ();
   blk_free ();
+  free (cache_file);
 }
 
 static int
@@ -184,6 +215,77 @@ cache_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
     }
     return 0;
   }
+  else if (strcmp (key, "cache-dirty-expire") == 0) {
+    if (nbdkit_parse_unsigned ("cache-dirty-expire",
+                               value, &dirty_expire) == -1)
+      return -1;
+    return 0;
+  }
+  else if (strcmp (key, "cache-dirty-ratio") == 0) {
+    if (nbdkit_parse_unsigned ("cache-dirty-ratio",
+                               value, &dirty_ratio) == -1)
+      return -1;
+    if (dirty_ratio > 100) {
+      nbdkit_error ("cache-dirty-ratio must be a percentage");
+      return -1;
+    }
+    return 0;
+  }
+  else if (strcmp (key, "cache-policy") == 0) {
+    if (strcmp (value, "lru") == 0) {
+      cache_policy = CACHE_POLICY_LRU;
+      return 0;
+    }
+    else if (strcmp (value, "2q") == 0) {
+      cache_policy = CACHE_POLICY_2Q;
+      return 0;
+    }
+    else {
+      nbdkit_error ("invalid cache-policy parameter, should be lru|2q");
+      return -1;
+    }
+  }
+  else if (strcmp (key, "cache-ram-size") == 0) {
+    ram_size = nbdkit_parse_size (value);
+    if (ram_size == -1)
+      return -1;
+    return 0;
+  }
+  else if (strcmp (key, "cache-stats") == 0) {
+    int fd;
+
+    if (stats_fp) {
+      nbdkit_error ("cache-stats parameter can only be given once");
+      return -1;
+    }
+    fd = open (value, O_CLOEXEC | O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+      nbdkit_error ("open: %s: %m", value);
+      return -1;
+    }
+    stats_fp = fdopen (fd, "w");
+    if (stats_fp == NULL) {
+      nbdkit_error ("fdopen: %s: %m", value);
+      close (fd);
+      return -1;
+    }
+    return 0;
+  }
+  else if (strcmp (key, "cache-file") == 0) {
+    free (cache_file);
+    cache_file = nbdkit_absolute_path (value);
+    if (cache_file == NULL)
+      return -1;
+    return 0;
+  }
+  else if (strcmp (key, "cache-file-id") == 0) {
+    if (strlen (value) > 1024) {
+      nbdkit_error ("cache-file-id is too long");
+      return -1;
+    }
+    cache_file_id = value;
+    return 0;
+  }
   else {
     return next (nxdata, key, value);
   }
@@ -192,14 +294,21 @@ cache_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
 #define cache_config_help_common \
   "cache=MODE                Set cache MODE, one of writeback (default),\n" \
   "                          writethrough, or unsafe.\n" \
-  "cache-on-read=BOOL|/PATH  Set to true to cache on reads (default false).\n"
+  "cache-on-read=BOOL|/PATH  Set to true to cache on reads (default false).\n" \
+  "cache-dirty-expire=SECS   Write back blocks dirty for longer than SECS.\n" \
+  "cache-dirty-ratio=PCT     Start writeback when PCT% of blocks are dirty.\n" \
+  "cache-file=FILENAME       Store the cache persistently in FILENAME.\n" \
+  "cache-file-id=ID          Identifies the plugin data for cache-file.\n" \
+  "cache-ram-size=SIZE       Keep up to SIZE of hot blocks in RAM.\n" \
+  "cache-stats=FILE          Write hit/miss statistics to FILE on exit.\n"
 #ifndef HAVE_CACHE_RECLAIM
 #define cache_config_help cache_config_help_common
 #else
 #define cache_config_help cache_config_help_common \
   "cache-max-size=SIZE       Set maximum space used by cache.\n" \
   "cache-high-threshold=PCT  Percentage of max size where reclaim begins.\n" \
-  "cache-low-threshold=PCT   Percentage of max size where reclaim ends.\n"
+  "cache-low-threshold=PCT   Percentage of max size where reclaim ends.\n" \
+  "cache-policy=lru|2q       Choose blocks to reclaim with LRU or 2Q.\n"
 #endif
 
 /* Decide if cache-on-read is currently on or off. */
@@ -227,18 +336,46 @@ cache_config_complete (nbdkit_next_config_complete *next,
     }
   }
 
+  if (cache_file_id && !cache_file) {
+    nbdkit_error ("cache-file-id requires cache-file");
+    return -1;
+  }
+
   return next (nxdata);
 }
 
 static int
-cache_get_ready (int thread_model)
+cache_get_ready (int model)
 {
+  /* The writeback thread uses the plugin at the same time as client
+   * connections.
+   */
+  if (writeback_enabled () &&
+      model < NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS) {
+    nbdkit_error ("cache-dirty-expire and cache-dirty-ratio "
+                  "cannot be used with this plugin's thread model");
+    return -1;
+  }
+  thread_model = model;
+
   if (blk_init () == -1)
     return -1;
 
   return 0;
 }
 
+static int
+cache_after_fork (nbdkit_backend *nxdata)
+{
+  return writeback_start (nxdata, thread_model);
+}
+
+static void
+cache_cleanup (nbdkit_backend *nxdata)
+{
+  writeback_stop ();
+}
+
 /* Get the file size, set the cache size. */
 static int64_t
 cache_get_size (nbdkit_next *next,
@@ -253,7 +390,6 @@ cache_get_size (nbdkit_next *next,
 
   nbdkit_debug ("cache: underlying file size: %" PRIi64, size);
 
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
   r = blk_set_size (size);
   if (r == -1)
     return -1;
@@ -391,7 +527,7 @@ cache_pread (nbdkit_next *next,
     uint64_t n = MIN (blksize - blkoffs, count);
 
     assert (block);
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_range_lock (blknum));
     r = blk_read (next, blknum, block, err);
     if (r == -1)
       return -1;
@@ -404,10 +540,11 @@ cache_pread (nbdkit_next *next,
     blknum++;
   }
 
-  /* Aligned body */
-  nrblocks = count / blksize;
-  if (nrblocks > 0) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  /* Aligned body.  This is split at range lock boundaries. */
+  while (count >= blksize) {
+    nrblocks = MIN (count / blksize, blk_range_end (blknum) - blknum);
+
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_range_lock (blknum));
     r = blk_read_multiple (next, blknum, nrblocks, buf, err);
     if (r == -1)
       return -1;
@@ -421,7 +558,7 @@ cache_pread (nbdkit_next *next,
   /* Unaligned tail */
   if (count) {
     assert (block);
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_range_lock (blknum));
     r = blk_read (next, blknum, block, err);
     if (r == -1)
       return -1;
@@ -467,10 +604,10 @@ cache_pwrite (nbdkit_next *next,
     uint64_t n = MIN (blksize - blkoffs, count);
 
     /* Do a read-modify-write operation on the current block.
-     * Hold the lock over the whole operation.
+     * Hold the range lock over the whole operation.
      */
     assert (block);
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_range_lock (blknum));
     r = blk_read (next, blknum, block, err);
     if (r != -1) {
       memcpy (&block[blkoffs], buf, n);
@@ -487,7 +624,7 @@ cache_pwrite (nbdkit_next *next,
 
   /* Aligned body */
   while (count >= blksize) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_range_lock (blknum));
     r = blk_write (next, blknum, buf, flags, err);
     if (r == -1)
       return -1;
@@ -501,7 +638,7 @@ cache_pwrite (nbdkit_next *next,
   /* Unaligned tail */
   if (count) {
     assert (block);
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_range_lock (blknum));
     r = blk_read (next, blknum, block, err);
     if (r != -1) {
       memcpy (block, buf, count);
@@ -558,9 +695,9 @@ cache_zero (nbdkit_next *next,
     uint64_t n = MIN (blksize - blkoffs, count);
 
     /* Do a read-modify-write operation on the current block.
-     * Hold the lock over the whole operation.
+     * Hold the range lock over the whole operation.
      */
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_range_lock (blknum));
     r = blk_read (next, blknum, block, err);
     if (r != -1) {
       memset (&block[blkoffs], 0, n);
@@ -579,7 +716,7 @@ cache_zero (nbdkit_next *next,
     memset (block, 0, blksize);
   while (count >=blksize) {
     /* Intentional that we do not use next->zero */
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_range_lock (blknum));
     r = blk_write (next, blknum, block, flags, err);
     if (r == -1)
       return -1;
@@ -591,7 +728,7 @@ cache_zero (nbdkit_next *next,
 
   /* Unaligned tail */
   if (count) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_range_lock (blknum));
     r = blk_read (next, blknum, block, err);
     if (r != -1) {
       memset (block, 0, count);
@@ -606,23 +743,13 @@ cache_zero (nbdkit_next *next,
   return 0;
 }
 
-/* Flush: Go through all the dirty blocks, flushing them to disk. */
-struct flush_data {
-  uint8_t *block;               /* bounce buffer */
-  unsigned errors;              /* count of errors seen */
-  int first_errno;              /* first errno seen */
-  nbdkit_next *next;
-};
-
-static int flush_dirty_block (uint64_t blknum, void *);
-
+/* Flush: Write back all the dirty blocks, then flush the plugin. */
 static int
 cache_flush (nbdkit_next *next, void *handle,
              uint32_t flags, int *err)
 {
-  CLEANUP_FREE uint8_t *block = NULL;
-  struct flush_data data =
-    { .errors = 0, .first_errno = 0, .next = next };
+  unsigned errors = 0;
+  const unsigned pass = blk_writeback_pass ();
   int tmp;
 
   if (cache_mode == CACHE_MODE_UNSAFE)
@@ -630,58 +757,27 @@ cache_flush (nbdkit_next *next, void *handle,
 
   assert (!flags);
 
-  /* Allocate the bounce buffer. */
-  block = malloc (blksize);
-  if (block == NULL) {
-    *err = errno;
-    nbdkit_error ("malloc: %m");
-    return -1;
-  }
-  data.block = block;
-
   /* In theory if cache_mode == CACHE_MODE_WRITETHROUGH then there
    * should be no dirty blocks.  However we go through the cache here
    * to be sure.  Also we still need to issue the flush to the
    * underlying storage.
    */
-  {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    for_each_dirty_block (flush_dirty_block, &data);
-  }
+  if (writeback_flush (next, pass, err) == -1)
+    errors++;
 
   /* Now issue a flush request to the underlying storage. */
-  if (next->flush (next, 0, data.errors ? &tmp : &data.first_errno) == -1)
-    data.errors++;
+  if (next->flush (next, 0, errors ? &tmp : err) == -1)
+    errors++;
 
-  if (data.errors > 0) {
-    *err = data.first_errno;
-    return -1;
-  }
-  return 0;
-}
-
-static int
-flush_dirty_block (uint64_t blknum, void *datav)
-{
-  struct flush_data *data = datav;
-  int tmp;
+  /* Blocks written back are only clean if everything succeeded. */
+  blk_writeback_done (pass, errors == 0);
 
-  /* Perform a read + writethrough which will read from the
-   * cache and write it through to the underlying storage.
-   */
-  if (blk_read (data->next, blknum, data->block,
-                data->errors ? &tmp : &data->first_errno) == -1)
-    goto err;
-  if (blk_writethrough (data->next, blknum, data->block, 0,
-                        data->errors ? &tmp : &data->first_errno) == -1)
-    goto err;
-
-  return 0;
+  if (errors == 0 && blk_checkpoint () == -1) {
+    *err = errno;
+    errors++;
+  }
 
- err:
-  nbdkit_error ("cache: flush of block %" PRIu64 " failed", blknum);
-  data->errors++;
-  return 0; /* continue scanning and flushing. */
+  return errors > 0 ? -1 : 0;
 }
 
 /* Cache data. */
@@ -715,7 +811,7 @@ cache_cache (nbdkit_next *next,
 
   /* Aligned body */
   while (remaining) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_range_lock (blknum));
     r = blk_cache (next, blknum, block, err);
     if (r == -1)
       return -1;
@@ -736,6 +832,8 @@ static struct nbdkit_filter filter = {
   .config_complete   = cache_config_complete,
   .config_help       = cache_config_help,
   .get_ready         = cache_get_ready,
+  .after_fork        = cache_after_fork,
+  .cleanup           = cache_cleanup,
   .prepare           = cache_prepare,
   .get_size          = cache_get_size,
   .block_size        = cache_block_size,
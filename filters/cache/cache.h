@@ -52,6 +52,12 @@ extern unsigned min_block_size;
 extern int64_t max_size;
 extern unsigned hi_thresh, lo_thresh;
 
+/* Replacement policy (cache-policy parameter). */
+extern enum cache_policy {
+  CACHE_POLICY_LRU,
+  CACHE_POLICY_2Q,
+} cache_policy;
+
 /* Cache on read mode. */
 extern enum cor_mode {
   COR_OFF,
@@ -61,4 +67,31 @@ extern enum cor_mode {
 extern const char *cor_path;
 extern bool cache_on_read (void);
 
+/* Background writeback thresholds (cache-dirty-expire and
+ * cache-dirty-ratio parameters), 0 if not set.
+ */
+extern unsigned dirty_expire, dirty_ratio;
+
+/* Persistent cache file (cache-file and cache-file-id parameters),
+ * NULL if not set.
+ */
+extern char *cache_file;
+extern const char *cache_file_id;
+
+/* Size of the in-memory tier (cache-ram-size parameter), 0 if not
+ * set.
+ */
+extern int64_t ram_size;
+
+/* Statistics, printed when nbdkit exits (cache-stats parameter).
+ * Protected by the blk lock, except ram_hits which is protected by
+ * the lock in ram.c.
+ */
+extern struct cache_stats {
+  uint64_t hits;                /* blocks read from the cache */
+  uint64_t ram_hits;            /* ... of which were read from RAM */
+  uint64_t misses;              /* blocks read from the plugin */
+  uint64_t evictions;           /* blocks reclaimed */
+} stats;
+
 #endif /* NBDKIT_CACHE_H */
@@ -50,6 +50,7 @@
 #include "cache.h"
 #include "blk.h"
 #include "lru.h"
+#include "twoq.h"
 
 /* LRU bitmaps.  These bitmaps implement a simple, fast LRU structure.
  *
@@ -94,6 +95,8 @@ lru_init (void)
 {
   bitmap_init (&bm[0], blksize, 1 /* bits per block */);
   bitmap_init (&bm[1], blksize, 1 /* bits per block */);
+  if (cache_policy == CACHE_POLICY_2Q)
+    twoq_init ();
 }
 
 void
@@ -101,11 +104,20 @@ lru_free (void)
 {
   bitmap_free (&bm[0]);
   bitmap_free (&bm[1]);
+  if (cache_policy == CACHE_POLICY_2Q)
+    twoq_free ();
 }
 
 int
 lru_set_size (uint64_t new_size)
 {
+  /* The 2Q lists are only used to choose blocks to reclaim. */
+  if (cache_policy == CACHE_POLICY_2Q) {
+    if (max_size != -1)
+      twoq_set_size (max_size / blksize);
+    return 0;
+  }
+
   if (bitmap_resize (&bm[0], new_size) == -1)
     return -1;
   if (bitmap_resize (&bm[1], new_size) == -1)
@@ -123,6 +135,12 @@ lru_set_size (uint64_t new_size)
 void
 lru_set_recently_accessed (uint64_t blknum)
 {
+  if (cache_policy == CACHE_POLICY_2Q) {
+    if (max_size != -1)
+      twoq_access (blknum);
+    return;
+  }
+
   /* If the block is already set in the first bitmap, don't need to do
    * anything.
    */
@@ -0,0 +1,393 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Persistent cache file (cache-file parameter).
+ *
+ * Normally the cache is an unlinked temporary file and the bitmap
+ * exists only in memory.  With cache-file=FILENAME the cache is stored
+ * in FILENAME, and FILENAME.meta records which blocks of it can be
+ * used after nbdkit is restarted.  The metadata file is:
+ *
+ *   header (PERSIST_HEADER_SIZE bytes, big endian)
+ *     magic "NBDKITCACHEMETA\0"
+ *     version, block size, disk size, length of cache-file-id, id
+ *   valid bitmap (1 bit per block)
+ *
+ * The invariant, which must hold even if nbdkit crashes, is that if a
+ * block's bit is set in the valid bitmap on disk, then the block in
+ * the cache file on disk contains the same data as the plugin.  This
+ * means:
+ *
+ * - Bits are only set by persist_checkpoint, for blocks which were
+ *   clean, after fdatasync on the cache file.
+ *
+ * - Before a valid block is modified or discarded, persist_invalidate
+ *   clears its bit and waits for fdatasync on the metadata.  So only
+ *   the first change to a block after each checkpoint is slower.
+ *
+ * Dirty blocks are never valid, so after a restart they are read from
+ * the plugin again (the client did not flush them, so this is safe).
+ *
+ * The header records the block size, disk size and an optional
+ * identifier of the plugin's data (cache-file-id), and if any of these
+ * do not match on startup the cache is discarded.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "bitmap.h"
+#include "byte-swapping.h"
+#include "cleanup.h"
+#include "rounding.h"
+#include "utils.h"
+
+#include "cache.h"
+#include "blk.h"
+#include "persist.h"
+
+#define PERSIST_MAGIC "NBDKITCACHEMETA"
+#define PERSIST_VERSION 1
+#define PERSIST_HEADER_SIZE 4096
+
+struct persist_header {
+  char magic[16];
+  uint32_t version;
+  uint32_t blksize;
+  uint64_t size;
+  uint32_t id_len;
+  char id[];
+} __attribute__ ((__packed__));
+
+static int meta_fd = -1;
+static uint64_t meta_size;      /* disk size recorded in the header */
+static bool loaded;
+
+/* The valid bitmap is the same as the bitmap on disk (except while it
+ * is being written).  The pending bitmap records blocks which have
+ * become clean since the last checkpoint.  The syncing bitmap records
+ * the pending blocks taken by a checkpoint which is waiting for
+ * fdatasync on the cache file; they must not be set in valid before
+ * then, else persist_invalidate could write them out early.
+ */
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bitmap valid, pending, syncing;
+static uint64_t nr_pending;
+
+/* Only one checkpoint can run at a time. */
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int
+persist_open (void)
+{
+  CLEANUP_FREE char *meta_file = NULL;
+  int fd;
+
+  if (asprintf (&meta_file, "%s.meta", cache_file) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return -1;
+  }
+
+  meta_fd = open (meta_file, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+  if (meta_fd == -1) {
+    nbdkit_error ("open: %s: %m", meta_file);
+    return -1;
+  }
+  if (flock (meta_fd, LOCK_EX|LOCK_NB) == -1) {
+    nbdkit_error ("%s: cache file is in use by another process: %m",
+                  cache_file);
+    return -1;
+  }
+
+  fd = open (cache_file, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+  if (fd == -1) {
+    nbdkit_error ("open: %s: %m", cache_file);
+    return -1;
+  }
+
+  nbdkit_debug ("cache: persistent cache file: %s", cache_file);
+  return fd;
+}
+
+/* Check the header matches the current configuration.  Returns true
+ * if the cache file can be used.
+ */
+static bool
+check_header (uint64_t size)
+{
+  char buf[PERSIST_HEADER_SIZE];
+  struct persist_header *h = (struct persist_header *) buf;
+  size_t id_len = cache_file_id ? strlen (cache_file_id) : 0;
+  ssize_t r;
+
+  r = full_pread (meta_fd, buf, sizeof buf, 0);
+  if (r == -1) {
+    nbdkit_debug ("cache: no metadata found");
+    return false;
+  }
+  if (memcmp (h->magic, PERSIST_MAGIC, sizeof h->magic) != 0 ||
+      be32toh (h->version) != PERSIST_VERSION) {
+    nbdkit_debug ("cache: metadata has wrong magic or version");
+    return false;
+  }
+  if (be32toh (h->blksize) != blksize) {
+    nbdkit_debug ("cache: metadata block size has changed");
+    return false;
+  }
+  if (be64toh (h->size) != size) {
+    nbdkit_debug ("cache: disk size has changed");
+    return false;
+  }
+  if (be32toh (h->id_len) != id_len ||
+      memcmp (h->id, cache_file_id ? cache_file_id : "", id_len) != 0) {
+    nbdkit_debug ("cache: cache-file-id has changed");
+    return false;
+  }
+  return true;
+}
+
+/* Write a new header and an empty valid bitmap. */
+static int
+reset_metadata (uint64_t size)
+{
+  char buf[PERSIST_HEADER_SIZE] = { 0 };
+  struct persist_header *h = (struct persist_header *) buf;
+  size_t id_len = cache_file_id ? strlen (cache_file_id) : 0;
+
+  memcpy (h->magic, PERSIST_MAGIC, sizeof h->magic);
+  h->version = htobe32 (PERSIST_VERSION);
+  h->blksize = htobe32 (blksize);
+  h->size = htobe64 (size);
+  h->id_len = htobe32 (id_len);
+  memcpy (h->id, cache_file_id ? cache_file_id : "", id_len);
+
+  bitmap_clear (&valid);
+  bitmap_clear (&pending);
+  bitmap_clear (&syncing);
+  nr_pending = 0;
+
+  /* Clear the bitmap on disk before writing the new header. */
+  if (ftruncate (meta_fd, PERSIST_HEADER_SIZE) == -1 ||
+      fdatasync (meta_fd) == -1 ||
+      full_pwrite (meta_fd, buf, sizeof buf, 0) == -1 ||
+      ftruncate (meta_fd, PERSIST_HEADER_SIZE + valid.size) == -1 ||
+      fdatasync (meta_fd) == -1) {
+    nbdkit_error ("%s.meta: %m", cache_file);
+    return -1;
+  }
+  meta_size = size;
+  return 0;
+}
+
+int
+persist_load (int fd, uint64_t size, struct bitmap *bm)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+  int64_t b;
+  uint64_t n = 0;
+
+  if (!loaded) {
+    bitmap_init (&valid, blksize, 1 /* bits per block */);
+    bitmap_init (&pending, blksize, 1 /* bits per block */);
+    bitmap_init (&syncing, blksize, 1 /* bits per block */);
+  }
+  else if (size == meta_size)
+    return 0;
+
+  if (bitmap_resize (&valid, size) == -1 ||
+      bitmap_resize (&pending, size) == -1 ||
+      bitmap_resize (&syncing, size) == -1)
+    return -1;
+
+  if (loaded || !check_header (size)) {
+    nbdkit_debug ("cache: discarding contents of %s", cache_file);
+    /* Discard the old contents of the cache file. */
+    if (!loaded && ftruncate (fd, 0) == -1) {
+      nbdkit_error ("ftruncate: %s: %m", cache_file);
+      return -1;
+    }
+    loaded = true;
+    return reset_metadata (size);
+  }
+  loaded = true;
+  meta_size = size;
+
+  if (valid.size > 0 &&
+      full_pread (meta_fd, valid.bitmap, valid.size,
+                  PERSIST_HEADER_SIZE) == -1) {
+    nbdkit_debug ("cache: could not read metadata bitmap: %m");
+    if (ftruncate (fd, 0) == -1) {
+      nbdkit_error ("ftruncate: %s: %m", cache_file);
+      return -1;
+    }
+    return reset_metadata (size);
+  }
+  for (b = bitmap_next (&valid, 0); b >= 0; b = bitmap_next (&valid, b + 1)) {
+    bitmap_set_blk (bm, b, BLOCK_CLEAN);
+    n++;
+  }
+  nbdkit_debug ("cache: loaded %" PRIu64 " blocks from %s", n, cache_file);
+  return 0;
+}
+
+void
+persist_clean (uint64_t blknum)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+
+  if (!bitmap_get_blk (&pending, blknum, true)) {
+    bitmap_set_blk (&pending, blknum, true);
+    nr_pending++;
+  }
+}
+
+int
+persist_invalidate (uint64_t blknum)
+{
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+    const uint64_t byte = blknum / 8;
+
+    if (bitmap_get_blk (&pending, blknum, false)) {
+      bitmap_set_blk (&pending, blknum, false);
+      nr_pending--;
+    }
+    bitmap_set_blk (&syncing, blknum, false);
+    if (!bitmap_get_blk (&valid, blknum, false))
+      return 0;
+
+    /* Writing the byte while holding the lock means that the bytes on
+     * disk are always written in the same order as they change.
+     */
+    bitmap_set_blk (&valid, blknum, false);
+    if (pwrite (meta_fd, &valid.bitmap[byte], 1,
+                PERSIST_HEADER_SIZE + byte) != 1) {
+      nbdkit_error ("pwrite: %s.meta: %m", cache_file);
+      return -1;
+    }
+  }
+
+  if (fdatasync (meta_fd) == -1) {
+    nbdkit_error ("fdatasync: %s.meta: %m", cache_file);
+    return -1;
+  }
+  return 0;
+}
+
+int
+persist_checkpoint (int fd)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&checkpoint_lock);
+  int64_t b;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+    if (nr_pending == 0)
+      return 0;
+    for (b = bitmap_next (&pending, 0); b >= 0;
+         b = bitmap_next (&pending, b + 1))
+      bitmap_set_blk (&syncing, b, true);
+    bitmap_clear (&pending);
+    nr_pending = 0;
+  }
+
+  /* The data of the blocks in syncing must be on disk before any of
+   * their bits can be set in valid.
+   */
+  if (fdatasync (fd) == -1) {
+    nbdkit_error ("fdatasync: %s: %m", cache_file);
+    goto restore_pending;
+  }
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+    /* If one of these blocks was changed during fdatasync then
+     * persist_invalidate has already cleared it from syncing.
+     */
+    for (b = bitmap_next (&syncing, 0); b >= 0;
+         b = bitmap_next (&syncing, b + 1))
+      bitmap_set_blk (&valid, b, true);
+    bitmap_clear (&syncing);
+    if (valid.size > 0 &&
+        full_pwrite (meta_fd, valid.bitmap, valid.size,
+                     PERSIST_HEADER_SIZE) == -1) {
+      nbdkit_error ("pwrite: %s.meta: %m", cache_file);
+      return -1;
+    }
+  }
+
+  if (fdatasync (meta_fd) == -1) {
+    nbdkit_error ("fdatasync: %s.meta: %m", cache_file);
+    return -1;
+  }
+  return 0;
+
+ restore_pending:
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+    /* Try these blocks again at the next checkpoint. */
+    for (b = bitmap_next (&syncing, 0); b >= 0;
+         b = bitmap_next (&syncing, b + 1)) {
+      if (!bitmap_get_blk (&pending, b, true)) {
+        bitmap_set_blk (&pending, b, true);
+        nr_pending++;
+      }
+    }
+    bitmap_clear (&syncing);
+  }
+  return -1;
+}
+
+void
+persist_close (void)
+{
+  if (meta_fd >= 0) {
+    close (meta_fd);
+    meta_fd = -1;
+  }
+  bitmap_free (&valid);
+  bitmap_free (&pending);
+  bitmap_free (&syncing);
+}
@@ -0,0 +1,74 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_PERSIST_H
+#define NBDKIT_PERSIST_H
+
+#include <stdint.h>
+
+#include "bitmap.h"
+
+/* Open (or create) the persistent cache file and its metadata file.
+ * Returns the file descriptor of the cache file, or -1 on error.
+ */
+extern int persist_open (void);
+
+/* Load the metadata for the current block size and disk size,
+ * setting the blocks which are validly cached in bm (which must be
+ * otherwise empty).  If the metadata does not match, the cache file
+ * is discarded.  Later calls only check if the disk size has changed.
+ *
+ * Note this must be called with the blk lock held.
+ */
+extern int persist_load (int fd, uint64_t size, struct bitmap *bm);
+
+/* Record that a block has become clean.  It will be marked as valid
+ * in the metadata at the next checkpoint.
+ *
+ * Note this must be called with the blk lock held.
+ */
+extern void persist_clean (uint64_t blknum);
+
+/* This must be called before the contents of a cached block are
+ * changed or discarded.  If the metadata says the block is valid, this
+ * clears it and waits for the change to reach the disk.
+ */
+extern int persist_invalidate (uint64_t blknum);
+
+/* Make the cache file contents durable, then mark all blocks which
+ * became clean since the last checkpoint as valid in the metadata.
+ */
+extern int persist_checkpoint (int fd);
+
+extern void persist_close (void);
+
+#endif /* NBDKIT_PERSIST_H */
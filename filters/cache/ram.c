@@ -0,0 +1,369 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* In-memory tier (cache-ram-size parameter).
+ *
+ * This keeps copies of hot blocks of the cache file in an allocator
+ * (see common/allocators), so that reads of those blocks do not have
+ * to pread the cache file.  The tier is inclusive: every block in RAM
+ * is also in the cache file with the same contents.  Blocks are
+ * demoted just by dropping them from RAM, and dirty tracking,
+ * writeback, reclaim and cache-file work exactly as without it.
+ *
+ * A block is copied into RAM when it is read from the cache file, ie.
+ * the second time it is read if it came from the plugin, so that a
+ * single sequential read does not replace the blocks in RAM.
+ *
+ * The tier holds up to nr_slots blocks.  When it is full, a block is
+ * evicted using the CLOCK algorithm: the hand goes round the slots,
+ * giving blocks which have been read since it last passed a second
+ * chance.
+ *
+ * ram_lock protects the bitmap, the slots and their hash table.  The
+ * contents of a block in RAM are protected by the range lock for the
+ * block (see blk_range_lock), which the caller of every function below
+ * except ram_init, ram_free and ram_set_size holds.  To evict another block
+ * we must take its range lock too.  We only try to take it, and skip
+ * the block if it is in use, so there is no lock ordering problem.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "allocator.h"
+#include "bitmap.h"
+#include "cleanup.h"
+
+#include "cache.h"
+#include "blk.h"
+#include "ram.h"
+
+/* Two bits per block in ram_bm. */
+enum ram_entry {
+  RAM_NOT_CACHED = 0,
+  RAM_CACHED = 1,
+  RAM_REFERENCED = 2,           /* cached and read since the hand passed */
+};
+
+#define EMPTY_SLOT UINT64_MAX
+
+static pthread_mutex_t ram_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The allocator storing the blocks, at their offset in the disk.
+ * NULL if cache-ram-size was not set.
+ */
+static struct allocator *ram;
+
+static struct bitmap ram_bm;
+
+/* The block in each slot of the clock, or EMPTY_SLOT. */
+static uint64_t *slots;
+static size_t nr_slots, hand;
+
+/* Hash table mapping blocks in RAM to their slots, so that
+ * ram_remove can free the slot.  It uses linear probing and holds
+ * slot numbers, or EMPTY_ENTRY.  The size is a power of 2 at least
+ * twice nr_slots.
+ */
+#define EMPTY_ENTRY SIZE_MAX
+static size_t *index_table;
+static size_t index_mask;
+
+static size_t
+index_hash (uint64_t b)
+{
+  return (size_t) ((b * UINT64_C (0x9e3779b97f4a7c15)) >> 32) & index_mask;
+}
+
+/* Return the position of block b in the hash table, or EMPTY_ENTRY. */
+static size_t
+index_find (uint64_t b)
+{
+  size_t pos;
+
+  for (pos = index_hash (b); index_table[pos] != EMPTY_ENTRY;
+       pos = (pos + 1) & index_mask) {
+    if (slots[index_table[pos]] == b)
+      return pos;
+  }
+  return EMPTY_ENTRY;
+}
+
+static void
+index_insert (uint64_t b, size_t slot)
+{
+  size_t pos;
+
+  for (pos = index_hash (b); index_table[pos] != EMPTY_ENTRY;
+       pos = (pos + 1) & index_mask)
+    ;
+  index_table[pos] = slot;
+}
+
+/* Delete the entry at pos, moving later entries in the same probe
+ * sequence back so that lookups still find them.
+ */
+static void
+index_delete (size_t pos)
+{
+  size_t next = pos, home;
+
+  index_table[pos] = EMPTY_ENTRY;
+  for (;;) {
+    next = (next + 1) & index_mask;
+    if (index_table[next] == EMPTY_ENTRY)
+      return;
+    home = index_hash (slots[index_table[next]]);
+    /* Leave the entry if its home position is cyclically in
+     * (pos, next].
+     */
+    if (pos <= next ? pos < home && home <= next : pos < home || home <= next)
+      continue;
+    index_table[pos] = index_table[next];
+    index_table[next] = EMPTY_ENTRY;
+    pos = next;
+  }
+}
+
+int
+ram_init (void)
+{
+  size_t i;
+
+  if (ram_size == 0)
+    return 0;
+
+  /* The hash table can have up to 4 entries per slot. */
+  if (ram_size / blksize > SIZE_MAX / 4 / sizeof *slots) {
+    nbdkit_error ("cache-ram-size is too large");
+    return -1;
+  }
+  nr_slots = ram_size / blksize;
+  if (nr_slots == 0) {
+    nbdkit_error ("cache-ram-size must be at least the block size (%u)",
+                  blksize);
+    return -1;
+  }
+  slots = malloc (nr_slots * sizeof *slots);
+  if (slots == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  for (i = 0; i < nr_slots; ++i)
+    slots[i] = EMPTY_SLOT;
+
+  for (i = 2; i < 2 * nr_slots; i *= 2)
+    ;
+  index_table = malloc (i * sizeof *index_table);
+  if (index_table == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  index_mask = i - 1;
+  for (i = 0; i <= index_mask; ++i)
+    index_table[i] = EMPTY_ENTRY;
+
+  ram = create_allocator ("sparse", false);
+  if (ram == NULL)
+    return -1;
+
+  bitmap_init (&ram_bm, blksize, 2 /* bits per block */);
+
+  nbdkit_debug ("cache: RAM tier holds up to %zu blocks", nr_slots);
+  return 0;
+}
+
+void
+ram_free (void)
+{
+  if (ram) {
+    ram->f->free (ram);
+    ram = NULL;
+  }
+  free (slots);
+  free (index_table);
+  bitmap_free (&ram_bm);
+}
+
+int
+ram_set_size (uint64_t new_size)
+{
+  if (ram == NULL)
+    return 0;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&ram_lock);
+  return bitmap_resize (&ram_bm, new_size);
+}
+
+bool
+ram_read (uint64_t blknum, uint8_t *block)
+{
+  if (ram == NULL)
+    return false;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&ram_lock);
+    if (bitmap_get_blk (&ram_bm, blknum, RAM_NOT_CACHED) == RAM_NOT_CACHED)
+      return false;
+    bitmap_set_blk (&ram_bm, blknum, RAM_REFERENCED);
+    stats.ram_hits++;
+  }
+
+  /* The block cannot be evicted while we hold its range lock. */
+  return ram->f->read (ram, block, blksize, blknum * blksize) == 0;
+}
+
+/* Find a free slot, evicting a block if necessary.  ram_lock must be
+ * held.  Returns -1 if every block in RAM is in use.
+ */
+static int64_t
+find_slot (void)
+{
+  size_t i, slot;
+  uint64_t b;
+  pthread_mutex_t *range_lock;
+
+  /* Two turns of the clock are enough to clear all the referenced
+   * bits and come back to an unreferenced block.
+   */
+  for (i = 0; i <= 2 * nr_slots; ++i) {
+    slot = hand;
+    hand = (hand + 1) % nr_slots;
+
+    b = slots[slot];
+    if (b == EMPTY_SLOT)
+      return slot;
+
+    switch (bitmap_get_blk (&ram_bm, b, RAM_NOT_CACHED)) {
+    case RAM_NOT_CACHED:
+      /* Beyond the end of the disk after it shrank. */
+      index_delete (index_find (b));
+      return slot;
+    case RAM_REFERENCED:
+      bitmap_set_blk (&ram_bm, b, RAM_CACHED);
+      break;
+    default:
+      /* The range lock may be held by another request, or by the
+       * caller.
+       */
+      range_lock = blk_range_lock (b);
+      if (pthread_mutex_trylock (range_lock) != 0)
+        break;
+      ram->f->zero (ram, blksize, b * blksize);
+      bitmap_set_blk (&ram_bm, b, RAM_NOT_CACHED);
+      index_delete (index_find (b));
+      pthread_mutex_unlock (range_lock);
+      return slot;
+    }
+  }
+
+  return -1;
+}
+
+void
+ram_insert (uint64_t blknum, const uint8_t *block)
+{
+  int64_t slot;
+
+  if (ram == NULL)
+    return;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&ram_lock);
+    if (bitmap_get_blk (&ram_bm, blknum, RAM_NOT_CACHED) == RAM_NOT_CACHED) {
+      /* If the disk shrank and grew again the block may still have a
+       * slot.
+       */
+      if (index_find (blknum) == EMPTY_ENTRY) {
+        slot = find_slot ();
+        if (slot == -1)
+          return;
+        slots[slot] = blknum;
+        index_insert (blknum, slot);
+      }
+      bitmap_set_blk (&ram_bm, blknum, RAM_CACHED);
+    }
+  }
+
+  /* Nothing else can read or evict the block until we release its
+   * range lock, so it is safe to copy it in after dropping ram_lock.
+   */
+  if (ram->f->write (ram, block, blksize, blknum * blksize) == -1)
+    ram_remove (blknum);
+}
+
+void
+ram_update (uint64_t blknum, const uint8_t *block)
+{
+  if (ram == NULL)
+    return;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&ram_lock);
+    if (bitmap_get_blk (&ram_bm, blknum, RAM_NOT_CACHED) == RAM_NOT_CACHED)
+      return;
+  }
+
+  if (ram->f->write (ram, block, blksize, blknum * blksize) == -1)
+    ram_remove (blknum);
+}
+
+void
+ram_remove (uint64_t blknum)
+{
+  size_t pos;
+
+  if (ram == NULL)
+    return;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&ram_lock);
+    if (bitmap_get_blk (&ram_bm, blknum, RAM_NOT_CACHED) == RAM_NOT_CACHED)
+      return;
+    bitmap_set_blk (&ram_bm, blknum, RAM_NOT_CACHED);
+    pos = index_find (blknum);
+    assert (pos != EMPTY_ENTRY);
+    slots[index_table[pos]] = EMPTY_SLOT;
+    index_delete (pos);
+  }
+
+  ram->f->zero (ram, blksize, blknum * blksize);
+}
@@ -0,0 +1,70 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef NBDKIT_RAM_H
+#define NBDKIT_RAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The in-memory tier (cache-ram-size parameter), see ram.c.  If
+ * cache-ram-size is not set these functions do nothing, and ram_read
+ * always returns false.
+ */
+extern int ram_init (void);
+extern void ram_free (void);
+
+/* Resize the tier's bitmap when the size of the plugin is known. */
+extern int ram_set_size (uint64_t new_size);
+
+/* Copy the block from RAM and return true if it is in RAM. */
+extern bool ram_read (uint64_t blknum, uint8_t *block)
+  __attribute__ ((__nonnull__ (2)));
+
+/* Copy a block which is in the cache file into RAM, possibly evicting
+ * another block from RAM.  Errors are ignored because the block can
+ * still be read from the cache file.
+ */
+extern void ram_insert (uint64_t blknum, const uint8_t *block)
+  __attribute__ ((__nonnull__ (2)));
+
+/* The block has been modified in the cache file.  If it is in RAM,
+ * update the copy.
+ */
+extern void ram_update (uint64_t blknum, const uint8_t *block)
+  __attribute__ ((__nonnull__ (2)));
+
+/* The block has been removed from the cache file, so remove it from
+ * RAM too.
+ */
+extern void ram_remove (uint64_t blknum);
+
+#endif /* NBDKIT_RAM_H */
@@ -48,8 +48,12 @@
 #include "bitmap.h"
 
 #include "cache.h"
+#include "blk.h"
 #include "reclaim.h"
 #include "lru.h"
+#include "persist.h"
+#include "ram.h"
+#include "twoq.h"
 
 #ifndef HAVE_CACHE_RECLAIM
 
@@ -66,7 +70,9 @@ reclaim (int fd, struct bitmap *bm)
  * The state machine starts in the NOT_RECLAIMING state.  When the
  * size of the cache exceeds the high threshold, we move to
  * RECLAIMING_LRU.  Once we have exhausted all LRU blocks, we move to
- * RECLAIMING_ANY (reclaiming any blocks).
+ * RECLAIMING_ANY (reclaiming any blocks).  With cache-policy=2q the
+ * 2Q lists choose the blocks instead of lru.c in the RECLAIMING_LRU
+ * state.
  *
  * If at any time the size of the cache goes below the low threshold
  * we move back to the NOT_RECLAIMING state.
@@ -87,8 +93,9 @@ static int64_t reclaim_blk;
 
 static void reclaim_one (int fd, struct bitmap *bm);
 static void reclaim_lru (int fd, struct bitmap *bm);
+static void reclaim_2q (int fd, struct bitmap *bm);
 static void reclaim_any (int fd, struct bitmap *bm);
-static void reclaim_block (int fd, struct bitmap *bm);
+static bool reclaim_block (int fd, struct bitmap *bm);
 
 void
 reclaim (int fd, struct bitmap *bm)
@@ -145,13 +152,19 @@ reclaim_lru (int fd, struct bitmap *bm)
 {
   int64_t old_reclaim_blk;
 
+  if (cache_policy == CACHE_POLICY_2Q) {
+    reclaim_2q (fd, bm);
+    return;
+  }
+
   /* Find the next block in the cache. */
   reclaim_blk = bitmap_next (bm, reclaim_blk+1);
   old_reclaim_blk = reclaim_blk;
 
   /* Search for an LRU block after this one. */
   do {
-    if (! lru_has_been_recently_accessed (reclaim_blk)) {
+    if (bitmap_get_blk (bm, reclaim_blk, BLOCK_NOT_CACHED) == BLOCK_CLEAN &&
+        ! lru_has_been_recently_accessed (reclaim_blk)) {
       reclaim_block (fd, bm);
       return;
     }
@@ -169,6 +182,32 @@ reclaim_lru (int fd, struct bitmap *bm)
   }
 }
 
+static void
+reclaim_2q (int fd, struct bitmap *bm)
+{
+  unsigned tries;
+
+  /* Blocks which cannot be reclaimed at the moment (dirty or in use)
+   * are moved to the back of the queue.  Give up after a few tries
+   * and try again on the next call.
+   */
+  for (tries = 0; tries < 8; ++tries) {
+    reclaim_blk = twoq_victim ();
+    if (reclaim_blk == -1) {
+      /* Blocks cached before the 2Q lists knew about them (eg. loaded
+       * from cache-file) are not on any list.
+       */
+      nbdkit_debug ("cache: reclaiming any blocks");
+      reclaiming = RECLAIMING_ANY;
+      reclaim_any (fd, bm);
+      return;
+    }
+    if (reclaim_block (fd, bm))
+      return;
+    twoq_requeue (reclaim_blk);
+  }
+}
+
 static void
 reclaim_any (int fd, struct bitmap *bm)
 {
@@ -180,27 +219,54 @@ reclaim_any (int fd, struct bitmap *bm)
   reclaim_block (fd, bm);
 }
 
-static void
+static bool
 reclaim_block (int fd, struct bitmap *bm)
 {
+  pthread_mutex_t *range_lock;
+
   if (reclaim_blk == -1) {
     nbdkit_debug ("cache: run out of blocks to reclaim!");
-    return;
+    return false;
   }
 
+  /* Dirty blocks (including blocks being written back) only exist in
+   * the cache, so they cannot be discarded.
+   */
+  if (bitmap_get_blk (bm, reclaim_blk, BLOCK_NOT_CACHED) != BLOCK_CLEAN)
+    return false;
+
+  /* Another request (possibly this one) may be using the block.  We
+   * cannot wait for its range lock here because we are holding the
+   * blk lock, so just skip it and reclaim something else next time.
+   */
+  range_lock = blk_range_lock (reclaim_blk);
+  if (pthread_mutex_trylock (range_lock) != 0)
+    return false;
+
   nbdkit_debug ("cache: reclaiming block %" PRIu64, reclaim_blk);
+  if (cache_file && persist_invalidate (reclaim_blk) == -1) {
+    pthread_mutex_unlock (range_lock);
+    return false;
+  }
 #ifdef FALLOC_FL_PUNCH_HOLE
   if (fallocate (fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
                  reclaim_blk * blksize, blksize) == -1) {
     nbdkit_error ("cache: reclaiming cache blocks: "
                   "fallocate: FALLOC_FL_PUNCH_HOLE: %m");
-    return;
+    pthread_mutex_unlock (range_lock);
+    return false;
   }
 #else
 #error "no implementation for punching holes"
 #endif
 
-  bitmap_set_blk (bm, reclaim_blk, 0);
+  bitmap_set_blk (bm, reclaim_blk, BLOCK_NOT_CACHED);
+  ram_remove (reclaim_blk);
+  if (cache_policy == CACHE_POLICY_2Q)
+    twoq_evicted (reclaim_blk);
+  stats.evictions++;
+  pthread_mutex_unlock (range_lock);
+  return true;
 }
 
 #endif /* HAVE_CACHE_RECLAIM */
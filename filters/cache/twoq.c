@@ -0,0 +1,373 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* 2Q replacement policy (cache-policy=2q).
+ *
+ * This is the "full" version of 2Q from Johnson & Shasha, "2Q: A Low
+ * Overhead High Performance Buffer Management Replacement Algorithm"
+ * (VLDB 1994).  Blocks are kept on three lists:
+ *
+ *   A1in   blocks which have been accessed once, in FIFO order
+ *   A1out  "ghost" entries for blocks recently evicted from A1in
+ *          (the blocks are no longer cached)
+ *   Am     blocks which have been accessed again, in LRU order
+ *
+ * A new block goes on A1in.  Further accesses to a block on A1in do
+ * not move it.  If a block is accessed when it is on A1out, it goes
+ * on Am.  The victim for reclaim is the oldest block on A1in if that
+ * list is larger than Kin, otherwise the least recently used block on
+ * Am.  So a long sequential scan only flushes blocks out of A1in and
+ * leaves the working set on Am alone.
+ *
+ * Kin is 1/4 and Kout (the maximum size of A1out) is 1/2 of the
+ * number of blocks in cache-max-size, as recommended in the paper.
+ *
+ * Unlike the bitmaps in lru.c this needs an entry for every cached
+ * block (and ghost), so the entries are stored in an array indexed
+ * by a hash table on the block number.
+ *
+ * All functions must be called with the blk lock held.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <nbdkit-filter.h>
+
+#include "minmax.h"
+
+#include "cache.h"
+#include "twoq.h"
+
+#define NIL UINT32_MAX
+
+enum list { LIST_NONE, LIST_A1IN, LIST_A1OUT, LIST_AM, NR_LISTS };
+
+struct entry {
+  uint64_t blknum;
+  uint32_t prev, next;          /* list links, or next free entry */
+  enum list list;
+};
+
+static struct entry *entries;
+static uint32_t nr_entries, nr_allocated;
+static uint32_t free_entries = NIL;
+
+static struct {
+  uint32_t head, tail;          /* head is the most recent */
+  uint64_t len;
+} lists[NR_LISTS];
+
+/* Open addressing hash table of entry index + 1 (0 = empty slot). */
+static uint32_t *table;
+static unsigned table_bits;
+static uint64_t nr_used;        /* entries in the hash table */
+
+static uint64_t kin, kout;
+
+static size_t
+hash (uint64_t blknum)
+{
+  return (blknum * UINT64_C (0x9e3779b97f4a7c15)) >> (64 - table_bits);
+}
+
+static uint32_t
+lookup (uint64_t blknum)
+{
+  const size_t mask = (UINT64_C (1) << table_bits) - 1;
+  size_t i;
+
+  if (table == NULL)
+    return NIL;
+
+  for (i = hash (blknum); table[i] != 0; i = (i + 1) & mask) {
+    if (entries[table[i] - 1].blknum == blknum)
+      return table[i] - 1;
+  }
+  return NIL;
+}
+
+static void
+table_insert (uint32_t idx)
+{
+  const size_t mask = (UINT64_C (1) << table_bits) - 1;
+  size_t i;
+
+  for (i = hash (entries[idx].blknum); table[i] != 0; i = (i + 1) & mask)
+    ;
+  table[i] = idx + 1;
+  nr_used++;
+}
+
+/* Keep the hash table at most half full. */
+static int
+table_grow (void)
+{
+  uint32_t *old_table = table;
+  const size_t old_size = table ? UINT64_C (1) << table_bits : 0;
+  size_t i;
+
+  if (table && (nr_used + 1) * 2 <= old_size)
+    return 0;
+
+  table = calloc (old_size ? old_size * 2 : 1024, sizeof *table);
+  if (table == NULL) {
+    table = old_table;
+    return -1;
+  }
+  table_bits = old_table ? table_bits + 1 : 10;
+  nr_used = 0;
+  for (i = 0; i < old_size; ++i)
+    if (old_table[i] != 0)
+      table_insert (old_table[i] - 1);
+  free (old_table);
+  return 0;
+}
+
+static void
+table_delete (uint64_t blknum)
+{
+  const size_t mask = (UINT64_C (1) << table_bits) - 1;
+  size_t i, j, k;
+
+  for (i = hash (blknum); entries[table[i] - 1].blknum != blknum;
+       i = (i + 1) & mask)
+    ;
+  table[i] = 0;
+  nr_used--;
+
+  /* Move following entries back so lookups don't stop at the hole. */
+  for (j = (i + 1) & mask; table[j] != 0; j = (j + 1) & mask) {
+    k = hash (entries[table[j] - 1].blknum);
+    if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+      table[i] = table[j];
+      table[j] = 0;
+      i = j;
+    }
+  }
+}
+
+static void
+list_remove (uint32_t idx)
+{
+  struct entry *e = &entries[idx];
+
+  if (e->prev != NIL)
+    entries[e->prev].next = e->next;
+  else
+    lists[e->list].head = e->next;
+  if (e->next != NIL)
+    entries[e->next].prev = e->prev;
+  else
+    lists[e->list].tail = e->prev;
+  lists[e->list].len--;
+  e->list = LIST_NONE;
+}
+
+static void
+list_push (enum list list, uint32_t idx)
+{
+  struct entry *e = &entries[idx];
+
+  e->list = list;
+  e->prev = NIL;
+  e->next = lists[list].head;
+  if (e->next != NIL)
+    entries[e->next].prev = idx;
+  else
+    lists[list].tail = idx;
+  lists[list].head = idx;
+  lists[list].len++;
+}
+
+static uint32_t
+new_entry (uint64_t blknum)
+{
+  uint32_t idx;
+
+  if (table_grow () == -1)
+    return NIL;
+
+  if (free_entries != NIL) {
+    idx = free_entries;
+    free_entries = entries[idx].next;
+  }
+  else {
+    if (nr_entries == nr_allocated) {
+      uint32_t n = nr_allocated ? nr_allocated * 2 : 1024;
+      struct entry *p;
+
+      if (n == NIL)
+        return NIL;
+      p = realloc (entries, n * sizeof *entries);
+      if (p == NULL)
+        return NIL;
+      entries = p;
+      nr_allocated = n;
+    }
+    idx = nr_entries++;
+  }
+
+  entries[idx].blknum = blknum;
+  entries[idx].list = LIST_NONE;
+  table_insert (idx);
+  return idx;
+}
+
+static void
+free_entry (uint32_t idx)
+{
+  table_delete (entries[idx].blknum);
+  entries[idx].next = free_entries;
+  free_entries = idx;
+}
+
+void
+twoq_init (void)
+{
+  size_t i;
+
+  for (i = 0; i < NR_LISTS; ++i) {
+    lists[i].head = lists[i].tail = NIL;
+    lists[i].len = 0;
+  }
+}
+
+void
+twoq_free (void)
+{
+  free (entries);
+  entries = NULL;
+  nr_entries = nr_allocated = 0;
+  free_entries = NIL;
+  free (table);
+  table = NULL;
+  nr_used = 0;
+}
+
+void
+twoq_set_size (uint64_t nr_blocks)
+{
+  kin = MAX (nr_blocks / 4, 1);
+  kout = MAX (nr_blocks / 2, 1);
+}
+
+void
+twoq_access (uint64_t blknum)
+{
+  uint32_t idx = lookup (blknum);
+
+  if (idx == NIL) {
+    idx = new_entry (blknum);
+    if (idx == NIL) {
+      nbdkit_debug ("cache: 2q: out of memory, block not tracked");
+      return;
+    }
+    list_push (LIST_A1IN, idx);
+    return;
+  }
+
+  switch (entries[idx].list) {
+  case LIST_A1IN:               /* correlated reference, leave it */
+    break;
+  case LIST_A1OUT:
+  case LIST_AM:
+    list_remove (idx);
+    list_push (LIST_AM, idx);
+    break;
+  default:
+    abort ();
+  }
+}
+
+int64_t
+twoq_victim (void)
+{
+  uint32_t idx;
+
+  if (lists[LIST_A1IN].len > kin || lists[LIST_AM].len == 0)
+    idx = lists[LIST_A1IN].tail;
+  else
+    idx = lists[LIST_AM].tail;
+  if (idx == NIL)
+    idx = lists[LIST_AM].tail;
+
+  return idx == NIL ? -1 : (int64_t) entries[idx].blknum;
+}
+
+void
+twoq_requeue (uint64_t blknum)
+{
+  uint32_t idx = lookup (blknum);
+  enum list list;
+
+  if (idx == NIL || entries[idx].list == LIST_A1OUT)
+    return;
+  list = entries[idx].list;
+  list_remove (idx);
+  list_push (list, idx);
+}
+
+void
+twoq_evicted (uint64_t blknum)
+{
+  uint32_t idx = lookup (blknum);
+
+  if (idx == NIL)
+    return;
+
+  switch (entries[idx].list) {
+  case LIST_A1IN:
+    list_remove (idx);
+    list_push (LIST_A1OUT, idx);
+    while (lists[LIST_A1OUT].len > kout) {
+      uint32_t tail = lists[LIST_A1OUT].tail;
+      list_remove (tail);
+      free_entry (tail);
+    }
+    break;
+  case LIST_AM:
+    list_remove (idx);
+    free_entry (idx);
+    break;
+  case LIST_A1OUT:              /* already evicted */
+    break;
+  default:
+    abort ();
+  }
+}
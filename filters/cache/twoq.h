@@ -0,0 +1,63 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_TWOQ_H
+#define NBDKIT_TWOQ_H
+
+#include <stdint.h>
+
+/* The 2Q replacement policy, see twoq.c.  These are called through
+ * lru.c when cache-policy=2q.
+ */
+extern void twoq_init (void);
+extern void twoq_free (void);
+
+/* Set the number of blocks that the cache can hold. */
+extern void twoq_set_size (uint64_t nr_blocks);
+
+/* A block has been accessed (and is now cached). */
+extern void twoq_access (uint64_t blknum);
+
+/* Return the block which should be reclaimed next, or -1 if there
+ * are no blocks on the lists.
+ */
+extern int64_t twoq_victim (void);
+
+/* The victim could not be reclaimed now, so move it to the back of
+ * the queue.
+ */
+extern void twoq_requeue (uint64_t blknum);
+
+/* A block has been reclaimed. */
+extern void twoq_evicted (uint64_t blknum);
+
+#endif /* NBDKIT_TWOQ_H */
@@ -0,0 +1,444 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Background writeback of dirty blocks.
+ *
+ * In writeback mode the client's writes only go to the cache, and
+ * dirty blocks are written to the plugin when the client flushes.
+ * After a large burst of writes that flush can take a very long time.
+ * This thread writes dirty blocks back in the background, in a
+ * similar way to the kernel's dirty_expire_centisecs and
+ * dirty_background_ratio settings:
+ *
+ * If cache-dirty-expire is set, blocks which have been dirty for
+ * longer than that are written back.  We don't keep a timestamp for
+ * every block.  Instead blk.c keeps a bitmap of blocks dirtied in the
+ * current period, and at the end of each period (half the expiry
+ * time) any dirty block not in the bitmap is written back and the
+ * bitmap is cleared.  So blocks are written back between half and
+ * all of the expiry time after they were last written.
+ *
+ * If cache-dirty-ratio is set and the percentage of dirty blocks (of
+ * cache-max-size, or the whole disk if there is no maximum) exceeds
+ * it, dirty blocks are written back until it drops below the ratio.
+ *
+ * Adjacent dirty blocks are coalesced into a single write of up to
+ * WRITEBACK_MAX_RUN bytes.  After each pass the plugin is flushed,
+ * and only then are the blocks marked clean.  A client flush still
+ * writes back whatever is left, but usually that is much less.
+ *
+ * Client flushes also use this file (writeback_flush) to write back
+ * runs of dirty blocks.  If the plugin is parallel then up to
+ * FLUSH_THREADS runs are written at the same time, the extra threads
+ * using the same shared context as the background thread.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "cleanup.h"
+#include "minmax.h"
+
+#include "cache.h"
+#include "blk.h"
+#include "writeback.h"
+
+/* Maximum size of a single write to the plugin. */
+#define WRITEBACK_MAX_RUN (4 * 1024 * 1024)
+
+/* Maximum number of parallel writes during a client flush. */
+#define FLUSH_THREADS 4
+
+static nbdkit_backend *wb_backend;
+static bool wb_parallel;
+static uint64_t wb_max_blocks;
+
+/* Shared context into the plugin, opened on first use. */
+static pthread_mutex_t context_lock = PTHREAD_MUTEX_INITIALIZER;
+static nbdkit_next *wb_next;
+
+static pthread_t thread;
+static bool thread_running;
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_cond = PTHREAD_COND_INITIALIZER;
+static bool wb_stop;            /* protected by wb_lock */
+
+bool
+writeback_enabled (void)
+{
+  return cache_mode == CACHE_MODE_WRITEBACK &&
+    (dirty_expire > 0 || dirty_ratio > 0);
+}
+
+static nbdkit_next *
+get_context (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&context_lock);
+  nbdkit_next *next;
+
+  if (wb_next)
+    return wb_next;
+
+  next = nbdkit_next_context_open (wb_backend, 0, "", 1);
+  if (next == NULL)
+    return NULL;
+  /* The server requires these to be known before writing. */
+  if (next->prepare (next) == -1 ||
+      next->get_size (next) == -1 ||
+      next->can_write (next) == -1 ||
+      next->can_flush (next) == -1) {
+    next->finalize (next);
+    nbdkit_next_context_close (next);
+    return NULL;
+  }
+  wb_next = next;
+  return wb_next;
+}
+
+static bool
+stopping (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&wb_lock);
+  return wb_stop;
+}
+
+/* Write back the dirty blocks in [blknum, end) with as few writes as
+ * possible.  The range of blocks written is added to [*lo, *hi).
+ */
+static int
+write_back_range (nbdkit_next *next, uint8_t *buf,
+                  uint64_t blknum, uint64_t end, bool old_only,
+                  unsigned pass, uint64_t *lo, uint64_t *hi, int *err)
+{
+  uint64_t n, orig_n;
+  int64_t r;
+
+  while (blknum < end) {
+    r = blk_find_dirty_run (blknum, old_only, end - blknum, &n);
+    if (r == -1 || r >= end)
+      break;
+
+    orig_n = n;
+    blk_lock_ranges (r, orig_n);
+    if (blk_writeback (next, r, &n, buf, pass, err) == -1) {
+      blk_unlock_ranges (r, orig_n);
+      nbdkit_error ("cache: writeback of block %" PRId64 " failed", r);
+      return -1;
+    }
+    blk_unlock_ranges (r, orig_n);
+
+    if (n > 0) {
+      *lo = MIN (*lo, (uint64_t) r);
+      *hi = MAX (*hi, r + n);
+    }
+    blknum = r + MAX (n, 1);
+  }
+
+  return 0;
+}
+
+/* Write back up to max dirty blocks starting at *cursor, wrapping
+ * around at the end of the disk.  *cursor is updated so the next call
+ * carries on where this one left off.
+ */
+static void
+write_back_dirty (nbdkit_next *next, uint8_t *buf,
+                  bool old_only, uint64_t *cursor, uint64_t max)
+{
+  const uint64_t start = *cursor;
+  uint64_t blknum = start, done = 0, lo = UINT64_MAX, hi = 0, n;
+  const unsigned pass = blk_writeback_pass ();
+  bool wrapped = false, ok = true;
+  int64_t r;
+  int err = 0;
+
+  while (done < max && !stopping ()) {
+    r = blk_find_dirty_run (blknum, old_only,
+                            MIN (wb_max_blocks, max - done), &n);
+    if (r == -1 || (wrapped && r >= start)) {
+      if (wrapped || start == 0)
+        break;
+      wrapped = true;
+      blknum = 0;
+      continue;
+    }
+
+    if (write_back_range (next, buf, r, r + n, old_only, pass,
+                          &lo, &hi, &err) == -1)
+      break;
+    done += n;
+    blknum = r + n;
+  }
+  *cursor = blknum;
+
+  if (lo >= hi)
+    return;
+
+  /* The blocks are only clean once the plugin has flushed them. */
+  if (next->can_flush (next) == 1 &&
+      next->flush (next, 0, &err) == -1) {
+    nbdkit_error ("cache: background writeback flush failed: %s",
+                  strerror (err));
+    ok = false;
+  }
+  blk_writeback_done (pass, ok);
+
+  nbdkit_debug ("cache: background writeback of blocks "
+                "%" PRIu64 "-%" PRIu64, lo, hi - 1);
+}
+
+static void *
+writeback_thread (void *vp)
+{
+  nbdkit_next *next = vp;
+  const time_t period = MAX (1, dirty_expire / 2);
+  time_t period_start = time (NULL), now;
+  uint64_t expire_cursor = 0, ratio_cursor = 0;
+  uint64_t nr_dirty, nr_blocks, limit;
+  CLEANUP_FREE uint8_t *buf = NULL;
+  struct timespec ts;
+
+  buf = malloc (wb_max_blocks * blksize);
+  if (buf == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+
+  for (;;) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&wb_lock);
+      if (!wb_stop) {
+        clock_gettime (CLOCK_REALTIME, &ts);
+        ts.tv_sec++;
+        pthread_cond_timedwait (&wb_cond, &wb_lock, &ts);
+      }
+      if (wb_stop)
+        break;
+    }
+
+    now = time (NULL);
+    if (dirty_expire > 0 && now - period_start >= period) {
+      expire_cursor = 0;
+      write_back_dirty (next, buf, true, &expire_cursor, UINT64_MAX);
+      blk_new_dirty_period ();
+      period_start = now;
+    }
+
+    if (dirty_ratio > 0) {
+      blk_dirty_stats (&nr_dirty, &nr_blocks);
+      if (max_size >= 0)
+        nr_blocks = max_size / blksize;
+      limit = nr_blocks * dirty_ratio / 100;
+      if (nr_dirty > limit)
+        write_back_dirty (next, buf, false, &ratio_cursor, nr_dirty - limit);
+    }
+  }
+
+  return NULL;
+}
+
+/* Runs of dirty blocks are handed out to the flush threads in order. */
+struct flush_state {
+  pthread_mutex_t lock;
+  uint64_t cursor;              /* start of the next run */
+  unsigned pass;                /* writeback pass, see blk.h */
+  unsigned errors;              /* count of errors seen */
+  int first_errno;              /* first errno seen */
+  uint64_t lo, hi;              /* range of blocks written */
+};
+
+struct flush_thread {
+  pthread_t thread;
+  struct flush_state *fs;
+  nbdkit_next *next;
+  uint8_t *buf;
+};
+
+static void *
+flush_runs (void *vp)
+{
+  struct flush_thread *t = vp;
+  struct flush_state *fs = t->fs;
+  uint64_t blknum, n, lo = UINT64_MAX, hi = 0;
+  int64_t r;
+  int err = 0;
+
+  for (;;) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&fs->lock);
+      r = blk_find_dirty_run (fs->cursor, false, wb_max_blocks, &n);
+      if (r == -1)
+        break;
+      blknum = r;
+      fs->cursor = blknum + n;
+    }
+
+    /* Carry on with the remaining runs after an error. */
+    if (write_back_range (t->next, t->buf, blknum, blknum + n, false,
+                          fs->pass, &lo, &hi, &err) == -1) {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&fs->lock);
+      if (fs->errors++ == 0)
+        fs->first_errno = err;
+    }
+  }
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&fs->lock);
+  fs->lo = MIN (fs->lo, lo);
+  fs->hi = MAX (fs->hi, hi);
+  return NULL;
+}
+
+int
+writeback_flush (nbdkit_next *next, unsigned pass, int *err)
+{
+  struct flush_state fs = {
+    .lock = PTHREAD_MUTEX_INITIALIZER, .pass = pass, .lo = UINT64_MAX,
+  };
+  struct flush_thread threads[FLUSH_THREADS];
+  size_t i, nr_threads = 1;
+  uint64_t nr_dirty, nr_blocks;
+  nbdkit_next *shared;
+  int r, tmp;
+
+  blk_dirty_stats (&nr_dirty, &nr_blocks);
+  if (nr_dirty == 0)
+    return 0;
+
+  threads[0].fs = &fs;
+  threads[0].next = next;
+  threads[0].buf = malloc (wb_max_blocks * blksize);
+  if (threads[0].buf == NULL) {
+    *err = errno;
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+
+  /* If there is more than one run to write and the plugin allows it,
+   * write some of them in other threads.
+   */
+  if (wb_parallel && nr_dirty > wb_max_blocks &&
+      (shared = get_context ()) != NULL) {
+    for (i = 1; i < FLUSH_THREADS; ++i) {
+      threads[i].fs = &fs;
+      threads[i].next = shared;
+      threads[i].buf = malloc (wb_max_blocks * blksize);
+      if (threads[i].buf == NULL)
+        break;
+      r = pthread_create (&threads[i].thread, NULL, flush_runs, &threads[i]);
+      if (r != 0) {
+        free (threads[i].buf);
+        break;
+      }
+      nr_threads++;
+    }
+  }
+
+  flush_runs (&threads[0]);
+
+  for (i = 1; i < nr_threads; ++i) {
+    pthread_join (threads[i].thread, NULL);
+    free (threads[i].buf);
+  }
+  free (threads[0].buf);
+
+  /* The caller flushes its own context, but writes made through the
+   * shared context need to be flushed too.
+   */
+  if (nr_threads > 1 && fs.lo < fs.hi &&
+      wb_next->can_flush (wb_next) == 1 &&
+      wb_next->flush (wb_next, 0, fs.errors ? &tmp : &fs.first_errno) == -1)
+    fs.errors++;
+
+  if (fs.errors > 0) {
+    *err = fs.first_errno;
+    return -1;
+  }
+  return 0;
+}
+
+int
+writeback_start (nbdkit_backend *backend, int thread_model)
+{
+  nbdkit_next *next;
+  int err;
+
+  wb_backend = backend;
+  wb_parallel = thread_model >= NBDKIT_THREAD_MODEL_PARALLEL;
+  wb_max_blocks = MAX (1, WRITEBACK_MAX_RUN / blksize);
+
+  if (!writeback_enabled ())
+    return 0;
+
+  next = get_context ();
+  if (next == NULL)
+    return -1;
+
+  err = pthread_create (&thread, NULL, writeback_thread, next);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return -1;
+  }
+  thread_running = true;
+  return 0;
+}
+
+void
+writeback_stop (void)
+{
+  if (thread_running) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&wb_lock);
+      wb_stop = true;
+      pthread_cond_signal (&wb_cond);
+    }
+    pthread_join (thread, NULL);
+    thread_running = false;
+  }
+
+  if (wb_next) {
+    wb_next->finalize (wb_next);
+    nbdkit_next_context_close (wb_next);
+    wb_next = NULL;
+  }
+}
@@ -0,0 +1,59 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_WRITEBACK_H
+#define NBDKIT_WRITEBACK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <nbdkit-filter.h>
+
+/* Is background writeback enabled?  (cache-dirty-expire or
+ * cache-dirty-ratio parameters)
+ */
+extern bool writeback_enabled (void);
+
+/* Start and stop the background writeback thread (if enabled).  The
+ * thread uses its own shared context into the plugin.
+ */
+extern int writeback_start (nbdkit_backend *backend, int thread_model);
+extern void writeback_stop (void);
+
+/* Write back all dirty blocks to the plugin, for a client flush.
+ * The blocks are left in the writeback state, so the caller must
+ * flush 'next' and then call blk_writeback_done for the pass (see
+ * blk_writeback_pass).
+ */
+extern int writeback_flush (nbdkit_next *next, unsigned pass, int *err);
+
+#endif /* NBDKIT_WRITEBACK_H */
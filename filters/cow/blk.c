@@ -65,8 +65,27 @@
  * above.  We could punch holes in the overlay as an optimization, but
  * for simplicity we do not do that yet.
  *
- * Since the overlay is a deleted temporary file, we can ignore FUA
- * and flush commands.
+ * When the overlay is a deleted temporary file, FUA and flush
+ * commands are ignored.  When it is a qcow2 file (cow-file
+ * parameter), blk_flush writes the qcow2 metadata for the allocated
+ * and trimmed blocks and syncs the file, see cowfile.c.  FUA writes
+ * call blk_flush too.
+ *
+ * Reads do not take any locks.  The state of a block is read from
+ * the bitmap with an atomic load, and changed with an atomic
+ * compare-and-swap of the byte containing it, after the data has been
+ * written to the overlay.  So a read which sees a block as allocated
+ * always finds the data in the overlay.
+ *
+ * Writes to the overlay (including cow-on-read and cow-on-cache) hold
+ * the lock for the block, one of NR_BLOCK_LOCKS hashed on the block
+ * number.  This stops a cow-on-read of old data from the plugin
+ * overwriting a block which has just been written.
+ *
+ * The bitmap is never reallocated while readers might be using it.
+ * When the size changes, blk_set_size makes a copy of the right size
+ * (holding all the block locks, so no state changes are lost) and
+ * publishes a pointer to it.  Old copies are freed in blk_free.
  */
 
 #include <config.h>
@@ -94,6 +113,7 @@
 #include "bitmap.h"
 #include "cleanup.h"
 #include "fdatasync.h"
+#include "minmax.h"
 #include "rounding.h"
 #include "pread.h"
 #include "pwrite.h"
@@ -101,21 +121,29 @@
 
 #include "cow.h"
 #include "blk.h"
+#include "cowfile.h"
 
-/* The temporary overlay. */
+/* The overlay.  This is a temporary file, or the qcow2 file if
+ * cow-file was used, in which case block 0 is at data_offset.
+ */
 static int fd = -1;
+static off_t data_offset;
 
-/* This lock protects the bitmap from parallel access. */
+/* This lock serializes calls to blk_set_size. */
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Bitmap. */
-static struct bitmap bm;
+/* Block locks, see above. */
+#define NR_BLOCK_LOCKS 64
+static pthread_mutex_t block_locks[NR_BLOCK_LOCKS];
 
-enum bm_entry {
-  BLOCK_NOT_ALLOCATED = 0,
-  BLOCK_ALLOCATED = 1,
-  BLOCK_TRIMMED = 3,
+/* Bitmap.  bm points to the current copy, and old copies are kept on
+ * the list until blk_free.
+ */
+struct bitmap_copy {
+  struct bitmap bm;
+  struct bitmap_copy *prev;
 };
+static struct bitmap_copy *bm;
 
 static const char *
 state_to_string (enum bm_entry state)
@@ -128,6 +156,83 @@ state_to_string (enum bm_entry state)
   }
 }
 
+static enum bm_entry
+get_state (uint64_t blknum)
+{
+  const struct bitmap *b = &__atomic_load_n (&bm, __ATOMIC_ACQUIRE)->bm;
+  BITMAP_OFFSET_BIT_MASK (b, blknum);
+
+  if (blk_offset >= b->size)
+    return BLOCK_NOT_ALLOCATED;
+  return (__atomic_load_n (&b->bitmap[blk_offset], __ATOMIC_ACQUIRE) & mask)
+    >> blk_bit;
+}
+
+/* The lock for the block must be held. */
+static void
+set_state (uint64_t blknum, enum bm_entry state)
+{
+  const struct bitmap *b = &__atomic_load_n (&bm, __ATOMIC_RELAXED)->bm;
+  BITMAP_OFFSET_BIT_MASK (b, blknum);
+  uint8_t old, new;
+
+  if (blk_offset >= b->size)
+    return;
+
+  /* Other blocks in the same byte may be changed at the same time. */
+  old = __atomic_load_n (&b->bitmap[blk_offset], __ATOMIC_RELAXED);
+  do {
+    new = (old & ~mask) | (state << blk_bit);
+  } while (!__atomic_compare_exchange_n (&b->bitmap[blk_offset], &old, new,
+                                         false,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  if (cow_file && ((old ^ new) & mask) != 0)
+    cowfile_mark (blknum);
+}
+
+/* Used by cowfile_set_size to load the state of blocks from the qcow2
+ * file.  All the block locks are held.
+ */
+static void
+load_state (uint64_t blknum, enum bm_entry state)
+{
+  bitmap_set_blk (&bm->bm, blknum, state);
+}
+
+static pthread_mutex_t *
+block_lock (uint64_t blknum)
+{
+  return &block_locks[blknum % NR_BLOCK_LOCKS];
+}
+
+/* Lock and unlock the block locks for a run of blocks.  To avoid
+ * deadlocks they are always acquired in index order.
+ */
+static void
+lock_blocks (uint64_t blknum, uint64_t nrblocks)
+{
+  size_t i;
+
+  for (i = 0; i < NR_BLOCK_LOCKS; ++i) {
+    if (nrblocks >= NR_BLOCK_LOCKS ||
+        (i - blknum) % NR_BLOCK_LOCKS < nrblocks)
+      pthread_mutex_lock (&block_locks[i]);
+  }
+}
+
+static void
+unlock_blocks (uint64_t blknum, uint64_t nrblocks)
+{
+  size_t i;
+
+  for (i = 0; i < NR_BLOCK_LOCKS; ++i) {
+    if (nrblocks >= NR_BLOCK_LOCKS ||
+        (i - blknum) % NR_BLOCK_LOCKS < nrblocks)
+      pthread_mutex_unlock (&block_locks[i]);
+  }
+}
+
 /* Extra debugging (-D cow.verbose=1). */
 NBDKIT_DLL_PUBLIC int cow_debug_verbose = 0;
 
@@ -137,8 +242,22 @@ blk_init (void)
   const char *tmpdir;
   size_t len;
   char *template;
+  size_t i;
 
-  bitmap_init (&bm, blksize, 2 /* bits per block */);
+  bm = calloc (1, sizeof *bm);
+  if (bm == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  bitmap_init (&bm->bm, blksize, 2 /* bits per block */);
+
+  for (i = 0; i < NR_BLOCK_LOCKS; ++i)
+    pthread_mutex_init (&block_locks[i], NULL);
+
+  if (cow_file) {
+    fd = cowfile_open ();
+    return fd >= 0 ? 0 : -1;
+  }
 
   tmpdir = getenv ("TMPDIR");
   if (!tmpdir)
@@ -178,10 +297,26 @@ blk_init (void)
 void
 blk_free (void)
 {
-  if (fd >= 0)
+  struct bitmap_copy *prev;
+  size_t i;
+
+  if (fd >= 0) {
+    if (cow_file)
+      cowfile_close (fd, get_state);
     close (fd);
+  }
+
+  if (bm) {
+    for (i = 0; i < NR_BLOCK_LOCKS; ++i)
+      pthread_mutex_destroy (&block_locks[i]);
+  }
 
-  bitmap_free (&bm);
+  while (bm) {
+    prev = bm->prev;
+    bitmap_free (&bm->bm);
+    free (bm);
+    bm = prev;
+  }
 }
 
 /* Because blk_set_size is called before the other blk_* functions
@@ -194,13 +329,38 @@ int
 blk_set_size (uint64_t new_size)
 {
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  struct bitmap_copy *new_bm;
+  int r;
+
+  /* This is called for every connection, usually with the same size. */
+  if (bm->prev == NULL || new_size != size) {
+    new_bm = calloc (1, sizeof *new_bm);
+    if (new_bm == NULL) {
+      nbdkit_error ("calloc: %m");
+      return -1;
+    }
+    bitmap_init (&new_bm->bm, blksize, 2 /* bits per block */);
+    if (bitmap_resize (&new_bm->bm, new_size) == -1) {
+      free (new_bm);
+      return -1;
+    }
 
-  size = new_size;
-
-  if (bitmap_resize (&bm, size) == -1)
-    return -1;
+    lock_blocks (0, NR_BLOCK_LOCKS);
+    if (new_bm->bm.size > 0)
+      memcpy (new_bm->bm.bitmap, bm->bm.bitmap,
+              MIN (bm->bm.size, new_bm->bm.size));
+    new_bm->prev = bm;
+    __atomic_store_n (&bm, new_bm, __ATOMIC_RELEASE);
+    __atomic_store_n (&size, new_size, __ATOMIC_RELEASE);
+    r = 0;
+    if (cow_file)
+      r = cowfile_set_size (fd, new_size, load_state, &data_offset);
+    unlock_blocks (0, NR_BLOCK_LOCKS);
+    if (r == -1)
+      return -1;
+  }
 
-  if (ftruncate (fd, ROUND_UP (size, blksize)) == -1) {
+  if (!cow_file && ftruncate (fd, ROUND_UP (new_size, blksize)) == -1) {
     nbdkit_error ("ftruncate: %m");
     return -1;
   }
@@ -214,13 +374,43 @@ blk_set_size (uint64_t new_size)
 void
 blk_status (uint64_t blknum, bool *present, bool *trimmed)
 {
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-  enum bm_entry state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_ALLOCATED);
+  enum bm_entry state = get_state (blknum);
 
   *present = state != BLOCK_NOT_ALLOCATED;
   *trimmed = state == BLOCK_TRIMMED;
 }
 
+/* Save blocks read from the plugin in the overlay.  Blocks which
+ * have been written (or trimmed) since we read them from the plugin
+ * are skipped.  The locks for the blocks must be held.
+ */
+static int
+copy_to_overlay (uint64_t blknum, uint64_t nrblocks, const uint8_t *block,
+                 int *err)
+{
+  uint64_t b, i, n;
+
+  for (b = 0; b < nrblocks; b += n) {
+    n = 1;
+    if (get_state (blknum + b) != BLOCK_NOT_ALLOCATED)
+      continue;
+    while (b + n < nrblocks &&
+           get_state (blknum + b + n) == BLOCK_NOT_ALLOCATED)
+      n++;
+
+    if (full_pwrite (fd, block + blksize * b, blksize * n,
+                     data_offset + (blknum + b) * blksize) == -1) {
+      *err = errno;
+      nbdkit_error ("pwrite: %m");
+      return -1;
+    }
+    for (i = 0; i < n; ++i)
+      set_state (blknum + b + i, BLOCK_ALLOCATED);
+  }
+
+  return 0;
+}
+
 /* These are the block operations.  They always read or write whole
  * blocks of size ‘blksize’.
  */
@@ -231,7 +421,8 @@ blk_read_multiple (nbdkit_next *next,
 {
   off_t offset = blknum * blksize;
   enum bm_entry state;
-  uint64_t b, runblocks;
+  uint64_t b, runblocks, sz;
+  int r;
 
   /* Find out how many of the following blocks form a "run" with the
    * same state.  We can process that many blocks in one go.
@@ -242,16 +433,13 @@ blk_read_multiple (nbdkit_next *next,
    * from the plugin, returning the old data.  However a read issued
    * after the write returns should always return the correct data.
    */
-  {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_ALLOCATED);
-
-    for (b = 1, runblocks = 1; b < nrblocks; ++b, ++runblocks) {
-      enum bm_entry s = bitmap_get_blk (&bm, blknum + b, BLOCK_NOT_ALLOCATED);
-      if (state != s)
-        break;
-    }
+  state = get_state (blknum);
+  for (b = 1, runblocks = 1; b < nrblocks; ++b, ++runblocks) {
+    enum bm_entry s = get_state (blknum + b);
+    if (state != s)
+      break;
   }
+  sz = __atomic_load_n (&size, __ATOMIC_ACQUIRE);
 
   if (cow_debug_verbose)
     nbdkit_debug ("cow: blk_read_multiple block %" PRIu64
@@ -266,8 +454,8 @@ blk_read_multiple (nbdkit_next *next,
     assert (blksize * runblocks <= UINT_MAX);
     n = blksize * runblocks;
 
-    if (offset + n > size) {
-      tail = offset + n - size;
+    if (offset + n > sz) {
+      tail = offset + n - sz;
       n -= tail;
     }
 
@@ -289,17 +477,16 @@ blk_read_multiple (nbdkit_next *next,
                       "at offset %" PRIu64 " into the cache",
                       runblocks, offset);
 
-      if (full_pwrite (fd, block, blksize * runblocks, offset) == -1) {
-        *err = errno;
-        nbdkit_error ("pwrite: %m");
+      lock_blocks (blknum, runblocks);
+      r = copy_to_overlay (blknum, runblocks, block, err);
+      unlock_blocks (blknum, runblocks);
+      if (r == -1)
         return -1;
-      }
-      for (b = 0; b < runblocks; ++b)
-        bitmap_set_blk (&bm, blknum+b, BLOCK_ALLOCATED);
     }
   }
   else if (state == BLOCK_ALLOCATED) { /* Read overlay. */
-    if (full_pread (fd, block, blksize * runblocks, offset) == -1) {
+    if (full_pread (fd, block, blksize * runblocks,
+                    data_offset + offset) == -1) {
       *err = errno;
       nbdkit_error ("pread: %m");
       return -1;
@@ -332,14 +519,13 @@ int
 blk_cache (nbdkit_next *next,
            uint64_t blknum, uint8_t *block, enum cache_mode mode, int *err)
 {
-  /* XXX Could make this lock more fine-grained with some thought. */
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
   off_t offset = blknum * blksize;
-  enum bm_entry state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_ALLOCATED);
+  enum bm_entry state = get_state (blknum);
+  uint64_t sz = __atomic_load_n (&size, __ATOMIC_ACQUIRE);
   unsigned n = blksize, tail = 0;
 
-  if (offset + n > size) {
-    tail = offset + n - size;
+  if (offset + n > sz) {
+    tail = offset + n - sz;
     n -= tail;
   }
 
@@ -349,7 +535,8 @@ blk_cache (nbdkit_next *next,
 
   if (state == BLOCK_ALLOCATED) {
 #if HAVE_POSIX_FADVISE
-    int r = posix_fadvise (fd, offset, blksize, POSIX_FADV_WILLNEED);
+    int r = posix_fadvise (fd, data_offset + offset, blksize,
+                           POSIX_FADV_WILLNEED);
     if (r) {
       errno = r;
       nbdkit_error ("posix_fadvise: %m");
@@ -374,12 +561,8 @@ blk_cache (nbdkit_next *next,
   memset (block + n, 0, tail);
 
   if (mode == BLK_CACHE_COW) {
-    if (full_pwrite (fd, block, blksize, offset) == -1) {
-      *err = errno;
-      nbdkit_error ("pwrite: %m");
-      return -1;
-    }
-    bitmap_set_blk (&bm, blknum, BLOCK_ALLOCATED);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (block_lock (blknum));
+    return copy_to_overlay (blknum, 1, block, err);
   }
   return 0;
 }
@@ -393,14 +576,13 @@ blk_write (uint64_t blknum, const uint8_t *block, int *err)
     nbdkit_debug ("cow: blk_write block %" PRIu64 " (offset %" PRIu64 ")",
                   blknum, (uint64_t) offset);
 
-  if (full_pwrite (fd, block, blksize, offset) == -1) {
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (block_lock (blknum));
+  if (full_pwrite (fd, block, blksize, data_offset + offset) == -1) {
     *err = errno;
     nbdkit_error ("pwrite: %m");
     return -1;
   }
-
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-  bitmap_set_blk (&bm, blknum, BLOCK_ALLOCATED);
+  set_state (blknum, BLOCK_ALLOCATED);
 
   return 0;
 }
@@ -418,7 +600,20 @@ blk_trim (uint64_t blknum, int *err)
    * here.  However it's not trivial since blksize is unrelated to the
    * overlay filesystem block size.
    */
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-  bitmap_set_blk (&bm, blknum, BLOCK_TRIMMED);
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (block_lock (blknum));
+  set_state (blknum, BLOCK_TRIMMED);
+  return 0;
+}
+
+int
+blk_flush (int *err)
+{
+  if (!cow_file)
+    return 0;
+
+  if (cowfile_sync (fd, get_state) == -1) {
+    *err = EIO;
+    return -1;
+  }
   return 0;
 }
@@ -33,6 +33,13 @@
 #ifndef NBDKIT_BLK_H
 #define NBDKIT_BLK_H
 
+/* The state of each block, see blk.c. */
+enum bm_entry {
+  BLOCK_NOT_ALLOCATED = 0,
+  BLOCK_ALLOCATED = 1,
+  BLOCK_TRIMMED = 3,
+};
+
 /* Initialize the overlay and bitmap. */
 extern int blk_init (void);
 
@@ -76,6 +83,12 @@ extern int blk_cache (nbdkit_next *next,
 extern int blk_write (uint64_t blknum, const uint8_t *block, int *err)
   __attribute__ ((__nonnull__ (2, 3)));
 
+/* If the overlay is stored in a qcow2 file (cow-file parameter),
+ * write the qcow2 metadata and sync the file.
+ */
+extern int blk_flush (int *err)
+  __attribute__ ((__nonnull__ (1)));
+
 /* Trim a single block. */
 extern int blk_trim (uint64_t blknum, int *err)
   __attribute__ ((__nonnull__ (2)));
@@ -56,14 +56,24 @@
 #include "cow.h"
 #include "blk.h"
 
-/* Read-modify-write requests are serialized through this global lock.
- * This is only used for unaligned requests which should be
- * infrequent.
+/* Read-modify-write requests to the same block are serialized
+ * through these locks (hashed on the block number), so unaligned
+ * requests to different blocks can run in parallel.
  */
-static pthread_mutex_t rmw_lock = PTHREAD_MUTEX_INITIALIZER;
+#define NR_RMW_LOCKS 64
+static pthread_mutex_t rmw_locks[NR_RMW_LOCKS];
+
+static pthread_mutex_t *
+rmw_lock (uint64_t blknum)
+{
+  return &rmw_locks[blknum % NR_RMW_LOCKS];
+}
 
 unsigned blksize = 65536;       /* block size */
 
+char *cow_file;
+const char *cow_backing_file, *cow_backing_format;
+
 static bool cow_on_cache;
 
 /* Cache on read ("cow-on-read") mode. */
@@ -75,10 +85,25 @@ extern enum cor_mode {
 enum cor_mode cor_mode = COR_OFF;
 const char *cor_path;
 
+static void
+cow_load (void)
+{
+  size_t i;
+
+  for (i = 0; i < NR_RMW_LOCKS; ++i)
+    pthread_mutex_init (&rmw_locks[i], NULL);
+}
+
 static void
 cow_unload (void)
 {
+  size_t i;
+
   blk_free ();
+  free (cow_file);
+
+  for (i = 0; i < NR_RMW_LOCKS; ++i)
+    pthread_mutex_destroy (&rmw_locks[i]);
 }
 
 static int
@@ -119,15 +144,64 @@ cow_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
     }
     return 0;
   }
+  else if (strcmp (key, "cow-file") == 0) {
+    free (cow_file);
+    cow_file = nbdkit_absolute_path (value);
+    if (cow_file == NULL)
+      return -1;
+    return 0;
+  }
+  else if (strcmp (key, "cow-backing-file") == 0) {
+    /* This limit comes from qemu. */
+    if (strlen (value) > 1023) {
+      nbdkit_error ("cow-backing-file is too long");
+      return -1;
+    }
+    cow_backing_file = value;
+    return 0;
+  }
+  else if (strcmp (key, "cow-backing-format") == 0) {
+    if (strlen (value) > 32) {
+      nbdkit_error ("cow-backing-format is too long");
+      return -1;
+    }
+    cow_backing_format = value;
+    return 0;
+  }
   else {
     return next (nxdata, key, value);
   }
 }
 
+static int
+cow_config_complete (nbdkit_next_config_complete *next,
+                     nbdkit_backend *nxdata)
+{
+  if (!cow_file && (cow_backing_file || cow_backing_format)) {
+    nbdkit_error ("cow-backing-file and cow-backing-format "
+                  "require cow-file");
+    return -1;
+  }
+  if (cow_backing_format && !cow_backing_file) {
+    nbdkit_error ("cow-backing-format requires cow-backing-file");
+    return -1;
+  }
+  /* qcow2 clusters can be at most 2M. */
+  if (cow_file && blksize > 2 * 1024 * 1024) {
+    nbdkit_error ("cow-block-size must be at most 2M when using cow-file");
+    return -1;
+  }
+
+  return next (nxdata);
+}
+
 #define cow_config_help \
   "cow-block-size=<N>       Set COW block size.\n" \
   "cow-on-cache=<BOOL>      Copy cache (prefetch) requests to the overlay.\n" \
-  "cow-on-read=<BOOL>|/PATH Copy read requests to the overlay."
+  "cow-on-read=<BOOL>|/PATH Copy read requests to the overlay.\n" \
+  "cow-file=FILENAME        Store the overlay in a qcow2 file.\n" \
+  "cow-backing-file=NAME    Backing file recorded in the qcow2 file.\n" \
+  "cow-backing-format=FMT   Format of the backing file (eg. raw)."
 
 static int
 cow_get_ready (int thread_model)
@@ -373,10 +447,10 @@ cow_pwrite (nbdkit_next *next,
     uint64_t n = MIN (blksize - blkoffs, count);
 
     /* Do a read-modify-write operation on the current block.
-     * Hold the rmw_lock over the whole operation.
+     * Hold the rmw_lock for the block over the whole operation.
      */
     assert (block);
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rmw_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (rmw_lock (blknum));
     r = blk_read (next, blknum, block, cow_on_read (), err);
     if (r != -1) {
       memcpy (&block[blkoffs], buf, n);
@@ -406,7 +480,7 @@ cow_pwrite (nbdkit_next *next,
   /* Unaligned tail */
   if (count) {
     assert (block);
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rmw_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (rmw_lock (blknum));
     r = blk_read (next, blknum, block, cow_on_read (), err);
     if (r != -1) {
       memcpy (block, buf, count);
@@ -416,7 +490,11 @@ cow_pwrite (nbdkit_next *next,
       return -1;
   }
 
-  /* flags & NBDKIT_FLAG_FUA is deliberately ignored. */
+  /* As for flush, this does nothing unless the overlay is a qcow2
+   * file.
+   */
+  if (flags & NBDKIT_FLAG_FUA)
+    return blk_flush (err);
 
   return 0;
 }
@@ -454,9 +532,9 @@ cow_zero (nbdkit_next *next,
     uint64_t n = MIN (blksize - blkoffs, count);
 
     /* Do a read-modify-write operation on the current block.
-     * Hold the rmw_lock over the whole operation.
+     * Hold the rmw_lock for the block over the whole operation.
      */
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rmw_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (rmw_lock (blknum));
     r = blk_read (next, blknum, block, cow_on_read (), err);
     if (r != -1) {
       memset (&block[blkoffs], 0, n);
@@ -488,7 +566,7 @@ cow_zero (nbdkit_next *next,
 
   /* Unaligned tail */
   if (count) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rmw_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (rmw_lock (blknum));
     r = blk_read (next, blknum, block, cow_on_read (), err);
     if (r != -1) {
       memset (block, 0, count);
@@ -498,7 +576,11 @@ cow_zero (nbdkit_next *next,
       return -1;
   }
 
-  /* flags & NBDKIT_FLAG_FUA is deliberately ignored. */
+  /* As for flush, this does nothing unless the overlay is a qcow2
+   * file.
+   */
+  if (flags & NBDKIT_FLAG_FUA)
+    return blk_flush (err);
 
   return 0;
 }
@@ -530,9 +612,9 @@ cow_trim (nbdkit_next *next,
     uint64_t n = MIN (blksize - blkoffs, count);
 
     /* Do a read-modify-write operation on the current block.
-     * Hold the lock over the whole operation.
+     * Hold the rmw_lock for the block over the whole operation.
      */
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rmw_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (rmw_lock (blknum));
     r = blk_read (next, blknum, block, cow_on_read (), err);
     if (r != -1) {
       memset (&block[blkoffs], 0, n);
@@ -559,7 +641,7 @@ cow_trim (nbdkit_next *next,
 
   /* Unaligned tail */
   if (count) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rmw_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (rmw_lock (blknum));
     r = blk_read (next, blknum, block, cow_on_read (), err);
     if (r != -1) {
       memset (block, 0, count);
@@ -569,7 +651,11 @@ cow_trim (nbdkit_next *next,
       return -1;
   }
 
-  /* flags & NBDKIT_FLAG_FUA is deliberately ignored. */
+  /* As for flush, this does nothing unless the overlay is a qcow2
+   * file.
+   */
+  if (flags & NBDKIT_FLAG_FUA)
+    return blk_flush (err);
 
   return 0;
 }
@@ -578,8 +664,8 @@ static int
 cow_flush (nbdkit_next *next, void *handle,
            uint32_t flags, int *err)
 {
-  /* Deliberately ignored. */
-  return 0;
+  /* Ignored unless the overlay is a qcow2 file. */
+  return blk_flush (err);
 }
 
 static int
@@ -776,9 +862,11 @@ cow_extents (nbdkit_next *next,
 static struct nbdkit_filter filter = {
   .name              = "cow",
   .longname          = "nbdkit copy-on-write (COW) filter",
+  .load              = cow_load,
   .unload            = cow_unload,
   .open              = cow_open,
   .config            = cow_config,
+  .config_complete   = cow_config_complete,
   .config_help       = cow_config_help,
   .get_ready         = cow_get_ready,
   .prepare           = cow_prepare,
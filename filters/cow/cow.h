@@ -36,4 +36,11 @@
 /* Size of a block in the cache. */
 extern unsigned blksize;
 
+/* The overlay is stored in this qcow2 file (cow-file parameter), or
+ * NULL if not set.  cow_backing_file and cow_backing_format are
+ * recorded in the file if set.
+ */
+extern char *cow_file;
+extern const char *cow_backing_file, *cow_backing_format;
+
 #endif /* NBDKIT_COW_H */
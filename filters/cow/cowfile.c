@@ -0,0 +1,582 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/* Storing the overlay in a qcow2 file (cow-file parameter).
+ *
+ * The file is an ordinary qcow2 (version 3) file with clusters the
+ * same size as the filter's blocks, optionally naming the plugin's
+ * data as its backing file, so it can be used by qemu-img (eg.
+ * "qemu-img commit").
+ *
+ * So that we never have to allocate clusters, everything in the file
+ * is at a fixed offset which only depends on the virtual size and
+ * the block size:
+ *
+ *   cluster 0         header, backing file format and name
+ *   L1 table
+ *   refcount table
+ *   refcount blocks   covering every cluster in the file
+ *   L2 tables         one for each L1 entry
+ *   data              one cluster for each block of the disk
+ *
+ * The file is sparse, so unused L2 tables and data clusters take no
+ * space.  Block N is always stored in data cluster N, and blk.c
+ * reads and writes it there directly.  Because the refcount blocks
+ * are contiguous and in order, the refcounts form a single array of
+ * 16 bit big endian entries, one for each cluster in the file.
+ *
+ * While nbdkit is running the bitmap in blk.c is the authoritative
+ * record of which blocks are in the overlay.  The L2 tables, the
+ * refcounts and the L1 table are only updated (for L2 tables
+ * covering blocks which have changed) when the client flushes and
+ * when nbdkit exits.  The dirty bit in the header is set while the
+ * file is open, so after a crash qemu knows that the refcounts may
+ * be wrong.
+ *
+ * When nbdkit is started with an existing file, the states of the
+ * blocks are loaded from the L2 tables.  This only works for files
+ * with the layout above, ie. created by this filter with the same
+ * size and block size, and not since modified by qemu.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "bitmap.h"
+#include "byte-swapping.h"
+#include "cleanup.h"
+#include "fdatasync.h"
+#include "ispowerof2.h"
+#include "minmax.h"
+#include "pread.h"
+#include "pwrite.h"
+#include "qcow2.h"
+#include "rounding.h"
+#include "utils.h"
+
+#include "cow.h"
+#include "blk.h"
+#include "cowfile.h"
+
+#define QCOW2_OFLAG_COPIED  (UINT64_C(1) << 63)
+#define QCOW2_OFLAG_ZERO    UINT64_C(1)
+#define QCOW2_EXT_END             0
+#define QCOW2_EXT_BACKING_FORMAT  0xe2792aca
+#define REFCOUNT_ORDER      4   /* 16 bit refcounts */
+
+/* The layout of the file, set by cowfile_set_size. */
+static bool have_layout;
+static struct {
+  uint64_t size;                /* virtual size */
+  uint64_t nr_blocks;
+  uint64_t l2_entries;          /* entries in each L2 table */
+  uint64_t l1_size;             /* entries in the L1 table */
+  uint64_t nr_meta;             /* clusters before the L2 tables */
+  uint64_t rt_clusters;         /* clusters in the refcount table */
+  uint64_t nr_rb;               /* refcount blocks */
+  uint64_t l1_offset, rt_offset, rb_offset, l2_offset, data_offset;
+  uint64_t file_clusters;
+} layout;
+
+/* One bit for each L2 table which must be rewritten.  Protected by
+ * lock.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bitmap dirty_l2;
+
+/* Serializes cowfile_sync. */
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int
+cowfile_open (void)
+{
+  int fd;
+
+  fd = open (cow_file, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+  if (fd == -1) {
+    nbdkit_error ("open: %s: %m", cow_file);
+    return -1;
+  }
+  if (flock (fd, LOCK_EX|LOCK_NB) == -1) {
+    nbdkit_error ("%s: cow file is in use by another process: %m",
+                  cow_file);
+    close (fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int
+compute_layout (uint64_t size)
+{
+  const uint64_t cs = blksize;
+  uint64_t l1_clusters, old_nr_rb;
+
+  layout.size = size;
+  layout.nr_blocks = DIV_ROUND_UP (size, cs);
+  layout.l2_entries = cs / 8;
+  layout.l1_size = MAX (1, DIV_ROUND_UP (layout.nr_blocks, layout.l2_entries));
+  /* qemu limits the L1 table to 32M. */
+  if (layout.l1_size > 32 * 1024 * 1024 / 8) {
+    nbdkit_error ("%s: disk is too large for a qcow2 file with "
+                  "cow-block-size=%u", cow_file, blksize);
+    return -1;
+  }
+  l1_clusters = DIV_ROUND_UP (layout.l1_size * 8, cs);
+
+  /* The number of refcount blocks depends on the size of the file,
+   * which includes the refcount table and blocks.
+   */
+  layout.nr_rb = 0;
+  do {
+    old_nr_rb = layout.nr_rb;
+    layout.rt_clusters = MAX (1, DIV_ROUND_UP (layout.nr_rb * 8, cs));
+    layout.nr_meta = 1 + l1_clusters + layout.rt_clusters + layout.nr_rb;
+    layout.file_clusters =
+      layout.nr_meta + layout.l1_size + layout.nr_blocks;
+    layout.nr_rb = DIV_ROUND_UP (layout.file_clusters, cs / 2);
+  } while (layout.nr_rb != old_nr_rb);
+
+  layout.l1_offset = cs;
+  layout.rt_offset = layout.l1_offset + l1_clusters * cs;
+  layout.rb_offset = layout.rt_offset + layout.rt_clusters * cs;
+  layout.l2_offset = layout.rb_offset + layout.nr_rb * cs;
+  layout.data_offset = layout.l2_offset + layout.l1_size * cs;
+  return 0;
+}
+
+/* Write the header cluster, including the backing file. */
+static int
+write_header (int fd, bool dirty)
+{
+  CLEANUP_FREE uint8_t *buf = calloc (1, blksize);
+  struct qcow2_header *h = (struct qcow2_header *) buf;
+  size_t pos = sizeof *h;
+  uint32_t u32;
+
+  if (buf == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+
+  memcpy (&h->magic, QCOW2_MAGIC_STRING, strlen (QCOW2_MAGIC_STRING));
+  h->version = htobe32 (3);
+  h->cluster_bits = htobe32 (log_2_bits (blksize));
+  h->size = htobe64 (layout.size);
+  h->l1_size = htobe32 (layout.l1_size);
+  h->l1_table_offset = htobe64 (layout.l1_offset);
+  h->refcount_table_offset = htobe64 (layout.rt_offset);
+  h->refcount_table_clusters = htobe32 (layout.rt_clusters);
+  h->incompatible_features =
+    htobe64 (dirty ? UINT64_C(1) << QCOW2_INCOMPAT_FEAT_DIRTY_BIT : 0);
+  h->refcount_order = htobe32 (REFCOUNT_ORDER);
+  h->header_length = htobe32 (sizeof *h);
+
+  /* Header extensions.  The lengths of the backing file name and
+   * format were checked in cow_config_complete so they fit in the
+   * smallest cluster.
+   */
+  if (cow_backing_file && cow_backing_format) {
+    u32 = htobe32 (QCOW2_EXT_BACKING_FORMAT);
+    memcpy (&buf[pos], &u32, 4);
+    u32 = htobe32 (strlen (cow_backing_format));
+    memcpy (&buf[pos+4], &u32, 4);
+    memcpy (&buf[pos+8], cow_backing_format, strlen (cow_backing_format));
+    pos += 8 + ROUND_UP (strlen (cow_backing_format), 8);
+  }
+  u32 = htobe32 (QCOW2_EXT_END);
+  memcpy (&buf[pos], &u32, 4);
+  pos += 8;
+
+  if (cow_backing_file) {
+    h->backing_file_offset = htobe64 (pos);
+    h->backing_file_size = htobe32 (strlen (cow_backing_file));
+    memcpy (&buf[pos], cow_backing_file, strlen (cow_backing_file));
+  }
+
+  if (full_pwrite (fd, buf, blksize, 0) == -1) {
+    nbdkit_error ("%s: pwrite: %m", cow_file);
+    return -1;
+  }
+  return 0;
+}
+
+/* Set or clear the dirty bit in the header. */
+static int
+set_dirty (int fd, bool dirty)
+{
+  uint64_t features =
+    htobe64 (dirty ? UINT64_C(1) << QCOW2_INCOMPAT_FEAT_DIRTY_BIT : 0);
+
+  if (full_pwrite (fd, &features, sizeof features,
+                   offsetof (struct qcow2_header,
+                             incompatible_features)) == -1) {
+    nbdkit_error ("%s: pwrite: %m", cow_file);
+    return -1;
+  }
+  return 0;
+}
+
+static int
+create_file (int fd)
+{
+  CLEANUP_FREE uint64_t *rt = NULL;
+  CLEANUP_FREE uint16_t *refs = NULL;
+  uint64_t i;
+
+  nbdkit_debug ("cow: creating qcow2 file %s", cow_file);
+
+  if (write_header (fd, true) == -1)
+    return -1;
+
+  /* The refcount table points to every refcount block. */
+  rt = calloc (layout.rt_clusters, blksize);
+  if (rt == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  for (i = 0; i < layout.nr_rb; ++i)
+    rt[i] = htobe64 (layout.rb_offset + i * blksize);
+  if (full_pwrite (fd, rt, layout.rt_clusters * blksize,
+                   layout.rt_offset) == -1) {
+    nbdkit_error ("%s: pwrite: %m", cow_file);
+    return -1;
+  }
+
+  /* The clusters before the L2 tables are always in use.  The L1
+   * table is all zeroes, which the sparse file gives us for free.
+   */
+  refs = malloc (layout.nr_meta * sizeof *refs);
+  if (refs == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  for (i = 0; i < layout.nr_meta; ++i)
+    refs[i] = htobe16 (1);
+  if (full_pwrite (fd, refs, layout.nr_meta * sizeof *refs,
+                   layout.rb_offset) == -1) {
+    nbdkit_error ("%s: pwrite: %m", cow_file);
+    return -1;
+  }
+
+  if (ftruncate (fd, layout.file_clusters * blksize) == -1) {
+    nbdkit_error ("%s: ftruncate: %m", cow_file);
+    return -1;
+  }
+  return 0;
+}
+
+static int
+load_file (int fd,
+           void (*load_state) (uint64_t blknum, enum bm_entry state))
+{
+  struct qcow2_header h;
+  CLEANUP_FREE uint64_t *l1 = NULL;
+  CLEANUP_FREE uint64_t *l2 = NULL;
+  uint64_t i, j, e, blknum, features, nr_allocated = 0;
+  const uint64_t dirty_bit = UINT64_C(1) << QCOW2_INCOMPAT_FEAT_DIRTY_BIT;
+
+  if (full_pread (fd, &h, sizeof h, 0) == -1) {
+    nbdkit_error ("%s: pread: %m", cow_file);
+    return -1;
+  }
+  features = be64toh (h.incompatible_features);
+  if (memcmp (&h.magic, QCOW2_MAGIC_STRING,
+              strlen (QCOW2_MAGIC_STRING)) != 0 ||
+      be32toh (h.version) != 3 ||
+      be32toh (h.cluster_bits) != log_2_bits (blksize) ||
+      be64toh (h.size) != layout.size ||
+      be32toh (h.crypt_method) != 0 ||
+      be32toh (h.l1_size) != layout.l1_size ||
+      be64toh (h.l1_table_offset) != layout.l1_offset ||
+      be64toh (h.refcount_table_offset) != layout.rt_offset ||
+      be32toh (h.refcount_table_clusters) != layout.rt_clusters ||
+      be32toh (h.nb_snapshots) != 0 ||
+      be32toh (h.refcount_order) != REFCOUNT_ORDER ||
+      (features & ~dirty_bit) != 0) {
+    nbdkit_error ("%s: this file was not created by nbdkit-cow-filter "
+                  "for a disk of this size and cow-block-size, "
+                  "or it has been modified", cow_file);
+    return -1;
+  }
+
+  l1 = malloc (layout.l1_size * sizeof *l1);
+  l2 = malloc (blksize);
+  if (l1 == NULL || l2 == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  if (full_pread (fd, l1, layout.l1_size * sizeof *l1,
+                  layout.l1_offset) == -1) {
+    nbdkit_error ("%s: pread: %m", cow_file);
+    return -1;
+  }
+
+  for (i = 0; i < layout.l1_size; ++i) {
+    e = be64toh (l1[i]);
+    if (e == 0)
+      continue;
+    if ((e & ~QCOW2_OFLAG_COPIED) != layout.l2_offset + i * blksize)
+      goto bad_layout;
+
+    if (full_pread (fd, l2, blksize, e & ~QCOW2_OFLAG_COPIED) == -1) {
+      nbdkit_error ("%s: pread: %m", cow_file);
+      return -1;
+    }
+    for (j = 0; j < layout.l2_entries; ++j) {
+      blknum = i * layout.l2_entries + j;
+      e = be64toh (l2[j]);
+      if (e == 0)
+        continue;
+      if (blknum >= layout.nr_blocks)
+        goto bad_layout;
+      if (e == QCOW2_OFLAG_ZERO)
+        load_state (blknum, BLOCK_TRIMMED);
+      else if ((e & ~QCOW2_OFLAG_COPIED) ==
+               layout.data_offset + blknum * blksize) {
+        load_state (blknum, BLOCK_ALLOCATED);
+        nr_allocated++;
+      }
+      else
+        goto bad_layout;
+    }
+  }
+
+  nbdkit_debug ("cow: loaded %s: %" PRIu64 " blocks allocated%s",
+                cow_file, nr_allocated,
+                features & dirty_bit ? " (not closed cleanly)" : "");
+
+  /* If nbdkit did not exit cleanly last time, rewrite all of the
+   * metadata at the next sync to correct the refcounts.
+   */
+  if (features & dirty_bit) {
+    for (i = 0; i < layout.l1_size; ++i)
+      bitmap_set_blk (&dirty_l2, i, 1);
+  }
+
+  return 0;
+
+ bad_layout:
+  nbdkit_error ("%s: the qcow2 file has been modified by another program "
+                "and cannot be used as an overlay", cow_file);
+  return -1;
+}
+
+int
+cowfile_set_size (int fd, uint64_t size,
+                  void (*load_state) (uint64_t blknum, enum bm_entry state),
+                  off_t *data_offset)
+{
+  struct stat statbuf;
+
+  if (have_layout) {
+    if (size != layout.size) {
+      nbdkit_error ("%s: the size of the plugin has changed", cow_file);
+      return -1;
+    }
+    *data_offset = layout.data_offset;
+    return 0;
+  }
+
+  if (compute_layout (size) == -1)
+    return -1;
+
+  bitmap_init (&dirty_l2, 1, 1 /* bits per block */);
+  if (bitmap_resize (&dirty_l2, layout.l1_size) == -1)
+    return -1;
+
+  if (fstat (fd, &statbuf) == -1) {
+    nbdkit_error ("%s: fstat: %m", cow_file);
+    return -1;
+  }
+  if (statbuf.st_size == 0) {
+    if (create_file (fd) == -1)
+      return -1;
+  }
+  else {
+    if (load_file (fd, load_state) == -1)
+      return -1;
+    /* Replace the backing file if a new one was given. */
+    if ((cow_backing_file ? write_header (fd, true) : set_dirty (fd, true))
+        == -1)
+      return -1;
+  }
+  if (fdatasync (fd) == -1) {
+    nbdkit_error ("%s: fdatasync: %m", cow_file);
+    return -1;
+  }
+
+  have_layout = true;
+  *data_offset = layout.data_offset;
+  return 0;
+}
+
+void
+cowfile_mark (uint64_t blknum)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  bitmap_set_blk (&dirty_l2, blknum / layout.l2_entries, 1);
+}
+
+/* Rewrite L2 table i and the refcounts and L1 entry which depend on
+ * it.  l2 and refs are buffers of blksize bytes.
+ */
+static int
+write_l2_table (int fd, uint64_t i, uint64_t *l2, uint16_t *refs,
+                enum bm_entry (*get_state) (uint64_t blknum))
+{
+  const uint64_t first = i * layout.l2_entries;
+  const uint64_t n = MIN (layout.l2_entries, layout.nr_blocks - first);
+  const uint64_t data_cluster = layout.data_offset / blksize + first;
+  const uint64_t l2_cluster = layout.l2_offset / blksize + i;
+  bool used = false;
+  uint64_t j, l1_entry;
+  uint16_t l2_ref;
+
+  memset (l2, 0, blksize);
+  memset (refs, 0, blksize);
+  for (j = 0; j < n; ++j) {
+    switch (get_state (first + j)) {
+    case BLOCK_ALLOCATED:
+      l2[j] = htobe64 ((layout.data_offset + (first + j) * blksize) |
+                       QCOW2_OFLAG_COPIED);
+      refs[j] = htobe16 (1);
+      used = true;
+      break;
+    case BLOCK_TRIMMED:
+      l2[j] = htobe64 (QCOW2_OFLAG_ZERO);
+      used = true;
+      break;
+    case BLOCK_NOT_ALLOCATED:
+      break;
+    }
+  }
+  l1_entry = used ? htobe64 ((layout.l2_offset + i * blksize) |
+                             QCOW2_OFLAG_COPIED) : 0;
+  l2_ref = htobe16 (used ? 1 : 0);
+
+  /* Write the refcounts before the tables which refer to the
+   * clusters.
+   */
+  if (full_pwrite (fd, refs, n * sizeof *refs,
+                   layout.rb_offset + data_cluster * sizeof *refs) == -1 ||
+      full_pwrite (fd, &l2_ref, sizeof l2_ref,
+                   layout.rb_offset + l2_cluster * sizeof l2_ref) == -1 ||
+      full_pwrite (fd, l2, blksize, layout.l2_offset + i * blksize) == -1 ||
+      full_pwrite (fd, &l1_entry, sizeof l1_entry,
+                   layout.l1_offset + i * sizeof l1_entry) == -1) {
+    nbdkit_error ("%s: pwrite: %m", cow_file);
+    return -1;
+  }
+  return 0;
+}
+
+int
+cowfile_sync (int fd, enum bm_entry (*get_state) (uint64_t blknum))
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&sync_lock);
+  CLEANUP_FREE uint64_t *l2 = NULL;
+  CLEANUP_FREE uint16_t *refs = NULL;
+  struct bitmap todo = dirty_l2;
+  int64_t i;
+  int r = 0;
+
+  if (!have_layout)
+    return 0;
+
+  l2 = malloc (blksize);
+  refs = malloc (blksize);
+  todo.bitmap = malloc (dirty_l2.size);
+  if (l2 == NULL || refs == NULL || todo.bitmap == NULL) {
+    nbdkit_error ("malloc: %m");
+    free (todo.bitmap);
+    return -1;
+  }
+
+  /* Take the list of L2 tables to write.  If a block changes after
+   * this then its L2 table is marked again.
+   */
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    memcpy (todo.bitmap, dirty_l2.bitmap, dirty_l2.size);
+    bitmap_clear (&dirty_l2);
+  }
+
+  for (i = bitmap_next (&todo, 0); i >= 0; i = bitmap_next (&todo, i + 1)) {
+    if (write_l2_table (fd, i, l2, refs, get_state) == -1) {
+      r = -1;
+      break;
+    }
+  }
+
+  if (r == 0 && fdatasync (fd) == -1) {
+    nbdkit_error ("%s: fdatasync: %m", cow_file);
+    r = -1;
+  }
+
+  /* If anything failed, try again next time. */
+  if (r == -1) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    for (i = bitmap_next (&todo, 0); i >= 0; i = bitmap_next (&todo, i + 1))
+      bitmap_set_blk (&dirty_l2, i, 1);
+  }
+
+  free (todo.bitmap);
+  return r;
+}
+
+void
+cowfile_close (int fd, enum bm_entry (*get_state) (uint64_t blknum))
+{
+  if (have_layout) {
+    if (cowfile_sync (fd, get_state) == 0 &&
+        set_dirty (fd, false) == 0 &&
+        fdatasync (fd) == -1)
+      nbdkit_error ("%s: fdatasync: %m", cow_file);
+  }
+  bitmap_free (&dirty_l2);
+}
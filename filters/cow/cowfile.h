@@ -0,0 +1,72 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef NBDKIT_COWFILE_H
+#define NBDKIT_COWFILE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "blk.h"
+
+/* Storing the overlay as a qcow2 file (cow-file parameter), see
+ * cowfile.c.
+ */
+
+/* Open or create the file.  Returns the file descriptor, or -1 on
+ * error.
+ */
+extern int cowfile_open (void);
+
+/* Set up the file for a disk of the given size.  If the file was
+ * created by an earlier run, load_state is called for each block
+ * which is in the overlay.  Sets *data_offset to the offset of block
+ * 0 in the file.
+ */
+extern int cowfile_set_size (int fd, uint64_t size,
+                             void (*load_state) (uint64_t blknum,
+                                                 enum bm_entry state),
+                             off_t *data_offset)
+  __attribute__ ((__nonnull__ (3, 4)));
+
+/* The state of a block has changed. */
+extern void cowfile_mark (uint64_t blknum);
+
+/* Write the qcow2 metadata for changed blocks and sync the file. */
+extern int cowfile_sync (int fd, enum bm_entry (*get_state) (uint64_t blknum))
+  __attribute__ ((__nonnull__ (2)));
+
+/* Sync the file and mark it as cleanly closed. */
+extern void cowfile_close (int fd,
+                           enum bm_entry (*get_state) (uint64_t blknum))
+  __attribute__ ((__nonnull__ (2)));
+
+#endif /* NBDKIT_COWFILE_H */
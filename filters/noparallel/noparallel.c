@@ -54,6 +54,8 @@ noparallel_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
     else if (strcmp (value, "all_requests") == 0 ||
              strcmp (value, "all-requests") == 0)
       thread_model = NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS;
+    else if (strcmp (value, "retirement") == 0)
+      thread_model = NBDKIT_THREAD_MODEL_SERIALIZE_RETIREMENT;
     else if (strcmp (value, "requests") != 0) {
       nbdkit_error ("unknown noparallel serialize mode '%s'", value);
       return -1;
@@ -64,8 +66,8 @@ noparallel_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
 }
 
 #define noparallel_config_help                                       \
-  "serialize=<MODE>      'requests' (default), 'all-requests', or\n" \
-  "                      'connections'.\n"                           \
+  "serialize=<MODE>      'requests' (default), 'retirement',\n"     \
+  "                      'all-requests', or 'connections'.\n"       \
 
 /* Apply runtime reduction to thread model. */
 static int
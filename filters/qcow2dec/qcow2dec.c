@@ -74,9 +74,8 @@
 #include "cleanup.h"
 #include "isaligned.h"
 #include "minmax.h"
-#include "rounding.h"
-
 #include "qcow2.h"
+#include "rounding.h"
 
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static int64_t virtual_size = -1;
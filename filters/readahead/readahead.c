@@ -69,23 +69,27 @@ struct readahead_handle {
 /* We have various requirements of the underlying filter(s) + plugin:
  * - They must support NBDKIT_CACHE_NATIVE (otherwise our requests
  *   would not do anything useful).
- * - They must use the PARALLEL thread model (otherwise we could
- *   violate their thread model).
+ * - They must use the PARALLEL or SERIALIZE_RETIREMENT thread model
+ *   (otherwise we could violate their thread model).
  */
 static bool
-filter_working (struct readahead_handle *h)
+allows_parallel_requests (void)
 {
   return
-    h->can_cache == NBDKIT_CACHE_NATIVE &&
-    thread_model == NBDKIT_THREAD_MODEL_PARALLEL;
+    thread_model == NBDKIT_THREAD_MODEL_PARALLEL ||
+    thread_model == NBDKIT_THREAD_MODEL_SERIALIZE_RETIREMENT;
+}
+
+static bool
+filter_working (struct readahead_handle *h)
+{
+  return h->can_cache == NBDKIT_CACHE_NATIVE && allows_parallel_requests ();
 }
 
 static bool
 suggest_cache_filter (struct readahead_handle *h)
 {
-  return
-    h->can_cache != NBDKIT_CACHE_NATIVE &&
-    thread_model == NBDKIT_THREAD_MODEL_PARALLEL;
+  return h->can_cache != NBDKIT_CACHE_NATIVE && allows_parallel_requests ();
 }
 
 /* We need to hook into .get_ready() so we can read the final thread
@@ -173,7 +173,8 @@ scan_prepare (nbdkit_next *next, void *handle, int readonly)
     return 0;
   }
 
-  if (thread_model != NBDKIT_THREAD_MODEL_PARALLEL) {
+  if (thread_model != NBDKIT_THREAD_MODEL_PARALLEL &&
+      thread_model != NBDKIT_THREAD_MODEL_SERIALIZE_RETIREMENT) {
     nbdkit_error ("scan: warning: underlying plugin does not support "
                   "the PARALLEL thread model, not scanning");
     return 0;
@@ -66,6 +66,8 @@ extern "C" {
 #define NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS    1
 #define NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS        2
 #define NBDKIT_THREAD_MODEL_PARALLEL                  3
+/* Sorts between SERIALIZE_REQUESTS and PARALLEL, despite its value. */
+#define NBDKIT_THREAD_MODEL_SERIALIZE_RETIREMENT      4
 
 #define NBDKIT_FLAG_MAY_TRIM  (1<<0) /* Maps to !NBD_CMD_FLAG_NO_HOLE */
 #define NBDKIT_FLAG_FUA       (1<<1) /* Maps to NBD_CMD_FLAG_FUA */
@@ -49,6 +49,8 @@ extern "C" {
 #error Unsupported API version
 #endif
 
+struct nbdkit_request;
+
 struct nbdkit_plugin {
   /* Do not set these fields directly; use NBDKIT_REGISTER_PLUGIN.
    * They exist so that we can support plugins compiled against
@@ -150,11 +152,24 @@ struct nbdkit_plugin {
 
   int (*block_size) (void *handle,
                      uint32_t *minimum, uint32_t *preferred, uint32_t *maximum);
+
+  int (*async_pread) (void *handle, void *buf, uint32_t count, uint64_t offset,
+                      uint32_t flags, struct nbdkit_request *req);
+  int (*async_pwrite) (void *handle, const void *buf, uint32_t count,
+                       uint64_t offset, uint32_t flags,
+                       struct nbdkit_request *req);
+
+  int (*pread_fd) (void *handle, uint32_t count, uint64_t offset,
+                   uint32_t flags, int *fd, uint64_t *fd_offset);
+  int (*prepare_pwrite) (void *handle, uint32_t count, uint64_t offset,
+                         uint32_t flags, void **buf);
 };
 
 NBDKIT_EXTERN_DECL (void, nbdkit_set_error, (int err));
 NBDKIT_EXTERN_DECL (const char *, nbdkit_export_name, (void));
 NBDKIT_EXTERN_DECL (int, nbdkit_is_tls, (void));
+NBDKIT_EXTERN_DECL (void, nbdkit_request_complete,
+                    (struct nbdkit_request *req, int err));
 
 #define NBDKIT_REGISTER_PLUGIN(plugin)                                  \
   NBDKIT_CXX_LANG_C                                                     \
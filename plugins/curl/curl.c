@@ -37,10 +37,11 @@
  * in config.c.  This file also contains a function to allocate fully
  * configured curl easy handles.
  *
- * The main nbdkit threads (this file) create curl easy handles
- * initialized with the work they want to carry out.  Note there is
- * one easy handle per request (eg. per pread/pwrite request).  The
- * easy handles are not reused.
+ * The main nbdkit threads (this file) take a curl easy handle from
+ * the pool (pool.c) and initialize it with the work they want to
+ * carry out.  Each request (eg. each pread/pwrite request) uses one
+ * easy handle, which is returned to the pool afterwards and reused
+ * by later requests.
  *
  * There is a background worker thread (worker.c) which has a single
  * curl multi handle.
@@ -107,6 +108,8 @@ curl_load (void)
 int
 curl_get_ready (void)
 {
+  if (pool_get_ready () == -1)
+    return -1;
   return worker_get_ready ();
 }
 
@@ -120,6 +123,7 @@ static void
 curl_unload (void)
 {
   worker_unload ();
+  pool_unload ();
   config_unload ();
   scripts_unload ();
   display_times ();
@@ -185,7 +189,7 @@ curl_get_size (void *handle)
   int64_t exportsize;
 
   /* Get a curl easy handle. */
-  ch = allocate_handle ();
+  ch = get_handle ();
   if (ch == NULL) goto err;
 
   /* Prepare to read the headers. */
@@ -274,12 +278,12 @@ curl_get_size (void *handle)
     nbdkit_debug ("accept range supported (for HTTP/HTTPS)");
   }
 
-  free_handle (ch);
+  put_handle (ch);
   return exportsize;
 
  err:
   if (ch)
-    free_handle (ch);
+    put_handle (ch);
   return -1;
 }
 
@@ -391,17 +395,14 @@ error_cb (char *ptr, size_t size, size_t nmemb, void *opaque)
 }
 
 /* Read data from the remote server. */
-static size_t write_cb (char *ptr, size_t size, size_t nmemb, void *opaque);
-
 static int
 curl_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 {
   CURLcode r;
   struct curl_handle *ch;
-  char range[128];
 
   /* Get a curl easy handle. */
-  ch = allocate_handle ();
+  ch = get_handle ();
   if (ch == NULL) goto err;
 
   /* Run the scripts if necessary and set headers in the handle. */
@@ -417,15 +418,14 @@ curl_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 
   curl_easy_setopt (ch->c, CURLOPT_HTTPGET, 1L);
 
-  /* Make an HTTP range request. */
-  snprintf (range, sizeof range, "%" PRIu64 "-%" PRIu64,
-            offset, offset + count);
-  curl_easy_setopt (ch->c, CURLOPT_RANGE, range);
-
-  /* Send the command to the worker thread and wait. */
+  /* Send the command to the worker thread and wait.  The worker
+   * thread makes the HTTP range request, possibly combined with other
+   * reads (see worker.c).
+   */
   struct command cmd = {
-    .type = EASY_HANDLE,
+    .type = READ,
     .ch = ch,
+    .offset = offset,
   };
 
   r = send_command_to_worker_and_wait (&cmd);
@@ -433,21 +433,27 @@ curl_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
     display_curl_error (ch, r, "pread");
     goto err;
   }
-  update_times (ch->c);
+  if (!cmd.coalesced)
+    update_times (ch->c);
 
   /* Could use curl_easy_getinfo here to obtain further information
    * about the connection.
    */
 
-  /* As far as I understand the cURL API, this should never happen. */
-  assert (ch->write_count == 0);
+  /* This can happen if the server sends a short response. */
+  if (ch->write_count > 0) {
+    nbdkit_error ("pread: server sent a short response, "
+                  "%" PRIu32 " of %" PRIu32 " bytes are missing",
+                  ch->write_count, count);
+    goto err;
+  }
 
-  free_handle (ch);
+  put_handle (ch);
   return 0;
 
  err:
   if (ch)
-    free_handle (ch);
+    put_handle (ch);
   return -1;
 }
 
@@ -458,7 +464,7 @@ curl_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
  *
  * We use the same terminology as libcurl here.
  */
-static size_t
+size_t
 write_cb (char *ptr, size_t size, size_t nmemb, void *opaque)
 {
   struct curl_handle *ch = opaque;
@@ -493,7 +499,7 @@ curl_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
   char range[128];
 
   /* Get a curl easy handle. */
-  ch = allocate_handle ();
+  ch = get_handle ();
   if (ch == NULL) goto err;
 
   /* Run the scripts if necessary and set headers in the handle. */
@@ -534,12 +540,12 @@ curl_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
   /* As far as I understand the cURL API, this should never happen. */
   assert (ch->read_count == 0);
 
-  free_handle (ch);
+  put_handle (ch);
   return 0;
 
  err:
   if (ch)
-    free_handle (ch);
+    put_handle (ch);
   return -1;
 }
 
@@ -118,12 +118,20 @@ struct curl_handle {
   struct command *cmd;
 };
 
-/* Asynchronous commands that can be sent to the worker thread. */
-enum command_type { EASY_HANDLE, STOP };
+/* Asynchronous commands that can be sent to the worker thread.
+ *
+ * READ is like EASY_HANDLE except that the caller sets write_buf and
+ * write_count in the handle but not the range.  The worker thread
+ * sets the range, and may combine the read with other pending reads
+ * into a single request.
+ */
+enum command_type { EASY_HANDLE, READ, STOP };
+struct read_batch;
 struct command {
   /* These fields are set by the caller. */
   enum command_type type;       /* command */
-  struct curl_handle *ch;       /* for EASY_HANDLE, the easy handle */
+  struct curl_handle *ch;       /* for EASY_HANDLE and READ, the easy handle */
+  uint64_t offset;              /* for READ, the offset to read from */
 
   /* This field is set to a unique value by send_command_and_wait. */
   uint64_t id;                  /* serial number */
@@ -132,8 +140,19 @@ struct command {
   pthread_mutex_t mutex;        /* completion mutex */
   pthread_cond_t cond;          /* completion condition */
   CURLcode status;              /* status code (CURLE_OK = succeeded) */
+
+  /* For READ, set if the data was fetched by a request made using
+   * another command's easy handle, so this handle was not used.
+   */
+  bool coalesced;
+
+  /* Used by worker thread in worker.c */
+  struct read_batch *batch;
 };
 
+/* curl.c */
+extern size_t write_cb (char *ptr, size_t size, size_t nmemb, void *opaque);
+
 /* config.c */
 extern int curl_config (const char *key, const char *value);
 extern int curl_config_complete (void);
@@ -143,6 +162,12 @@ extern void curl_dump_plugin (void);
 extern struct curl_handle *allocate_handle (void);
 extern void free_handle (struct curl_handle *);
 
+/* pool.c */
+extern int pool_get_ready (void);
+extern void pool_unload (void);
+extern struct curl_handle *get_handle (void);
+extern void put_handle (struct curl_handle *ch);
+
 /* worker.c */
 extern int worker_get_ready (void);
 extern int worker_after_fork (void);
@@ -0,0 +1,195 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Pool of curl easy handles.
+ *
+ * Setting up a fully configured easy handle (see allocate_handle in
+ * config.c) is quite expensive, so instead of creating one for every
+ * request we keep handles which are not in use in a pool and reuse
+ * them.
+ *
+ * The HTTP connections themselves belong to the connection cache of
+ * the multi handle (see worker.c), so they are kept alive and reused
+ * whichever easy handle makes the request.  To avoid a full TLS
+ * handshake on every new connection, all easy handles also share a
+ * TLS session cache (and DNS cache) through a curl share handle.
+ *
+ * The pool keeps at most 'connections' idle handles.  If all handles
+ * are busy we allocate another one rather than waiting, so the pool
+ * does not limit the number of concurrent requests, which matters for
+ * HTTP/2 and HTTP/3 where many requests share a connection.  The
+ * number of HTTP connections is still limited by
+ * CURLMOPT_MAX_TOTAL_CONNECTIONS.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <curl/curl.h>
+
+#include <nbdkit-plugin.h>
+
+#include "cleanup.h"
+#include "vector.h"
+
+#include "curldefs.h"
+
+DEFINE_VECTOR_TYPE (curl_handle_list, struct curl_handle *);
+
+/* Use '-D curl.pool=1' to set. */
+NBDKIT_DLL_PUBLIC int curl_debug_pool = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static curl_handle_list idle_handles = empty_vector;
+
+/* The share handle, and locks for each type of shared data. */
+static CURLSH *share;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+static void
+share_lock_cb (CURL *c, curl_lock_data data, curl_lock_access access,
+               void *opaque)
+{
+  pthread_mutex_lock (&share_locks[data]);
+}
+
+static void
+share_unlock_cb (CURL *c, curl_lock_data data, void *opaque)
+{
+  pthread_mutex_unlock (&share_locks[data]);
+}
+
+int
+pool_get_ready (void)
+{
+  size_t i;
+
+  for (i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+    pthread_mutex_init (&share_locks[i], NULL);
+
+  /* If this fails we can carry on without sharing. */
+  share = curl_share_init ();
+  if (share == NULL) {
+    nbdkit_debug ("curl_share_init failed, not sharing TLS sessions");
+    return 0;
+  }
+  curl_share_setopt (share, CURLSHOPT_LOCKFUNC, share_lock_cb);
+  curl_share_setopt (share, CURLSHOPT_UNLOCKFUNC, share_unlock_cb);
+  curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+
+  return 0;
+}
+
+/* Called after the worker thread has stopped. */
+void
+pool_unload (void)
+{
+  size_t i;
+
+  for (i = 0; i < idle_handles.len; ++i)
+    free_handle (idle_handles.ptr[i]);
+  curl_handle_list_reset (&idle_handles);
+
+  if (share) {
+    curl_share_cleanup (share);
+    share = NULL;
+  }
+}
+
+/* Get an idle handle from the pool, or allocate a new one. */
+struct curl_handle *
+get_handle (void)
+{
+  struct curl_handle *ch = NULL;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    if (idle_handles.len > 0) {
+      ch = idle_handles.ptr[idle_handles.len-1];
+      idle_handles.len--;
+    }
+  }
+  if (ch)
+    return ch;
+
+  if (curl_debug_pool)
+    nbdkit_debug ("pool: no idle handles, allocating a new handle");
+  ch = allocate_handle ();
+  if (ch == NULL)
+    return NULL;
+  if (share)
+    curl_easy_setopt (ch->c, CURLOPT_SHARE, share);
+  return ch;
+}
+
+/* Return a handle to the pool after a request. */
+void
+put_handle (struct curl_handle *ch)
+{
+  /* Undo the settings made for the last request, so the handle is in
+   * the same state as one fresh from allocate_handle.  Setting
+   * CURLOPT_HTTPGET also resets CURLOPT_NOBODY and CURLOPT_UPLOAD.
+   */
+  curl_easy_setopt (ch->c, CURLOPT_HTTPGET, 1L);
+  curl_easy_setopt (ch->c, CURLOPT_RANGE, NULL);
+  curl_easy_setopt (ch->c, CURLOPT_HEADERFUNCTION, NULL);
+  curl_easy_setopt (ch->c, CURLOPT_HEADERDATA, NULL);
+  curl_easy_setopt (ch->c, CURLOPT_WRITEFUNCTION, NULL);
+  curl_easy_setopt (ch->c, CURLOPT_WRITEDATA, NULL);
+  curl_easy_setopt (ch->c, CURLOPT_READFUNCTION, NULL);
+  curl_easy_setopt (ch->c, CURLOPT_READDATA, NULL);
+  curl_easy_setopt (ch->c, CURLOPT_INFILESIZE_LARGE, (curl_off_t) -1);
+  ch->accept_range = false;
+  ch->write_buf = NULL;
+  ch->write_count = 0;
+  ch->read_buf = NULL;
+  ch->read_count = 0;
+  ch->cmd = NULL;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    if (idle_handles.len < connections &&
+        curl_handle_list_append (&idle_handles, ch) == 0)
+      return;
+  }
+
+  /* The pool is full. */
+  if (curl_debug_pool)
+    nbdkit_debug ("pool: pool is full, freeing handle");
+  free_handle (ch);
+}
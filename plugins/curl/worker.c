@@ -39,6 +39,7 @@
 #include <inttypes.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
 #include <assert.h>
 #include <pthread.h>
 
@@ -47,6 +48,7 @@
 #include <nbdkit-plugin.h>
 
 #include "cleanup.h"
+#include "minmax.h"
 #include "vector.h"
 
 #include "curldefs.h"
@@ -75,11 +77,42 @@ DEFINE_VECTOR_TYPE (curl_handle_list, struct curl_handle *);
 static curl_handle_list curl_handles = empty_vector;
 #endif
 
+/* Commands read from the pipe which have not been dispatched yet. */
+DEFINE_VECTOR_TYPE (command_list, struct command *);
+static command_list queue = empty_vector;
+
+/* Reads which arrive at the worker thread at the same time (because
+ * several NBD requests are in flight) and which are adjacent or close
+ * together are combined into a single HTTP range request, and the
+ * response is scattered back to the callers.  This saves a round
+ * trip and per-request overhead (and cost, for object stores which
+ * charge per request).  We never wait for more reads to arrive, so
+ * this adds no latency.
+ *
+ * MAX_READ_GAP is the largest gap between reads that we will fill by
+ * reading (and discarding) data that nobody asked for.
+ * MAX_READ_BATCH_SIZE and MAX_READ_BATCH_COMMANDS limit the size of a
+ * combined request.
+ */
+#define MAX_READ_GAP (64 * 1024)
+#define MAX_READ_BATCH_SIZE (32 * 1024 * 1024)
+#define MAX_READ_BATCH_COMMANDS 64
+
+struct read_batch {
+  uint64_t offset;              /* start of the combined range */
+  uint64_t end;                 /* end of the combined range */
+  uint64_t pos;                 /* offset of the next byte received */
+  long bad_response;            /* if != 0, response code other than 206 */
+  command_list cmds;            /* the combined reads */
+};
+static command_list reads = empty_vector;
+
 static const char *
 command_type_to_string (enum command_type type)
 {
   switch (type) {
   case EASY_HANDLE: return "EASY_HANDLE";
+  case READ:        return "READ";
   case STOP:        return "STOP";
   default:          abort ();
   }
@@ -171,6 +204,11 @@ worker_unload (void)
     curl_multi_cleanup (multi);
     multi = NULL;
   }
+
+  free (queue.ptr);
+  queue = (command_list) empty_vector;
+  free (reads.ptr);
+  reads = (command_list) empty_vector;
 }
 
 /* Command queue. */
@@ -213,10 +251,12 @@ send_command_to_worker_and_wait (struct command *cmd)
 }
 
 /* The background worker thread. */
-static struct command *process_multi_handle (void);
+static int process_multi_handle (void);
+static void read_more_commands (void);
 static void check_for_finished_handles (void);
 static void retire_command (struct command *cmd, CURLcode code);
 static void do_easy_handle (struct command *cmd);
+static void do_reads (void);
 
 static void *
 worker_thread (void *vp)
@@ -227,26 +267,38 @@ worker_thread (void *vp)
     nbdkit_debug ("curl: background worker thread started");
 
   while (!stop) {
-    struct command *cmd = NULL;
+    size_t i;
 
-    cmd = process_multi_handle ();
-    if (cmd == NULL)
+    if (process_multi_handle () == -1)
       continue; /* or die?? */
 
-    if (curl_debug_worker)
-      nbdkit_debug ("curl: dispatching %s command %" PRIu64,
-                    command_type_to_string (cmd->type), cmd->id);
+    /* Move the READ commands out of the queue and dispatch them
+     * together.
+     */
+    do_reads ();
+
+    for (i = 0; i < queue.len; ++i) {
+      struct command *cmd = queue.ptr[i];
 
-    switch (cmd->type) {
-    case STOP:
-      stop = true;
-      retire_command (cmd, CURLE_OK);
-      break;
+      if (curl_debug_worker)
+        nbdkit_debug ("curl: dispatching %s command %" PRIu64,
+                      command_type_to_string (cmd->type), cmd->id);
 
-    case EASY_HANDLE:
-      do_easy_handle (cmd);
-      break;
+      switch (cmd->type) {
+      case STOP:
+        stop = true;
+        retire_command (cmd, CURLE_OK);
+        break;
+
+      case EASY_HANDLE:
+        do_easy_handle (cmd);
+        break;
+
+      case READ:
+        abort (); /* handled by do_reads above */
+      }
     }
+    queue.len = 0;
   } /* while (!stop) */
 
   if (curl_debug_worker)
@@ -256,26 +308,25 @@ worker_thread (void *vp)
 }
 
 /* Process the multi handle, and look out for new commands.  Returns
- * when there is a new command.
+ * when there are new commands in the queue.
  */
-static struct command *
+static int
 process_multi_handle (void)
 {
   struct curl_waitfd extra_fds[1] =
   { { .fd = self_pipe[0], .events = CURL_WAIT_POLLIN } };
   CURLMcode mc;
   int numfds, running_handles;
-  struct command *cmd = NULL;
 #ifndef HAVE_CURL_MULTI_POLL
   int repeats = 0;
 #endif
 
-  while (!cmd) {
+  while (queue.len == 0) {
     /* Process the multi handle. */
     mc = curl_multi_perform (multi, &running_handles);
     if (mc != CURLM_OK) {
       nbdkit_error ("curl_multi_perform: %s", curl_multi_strerror (mc));
-      return NULL;
+      return -1;
     }
 
     check_for_finished_handles ();
@@ -284,7 +335,7 @@ process_multi_handle (void)
     mc = curl_multi_poll (multi, extra_fds, 1, 1000000, &numfds);
     if (mc != CURLM_OK) {
       nbdkit_error ("curl_multi_poll: %s", curl_multi_strerror (mc));
-      return NULL;
+      return -1;
     }
 #else
     /* This is the older curl_multi_wait function.  For unclear
@@ -295,7 +346,7 @@ process_multi_handle (void)
     mc = curl_multi_wait (multi, extra_fds, 1, 1000000, &numfds);
     if (mc != CURLM_OK) {
       nbdkit_error ("curl_multi_wait: %s", curl_multi_strerror (mc));
-      return NULL;
+      return -1;
     }
 
     if (numfds == 0) {
@@ -320,12 +371,30 @@ process_multi_handle (void)
 
     if (extra_fds[0].revents == CURL_WAIT_POLLIN) {
       /* There's a command waiting. */
-      if (read (self_pipe[0], &cmd, sizeof cmd) != sizeof cmd)
-        abort ();
+      read_more_commands ();
     }
   }
 
-  return cmd;
+  return 0;
+}
+
+/* Read all the commands waiting in the pipe and add them to the
+ * queue.  There is at least one.
+ */
+static void
+read_more_commands (void)
+{
+  struct pollfd pfd = { .fd = self_pipe[0], .events = POLLIN };
+  struct command *cmd;
+
+  do {
+    if (read (self_pipe[0], &cmd, sizeof cmd) != sizeof cmd)
+      abort ();
+    if (command_list_append (&queue, cmd) == -1) {
+      nbdkit_error ("realloc: %m");
+      retire_command (cmd, CURLE_OUT_OF_MEMORY);
+    }
+  } while (poll (&pfd, 1, 0) == 1 && (pfd.revents & POLLIN) != 0);
 }
 
 /* This checks if any easy handles in the multi have
@@ -364,9 +433,93 @@ check_for_finished_handles (void)
   }
 }
 
-/* Retire a command.  status is a CURLcode. */
+/* Retire a command.  status is a CURLcode.  If the command made a
+ * request on behalf of a batch of reads, all the reads in the batch
+ * are retired, and any read which did not receive all of its data
+ * fails.  If the server did not answer the combined request with a
+ * partial response, the reads are retried one at a time instead.
+ */
+static void signal_command (struct command *cmd, CURLcode status);
+static CURLcode check_batch_read (struct read_batch *batch,
+                                  struct command *c, CURLcode status);
+static void do_read (struct command *cmd);
+
 static void
 retire_command (struct command *cmd, CURLcode status)
+{
+  struct read_batch *batch = cmd->batch;
+  size_t i;
+
+  if (batch) {
+    long code = batch->bad_response;
+
+    /* The response may not have had a body, so scatter_cb did not see
+     * it.
+     */
+    if (code == 0 && batch->pos == batch->offset)
+      curl_easy_getinfo (cmd->ch->c, CURLINFO_RESPONSE_CODE, &code);
+
+    if (code != 0 && code != 206) {
+      nbdkit_debug ("curl: server sent response code %ld instead of 206 "
+                    "for range %" PRIu64 "-%" PRIu64 ", "
+                    "retrying %zu reads separately",
+                    code, batch->offset, batch->end - 1, batch->cmds.len);
+
+      /* Nothing was scattered to the reads (see scatter_cb), so they
+       * can simply be sent again.
+       */
+      cmd->batch = NULL;
+      curl_easy_setopt (cmd->ch->c, CURLOPT_WRITEFUNCTION, write_cb);
+      curl_easy_setopt (cmd->ch->c, CURLOPT_WRITEDATA, cmd->ch);
+      for (i = 0; i < batch->cmds.len; ++i) {
+        batch->cmds.ptr[i]->coalesced = false;
+        do_read (batch->cmds.ptr[i]);
+      }
+      free (batch->cmds.ptr);
+      free (batch);
+      return;
+    }
+
+    /* The command which made the request must be signalled last
+     * because it (and its handle) go away as soon as it returns.
+     */
+    for (i = 0; i < batch->cmds.len; ++i) {
+      struct command *c = batch->cmds.ptr[i];
+
+      if (c == cmd)
+        continue;
+      if (status != CURLE_OK)
+        memcpy (c->ch->errbuf, cmd->ch->errbuf, sizeof c->ch->errbuf);
+      signal_command (c, check_batch_read (batch, c, status));
+    }
+    status = check_batch_read (batch, cmd, status);
+    free (batch->cmds.ptr);
+    free (batch);
+  }
+
+  signal_command (cmd, status);
+}
+
+/* If the request for a batch succeeded, check that the server sent
+ * all of the data for read c.
+ */
+static CURLcode
+check_batch_read (struct read_batch *batch, struct command *c,
+                  CURLcode status)
+{
+  if (status == CURLE_OK && c->ch->write_count > 0) {
+    snprintf (c->ch->errbuf, sizeof c->ch->errbuf,
+              "server sent %" PRIu64 " bytes of range %" PRIu64 "-%" PRIu64
+              ", read is incomplete at offset %" PRIu64,
+              batch->pos - batch->offset, batch->offset, batch->end - 1,
+              c->offset);
+    return CURLE_PARTIAL_FILE;
+  }
+  return status;
+}
+
+static void
+signal_command (struct command *cmd, CURLcode status)
 {
   if (curl_debug_worker)
     nbdkit_debug ("curl: retiring %s command %" PRIu64,
@@ -400,3 +553,191 @@ do_easy_handle (struct command *cmd)
  err:
   retire_command (cmd, CURLE_OUT_OF_MEMORY);
 }
+
+/* Set the range for a single read and start it. */
+static void
+do_read (struct command *cmd)
+{
+  struct curl_handle *ch = cmd->ch;
+  char range[128];
+
+  snprintf (range, sizeof range, "%" PRIu64 "-%" PRIu64,
+            cmd->offset, cmd->offset + ch->write_count);
+  curl_easy_setopt (ch->c, CURLOPT_RANGE, range);
+
+  do_easy_handle (cmd);
+}
+
+/* Write callback for combined reads.  The data arrives in order, so
+ * each read's write_buf, write_count and offset are advanced as its
+ * part of the range is received.
+ */
+static size_t
+scatter_cb (char *ptr, size_t size, size_t nmemb, void *opaque)
+{
+  struct read_batch *batch = opaque;
+  size_t realsize = size * nmemb;
+  uint64_t start = batch->pos, end = batch->pos + realsize;
+  size_t i;
+
+  /* If the server ignored the range and sent (eg) 200 and the whole
+   * file then the data would not line up with the reads, so stop the
+   * transfer.  retire_command retries the reads one at a time.
+   */
+  if (start == batch->offset) {
+    long code = 0;
+
+    curl_easy_getinfo (batch->cmds.ptr[0]->ch->c, CURLINFO_RESPONSE_CODE,
+                       &code);
+    if (code != 206) {
+      batch->bad_response = code;
+#ifdef CURL_WRITEFUNC_ERROR
+      return CURL_WRITEFUNC_ERROR;
+#else
+      return 0; /* in older curl, any size < requested is an error */
+#endif
+    }
+  }
+
+  /* Ignore anything beyond the end of the range. */
+  if (end > batch->end)
+    end = MAX (start, batch->end);
+
+  for (i = 0; i < batch->cmds.len; ++i) {
+    struct command *cmd = batch->cmds.ptr[i];
+    struct curl_handle *ch = cmd->ch;
+    uint64_t s, e;
+
+    s = MAX (start, cmd->offset);
+    e = MIN (end, cmd->offset + ch->write_count);
+    if (s >= e)
+      continue;
+    assert (s == cmd->offset);
+
+    memcpy (ch->write_buf, ptr + (s - start), e - s);
+    ch->write_buf += e - s;
+    ch->write_count -= e - s;
+    cmd->offset += e - s;
+  }
+
+  batch->pos = end;
+  return realsize;
+}
+
+/* Combine n reads into a single request using the easy handle of the
+ * first read.
+ */
+static void
+do_read_batch (struct command **cmds, size_t n, uint64_t offset, uint64_t end)
+{
+  struct command *cmd = cmds[0];
+  struct curl_handle *ch = cmd->ch;
+  struct read_batch *batch;
+  char range[128];
+  size_t i;
+
+  batch = malloc (sizeof *batch);
+  if (batch == NULL)
+    goto fallback;
+  batch->offset = batch->pos = offset;
+  batch->end = end;
+  batch->bad_response = 0;
+  batch->cmds = (command_list) empty_vector;
+  if (command_list_reserve_exactly (&batch->cmds, n) == -1) {
+    free (batch);
+    goto fallback;
+  }
+  for (i = 0; i < n; ++i) {
+    command_list_append (&batch->cmds, cmds[i]);
+    if (i > 0)
+      cmds[i]->coalesced = true;
+  }
+
+  if (curl_debug_worker)
+    nbdkit_debug ("curl: combining %zu reads into range %" PRIu64 "-%" PRIu64,
+                  n, offset, end - 1);
+
+  cmd->batch = batch;
+  curl_easy_setopt (ch->c, CURLOPT_WRITEFUNCTION, scatter_cb);
+  curl_easy_setopt (ch->c, CURLOPT_WRITEDATA, batch);
+  /* As in do_read, ask for one byte more than needed (HTTP ranges
+   * are inclusive).  scatter_cb ignores anything past the end.
+   */
+  snprintf (range, sizeof range, "%" PRIu64 "-%" PRIu64, offset, end);
+  curl_easy_setopt (ch->c, CURLOPT_RANGE, range);
+
+  do_easy_handle (cmd);
+  return;
+
+ fallback:
+  for (i = 0; i < n; ++i)
+    do_read (cmds[i]);
+}
+
+static int
+compare_offsets (const struct command **c1, const struct command **c2)
+{
+  if ((*c1)->offset < (*c2)->offset) return -1;
+  if ((*c1)->offset > (*c2)->offset) return 1;
+  return 0;
+}
+
+/* Remove the READ commands from the queue, combine those which are
+ * close together, and dispatch them.
+ */
+static void
+do_reads (void)
+{
+  size_t i, j;
+
+  /* Move the reads from the queue to the reads list.  Reserving
+   * enough space first means the appends below cannot fail.
+   */
+  reads.len = 0;
+  if (reads.cap < queue.len &&
+      command_list_reserve (&reads, queue.len) == -1) {
+    /* Just dispatch the reads individually. */
+    for (i = 0; i < queue.len; ++i) {
+      if (queue.ptr[i]->type == READ) {
+        do_read (queue.ptr[i]);
+        command_list_remove (&queue, i--);
+      }
+    }
+    return;
+  }
+  for (i = j = 0; i < queue.len; ++i) {
+    if (queue.ptr[i]->type == READ)
+      command_list_append (&reads, queue.ptr[i]);
+    else
+      queue.ptr[j++] = queue.ptr[i];
+  }
+  queue.len = j;
+
+  if (reads.len > 1)
+    command_list_sort (&reads, compare_offsets);
+
+  for (i = 0; i < reads.len; i = j) {
+    struct command *cmd = reads.ptr[i];
+    uint64_t offset = cmd->offset;
+    uint64_t end = offset + cmd->ch->write_count;
+
+    if (curl_debug_worker)
+      nbdkit_debug ("curl: dispatching %s command %" PRIu64,
+                    command_type_to_string (cmd->type), cmd->id);
+
+    for (j = i+1; j < reads.len && j-i < MAX_READ_BATCH_COMMANDS; ++j) {
+      const struct command *next = reads.ptr[j];
+      uint64_t next_end = next->offset + next->ch->write_count;
+
+      if (next->offset > end + MAX_READ_GAP ||
+          MAX (end, next_end) - offset > MAX_READ_BATCH_SIZE)
+        break;
+      end = MAX (end, next_end);
+    }
+
+    if (j-i == 1)
+      do_read (cmd);
+    else
+      do_read_batch (&reads.ptr[i], j-i, offset, end);
+  }
+}
@@ -110,6 +110,9 @@ sh_thread_model (void)
       s.ptr[s.len-1] = '\0';
     if (ascii_strcasecmp (s.ptr, "parallel") == 0)
       r = NBDKIT_THREAD_MODEL_PARALLEL;
+    else if (ascii_strcasecmp (s.ptr, "serialize_retirement") == 0 ||
+             ascii_strcasecmp (s.ptr, "serialize-retirement") == 0)
+      r = NBDKIT_THREAD_MODEL_SERIALIZE_RETIREMENT;
     else if (ascii_strcasecmp (s.ptr, "serialize_requests") == 0 ||
              ascii_strcasecmp (s.ptr, "serialize-requests") == 0)
       r = NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS;
@@ -0,0 +1,487 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Extent cache for the file plugin (cache-extents=true parameter).
+ *
+ * Answering .extents using lseek(SEEK_DATA/SEEK_HOLE) costs two
+ * system calls per extent on every request, which is slow for files
+ * with very many extents and on network filesystems.  Instead we read
+ * the whole extent map once, using FIEMAP if the filesystem supports
+ * it or else a single pass of lseek, and then keep it up to date as
+ * the plugin writes, zeroes and trims the file.  This only works if
+ * nothing else modifies the file while nbdkit is serving it.
+ *
+ * The cache is shared between all handles open on the same file
+ * (same device and inode), so writes through one connection are seen
+ * by the others.  It is built when the first handle opens the file,
+ * before any writes can happen, and freed when the last handle
+ * closes it.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
+
+#if defined (__linux__) && HAVE_LINUX_FS_H
+#include <linux/fs.h>       /* For FS_IOC_FIEMAP. */
+#include <linux/fiemap.h>
+#endif
+
+#include <pthread.h>
+
+#define NBDKIT_API_VERSION 2
+#include <nbdkit-plugin.h>
+
+#include "cleanup.h"
+#include "minmax.h"
+#include "vector.h"
+
+#include "extcache.h"
+
+#ifdef SEEK_HOLE
+
+#define HOLE (NBDKIT_EXTENT_HOLE|NBDKIT_EXTENT_ZERO)
+
+/* The extents are ordered, non-overlapping, have no gaps and cover
+ * the whole file.  Adjacent extents always have different types.
+ */
+struct extent {
+  uint64_t offset, length;
+  uint32_t type;
+};
+DEFINE_VECTOR_TYPE (extent_list, struct extent);
+
+struct extcache {
+  struct extcache *next;        /* Linked list of caches. */
+  dev_t dev;                    /* Identifies the file. */
+  ino_t ino;
+  unsigned refs;
+
+  pthread_rwlock_t lock;        /* Protects the fields below. */
+  bool valid;                   /* False if the cache cannot be used. */
+  uint64_t size;
+  extent_list extents;
+};
+
+/* List of caches, one per open file. */
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct extcache *caches;
+
+static int
+compare_ranges (const void *offsetp, const struct extent *e)
+{
+  const uint64_t offset = *(const uint64_t *) offsetp;
+
+  if (offset < e->offset)
+    return -1;
+  else if (offset >= e->offset + e->length)
+    return 1;
+  else
+    return 0;
+}
+
+/* Return the index of the extent containing offset, which must be
+ * inside the file.
+ */
+static size_t
+find_extent (struct extcache *c, uint64_t offset)
+{
+  struct extent *p;
+
+  p = extent_list_search (&c->extents, &offset, compare_ranges);
+  assert (p != NULL);
+  return p - c->extents.ptr;
+}
+
+/* Append an extent while building the cache. */
+static int
+append_extent (struct extcache *c,
+               uint64_t offset, uint64_t length, uint32_t type)
+{
+  struct extent *last;
+
+  if (length == 0)
+    return 0;
+
+  if (c->extents.len > 0) {
+    last = &c->extents.ptr[c->extents.len-1];
+    assert (last->offset + last->length == offset);
+    if (last->type == type) {
+      last->length += length;
+      return 0;
+    }
+  }
+
+  return extent_list_append (&c->extents,
+                             (struct extent) { offset, length, type });
+}
+
+#ifdef FS_IOC_FIEMAP
+#define NR_FIEMAP_EXTENTS 1024
+
+static int
+read_fiemap (struct extcache *c, int fd)
+{
+  CLEANUP_FREE struct fiemap *fm = NULL;
+  uint64_t pos = 0;
+  bool sync = true, last = false;
+  unsigned i;
+
+  fm = malloc (sizeof *fm + NR_FIEMAP_EXTENTS * sizeof fm->fm_extents[0]);
+  if (fm == NULL) {
+    nbdkit_debug ("malloc: %m");
+    return -1;
+  }
+
+  while (!last && pos < c->size) {
+    memset (fm, 0, sizeof *fm);
+    fm->fm_start = pos;
+    fm->fm_length = c->size - pos;
+    /* Flush delayed allocations first, but only once. */
+    fm->fm_flags = sync ? FIEMAP_FLAG_SYNC : 0;
+    fm->fm_extent_count = NR_FIEMAP_EXTENTS;
+    if (ioctl (fd, FS_IOC_FIEMAP, fm) == -1) {
+      nbdkit_debug ("ioctl: FS_IOC_FIEMAP: %m");
+      return -1;
+    }
+    sync = false;
+    if (fm->fm_mapped_extents == 0)
+      break;
+
+    for (i = 0; i < fm->fm_mapped_extents; ++i) {
+      const struct fiemap_extent *fe = &fm->fm_extents[i];
+      uint64_t start = MAX (fe->fe_logical, pos);
+      uint64_t end = MIN (fe->fe_logical + fe->fe_length, c->size);
+
+      if (fe->fe_flags & FIEMAP_EXTENT_LAST)
+        last = true;
+      if (start >= end)
+        continue;
+      /* Anything between the previous extent and this one is a hole. */
+      if (append_extent (c, pos, start - pos, HOLE) == -1 ||
+          append_extent (c, start, end - start,
+                         fe->fe_flags & FIEMAP_EXTENT_UNWRITTEN
+                         ? NBDKIT_EXTENT_ZERO : 0) == -1) {
+        nbdkit_debug ("realloc: %m");
+        return -1;
+      }
+      pos = end;
+    }
+  }
+
+  if (append_extent (c, pos, c->size - pos, HOLE) == -1) {
+    nbdkit_debug ("realloc: %m");
+    return -1;
+  }
+  return 0;
+}
+#endif /* FS_IOC_FIEMAP */
+
+/* Fallback for filesystems which don't support FIEMAP, such as NFS. */
+static int
+read_seek_hole (struct extcache *c, int fd)
+{
+  uint64_t pos = 0;
+  off_t r;
+
+  while (pos < c->size) {
+    r = lseek (fd, pos, SEEK_DATA);
+    if (r == -1) {
+      if (errno != ENXIO) {
+        nbdkit_debug ("lseek: SEEK_DATA: %" PRIu64 ": %m", pos);
+        return -1;
+      }
+      r = c->size;                /* Final hole, see do_extents. */
+    }
+    if (append_extent (c, pos, MIN (r, c->size) - pos, HOLE) == -1)
+      goto nomem;
+    pos = MIN (r, c->size);
+    if (pos >= c->size)
+      break;
+
+    r = lseek (fd, pos, SEEK_HOLE);
+    if (r == -1) {
+      nbdkit_debug ("lseek: SEEK_HOLE: %" PRIu64 ": %m", pos);
+      return -1;
+    }
+    if (append_extent (c, pos, MIN (r, c->size) - pos, 0) == -1)
+      goto nomem;
+    pos = MIN (r, c->size);
+  }
+  return 0;
+
+ nomem:
+  nbdkit_debug ("realloc: %m");
+  return -1;
+}
+
+static void
+build_cache (struct extcache *c, int fd)
+{
+  c->valid = false;
+
+#ifdef FS_IOC_FIEMAP
+  if (read_fiemap (c, fd) == 0) {
+    c->valid = true;
+    nbdkit_debug ("extent cache: read %zu extents using FIEMAP",
+                  c->extents.len);
+    return;
+  }
+  extent_list_reset (&c->extents);
+#endif
+
+  if (read_seek_hole (c, fd) == 0) {
+    c->valid = true;
+    nbdkit_debug ("extent cache: read %zu extents using lseek",
+                  c->extents.len);
+    return;
+  }
+  extent_list_reset (&c->extents);
+
+  nbdkit_debug ("extent cache: cannot read extents, "
+                "falling back to lseek for each request");
+}
+
+struct extcache *
+extcache_get (int fd, const struct stat *statbuf)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&caches_lock);
+  struct extcache *c;
+  int err;
+
+  for (c = caches; c != NULL; c = c->next) {
+    if (c->dev == statbuf->st_dev && c->ino == statbuf->st_ino) {
+      c->refs++;
+      return c;
+    }
+  }
+
+  c = calloc (1, sizeof *c);
+  if (c == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  err = pthread_rwlock_init (&c->lock, NULL);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_rwlock_init: %m");
+    free (c);
+    return NULL;
+  }
+  c->dev = statbuf->st_dev;
+  c->ino = statbuf->st_ino;
+  c->refs = 1;
+  c->size = statbuf->st_size;
+
+  /* No other handle has the file open, so it cannot change while we
+   * read the extents.
+   */
+  build_cache (c, fd);
+
+  c->next = caches;
+  caches = c;
+  return c;
+}
+
+void
+extcache_put (struct extcache *c)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&caches_lock);
+  struct extcache **pp;
+
+  if (--c->refs > 0)
+    return;
+
+  for (pp = &caches; *pp != c; pp = &(*pp)->next)
+    ;
+  *pp = c->next;
+
+  pthread_rwlock_destroy (&c->lock);
+  free (c->extents.ptr);
+  free (c);
+}
+
+/* Replace the range [offset, offset+count) with a single extent,
+ * splitting and merging the extents around it.
+ */
+static int
+replace_range (struct extcache *c,
+               uint64_t offset, uint64_t count, uint32_t type)
+{
+  const uint64_t end = offset + count;
+  const struct extent *e;
+  struct extent new[5];
+  size_t first, last, lo, hi, n, i, j, old;
+
+  first = find_extent (c, offset);
+  last = find_extent (c, end - 1);
+
+  /* Overwriting data with data is the common case. */
+  if (first == last && c->extents.ptr[first].type == type)
+    return 0;
+
+  /* Build the new extents, including the neighbours so we can merge
+   * with them.
+   */
+  lo = first;
+  hi = last;
+  n = 0;
+  if (first > 0) {
+    lo = first - 1;
+    new[n++] = c->extents.ptr[lo];
+  }
+  e = &c->extents.ptr[first];
+  if (offset > e->offset)
+    new[n++] = (struct extent) { e->offset, offset - e->offset, e->type };
+  new[n++] = (struct extent) { offset, count, type };
+  e = &c->extents.ptr[last];
+  if (end < e->offset + e->length)
+    new[n++] = (struct extent) { end, e->offset + e->length - end, e->type };
+  if (last + 1 < c->extents.len) {
+    hi = last + 1;
+    new[n++] = c->extents.ptr[hi];
+  }
+
+  /* Merge adjacent extents with the same type. */
+  for (i = 0, j = 1; j < n; ++j) {
+    if (new[i].type == new[j].type)
+      new[i].length += new[j].length;
+    else
+      new[++i] = new[j];
+  }
+  n = i + 1;
+
+  /* Replace extents [lo, hi] with new[0..n-1]. */
+  old = hi - lo + 1;
+  if (c->extents.len - old + n > c->extents.cap &&
+      extent_list_reserve (&c->extents, n - old) == -1)
+    return -1;
+  memmove (&c->extents.ptr[lo + n], &c->extents.ptr[hi + 1],
+           (c->extents.len - hi - 1) * sizeof c->extents.ptr[0]);
+  memcpy (&c->extents.ptr[lo], new, n * sizeof new[0]);
+  c->extents.len = c->extents.len - old + n;
+  return 0;
+}
+
+void
+extcache_lock (struct extcache *c)
+{
+  int err;
+
+  err = pthread_rwlock_wrlock (&c->lock);
+  assert (err == 0);
+}
+
+void
+extcache_unlock (struct extcache *c)
+{
+  pthread_rwlock_unlock (&c->lock);
+}
+
+void
+extcache_set_range (struct extcache *c,
+                    uint64_t offset, uint64_t count, uint32_t type)
+{
+  if (count > 0 && c->valid) {
+    /* Clip to the size when the cache was built. */
+    if (offset < c->size) {
+      count = MIN (count, c->size - offset);
+      if (replace_range (c, offset, count, type) == -1) {
+        nbdkit_debug ("extent cache: realloc: %m: "
+                      "falling back to lseek for each request");
+        c->valid = false;
+      }
+    }
+  }
+}
+
+void
+extcache_update (struct extcache *c,
+                 uint64_t offset, uint64_t count, uint32_t type)
+{
+  extcache_lock (c);
+  extcache_set_range (c, offset, count, type);
+  extcache_unlock (c);
+}
+
+int
+extcache_extents (struct extcache *c,
+                  uint32_t count, uint64_t offset, bool req_one,
+                  struct nbdkit_extents *extents)
+{
+  const uint64_t end = offset + count;
+  size_t i;
+  int err, r = 0;
+
+  err = pthread_rwlock_rdlock (&c->lock);
+  assert (err == 0);
+
+  if (!c->valid || end > c->size) {
+    r = 1;
+    goto out;
+  }
+
+  for (i = find_extent (c, offset);
+       i < c->extents.len && offset < end;
+       ++i) {
+    const struct extent *e = &c->extents.ptr[i];
+    uint64_t len = MIN (e->offset + e->length, end) - offset;
+
+    if (nbdkit_add_extent (extents, offset, len, e->type) == -1) {
+      r = -1;
+      goto out;
+    }
+    if (req_one)
+      break;
+    offset += len;
+  }
+
+ out:
+  pthread_rwlock_unlock (&c->lock);
+  return r;
+}
+
+#endif /* SEEK_HOLE */
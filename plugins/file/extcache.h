@@ -0,0 +1,90 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_FILE_EXTCACHE_H
+#define NBDKIT_FILE_EXTCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+struct nbdkit_extents;
+
+#ifdef SEEK_HOLE
+
+/* The extent cache (cache-extents=true) is shared between all handles
+ * open on the same file.
+ */
+struct extcache;
+
+/* Find the cache for this file, building it if no handle has the
+ * file open yet, and take a reference.  Returns NULL (after calling
+ * nbdkit_error) on error.  The caller must hold the lseek lock.
+ */
+extern struct extcache *extcache_get (int fd, const struct stat *statbuf);
+
+/* Drop the reference.  The cache is freed by the last handle. */
+extern void extcache_put (struct extcache *c);
+
+/* Record that the range now has the given type (0 for data, or
+ * NBDKIT_EXTENT_* flags).  This must be called for every write, zero
+ * and trim made through any handle.  Writes call it after writing.
+ */
+extern void extcache_update (struct extcache *c,
+                             uint64_t offset, uint64_t count, uint32_t type);
+
+/* Zeroing and trimming instead hold the cache locked from before the
+ * file is changed until extcache_set_range has recorded the new type,
+ * so that the update cannot hide a concurrent write which lands after
+ * the range was zeroed.  The lock stops extents being read in the
+ * meantime.
+ */
+extern void extcache_lock (struct extcache *c);
+extern void extcache_unlock (struct extcache *c);
+extern void extcache_set_range (struct extcache *c,
+                                uint64_t offset, uint64_t count,
+                                uint32_t type);
+
+/* Answer .extents from the cache.  Returns 0 if successful, -1 (after
+ * calling nbdkit_error) on error, or 1 if the cache is not usable, in
+ * which case the caller should fall back to lseek.  The cache is not
+ * usable if the extents could not be read when it was built, or if it
+ * could not be updated later.
+ */
+extern int extcache_extents (struct extcache *c,
+                             uint32_t count, uint64_t offset, bool req_one,
+                             struct nbdkit_extents *extents);
+
+#endif /* SEEK_HOLE */
+
+#endif /* NBDKIT_FILE_EXTCACHE_H */
@@ -71,8 +71,13 @@
 #include "isaligned.h"
 #include "ispowerof2.h"
 #include "minmax.h"
+#include "posix_memalign.h"
+#include "rounding.h"
 #include "utils.h"
 
+#include "extcache.h"
+#include "uring.h"
+
 static enum {
   mode_none,
   mode_filename,
@@ -94,7 +99,32 @@ static int fadvise_mode =
   ;
 
 /* cache mode */
-static enum { cache_default, cache_none } cache_mode = cache_default;
+static enum { cache_default, cache_none, cache_direct } cache_mode =
+  cache_default;
+
+#ifdef O_DIRECT
+/* With cache=direct, unaligned writes must read-modify-write the
+ * partial blocks at the edges of the request, and no other request
+ * may write those blocks meanwhile.  So every write, zero and trim
+ * locks the blocks it touches: exclusively for the partial blocks at
+ * its edges, and shared for the whole blocks in between, so that
+ * aligned requests do not contend with each other.  Blocks are hashed
+ * to locks so unrelated requests rarely contend.
+ */
+#define NR_BLOCK_LOCKS 64
+static pthread_rwlock_t block_locks[NR_BLOCK_LOCKS];
+
+/* The block_locks held by a request, as bitmasks. */
+struct held_locks {
+  uint64_t shared, exclusive;
+};
+#endif
+
+/* cache-extents parameter. */
+static bool cache_extents = false;
+
+/* I/O method (io parameter). */
+static enum { io_mode_sync, io_mode_uring } io_mode = io_mode_sync;
 
 /* Define EVICT_WRITES if we are going to evict the page cache
  * (cache=none) after writing.  This is only known to work on Linux.
@@ -174,6 +204,10 @@ is_enotsup (int err)
 static void
 file_unload (void)
 {
+#ifdef HAVE_IO_URING
+  if (io_mode == io_mode_uring)
+    uring_unload ();
+#endif
   free (filename);
   free (directory);
 }
@@ -267,11 +301,48 @@ file_config (const char *key, const char *value)
       cache_mode = cache_default;
     else if (strcmp (value, "none") == 0)
       cache_mode = cache_none;
+    else if (strcmp (value, "direct") == 0) {
+#ifdef O_DIRECT
+      cache_mode = cache_direct;
+#else
+      nbdkit_error ("cache=direct is not supported on this platform");
+      return -1;
+#endif
+    }
     else {
       nbdkit_error ("unknown cache mode: %s", value);
       return -1;
     }
   }
+  else if (strcmp (key, "cache-extents") == 0) {
+    int r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+#ifdef SEEK_HOLE
+    cache_extents = r;
+#else
+    if (r) {
+      nbdkit_error ("cache-extents is not supported on this platform");
+      return -1;
+    }
+#endif
+  }
+  else if (strcmp (key, "io") == 0) {
+    if (strcmp (value, "sync") == 0)
+      io_mode = io_mode_sync;
+    else if (strcmp (value, "uring") == 0) {
+#ifdef HAVE_IO_URING
+      io_mode = io_mode_uring;
+#else
+      nbdkit_error ("io=uring is not supported on this platform");
+      return -1;
+#endif
+    }
+    else {
+      nbdkit_error ("unknown io mode: %s", value);
+      return -1;
+    }
+  }
   else if (strcmp (key, "rdelay") == 0 ||
            strcmp (key, "wdelay") == 0) {
     nbdkit_error ("add --filter=delay on the command line");
@@ -359,6 +430,20 @@ file_config_complete (void)
     }
   }
 
+#ifdef HAVE_IO_URING
+  if (io_mode == io_mode_uring && uring_init () == -1)
+    return -1;
+#endif
+
+#ifdef O_DIRECT
+  if (cache_mode == cache_direct) {
+    size_t i;
+
+    for (i = 0; i < NR_BLOCK_LOCKS; ++i)
+      pthread_rwlock_init (&block_locks[i], NULL);
+  }
+#endif
+
   return 0;
 }
 
@@ -367,8 +452,10 @@ file_config_complete (void)
   "fd=<FILE_DESCRIPTOR>    Serve file attached to file descriptor\n" \
   "dir=<DIRNAME>           A directory containing files to serve\n" \
   "dirfd=<FILE_DESCRIPTOR> Serve dir attached to file descriptor\n" \
-  "cache=<MODE>            Set use of caching (default, none)\n" \
-  "fadvise=<LEVEL>         Set fadvise hint (normal, random, sequential)"
+  "cache=<MODE>            Set use of caching (default, none, direct)\n" \
+  "cache-extents=true      Cache the extent map of files\n" \
+  "fadvise=<LEVEL>         Set fadvise hint (normal, random, sequential)\n" \
+  "io=<MODE>               Set I/O method (sync, uring)"
 
 /* Print some extra information about how the plugin was compiled. */
 static void
@@ -389,12 +476,21 @@ file_dump_plugin (void)
 #ifdef SEEK_HOLE
   printf ("file_extents=yes\n");
 #endif
+#ifdef FS_IOC_FIEMAP
+  printf ("file_fiemap=yes\n");
+#endif
 #ifdef FALLOC_FL_PUNCH_HOLE
   printf ("file_falloc_fl_punch_hole=yes\n");
 #endif
 #ifdef FALLOC_FL_ZERO_RANGE
   printf ("file_falloc_fl_zero_range=yes\n");
 #endif
+#ifdef HAVE_IO_URING
+  printf ("file_io_uring=yes\n");
+#endif
+#ifdef O_DIRECT
+  printf ("file_o_direct=yes\n");
+#endif
 }
 
 /* Common code for listing exports of a directory. */
@@ -479,6 +575,7 @@ struct handle {
   struct stat statbuf;
   bool is_block_device;
   int sector_size;
+  uint32_t direct_align, direct_mem_align; /* 0 unless cache=direct */
   unsigned short rotational;
   uint32_t minimum, preferred, maximum;
   bool can_write;
@@ -486,6 +583,9 @@ struct handle {
   bool can_zero_range;
   bool can_fallocate;
   bool can_zeroout;
+#ifdef SEEK_HOLE
+  struct extcache *extcache;    /* NULL unless cache-extents=true */
+#endif
 };
 
 /* Common code for opening a file by name, used by mode_filename and
@@ -506,6 +606,10 @@ open_file_by_name (struct handle *h, int readonly, int dfd, const char *file)
   }
 
   flags = O_CLOEXEC|O_NOCTTY;
+#ifdef O_DIRECT
+  if (cache_mode == cache_direct)
+    flags |= O_DIRECT;
+#endif
   if (readonly)
     flags |= O_RDONLY;
   else
@@ -527,6 +631,51 @@ open_file_by_name (struct handle *h, int readonly, int dfd, const char *file)
   return 0;
 }
 
+#ifdef O_DIRECT
+/* With cache=direct, work out the alignment that O_DIRECT requires
+ * for the file offset and length, and for the memory buffer.  For
+ * block devices this is the logical block size.  For regular files
+ * we ask the filesystem if we can, else assume 4K which should be
+ * safe everywhere.
+ */
+static int
+get_direct_align (struct handle *h, const char *file)
+{
+  h->direct_align = h->direct_mem_align = h->sector_size;
+
+#ifdef STATX_DIOALIGN
+  if (!h->is_block_device) {
+    struct statx stx;
+
+    if (statx (h->fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+        (stx.stx_mask & STATX_DIOALIGN) != 0) {
+      if (stx.stx_dio_offset_align == 0) {
+        nbdkit_error ("%s: the filesystem does not support O_DIRECT", file);
+        return -1;
+      }
+      h->direct_align = stx.stx_dio_offset_align;
+      h->direct_mem_align = stx.stx_dio_mem_align;
+    }
+  }
+#endif
+
+  if (h->direct_align < 512 || h->direct_align > 65536 ||
+      !is_power_of_2 (h->direct_align) ||
+      h->direct_mem_align > h->direct_align ||
+      !is_power_of_2 (h->direct_mem_align)) {
+    nbdkit_error ("%s: unsupported O_DIRECT alignment: offset %" PRIu32
+                  ", memory %" PRIu32,
+                  file, h->direct_align, h->direct_mem_align);
+    return -1;
+  }
+
+  nbdkit_debug ("%s: O_DIRECT alignment: offset %" PRIu32
+                ", memory %" PRIu32,
+                file, h->direct_align, h->direct_mem_align);
+  return 0;
+}
+#endif /* O_DIRECT */
+
 /* Create the per-connection handle. */
 static void *
 file_open (int readonly)
@@ -606,6 +755,21 @@ file_open (int readonly)
       nbdkit_debug ("file descriptor is write-only (ie. not readable): "
                     "NBD protocol does not support this, but continuing "
                     "anyway!");
+
+#ifdef O_DIRECT
+    /* The status flags are shared with the caller's file descriptor,
+     * so this also affects it.
+     */
+    if (cache_mode == cache_direct) {
+      r = fcntl (h->fd, F_GETFL);
+      if (r == -1 || fcntl (h->fd, F_SETFL, r | O_DIRECT) == -1) {
+        nbdkit_error ("fcntl: F_SETFL: O_DIRECT: %m");
+        close (h->fd);
+        free (h);
+        return NULL;
+      }
+    }
+#endif
     break;
   }
 
@@ -678,6 +842,15 @@ file_open (int readonly)
   }
 #endif
 
+  h->direct_align = h->direct_mem_align = 0;
+#ifdef O_DIRECT
+  if (cache_mode == cache_direct && get_direct_align (h, file) == -1) {
+    close (h->fd);
+    free (h);
+    return NULL;
+  }
+#endif
+
   h->rotational = 0; /* Default before nbdkit 1.40 */
 #ifdef BLKROTATIONAL
   if (h->is_block_device) {
@@ -727,6 +900,19 @@ file_open (int readonly)
   h->can_fallocate = true;
   h->can_zeroout = h->is_block_device;
 
+#ifdef SEEK_HOLE
+  h->extcache = NULL;
+  if (cache_extents && !h->is_block_device) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lseek_lock);
+    h->extcache = extcache_get (h->fd, &h->statbuf);
+    if (h->extcache == NULL) {
+      close (h->fd);
+      free (h);
+      return NULL;
+    }
+  }
+#endif
+
   return h;
 }
 
@@ -738,6 +924,10 @@ file_close (void *handle)
 
 #ifdef EVICT_WRITES
   remove_fd_from_window (h->fd);
+#endif
+#ifdef SEEK_HOLE
+  if (h->extcache)
+    extcache_put (h->extcache);
 #endif
   close (h->fd);
   free (h);
@@ -780,6 +970,15 @@ file_block_size (void *handle, uint32_t *minimum,
   *minimum = h->minimum;
   *preferred = h->preferred;
   *maximum = h->maximum;
+
+  /* With cache=direct, ask clients to send aligned requests so we
+   * don't need a bounce buffer.
+   */
+  if (h->direct_align) {
+    *minimum = MAX (*minimum, h->direct_align);
+    *preferred = MAX (*preferred, MAX (*minimum, 4096));
+    *maximum = 0xffffffff;
+  }
   return 0;
 }
 
@@ -823,6 +1022,10 @@ file_can_fua (void *handle)
 static int
 file_can_cache (void *handle)
 {
+  /* With cache=direct there is no page cache to populate. */
+  if (cache_mode == cache_direct)
+    return NBDKIT_CACHE_NONE;
+
   /* Prefer posix_fadvise(), but letting nbdkit call .pread on our
    * behalf also tends to work well for the local file system
    * cache.
@@ -834,13 +1037,44 @@ file_can_cache (void *handle)
 #endif
 }
 
+/* Wrappers around the system calls which use io_uring if io=uring. */
+static ssize_t
+do_pread (int fd, void *buf, size_t count, off_t offset)
+{
+#ifdef HAVE_IO_URING
+  if (io_mode == io_mode_uring)
+    return uring_pread (fd, buf, count, offset);
+#endif
+  return pread (fd, buf, count, offset);
+}
+
+static ssize_t
+do_pwrite (int fd, const void *buf, size_t count, off_t offset)
+{
+#ifdef HAVE_IO_URING
+  if (io_mode == io_mode_uring)
+    return uring_pwrite (fd, buf, count, offset, false);
+#endif
+  return pwrite (fd, buf, count, offset);
+}
+
+static int
+do_fdatasync (int fd)
+{
+#ifdef HAVE_IO_URING
+  if (io_mode == io_mode_uring)
+    return uring_fdatasync (fd);
+#endif
+  return fdatasync (fd);
+}
+
 /* Flush the file to disk. */
 static int
 file_flush (void *handle, uint32_t flags)
 {
   struct handle *h = handle;
 
-  if (fdatasync (h->fd) == -1) {
+  if (do_fdatasync (h->fd) == -1) {
     nbdkit_error ("fdatasync: %m");
     return -1;
   }
@@ -848,6 +1082,220 @@ file_flush (void *handle, uint32_t flags)
   return 0;
 }
 
+#ifdef O_DIRECT
+/* With cache=direct, requests which don't meet the O_DIRECT alignment
+ * requirements go through an aligned bounce buffer.  Aligned requests
+ * (the common case, since we advertise the alignment as the minimum
+ * block size) go straight to the file.
+ */
+#define BOUNCE_SIZE (1024 * 1024)
+
+static bool
+is_direct_aligned (struct handle *h, const void *buf,
+                   uint32_t count, uint64_t offset)
+{
+  return IS_ALIGNED (offset | count, h->direct_align) &&
+    IS_ALIGNED ((uintptr_t) buf, h->direct_mem_align);
+}
+
+/* Lock the blocks touched by the range, see block_locks.  Locks are
+ * always taken in array order to avoid deadlock.
+ */
+static void
+lock_blocks (struct handle *h, uint32_t count, uint64_t offset,
+             struct held_locks *held)
+{
+  const uint64_t first = offset / h->direct_align;
+  const uint64_t last = (offset + count - 1) / h->direct_align;
+  uint64_t b;
+  size_t i;
+
+  held->shared = held->exclusive = 0;
+  if (count == 0)
+    return;
+
+  if (!IS_ALIGNED (offset, h->direct_align))
+    held->exclusive |= UINT64_C (1) << (first % NR_BLOCK_LOCKS);
+  if (!IS_ALIGNED (offset + count, h->direct_align))
+    held->exclusive |= UINT64_C (1) << (last % NR_BLOCK_LOCKS);
+  for (b = first; b <= last && b - first < NR_BLOCK_LOCKS; ++b)
+    held->shared |= UINT64_C (1) << (b % NR_BLOCK_LOCKS);
+  held->shared &= ~held->exclusive;
+
+  for (i = 0; i < NR_BLOCK_LOCKS; ++i) {
+    if (held->exclusive & (UINT64_C (1) << i))
+      pthread_rwlock_wrlock (&block_locks[i]);
+    else if (held->shared & (UINT64_C (1) << i))
+      pthread_rwlock_rdlock (&block_locks[i]);
+  }
+}
+
+static void
+unlock_blocks (struct held_locks *held)
+{
+  size_t i;
+
+  for (i = 0; i < NR_BLOCK_LOCKS; ++i) {
+    if ((held->shared | held->exclusive) & (UINT64_C (1) << i))
+      pthread_rwlock_unlock (&block_locks[i]);
+  }
+}
+
+/* Allocate a bounce buffer big enough for the aligned span of count
+ * bytes, but no larger than BOUNCE_SIZE.
+ */
+static void *
+alloc_bounce (struct handle *h, uint32_t count, size_t *size_rtn)
+{
+  void *bounce;
+  int r;
+
+  *size_rtn = MIN (ROUND_UP ((uint64_t) count, h->direct_align) +
+                   h->direct_align,
+                   BOUNCE_SIZE);
+  r = posix_memalign (&bounce, h->direct_align, *size_rtn);
+  if (r != 0) {
+    errno = r;
+    nbdkit_error ("posix_memalign: %m");
+    return NULL;
+  }
+  return bounce;
+}
+
+/* Read an aligned range into the bounce buffer.  This returns the
+ * number of bytes read, which is short only at the end of the file.
+ */
+static ssize_t
+read_aligned (struct handle *h, char *bounce, size_t len, uint64_t start)
+{
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t r = do_pread (h->fd, bounce + done, len - done, start + done);
+    if (r == -1) {
+      nbdkit_error ("pread: %m");
+      return -1;
+    }
+    done += r;
+    /* O_DIRECT only returns a short read at the end of the file. */
+    if (r == 0 || !IS_ALIGNED (done, h->direct_align))
+      break;
+  }
+  return done;
+}
+
+static int
+direct_pread (struct handle *h, void *buf, uint32_t count, uint64_t offset)
+{
+  CLEANUP_FREE char *bounce = NULL;
+  size_t bounce_size;
+
+  bounce = alloc_bounce (h, count, &bounce_size);
+  if (bounce == NULL)
+    return -1;
+
+  while (count > 0) {
+    const uint64_t start = ROUND_DOWN (offset, h->direct_align);
+    const size_t skip = offset - start;
+    const size_t n = MIN (count, bounce_size - skip);
+    const size_t len = ROUND_UP (skip + n, h->direct_align);
+    ssize_t r;
+
+    r = read_aligned (h, bounce, len, start);
+    if (r == -1)
+      return -1;
+    if (r < skip + n) {
+      nbdkit_error ("pread: unexpected end of file");
+      return -1;
+    }
+    memcpy (buf, bounce + skip, n);
+
+    buf += n;
+    count -= n;
+    offset += n;
+  }
+
+  return 0;
+}
+
+static int
+direct_pwrite (struct handle *h, const void *buf,
+               uint32_t count, uint64_t offset)
+{
+  CLEANUP_FREE char *bounce = NULL;
+  size_t bounce_size;
+  struct held_locks held;
+  int ret = -1;
+
+  bounce = alloc_bounce (h, count, &bounce_size);
+  if (bounce == NULL)
+    return -1;
+
+  lock_blocks (h, count, offset, &held);
+
+  while (count > 0) {
+    const uint64_t start = ROUND_DOWN (offset, h->direct_align);
+    const size_t skip = offset - start;
+    const size_t n = MIN (count, bounce_size - skip);
+    const size_t len = ROUND_UP (skip + n, h->direct_align);
+    const size_t tail = len - h->direct_align;
+    struct stat statbuf;
+    bool truncate = false;
+    size_t done;
+
+    /* Read the partial blocks at each end.  Anything past the end of
+     * the file reads as zeroes.
+     */
+    if (skip > 0 || skip + n < len) {
+      memset (bounce, 0, len);
+      if (skip > 0 &&
+          read_aligned (h, bounce, h->direct_align, start) == -1)
+        goto out;
+      if (skip + n < len && (skip == 0 || tail > 0) &&
+          read_aligned (h, bounce + tail, h->direct_align,
+                        start + tail) == -1)
+        goto out;
+    }
+    memcpy (bounce + skip, buf, n);
+
+    /* Writing the whole of the last block of a regular file whose
+     * size is not aligned would extend it, so we must truncate it
+     * back afterwards.
+     */
+    if (!h->is_block_device && skip + n < len) {
+      if (fstat (h->fd, &statbuf) == -1) {
+        nbdkit_error ("fstat: %m");
+        goto out;
+      }
+      truncate = start + len > statbuf.st_size;
+    }
+
+    for (done = 0; done < len; ) {
+      ssize_t r = do_pwrite (h->fd, bounce + done, len - done, start + done);
+      if (r == -1) {
+        nbdkit_error ("pwrite: %m");
+        goto out;
+      }
+      done += r;
+    }
+
+    if (truncate && ftruncate (h->fd, statbuf.st_size) == -1) {
+      nbdkit_error ("ftruncate: %m");
+      goto out;
+    }
+
+    buf += n;
+    count -= n;
+    offset += n;
+  }
+  ret = 0;
+
+ out:
+  unlock_blocks (&held);
+  return ret;
+}
+#endif /* O_DIRECT */
+
 /* Read data from the file. */
 static int
 file_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
@@ -859,8 +1307,13 @@ file_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   uint64_t orig_offset = offset;
 #endif
 
+#ifdef O_DIRECT
+  if (h->direct_align && !is_direct_aligned (h, buf, count, offset))
+    return direct_pread (h, buf, count, offset);
+#endif
+
   while (count > 0) {
-    ssize_t r = pread (h->fd, buf, count, offset);
+    ssize_t r = do_pread (h->fd, buf, count, offset);
     if (r == -1) {
       nbdkit_error ("pread: %m");
       return -1;
@@ -883,20 +1336,50 @@ file_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   return 0;
 }
 
-/* Write data to the file. */
+/* Let the server send data straight from the file to the client. */
 static int
-file_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
-             uint32_t flags)
+file_pread_fd (void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+               int *fd, uint64_t *fd_offset)
 {
   struct handle *h = handle;
 
-#if EVICT_WRITES
-  uint32_t orig_count = count;
-  uint64_t orig_offset = offset;
+  /* With cache=none, .pread must evict the pages after reading.
+   * With cache=direct, reads must bypass the page cache.  With
+   * io=uring, reads should go through io_uring.
+   */
+  if (cache_mode != cache_default || io_mode == io_mode_uring)
+    return 0;
+
+  *fd = h->fd;
+  *fd_offset = offset;
+  return 0;
+}
+
+/* Write the whole range.  With io=uring this may submit the flush
+ * with the writes, in which case NBDKIT_FLAG_FUA is cleared in *flags.
+ */
+static int
+write_range (struct handle *h, const void *buf, uint32_t count,
+             uint64_t offset, uint32_t *flags)
+{
+#ifdef HAVE_IO_URING
+  /* io_uring can submit the flush with the writes. */
+  if (io_mode == io_mode_uring && (*flags & NBDKIT_FLAG_FUA)) {
+    ssize_t r = uring_pwrite (h->fd, buf, count, offset, true);
+    if (r == -1) {
+      nbdkit_error ("pwrite: %m");
+      return -1;
+    }
+    if (r == count)
+      *flags &= ~NBDKIT_FLAG_FUA;
+    buf += r;
+    count -= r;
+    offset += r;
+  }
 #endif
 
   while (count > 0) {
-    ssize_t r = pwrite (h->fd, buf, count, offset);
+    ssize_t r = do_pwrite (h->fd, buf, count, offset);
     if (r == -1) {
       nbdkit_error ("pwrite: %m");
       return -1;
@@ -906,6 +1389,54 @@ file_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
     offset += r;
   }
 
+  return 0;
+}
+
+/* Write data to the file. */
+static int
+file_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
+             uint32_t flags)
+{
+  struct handle *h = handle;
+  int r;
+
+#if EVICT_WRITES
+  uint32_t orig_count = count;
+  uint64_t orig_offset = offset;
+#endif
+
+#ifdef O_DIRECT
+  if (h->direct_align) {
+    struct held_locks held;
+
+    if (!is_direct_aligned (h, buf, count, offset))
+      r = direct_pwrite (h, buf, count, offset);
+    else {
+      lock_blocks (h, count, offset, &held);
+      r = write_range (h, buf, count, offset, &flags);
+      unlock_blocks (&held);
+    }
+  }
+  else
+#endif
+    r = write_range (h, buf, count, offset, &flags);
+
+#ifdef SEEK_HOLE
+  /* Update the extent cache after writing, so that if the range is
+   * zeroed or trimmed at the same time the cache may show data where
+   * there is a hole, which is safe, but never the reverse (see
+   * do_zero).  Even a failed write may have written some data.
+   */
+  if (h->extcache) {
+    int err = errno;
+
+    extcache_update (h->extcache, offset, count, 0);
+    errno = err;
+  }
+#endif
+  if (r == -1)
+    return -1;
+
   if ((flags & NBDKIT_FLAG_FUA) && file_flush (handle, 0) == -1)
     return -1;
 
@@ -921,7 +1452,14 @@ file_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
 static int
 do_fallocate (int fd, int mode_, off_t offset, off_t len)
 {
-  int r = fallocate (fd, mode_, offset, len);
+  int r;
+
+#ifdef HAVE_IO_URING
+  if (io_mode == io_mode_uring)
+    r = uring_fallocate (fd, mode_, offset, len);
+  else
+#endif
+    r = fallocate (fd, mode_, offset, len);
   if (r == -1 && errno == ENODEV) {
     /* kernel 3.10 fails with ENODEV for block device. Kernel >= 4.9 fails
        with EOPNOTSUPP in this case. Normalize errno to simplify callers. */
@@ -931,11 +1469,14 @@ do_fallocate (int fd, int mode_, off_t offset, off_t len)
 }
 #endif
 
-/* Write zeroes to the file. */
+/* Zero the range using whichever method works, setting *type to the
+ * type of the range afterwards for the extent cache.
+ */
 static int
-file_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
+zero_range (struct handle *h, uint32_t count, uint64_t offset,
+            uint32_t flags, uint32_t *type)
 {
-  struct handle *h __attribute__ ((unused)) = handle;
+  *type = NBDKIT_EXTENT_ZERO;
 
 #ifdef FALLOC_FL_PUNCH_HOLE
   if (h->can_punch_hole && (flags & NBDKIT_FLAG_MAY_TRIM)) {
@@ -947,7 +1488,8 @@ file_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
       if (file_debug_zero)
         nbdkit_debug ("h->can_punch_hole && may_trim: "
                       "zero succeeded using fallocate");
-      goto out;
+      *type = NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO;
+      return 0;
     }
 
     if (!is_enotsup (errno)) {
@@ -968,7 +1510,7 @@ file_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
       if (file_debug_zero)
         nbdkit_debug ("h->can_zero-range: "
                       "zero succeeded using fallocate");
-      goto out;
+      return 0;
     }
 
     if (!is_enotsup (errno)) {
@@ -995,7 +1537,7 @@ file_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
         if (file_debug_zero)
           nbdkit_debug ("h->can_punch_hole && h->can_fallocate: "
                         "zero succeeded using fallocate");
-        goto out;
+        return 0;
       }
 
       if (!is_enotsup (errno)) {
@@ -1026,7 +1568,7 @@ file_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
       if (file_debug_zero)
         nbdkit_debug ("h->can_zeroout && IS_ALIGNED: "
                       "zero succeeded using BLKZEROOUT");
-      goto out;
+      return 0;
     }
 
     if (errno != ENOTTY) {
@@ -1043,27 +1585,86 @@ file_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
     nbdkit_debug ("zero falling back to writing");
   errno = EOPNOTSUPP;
   return -1;
+}
 
-#ifdef __clang__
-  __attribute__ ((unused))
+/* Write zeroes to the file. */
+static int
+do_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
+{
+  struct handle *h = handle;
+  uint32_t type __attribute__ ((unused));
+  int r;
+
+#ifdef SEEK_HOLE
+  /* A write which lands after the range is zeroed but before the
+   * extent cache is updated would otherwise be hidden by the update.
+   */
+  if (h->extcache)
+    extcache_lock (h->extcache);
 #endif
-    out:
+  r = zero_range (h, count, offset, flags, &type);
+#ifdef SEEK_HOLE
+  if (h->extcache) {
+    if (r == 0)
+      extcache_set_range (h->extcache, offset, count, type);
+    extcache_unlock (h->extcache);
+  }
+#endif
+  if (r == -1)
+    return -1;
+
   if ((flags & NBDKIT_FLAG_FUA) && file_flush (handle, 0) == -1)
     return -1;
   return 0;
 }
 
+static int
+file_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
+{
+#ifdef O_DIRECT
+  struct handle *h = handle;
+
+  /* The kernel zeroes partial blocks itself, which would race with
+   * the read-modify-write cycle in direct_pwrite.
+   */
+  if (h->direct_align) {
+    struct held_locks held;
+    int r;
+
+    lock_blocks (h, count, offset, &held);
+    r = do_zero (handle, count, offset, flags);
+    unlock_blocks (&held);
+    return r;
+  }
+#endif
+
+  return do_zero (handle, count, offset, flags);
+}
+
 /* Punch a hole in the file. */
 static int
-file_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
+do_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
 #ifdef FALLOC_FL_PUNCH_HOLE
   struct handle *h = handle;
   int r;
 
   if (h->can_punch_hole) {
+#ifdef SEEK_HOLE
+    /* Hold the extent cache locked until it is updated, see do_zero. */
+    if (h->extcache)
+      extcache_lock (h->extcache);
+#endif
     r = do_fallocate (h->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
                       offset, count);
+#ifdef SEEK_HOLE
+    if (h->extcache) {
+      if (r == 0)
+        extcache_set_range (h->extcache, offset, count,
+                            NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO);
+      extcache_unlock (h->extcache);
+    }
+#endif
     if (r == -1) {
       /* Trim is advisory; we don't care if it fails for anything other
        * than EIO or EPERM. */
@@ -1086,6 +1687,27 @@ file_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
   return 0;
 }
 
+static int
+file_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
+{
+#ifdef O_DIRECT
+  struct handle *h = handle;
+
+  /* See file_zero. */
+  if (h->direct_align) {
+    struct held_locks held;
+    int r;
+
+    lock_blocks (h, count, offset, &held);
+    r = do_trim (handle, count, offset, flags);
+    unlock_blocks (&held);
+    return r;
+  }
+#endif
+
+  return do_trim (handle, count, offset, flags);
+}
+
 #ifdef SEEK_HOLE
 /* Extents. */
 
@@ -1172,6 +1794,15 @@ static int
 file_extents (void *handle, uint32_t count, uint64_t offset,
               uint32_t flags, struct nbdkit_extents *extents)
 {
+  struct handle *h = handle;
+
+  if (h->extcache) {
+    int r = extcache_extents (h->extcache, count, offset,
+                              flags & NBDKIT_FLAG_REQ_ONE, extents);
+    if (r <= 0)
+      return r;
+  }
+
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lseek_lock);
   return do_extents (handle, count, offset, flags, extents);
 }
@@ -1218,6 +1849,7 @@ static struct nbdkit_plugin plugin = {
   .can_fua           = file_can_fua,
   .can_cache         = file_can_cache,
   .pread             = file_pread,
+  .pread_fd          = file_pread_fd,
   .pwrite            = file_pwrite,
   .flush             = file_flush,
   .trim              = file_trim,
@@ -0,0 +1,498 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/* io_uring support for the file plugin (io=uring parameter).
+ *
+ * nbdkit plugin callbacks are synchronous, so each thread has its
+ * own ring, submits the operations for one request, and waits for
+ * them to complete.  We use the system calls directly because this is
+ * simple enough not to need liburing.
+ *
+ * The advantage over ordinary pread and pwrite comes from splitting
+ * large requests into several operations which are submitted with a
+ * single system call, so a single thread can keep several I/Os in
+ * flight.  Write requests with the FUA flag submit the fdatasync in
+ * the same batch as the writes.
+ *
+ * We cannot use registered buffers because the buffers are allocated
+ * by the server, differently for each request.  We don't register
+ * the file descriptors either (fixed files): the rings belong to
+ * threads, which serve different handles, so a registration could
+ * outlive the handle and its file descriptor number could be reused
+ * for another file.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <pthread.h>
+
+#define NBDKIT_API_VERSION 2
+#include <nbdkit-plugin.h>
+
+#include "minmax.h"
+#include "rounding.h"
+
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+/* Size of each ring, which is also the maximum number of operations
+ * submitted for one request.
+ */
+#define QUEUE_DEPTH 64
+
+/* Requests are split into operations of at least this size. */
+#define MIN_CHUNK (128 * 1024)
+
+struct ring {
+  int fd;
+
+  /* Submission queue. */
+  void *sq_ptr;
+  size_t sq_len;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  unsigned tail;                /* Our copy of *sq_tail. */
+
+  /* Completion queue. */
+  void *cq_ptr;
+  size_t cq_len;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+static pthread_key_t ring_key;
+
+static void
+free_ring (void *vp)
+{
+  struct ring *r = vp;
+
+  if (r) {
+    if (r->sqes)
+      munmap (r->sqes, r->sqes_len);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+      munmap (r->cq_ptr, r->cq_len);
+    if (r->sq_ptr)
+      munmap (r->sq_ptr, r->sq_len);
+    if (r->fd >= 0)
+      close (r->fd);
+    free (r);
+  }
+}
+
+/* Create a ring.  On error returns NULL with errno set. */
+static struct ring *
+create_ring (void)
+{
+  struct io_uring_params p;
+  struct ring *r;
+  int saved_errno;
+
+  r = calloc (1, sizeof *r);
+  if (r == NULL)
+    return NULL;
+
+  memset (&p, 0, sizeof p);
+  r->fd = syscall (__NR_io_uring_setup, QUEUE_DEPTH, &p);
+  if (r->fd == -1)
+    goto err;
+
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->sq_len = r->cq_len = MAX (r->sq_len, r->cq_len);
+
+  r->sq_ptr = mmap (NULL, r->sq_len, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED) {
+    r->sq_ptr = NULL;
+    goto err;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_ptr = r->sq_ptr;
+  else {
+    r->cq_ptr = mmap (NULL, r->cq_len, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ptr == MAP_FAILED) {
+      r->cq_ptr = NULL;
+      goto err;
+    }
+  }
+  r->sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+  r->sqes = mmap (NULL, r->sqes_len, PROT_READ|PROT_WRITE,
+                  MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    r->sqes = NULL;
+    goto err;
+  }
+
+  r->sq_head = r->sq_ptr + p.sq_off.head;
+  r->sq_tail = r->sq_ptr + p.sq_off.tail;
+  r->sq_mask = r->sq_ptr + p.sq_off.ring_mask;
+  r->sq_array = r->sq_ptr + p.sq_off.array;
+  r->tail = *r->sq_tail;
+  r->cq_head = r->cq_ptr + p.cq_off.head;
+  r->cq_tail = r->cq_ptr + p.cq_off.tail;
+  r->cq_mask = r->cq_ptr + p.cq_off.ring_mask;
+  r->cqes = r->cq_ptr + p.cq_off.cqes;
+  return r;
+
+ err:
+  saved_errno = errno;
+  free_ring (r);
+  errno = saved_errno;
+  return NULL;
+}
+
+/* Get the ring for the current thread, creating it if necessary. */
+static struct ring *
+get_ring (void)
+{
+  struct ring *r;
+
+  r = pthread_getspecific (ring_key);
+  if (r == NULL) {
+    r = create_ring ();
+    if (r == NULL)
+      return NULL;
+    errno = pthread_setspecific (ring_key, r);
+    if (errno != 0) {
+      free_ring (r);
+      return NULL;
+    }
+  }
+  return r;
+}
+
+/* If a system call fails the state of the ring is unknown, so throw
+ * it away.  The next call will create a new ring.
+ */
+static void
+discard_ring (struct ring *r)
+{
+  int saved_errno = errno;
+
+  pthread_setspecific (ring_key, NULL);
+  free_ring (r);
+  errno = saved_errno;
+}
+
+/* Return the next submission queue entry. */
+static struct io_uring_sqe *
+next_sqe (struct ring *r)
+{
+  const unsigned i = r->tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[i];
+
+  memset (sqe, 0, sizeof *sqe);
+  r->sq_array[i] = i;
+  r->tail++;
+  return sqe;
+}
+
+/* Submit the queued operations and wait for nr completions, which are
+ * returned in res[user_data].  On error the ring is discarded and -1
+ * is returned with errno set.
+ */
+static int
+submit_and_wait (struct ring *r, unsigned nr, int *res)
+{
+  unsigned head, pending, ready;
+  struct io_uring_cqe *cqe;
+
+  __atomic_store_n (r->sq_tail, r->tail, __ATOMIC_RELEASE);
+
+  for (;;) {
+    pending = r->tail - __atomic_load_n (r->sq_head, __ATOMIC_ACQUIRE);
+    ready = __atomic_load_n (r->cq_tail, __ATOMIC_ACQUIRE) - *r->cq_head;
+    if (pending == 0 && ready >= nr)
+      break;
+    if (syscall (__NR_io_uring_enter, r->fd, pending, nr,
+                 IORING_ENTER_GETEVENTS, NULL, 0) == -1 &&
+        errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      discard_ring (r);
+      return -1;
+    }
+  }
+
+  head = *r->cq_head;
+  for (; nr > 0; nr--, head++) {
+    cqe = &r->cqes[head & *r->cq_mask];
+    res[cqe->user_data] = cqe->res;
+  }
+  __atomic_store_n (r->cq_head, head, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Complete a short read or write. */
+static ssize_t
+finish_rw (bool is_write, int fd, void *buf, size_t count, off_t offset)
+{
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < count) {
+    if (is_write)
+      n = pwrite (fd, buf + done, count - done, offset + done);
+    else
+      n = pread (fd, buf + done, count - done, offset + done);
+    if (n == -1)
+      return -1;
+    if (n == 0)
+      break;
+    done += n;
+  }
+  return done;
+}
+
+static ssize_t
+do_rw (bool is_write, int fd, void *buf, size_t count, off_t offset,
+       bool sync)
+{
+  struct ring *r;
+  struct io_uring_sqe *sqe;
+  int res[QUEUE_DEPTH];
+  size_t chunk, len, done;
+  ssize_t n;
+  unsigned i, nr;
+  bool short_write = false;
+
+  if (count == 0)
+    return 0;
+
+  r = get_ring ();
+  if (r == NULL)
+    return -1;
+
+  /* Split the request, leaving space for the fdatasync. */
+  chunk = MAX (MIN_CHUNK, ROUND_UP (DIV_ROUND_UP (count, QUEUE_DEPTH-1),
+                                    4096));
+  nr = DIV_ROUND_UP (count, chunk);
+  for (i = 0; i < nr; ++i) {
+    sqe = next_sqe (r);
+    sqe->opcode = is_write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buf + i * chunk;
+    sqe->len = MIN (chunk, count - i * chunk);
+    sqe->off = offset + i * chunk;
+    sqe->user_data = i;
+  }
+  if (sync) {
+    /* IOSQE_IO_DRAIN makes this wait for the writes. */
+    sqe = next_sqe (r);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->flags = IOSQE_IO_DRAIN;
+    sqe->fd = fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = nr;
+  }
+
+  if (submit_and_wait (r, nr + sync, res) == -1)
+    return -1;
+
+  for (i = 0, done = 0; i < nr; ++i, done += len) {
+    len = MIN (chunk, count - i * chunk);
+    if (res[i] < 0) {
+      errno = -res[i];
+      return -1;
+    }
+    if (res[i] < len) {
+      n = finish_rw (is_write, fd, buf + done + res[i], len - res[i],
+                     offset + done + res[i]);
+      if (n == -1)
+        return -1;
+      if (res[i] + n < len)     /* end of file */
+        return done + res[i] + n;
+      short_write = is_write;
+    }
+  }
+
+  if (sync) {
+    if (res[nr] < 0) {
+      errno = -res[nr];
+      return -1;
+    }
+    /* The fdatasync may have run before the short writes were
+     * finished.
+     */
+    if (short_write && fdatasync (fd) == -1)
+      return -1;
+  }
+
+  return count;
+}
+
+ssize_t
+uring_pread (int fd, void *buf, size_t count, off_t offset)
+{
+  return do_rw (false, fd, buf, count, offset, false);
+}
+
+ssize_t
+uring_pwrite (int fd, const void *buf, size_t count, off_t offset,
+              bool sync)
+{
+  return do_rw (true, fd, (void *) buf, count, offset, sync);
+}
+
+int
+uring_fdatasync (int fd)
+{
+  struct ring *r;
+  struct io_uring_sqe *sqe;
+  int res;
+
+  r = get_ring ();
+  if (r == NULL)
+    return -1;
+
+  sqe = next_sqe (r);
+  sqe->opcode = IORING_OP_FSYNC;
+  sqe->fd = fd;
+  sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+  sqe->user_data = 0;
+  if (submit_and_wait (r, 1, &res) == -1)
+    return -1;
+  if (res < 0) {
+    errno = -res;
+    return -1;
+  }
+  return 0;
+}
+
+int
+uring_fallocate (int fd, int mode, off_t offset, off_t len)
+{
+  struct ring *r;
+  struct io_uring_sqe *sqe;
+  int res;
+
+  r = get_ring ();
+  if (r == NULL)
+    return -1;
+
+  sqe = next_sqe (r);
+  sqe->opcode = IORING_OP_FALLOCATE;
+  sqe->fd = fd;
+  sqe->off = offset;
+  sqe->addr = len;
+  sqe->len = mode;
+  sqe->user_data = 0;
+  if (submit_and_wait (r, 1, &res) == -1)
+    return -1;
+  if (res < 0) {
+    errno = -res;
+    return -1;
+  }
+  return 0;
+}
+
+int
+uring_init (void)
+{
+  static const unsigned ops[] = {
+    IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_FALLOCATE
+  };
+  const size_t probe_len =
+    sizeof (struct io_uring_probe) +
+    IORING_OP_LAST * sizeof (struct io_uring_probe_op);
+  struct io_uring_probe *probe;
+  struct ring *r;
+  size_t i;
+  int err;
+
+  /* Check that we can create a ring (io_uring may be disabled or
+   * blocked by seccomp) and that the kernel supports the operations
+   * we need.
+   */
+  r = create_ring ();
+  if (r == NULL) {
+    nbdkit_error ("io=uring: io_uring_setup: %m");
+    return -1;
+  }
+  probe = calloc (1, probe_len);
+  if (probe == NULL) {
+    nbdkit_error ("calloc: %m");
+    free_ring (r);
+    return -1;
+  }
+  if (syscall (__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE,
+               probe, IORING_OP_LAST) == -1) {
+    nbdkit_error ("io=uring: the kernel is too old: "
+                  "io_uring_register: IORING_REGISTER_PROBE: %m");
+    goto err;
+  }
+  for (i = 0; i < sizeof ops / sizeof ops[0]; ++i) {
+    if (ops[i] > probe->last_op ||
+        !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+      nbdkit_error ("io=uring: the kernel does not support "
+                    "io_uring operation %u", ops[i]);
+      goto err;
+    }
+  }
+  free (probe);
+  free_ring (r);
+
+  err = pthread_key_create (&ring_key, free_ring);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_key_create: %m");
+    return -1;
+  }
+  return 0;
+
+ err:
+  free (probe);
+  free_ring (r);
+  return -1;
+}
+
+void
+uring_unload (void)
+{
+  pthread_key_delete (ring_key);
+}
+
+#endif /* HAVE_IO_URING */
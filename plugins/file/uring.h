@@ -0,0 +1,78 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef NBDKIT_FILE_URING_H
+#define NBDKIT_FILE_URING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* io=uring is only available on Linux if the kernel headers are new
+ * enough (5.6) to have the operations we need.
+ */
+#if defined (__linux__) && defined (__has_include)
+#if __has_include (<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined (__NR_io_uring_setup) && defined (IORING_FEAT_RW_CUR_POS)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+/* Check that io_uring works and set up per-thread rings.  Returns -1
+ * (after calling nbdkit_error) if it does not work.
+ */
+extern int uring_init (void);
+extern void uring_unload (void);
+
+/* These work like the system calls with the same names, returning -1
+ * and setting errno on error.  Each thread has its own ring.
+ *
+ * uring_pread and uring_pwrite split large requests into several
+ * operations which are submitted together, and only return a short
+ * count at the end of the file.  If sync is true, uring_pwrite also
+ * calls fdatasync, submitted in the same batch as the writes.
+ */
+extern ssize_t uring_pread (int fd, void *buf, size_t count, off_t offset);
+extern ssize_t uring_pwrite (int fd, const void *buf, size_t count,
+                             off_t offset, bool sync);
+extern int uring_fdatasync (int fd);
+extern int uring_fallocate (int fd, int mode, off_t offset, off_t len);
+
+#endif /* HAVE_IO_URING */
+
+#endif /* NBDKIT_FILE_URING_H */
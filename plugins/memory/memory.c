@@ -189,6 +189,19 @@ memory_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   return a->f->read (a, buf, count, offset);
 }
 
+/* Let the server receive write data directly into the allocator's
+ * storage where possible.  memory_pwrite is then called with the same
+ * pointer and the allocator skips the copy.
+ */
+static int
+memory_prepare_pwrite (void *handle, uint32_t count, uint64_t offset,
+                       uint32_t flags, void **buf)
+{
+  if (a->f->get_ptr)
+    *buf = a->f->get_ptr (a, count, offset);
+  return 0;
+}
+
 /* Write data. */
 static int
 memory_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
@@ -253,6 +266,7 @@ static struct nbdkit_plugin plugin = {
   .can_cache         = memory_can_cache,
   .can_fast_zero     = memory_can_fast_zero,
   .pread             = memory_pread,
+  .prepare_pwrite    = memory_prepare_pwrite,
   .pwrite            = memory_pwrite,
   .zero              = memory_zero,
   .trim              = memory_trim,
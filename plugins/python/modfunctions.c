@@ -380,6 +380,7 @@ create_nbdkit_module (void)
   ADD_INT_CONSTANT (THREAD_MODEL_SERIALIZE_CONNECTIONS);
   ADD_INT_CONSTANT (THREAD_MODEL_SERIALIZE_ALL_REQUESTS);
   ADD_INT_CONSTANT (THREAD_MODEL_SERIALIZE_REQUESTS);
+  ADD_INT_CONSTANT (THREAD_MODEL_SERIALIZE_RETIREMENT);
   ADD_INT_CONSTANT (THREAD_MODEL_PARALLEL);
 
   ADD_INT_CONSTANT (FLAG_MAY_TRIM);
@@ -37,6 +37,7 @@
 #include <inttypes.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 
 #include <dlfcn.h>
 
@@ -384,11 +385,11 @@ backend_close (struct context *c)
 }
 
 bool
-backend_valid_range (struct context *c, uint64_t offset, uint32_t count)
+backend_valid_range (struct context *c, uint64_t offset, uint64_t count)
 {
   assert (c->exportsize <= INT64_MAX); /* Guaranteed by negotiation phase */
   return count > 0 && offset <= c->exportsize &&
-    offset + count <= c->exportsize;
+    count <= c->exportsize - offset;
 }
 
 /* Wrappers for all callbacks in a filter's struct nbdkit_next_ops. */
@@ -640,6 +641,7 @@ backend_pread (struct context *c,
 {
   PUSH_CONTEXT_FOR_SCOPE (c);
   struct backend *b = c->b;
+  struct timespec start;
   int r;
 
   assert (b->magic == BACKEND_MAGIC);
@@ -649,7 +651,9 @@ backend_pread (struct context *c,
   datapath_debug ("%s: pread count=%" PRIu32 " offset=%" PRIu64,
                   b->name, count, offset);
 
+  metrics_start (&start);
   r = b->pread (c, buf, count, offset, flags, err);
+  metrics_record (b, METRICS_PREAD, &start, r);
   if (r == -1)
     assert (*err);
   return r;
@@ -663,6 +667,7 @@ backend_pwrite (struct context *c,
   PUSH_CONTEXT_FOR_SCOPE (c);
   struct backend *b = c->b;
   bool fua = !!(flags & NBDKIT_FLAG_FUA);
+  struct timespec start;
   int r;
 
   assert (b->magic == BACKEND_MAGIC);
@@ -675,7 +680,125 @@ backend_pwrite (struct context *c,
   datapath_debug ("%s: pwrite count=%" PRIu32 " offset=%" PRIu64 " fua=%d",
                   b->name, count, offset, fua);
 
+  metrics_start (&start);
   r = b->pwrite (c, buf, count, offset, flags, err);
+  metrics_record (b, METRICS_PWRITE, &start, r);
+  if (r == -1)
+    assert (*err);
+  return r;
+}
+
+int
+backend_async_pread (struct context *c,
+                     void *buf, uint32_t count, uint64_t offset,
+                     uint32_t flags, struct nbdkit_request *req, int *err)
+{
+  PUSH_CONTEXT_FOR_SCOPE (c);
+  struct backend *b = c->b;
+  int r;
+
+  assert (b->magic == BACKEND_MAGIC);
+  assert (b->async_pread != NULL);
+  assert (c->handle && (c->state & HANDLE_CONNECTED));
+  assert (backend_valid_range (c, offset, count));
+  assert (flags == 0);
+  datapath_debug ("%s: async_pread count=%" PRIu32 " offset=%" PRIu64,
+                  b->name, count, offset);
+
+  /* The time is recorded by nbdkit_request_complete.  req must not
+   * be touched after the request is started, since it may already
+   * have completed.
+   */
+  req->b = b;
+  metrics_start (&req->start);
+  r = b->async_pread (c, buf, count, offset, flags, req, err);
+  if (r == -1) {
+    metrics_record (b, METRICS_PREAD, &req->start, r);
+    assert (*err);
+  }
+  return r;
+}
+
+int
+backend_async_pwrite (struct context *c,
+                      const void *buf, uint32_t count, uint64_t offset,
+                      uint32_t flags, struct nbdkit_request *req, int *err)
+{
+  PUSH_CONTEXT_FOR_SCOPE (c);
+  struct backend *b = c->b;
+  bool fua = !!(flags & NBDKIT_FLAG_FUA);
+  int r;
+
+  assert (b->magic == BACKEND_MAGIC);
+  assert (b->async_pwrite != NULL);
+  assert (c->handle && (c->state & HANDLE_CONNECTED));
+  assert (c->can_write == 1);
+  assert (backend_valid_range (c, offset, count));
+  assert (!(flags & ~NBDKIT_FLAG_FUA));
+  if (fua)
+    assert (c->can_fua == NBDKIT_FUA_NATIVE);
+  datapath_debug ("%s: async_pwrite count=%" PRIu32 " offset=%" PRIu64
+                  " fua=%d",
+                  b->name, count, offset, fua);
+
+  /* See backend_async_pread. */
+  req->b = b;
+  metrics_start (&req->start);
+  r = b->async_pwrite (c, buf, count, offset, flags, req, err);
+  if (r == -1) {
+    metrics_record (b, METRICS_PWRITE, &req->start, r);
+    assert (*err);
+  }
+  return r;
+}
+
+int
+backend_pread_fd (struct context *c,
+                  uint32_t count, uint64_t offset, uint32_t flags,
+                  int *fd, uint64_t *fd_offset, int *err)
+{
+  PUSH_CONTEXT_FOR_SCOPE (c);
+  struct backend *b = c->b;
+  struct timespec start;
+  int r;
+
+  assert (b->magic == BACKEND_MAGIC);
+  assert (b->pread_fd != NULL);
+  assert (c->handle && (c->state & HANDLE_CONNECTED));
+  assert (backend_valid_range (c, offset, count));
+  assert (flags == 0);
+  datapath_debug ("%s: pread_fd count=%" PRIu32 " offset=%" PRIu64,
+                  b->name, count, offset);
+
+  *fd = -1;
+  metrics_start (&start);
+  r = b->pread_fd (c, count, offset, flags, fd, fd_offset, err);
+  metrics_record (b, METRICS_PREAD, &start, r);
+  if (r == -1)
+    assert (*err);
+  return r;
+}
+
+int
+backend_prepare_pwrite (struct context *c,
+                        uint32_t count, uint64_t offset, uint32_t flags,
+                        void **buf, int *err)
+{
+  PUSH_CONTEXT_FOR_SCOPE (c);
+  struct backend *b = c->b;
+  int r;
+
+  assert (b->magic == BACKEND_MAGIC);
+  assert (b->prepare_pwrite != NULL);
+  assert (c->handle && (c->state & HANDLE_CONNECTED));
+  assert (c->can_write == 1);
+  assert (backend_valid_range (c, offset, count));
+  assert (flags == 0);
+  datapath_debug ("%s: prepare_pwrite count=%" PRIu32 " offset=%" PRIu64,
+                  b->name, count, offset);
+
+  *buf = NULL;
+  r = b->prepare_pwrite (c, count, offset, flags, buf, err);
   if (r == -1)
     assert (*err);
   return r;
@@ -687,6 +810,7 @@ backend_flush (struct context *c,
 {
   PUSH_CONTEXT_FOR_SCOPE (c);
   struct backend *b = c->b;
+  struct timespec start;
   int r;
 
   assert (b->magic == BACKEND_MAGIC);
@@ -695,7 +819,9 @@ backend_flush (struct context *c,
   assert (flags == 0);
   datapath_debug ("%s: flush", b->name);
 
+  metrics_start (&start);
   r = b->flush (c, flags, err);
+  metrics_record (b, METRICS_FLUSH, &start, r);
   if (r == -1)
     assert (*err);
   return r;
@@ -709,6 +835,7 @@ backend_trim (struct context *c,
   PUSH_CONTEXT_FOR_SCOPE (c);
   struct backend *b = c->b;
   bool fua = !!(flags & NBDKIT_FLAG_FUA);
+  struct timespec start;
   int r;
 
   assert (b->magic == BACKEND_MAGIC);
@@ -722,7 +849,9 @@ backend_trim (struct context *c,
   datapath_debug ("%s: trim count=%" PRIu32 " offset=%" PRIu64 " fua=%d",
                   b->name, count, offset, fua);
 
+  metrics_start (&start);
   r = b->trim (c, count, offset, flags, err);
+  metrics_record (b, METRICS_TRIM, &start, r);
   if (r == -1)
     assert (*err);
   return r;
@@ -737,6 +866,7 @@ backend_zero (struct context *c,
   struct backend *b = c->b;
   bool fua = !!(flags & NBDKIT_FLAG_FUA);
   bool fast = !!(flags & NBDKIT_FLAG_FAST_ZERO);
+  struct timespec start;
   int r;
 
   assert (b->magic == BACKEND_MAGIC);
@@ -755,8 +885,11 @@ backend_zero (struct context *c,
                   b->name, count, offset,
                   !!(flags & NBDKIT_FLAG_MAY_TRIM), fua, fast);
 
-  if (c->can_zero == NBDKIT_ZERO_NATIVE)
+  if (c->can_zero == NBDKIT_ZERO_NATIVE) {
+    metrics_start (&start);
     r = b->zero (c, count, offset, flags, err);
+    metrics_record (b, METRICS_ZERO, &start, r);
+  }
   else { /* NBDKIT_ZERO_EMULATE */
     int writeflags = 0;
     bool need_flush = false;
@@ -806,6 +939,7 @@ backend_extents (struct context *c,
 {
   PUSH_CONTEXT_FOR_SCOPE (c);
   struct backend *b = c->b;
+  struct timespec start;
   int r;
 
   assert (b->magic == BACKEND_MAGIC);
@@ -825,7 +959,9 @@ backend_extents (struct context *c,
       *err = errno;
     return r;
   }
+  metrics_start (&start);
   r = b->extents (c, count, offset, flags, extents, err);
+  metrics_record (b, METRICS_EXTENTS, &start, r);
   if (r == -1)
     assert (*err);
   return r;
@@ -838,6 +974,7 @@ backend_cache (struct context *c,
 {
   PUSH_CONTEXT_FOR_SCOPE (c);
   struct backend *b = c->b;
+  struct timespec start;
   int r;
 
   assert (b->magic == BACKEND_MAGIC);
@@ -861,7 +998,9 @@ backend_cache (struct context *c,
     }
     return 0;
   }
+  metrics_start (&start);
   r = b->cache (c, count, offset, flags, err);
+  metrics_record (b, METRICS_CACHE, &start, r);
   if (r == -1)
     assert (*err);
   return r;
@@ -41,17 +41,45 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <time.h>
 
 #ifdef HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
 #endif
 
+#ifndef WIN32
+#include <sys/uio.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#if defined (__linux__) && defined (MSG_ZEROCOPY) && defined (SO_ZEROCOPY)
+#define USE_ZEROCOPY 1
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#endif
+
+#include "poll.h"
+
 #include "internal.h"
 #include "utils.h"
 
 /* Default number of parallel requests. */
 #define DEFAULT_PARALLEL_REQUESTS 16
 
+/* Seconds that an extra worker thread may sit idle before exiting. */
+#define WORKER_IDLE_TIMEOUT 10
+
+/* Read replies at least this large are sent with MSG_ZEROCOPY. */
+#define ZEROCOPY_THRESHOLD (64 * 1024)
+
+/* Buffers waiting for MSG_ZEROCOPY completion before they can be
+ * freed.  If more than this many build up, wait for the oldest.
+ */
+#define ZEROCOPY_MAX_DEFERRED 64
+
 static struct connection *new_connection (int sockin, int sockout,
                                           int nworkers);
 static void free_connection (struct connection *conn);
@@ -60,7 +88,12 @@ static void free_connection (struct connection *conn);
 static int raw_recv ( void *buf, size_t len);
 static int raw_send_socket (const void *buf, size_t len, int flags);
 #ifndef WIN32
+static int raw_sendv_socket (const struct send_iov *iov, size_t n, int flags);
 static int raw_send_other (const void *buf, size_t len, int flags);
+static int raw_sendv_other (const struct send_iov *iov, size_t n, int flags);
+#endif
+#ifdef __linux__
+static int raw_sendfile (int fd, uint64_t offset, size_t len);
 #endif
 static void raw_close (int how);
 
@@ -116,6 +149,86 @@ struct worker_data {
   char *name;
 };
 
+static void start_worker (struct connection *conn);
+
+/* Process requests until the client goes away.  Only one worker at a
+ * time reads from the client.  After reading a request, if no other
+ * worker is free to read the next one, another thread is started (up
+ * to conn->nworkers in total).  The first worker runs in the
+ * connection thread and always stays until the end; the others exit
+ * if they are idle for WORKER_IDLE_TIMEOUT seconds.
+ */
+static void
+worker_loop (struct connection *conn, bool first)
+{
+  struct request req;
+  struct timespec deadline;
+  bool timed_out;
+  int r;
+
+  for (;;) {
+    pthread_mutex_lock (&conn->workers_lock);
+    if (!first) {
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += WORKER_IDLE_TIMEOUT;
+    }
+    timed_out = false;
+    while (conn->reading && !timed_out &&
+           !quit && connection_get_status () > STATUS_CLIENT_DONE) {
+      if (first)
+        pthread_cond_wait (&conn->workers_cond, &conn->workers_lock);
+      else
+        timed_out = pthread_cond_timedwait (&conn->workers_cond,
+                                            &conn->workers_lock,
+                                            &deadline) == ETIMEDOUT;
+    }
+    if (timed_out || quit || connection_get_status () <= STATUS_CLIENT_DONE) {
+      if (!first)
+        conn->nidle--;
+      pthread_mutex_unlock (&conn->workers_lock);
+      if (!first) {
+        /* The connection may be freed as soon as nthreads drops, so
+         * wait for MSG_ZEROCOPY sends from this thread's buffers
+         * first.
+         */
+        threadlocal_wait_zerocopy ();
+        pthread_mutex_lock (&conn->workers_lock);
+        conn->nthreads--;
+        pthread_cond_broadcast (&conn->workers_cond);
+        pthread_mutex_unlock (&conn->workers_lock);
+      }
+      return;
+    }
+    conn->reading = true;
+    pthread_mutex_unlock (&conn->workers_lock);
+
+    r = protocol_recv_request (&req);
+
+    pthread_mutex_lock (&conn->workers_lock);
+    conn->reading = false;
+    if (r == 1) {
+      conn->nidle--;
+      if (conn->nidle == 0 && conn->nthreads < conn->nworkers)
+        start_worker (conn);
+    }
+    pthread_cond_broadcast (&conn->workers_cond);
+    pthread_mutex_unlock (&conn->workers_lock);
+
+    if (r == 0)
+      continue;
+    if (r == -1 || protocol_handle_request_send_reply (&req)) {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
+      conn->close (SHUT_WR);
+    }
+
+    if (r == 1) {
+      pthread_mutex_lock (&conn->workers_lock);
+      conn->nidle++;
+      pthread_mutex_unlock (&conn->workers_lock);
+    }
+  }
+}
+
 static void *
 connection_worker (void *data)
 {
@@ -129,24 +242,59 @@ connection_worker (void *data)
   threadlocal_set_conn (conn);
   free (worker);
 
-  while (!quit && connection_get_status () > STATUS_CLIENT_DONE)
-    if (protocol_recv_request_send_reply ()) {
-      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
-      conn->close (SHUT_WR);
-    }
+  worker_loop (conn, false);
+
   debug ("exiting worker thread %s", threadlocal_get_name ());
   free (name);
   return NULL;
 }
 
+/* Start another worker thread.  Called with workers_lock held.  If
+ * this fails the existing workers carry on, so it is not fatal.
+ */
+static void
+start_worker (struct connection *conn)
+{
+  struct worker_data *worker;
+  pthread_attr_t attrs;
+  pthread_t thread;
+  int err;
+
+  worker = malloc (sizeof *worker);
+  if (unlikely (!worker)) {
+    perror ("malloc");
+    return;
+  }
+  if (unlikely (asprintf (&worker->name, "%s.%u",
+                          top->plugin_name (top), conn->next_worker) < 0)) {
+    perror ("asprintf");
+    free (worker);
+    return;
+  }
+  worker->conn = conn;
+
+  pthread_attr_init (&attrs);
+  pthread_attr_setdetachstate (&attrs, PTHREAD_CREATE_DETACHED);
+  err = pthread_create (&thread, &attrs, connection_worker, worker);
+  pthread_attr_destroy (&attrs);
+  if (unlikely (err)) {
+    errno = err;
+    perror ("pthread_create");
+    free (worker->name);
+    free (worker);
+    return;
+  }
+  conn->next_worker++;
+  conn->nthreads++;
+  conn->nidle++;
+}
+
 void
 handle_single_connection (int sockin, int sockout)
 {
   const char *plugin_name;
-  int r;
   struct connection *conn;
   int nworkers = threads ? threads : DEFAULT_PARALLEL_REQUESTS;
-  pthread_t *workers = NULL;
 
   lock_connection ();
 
@@ -190,6 +338,12 @@ handle_single_connection (int sockin, int sockout)
 
   cancel_timeout (conn);
 
+  if (nworkers && engine_add_connection (conn)) {
+    /* The engine now owns the connection. */
+    unlock_connection ();
+    return;
+  }
+
   if (!nworkers) {
     /* No need for a separate thread. */
     debug ("handshake complete, processing requests serially");
@@ -198,59 +352,46 @@ handle_single_connection (int sockin, int sockout)
         conn->close (SHUT_WR);
   }
   else {
-    /* Create thread pool to process requests. */
-    debug ("handshake complete, processing requests with %d threads",
+    /* Process requests in this thread, starting more threads as the
+     * client sends requests in parallel.
+     */
+    debug ("handshake complete, processing requests with up to %d threads",
            nworkers);
-    workers = calloc (nworkers, sizeof *workers);
-    if (unlikely (!workers)) {
-      perror ("malloc");
-      goto done;
-    }
+    pthread_mutex_lock (&conn->workers_lock);
+    conn->nthreads = conn->nidle = 1;
+    pthread_mutex_unlock (&conn->workers_lock);
 
-    for (nworkers = 0; nworkers < conn->nworkers; nworkers++) {
-      struct worker_data *worker = malloc (sizeof *worker);
-      int err;
+    worker_loop (conn, true);
 
-      if (unlikely (!worker)) {
-        perror ("malloc");
-        connection_set_status (STATUS_DEAD);
-        goto wait;
-      }
-      if (unlikely (asprintf (&worker->name, "%s.%d", plugin_name, nworkers)
-                    < 0)) {
-        perror ("asprintf");
-        connection_set_status (STATUS_DEAD);
-        free (worker);
-        goto wait;
-      }
-      worker->conn = conn;
-      err = pthread_create (&workers[nworkers], NULL, connection_worker,
-                            worker);
-      if (unlikely (err)) {
-        errno = err;
-        perror ("pthread_create");
-        connection_set_status (STATUS_DEAD);
-        free (worker);
-        goto wait;
-      }
-    }
-
-  wait:
-    while (nworkers)
-      pthread_join (workers[--nworkers], NULL);
-    free (workers);
+    /* Wait for the other workers to exit. */
+    pthread_mutex_lock (&conn->workers_lock);
+    while (conn->nthreads > 1)
+      pthread_cond_wait (&conn->workers_cond, &conn->workers_lock);
+    pthread_mutex_unlock (&conn->workers_lock);
   }
 
+  threadlocal_wait_zerocopy ();
+  finish_connection (conn);
+  unlock_connection ();
+  return;
+
+ done:
+  free_connection (conn);
+  unlock_connection ();
+}
+
+/* Finish a connection after the last request has been processed. */
+void
+finish_connection (struct connection *conn)
+{
+  protocol_wait_for_async_requests ();
+
   /* Finalize (for filters), called just before close. */
   lock_request ();
-  r = backend_finalize (conn->top_context);
+  backend_finalize (conn->top_context);
   unlock_request ();
-  if (r == -1)
-    goto done;
 
- done:
   free_connection (conn);
-  unlock_connection ();
 }
 
 static struct connection *
@@ -272,8 +413,16 @@ new_connection (int sockin, int sockout, int nworkers)
 
   pthread_mutex_init (&conn->request_lock, NULL);
   pthread_mutex_init (&conn->read_lock, NULL);
+  pthread_mutex_init (&conn->retire_lock, NULL);
   pthread_mutex_init (&conn->write_lock, NULL);
   pthread_mutex_init (&conn->status_lock, NULL);
+  pthread_cond_init (&conn->retire_cond, NULL);
+  pthread_mutex_init (&conn->async_lock, NULL);
+  pthread_cond_init (&conn->async_cond, NULL);
+  pthread_mutex_init (&conn->workers_lock, NULL);
+  pthread_cond_init (&conn->workers_cond, NULL);
+  pthread_mutex_init (&conn->zc_lock, NULL);
+  pthread_cond_init (&conn->zc_cond, NULL);
 
   conn->default_exportname = calloc (top->i + 1,
                                      sizeof *conn->default_exportname);
@@ -330,12 +479,29 @@ new_connection (int sockin, int sockout, int nworkers)
   conn->sockout = sockout;
   conn->recv = raw_recv;
 #ifndef WIN32
-  if (getsockopt (sockout, SOL_SOCKET, SO_TYPE, &opt, &optlen) == 0)
+  if (getsockopt (sockout, SOL_SOCKET, SO_TYPE, &opt, &optlen) == 0) {
     conn->send = raw_send_socket;
-  else
+    conn->sendv = raw_sendv_socket;
+#ifdef USE_ZEROCOPY
+    /* This fails for socket types which don't support zerocopy,
+     * such as Unix domain sockets.
+     */
+    opt = 1;
+    if (!no_zerocopy &&
+        setsockopt (sockout, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof opt) == 0)
+      conn->zerocopy = true;
+#endif
+  }
+  else {
     conn->send = raw_send_other;
+    conn->sendv = raw_sendv_other;
+  }
+#ifdef __linux__
+  conn->sendfile = raw_sendfile;
+#endif
 #else
   conn->send = raw_send_socket;
+  conn->sendv = connection_sendv_emulated;
 #endif
   conn->close = raw_close;
 
@@ -355,8 +521,16 @@ new_connection (int sockin, int sockout, int nworkers)
  error1:
   pthread_mutex_destroy (&conn->request_lock);
   pthread_mutex_destroy (&conn->read_lock);
+  pthread_mutex_destroy (&conn->retire_lock);
   pthread_mutex_destroy (&conn->write_lock);
   pthread_mutex_destroy (&conn->status_lock);
+  pthread_cond_destroy (&conn->retire_cond);
+  pthread_mutex_destroy (&conn->async_lock);
+  pthread_cond_destroy (&conn->async_cond);
+  pthread_mutex_destroy (&conn->workers_lock);
+  pthread_cond_destroy (&conn->workers_cond);
+  pthread_mutex_destroy (&conn->zc_lock);
+  pthread_cond_destroy (&conn->zc_cond);
   free (conn);
   return NULL;
 }
@@ -365,6 +539,7 @@ static void
 free_connection (struct connection *conn)
 {
   struct backend *b;
+  size_t i;
 
   if (!conn)
     return;
@@ -393,8 +568,20 @@ free_connection (struct connection *conn)
 
   pthread_mutex_destroy (&conn->request_lock);
   pthread_mutex_destroy (&conn->read_lock);
+  pthread_mutex_destroy (&conn->retire_lock);
   pthread_mutex_destroy (&conn->write_lock);
   pthread_mutex_destroy (&conn->status_lock);
+  pthread_cond_destroy (&conn->retire_cond);
+  pthread_mutex_destroy (&conn->async_lock);
+  pthread_cond_destroy (&conn->async_cond);
+  pthread_mutex_destroy (&conn->workers_lock);
+  pthread_cond_destroy (&conn->workers_cond);
+  pthread_mutex_destroy (&conn->zc_lock);
+  pthread_cond_destroy (&conn->zc_cond);
+  zc_range_vector_reset (&conn->zc_pending);
+  for (i = 0; i < conn->zc_free.len; ++i)
+    free (conn->zc_free.ptr[i].ptr);
+  zc_buffer_vector_reset (&conn->zc_free);
 
   free (conn->exportname_from_set_meta_context);
   free_interns ();
@@ -444,7 +631,139 @@ raw_send_socket (const void *vbuf, size_t len, int flags)
   return 0;
 }
 
+/* Send several buffers by calling conn->send on each.  This is used
+ * where there is no scatter-gather send (eg. TLS).
+ */
+int
+connection_sendv_emulated (const struct send_iov *iov, size_t n, int flags)
+{
+  GET_CONN;
+  size_t i;
+
+  for (i = 0; i < n; ++i) {
+    if (conn->send (iov[i].base, iov[i].len,
+                    i < n-1 ? SEND_MORE : flags & SEND_MORE) == -1)
+      return -1;
+  }
+  return 0;
+}
+
 #ifndef WIN32
+/* Copy iov into a struct iovec array, skipping empty buffers.
+ * Returns the number of entries.
+ */
+static int
+make_iovec (struct iovec *v, const struct send_iov *iov, size_t n,
+            size_t *total)
+{
+  size_t i;
+  int nv = 0;
+
+  assert (n <= SEND_IOV_MAX);
+
+  *total = 0;
+  for (i = 0; i < n; ++i) {
+    if (iov[i].len == 0)
+      continue;
+    v[nv].iov_base = (void *) iov[i].base;
+    v[nv].iov_len = iov[i].len;
+    *total += iov[i].len;
+    nv++;
+  }
+  return nv;
+}
+
+/* Skip over r bytes which have been sent. */
+static void
+advance_iovec (struct iovec **v, int *nv, size_t r)
+{
+  while (*nv > 0 && r >= (*v)[0].iov_len) {
+    r -= (*v)[0].iov_len;
+    (*v)++;
+    (*nv)--;
+  }
+  if (*nv > 0) {
+    (*v)[0].iov_base = (char *) (*v)[0].iov_base + r;
+    (*v)[0].iov_len -= r;
+  }
+}
+
+/* Send all of the buffers with sendmsg() and the given flags.
+ * Returns 0 or -1 on error.
+ */
+static int
+sendmsg_all (struct connection *conn, struct iovec *v, int nv, int f)
+{
+  struct msghdr msg;
+  ssize_t r;
+
+  while (nv > 0) {
+    memset (&msg, 0, sizeof msg);
+    msg.msg_iov = v;
+    msg.msg_iovlen = nv;
+    r = sendmsg (conn->sockout, &msg, f);
+    if (r == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+#ifdef USE_ZEROCOPY
+      /* The kernel may refuse zerocopy if the socket has too much
+       * pinned memory.  Fall back to copying.
+       */
+      if (errno == ENOBUFS && (f & MSG_ZEROCOPY)) {
+        f &= ~MSG_ZEROCOPY;
+        continue;
+      }
+#endif
+      return -1;
+    }
+#ifdef USE_ZEROCOPY
+    if (f & MSG_ZEROCOPY)
+      conn->zc_sent++;
+#endif
+    advance_iovec (&v, &nv, r);
+  }
+
+  return 0;
+}
+
+/* Write buffers to conn->sockout with a single sendmsg() where
+ * possible and either succeed completely (returns 0) or fail (returns
+ * -1).  flags may include SEND_MORE, and SEND_ZEROCOPY to allow a
+ * large last buffer to be sent with MSG_ZEROCOPY.  The other buffers
+ * (usually reply headers on the caller's stack) are always copied.
+ */
+static int
+raw_sendv_socket (const struct send_iov *iov, size_t n, int flags)
+{
+  GET_CONN;
+  struct iovec vec[SEND_IOV_MAX];
+  int nv;
+  size_t total;
+  int f = 0;
+
+  if (conn->sockout < 0) {
+    errno = EBADF;
+    return -1;
+  }
+#ifdef MSG_MORE
+  if (flags & SEND_MORE)
+    f |= MSG_MORE;
+#endif
+
+  nv = make_iovec (vec, iov, n, &total);
+
+#ifdef USE_ZEROCOPY
+  if ((flags & SEND_ZEROCOPY) && conn->zerocopy && nv > 0 &&
+      vec[nv-1].iov_len >= ZEROCOPY_THRESHOLD) {
+    if (nv > 1 && sendmsg_all (conn, vec, nv-1, f | MSG_MORE) == -1)
+      return -1;
+    return sendmsg_all (conn, &vec[nv-1], 1, f | MSG_ZEROCOPY);
+  }
+#endif
+
+  return sendmsg_all (conn, vec, nv, f);
+}
+
 /* Write buffer to conn->sockout with write() and either succeed completely
  * (returns 0) or fail (returns -1). flags is ignored.
  */
@@ -470,8 +789,308 @@ raw_send_other (const void *vbuf, size_t len, int flags)
 
   return 0;
 }
+
+/* Write buffers to conn->sockout with writev() and either succeed
+ * completely (returns 0) or fail (returns -1). flags is ignored.
+ */
+static int
+raw_sendv_other (const struct send_iov *iov, size_t n, int flags)
+{
+  GET_CONN;
+  int sock = conn->sockout;
+  struct iovec vec[SEND_IOV_MAX], *v = vec;
+  int nv;
+  size_t total;
+  ssize_t r;
+
+  assert (sock >= 0);
+  nv = make_iovec (vec, iov, n, &total);
+  while (nv > 0) {
+    r = writev (sock, v, nv);
+    if (r == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+    advance_iovec (&v, &nv, r);
+  }
+
+  return 0;
+}
 #endif /* !WIN32 */
 
+#ifdef __linux__
+/* Send len bytes from fd at offset to conn->sockout with sendfile(),
+ * which avoids copying the data through userspace.  Either succeed
+ * completely (returns 0) or fail (returns -1).
+ */
+static int
+raw_sendfile (int fd, uint64_t offset, size_t len)
+{
+  GET_CONN;
+  int sock = conn->sockout;
+  off_t off = offset;
+  ssize_t r;
+
+  if (sock < 0) {
+    errno = EBADF;
+    return -1;
+  }
+  while (len > 0) {
+    r = sendfile (sock, fd, &off, len);
+    if (r == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+    if (r == 0) {
+      /* The file is shorter than the plugin said. */
+      errno = EIO;
+      return -1;
+    }
+    len -= r;
+  }
+
+  return 0;
+}
+#endif /* __linux__ */
+
+#ifdef USE_ZEROCOPY
+/* True if a is before b, allowing for the 32 bit counters to wrap. */
+static inline bool
+zc_before (uint32_t a, uint32_t b)
+{
+  return (int32_t) (a - b) < 0;
+}
+
+/* Record that zerocopy sends lo..hi (inclusive) have completed.
+ * Called with zc_lock held.
+ */
+static void
+zc_complete (struct connection *conn, uint32_t lo, uint32_t hi)
+{
+  size_t i;
+  bool progress;
+
+  if (zc_before (conn->zc_done, lo)) {
+    /* Out of order, keep it until the gap is filled. */
+    if (zc_range_vector_append (&conn->zc_pending,
+                                (struct zc_range) { .lo = lo, .hi = hi })
+        == -1) {
+      /* Treating the gap as complete is the only way to make
+       * progress.
+       */
+      nbdkit_error ("realloc: %m");
+      conn->zc_done = hi + 1;
+    }
+    return;
+  }
+  if (!zc_before (hi, conn->zc_done))
+    conn->zc_done = hi + 1;
+
+  do {
+    progress = false;
+    for (i = 0; i < conn->zc_pending.len; ++i) {
+      struct zc_range *range = &conn->zc_pending.ptr[i];
+
+      if (!zc_before (conn->zc_done, range->lo)) {
+        if (!zc_before (range->hi, conn->zc_done))
+          conn->zc_done = range->hi + 1;
+        zc_range_vector_remove (&conn->zc_pending, i);
+        progress = true;
+        break;
+      }
+    }
+  } while (progress);
+}
+
+/* Free the deferred buffers whose sends have all completed.  Called
+ * with zc_lock held.
+ */
+static void
+zc_free_buffers (struct connection *conn)
+{
+  size_t i = 0;
+
+  while (i < conn->zc_free.len) {
+    if (zc_before (conn->zc_done, conn->zc_free.ptr[i].zc_sent))
+      i++;
+    else {
+      free (conn->zc_free.ptr[i].ptr);
+      zc_buffer_vector_remove (&conn->zc_free, i);
+    }
+  }
+}
+
+/* Read zerocopy completion notifications from the socket error
+ * queue.  Called without zc_lock held.  Returns -1 if the error queue
+ * cannot be read, so that the caller can stop waiting.
+ */
+static int
+zc_read_notifications (struct connection *conn)
+{
+  char control[CMSG_SPACE (sizeof (struct sock_extended_err)) + 64];
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  struct sock_extended_err *serr;
+
+  for (;;) {
+    memset (&msg, 0, sizeof msg);
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    if (recvmsg (conn->sockout, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        return 0;
+      return -1;
+    }
+
+    for (cm = CMSG_FIRSTHDR (&msg); cm != NULL; cm = CMSG_NXTHDR (&msg, cm)) {
+      if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+            (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+        continue;
+      serr = (struct sock_extended_err *) CMSG_DATA (cm);
+      if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+
+      pthread_mutex_lock (&conn->zc_lock);
+      /* The kernel had to copy the data anyway (eg. loopback or a
+       * device without scatter-gather), so zerocopy only adds
+       * overhead.  Stop using it for this connection.
+       */
+      if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && conn->zerocopy) {
+        debug ("MSG_ZEROCOPY data was copied, disabling zerocopy");
+        conn->zerocopy = false;
+      }
+      zc_complete (conn, serr->ee_info, serr->ee_data);
+      zc_free_buffers (conn);
+      pthread_mutex_unlock (&conn->zc_lock);
+    }
+  }
+}
+#endif /* USE_ZEROCOPY */
+
+/* Return true if the kernel has finished with all MSG_ZEROCOPY sends
+ * made before the caller read conn->zc_sent.  This reads any
+ * completions which have arrived but never blocks.
+ */
+bool
+connection_zerocopy_done (uint32_t zc_sent)
+{
+#ifdef USE_ZEROCOPY
+  GET_CONN;
+  bool done;
+
+  pthread_mutex_lock (&conn->zc_lock);
+  done = !zc_before (conn->zc_done, zc_sent);
+  pthread_mutex_unlock (&conn->zc_lock);
+  if (done)
+    return true;
+
+  if (zc_read_notifications (conn) == -1)
+    return false;
+  pthread_mutex_lock (&conn->zc_lock);
+  done = !zc_before (conn->zc_done, zc_sent);
+  pthread_mutex_unlock (&conn->zc_lock);
+  return done;
+#else
+  return true;
+#endif
+}
+
+/* Wait until the kernel has finished with all MSG_ZEROCOPY sends made
+ * before the caller read conn->zc_sent, so that the buffers can be
+ * reused.  Must be called without write_lock held.
+ */
+void
+connection_wait_zerocopy (uint32_t zc_sent)
+{
+#ifdef USE_ZEROCOPY
+  GET_CONN;
+  struct pollfd pfd;
+
+  pthread_mutex_lock (&conn->zc_lock);
+  while (zc_before (conn->zc_done, zc_sent)) {
+    if (conn->zc_reading) {
+      pthread_cond_wait (&conn->zc_cond, &conn->zc_lock);
+      continue;
+    }
+
+    /* Read the notifications for all waiting threads. */
+    conn->zc_reading = true;
+    pthread_mutex_unlock (&conn->zc_lock);
+
+    pfd.fd = conn->sockout;
+    pfd.events = 0;             /* POLLERR is always reported */
+    pfd.revents = 0;
+    if (poll (&pfd, 1, 1000) == -1 && errno != EINTR) {
+      nbdkit_error ("poll: %m");
+      goto give_up;
+    }
+    if (zc_read_notifications (conn) == -1 ||
+        (pfd.revents & (POLLHUP | POLLNVAL)) ||
+        quit || connection_get_status () < STATUS_CLIENT_DONE)
+      goto give_up;
+
+    pthread_mutex_lock (&conn->zc_lock);
+    conn->zc_reading = false;
+    pthread_cond_broadcast (&conn->zc_cond);
+  }
+  pthread_mutex_unlock (&conn->zc_lock);
+  return;
+
+ give_up:
+  /* The connection is going away, so the buffers will not be sent. */
+  pthread_mutex_lock (&conn->zc_lock);
+  conn->zc_reading = false;
+  if (zc_before (conn->zc_done, zc_sent))
+    conn->zc_done = zc_sent;
+  zc_free_buffers (conn);
+  pthread_cond_broadcast (&conn->zc_cond);
+  pthread_mutex_unlock (&conn->zc_lock);
+#endif /* USE_ZEROCOPY */
+}
+
+/* Free a buffer which may have been sent with MSG_ZEROCOPY.  If the
+ * kernel is still using it, it is freed later when the completion
+ * is read (or when the connection is closed).
+ */
+void
+connection_free_after_zerocopy (void *buf, const struct zerocopy_ref *zc)
+{
+#ifdef USE_ZEROCOPY
+  GET_CONN;
+  uint32_t oldest;
+  int r;
+
+  if (!zc->pending || connection_zerocopy_done (zc->zc_sent)) {
+    free (buf);
+    return;
+  }
+
+  pthread_mutex_lock (&conn->zc_lock);
+  if (conn->zc_free.len >= ZEROCOPY_MAX_DEFERRED) {
+    /* Don't let unsent buffers pile up without limit. */
+    oldest = conn->zc_free.ptr[0].zc_sent;
+    pthread_mutex_unlock (&conn->zc_lock);
+    connection_wait_zerocopy (oldest);
+    pthread_mutex_lock (&conn->zc_lock);
+  }
+  if (zc_before (conn->zc_done, zc->zc_sent))
+    r = zc_buffer_vector_append (&conn->zc_free,
+                                 (struct zc_buffer) { .ptr = buf,
+                                                      .zc_sent = zc->zc_sent });
+  else
+    r = 1;
+  pthread_mutex_unlock (&conn->zc_lock);
+  if (r == 0)
+    return;
+  if (r == -1)
+    /* Leaking the buffer would be worse than waiting. */
+    connection_wait_zerocopy (zc->zc_sent);
+#endif /* USE_ZEROCOPY */
+  free (buf);
+}
+
 /* Read buffer from conn->sockin and either succeed completely
  * (returns > 0), read an EOF (returns 0), or fail (returns -1).
  */
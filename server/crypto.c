@@ -778,6 +778,8 @@ crypto_negotiate_tls (int sockin, int sockout)
   conn->crypto_session = session;
   conn->recv = crypto_recv;
   conn->send = crypto_send;
+  conn->sendv = connection_sendv_emulated;
+  conn->sendfile = NULL;
   conn->close = crypto_close;
   return 0;
 
@@ -0,0 +1,1136 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* The epoll connection engine (--engine=epoll).
+ *
+ * With the default engine every connection owns a thread pool of -t
+ * worker threads, so N idle clients cost N * threads blocked threads.
+ * With this engine, once the handshake is complete the connection is
+ * handed to a single poller thread which watches all the client
+ * sockets, and requests are processed by a fixed pool of worker
+ * threads shared between all connections.
+ *
+ * The sockets are non-blocking and worker threads never wait for a
+ * client:
+ *
+ * - The poller reads from the socket and splits the input into
+ *   complete requests (the header and any write payload).  Only
+ *   complete requests are queued for the workers, which decode them
+ *   from memory (see engine_recv).  A client which sends half a
+ *   request, or sends slowly, ties up a buffer but not a thread.
+ *
+ * - Replies are sent with non-blocking sends.  Anything the socket
+ *   will not take immediately is copied to a per-connection output
+ *   queue which the poller sends when the socket becomes writable.
+ *
+ * The poller stops reading from a connection while -t requests are
+ * queued or in flight, or while the output queue is over OUT_LIMIT.
+ * Requests on a connection are decoded in order, one at a time, but
+ * are then processed in parallel.  Each socket is registered with
+ * EPOLLONESHOT and re-armed with the events which are currently
+ * wanted.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#endif
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#include "internal.h"
+#include "byte-swapping.h"
+#include "nbd-protocol.h"
+
+#ifdef __linux__
+
+/* Stop reading requests while more than this is waiting to be sent. */
+#define OUT_LIMIT MAX_REQUEST_SIZE
+
+/* A complete request read by the poller.  If len == 0 this marks the
+ * end of the input, with err == 0 for EOF or an errno value.
+ */
+struct engine_req {
+  struct engine_req *next;
+  size_t len;                   /* Length of data. */
+  size_t pos;                   /* Bytes received or consumed so far. */
+  int err;
+  char data[];
+};
+
+/* Data waiting to be sent. */
+struct engine_out {
+  struct engine_out *next;
+  size_t len;
+  size_t pos;                   /* Bytes sent so far. */
+  char data[];
+};
+
+struct engine_conn {
+  struct connection *conn;
+  size_t instance_num;
+  struct engine_conn *next;     /* List of all connections. */
+  struct engine_conn *next_job; /* Link in the job queue. */
+
+  /* These fields are protected by lock. */
+  struct engine_req *reqs_head, *reqs_tail; /* Requests to decode. */
+  unsigned nr_reqs;
+  unsigned inflight;            /* Requests being processed. */
+  uint32_t armed;               /* Events armed in epoll. */
+  bool polling;                 /* Poller is doing I/O on the socket. */
+  bool reading;                 /* Decode job queued or running. */
+  bool input_done;              /* EOF or error has been queued. */
+  bool want_out;                /* Output queue is not empty. */
+  bool out_full;                /* Output queue is over OUT_LIMIT. */
+  bool closing;                 /* Connection is shutting down. */
+  bool finishing;               /* Finish job queued or running. */
+
+  /* Only used by the poller, while polling is set. */
+  char hdr[sizeof (struct nbd_request_ext)];
+  size_t hdr_len;
+  struct engine_req *partial;   /* Request whose payload is arriving. */
+
+  /* Only used by the worker decoding a request. */
+  struct engine_req *cur;
+
+  /* The output queue, protected by conn->write_lock. */
+  struct engine_out *out_head, *out_tail;
+  uint64_t out_bytes;
+  bool out_error;               /* A send failed, discard output. */
+
+  /* The connection functions replaced by the engine. */
+  connection_recv_function saved_recv;
+  connection_send_function saved_send;
+  connection_sendv_function saved_sendv;
+  connection_sendfile_function saved_sendfile;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t conns_cond = PTHREAD_COND_INITIALIZER;
+
+static bool started, stopping;
+static int epfd = -1;
+static pthread_t poller;
+static pthread_t *workers;
+static size_t nr_workers;
+
+static struct engine_conn *conns; /* All connections. */
+static size_t nr_conns;
+static struct engine_conn *jobs_head, *jobs_tail;
+static struct engine_conn *dead;  /* Finished, waiting to be freed. */
+
+/* Used as the epoll data.ptr for the quit_fd. */
+static int quit_tag;
+
+/* Call with lock held. */
+static void
+queue_job (struct engine_conn *ec)
+{
+  ec->next_job = NULL;
+  if (jobs_tail)
+    jobs_tail->next_job = ec;
+  else
+    jobs_head = ec;
+  jobs_tail = ec;
+  pthread_cond_signal (&job_cond);
+}
+
+/* Call with lock held.  Number of requests which may still be read
+ * from the connection before reaching the -t limit.
+ */
+static unsigned
+read_quota (struct engine_conn *ec)
+{
+  unsigned used = ec->inflight + ec->nr_reqs + ec->reading;
+
+  if (ec->closing || ec->input_done || ec->out_full ||
+      used >= (unsigned) ec->conn->nworkers)
+    return 0;
+  return ec->conn->nworkers - used;
+}
+
+/* Call with lock held.  Arm the socket for the events we are
+ * interested in.  While the poller is using the socket it re-arms
+ * it afterwards.
+ */
+static void
+maybe_arm (struct engine_conn *ec)
+{
+  struct epoll_event ev = { .data.ptr = ec };
+  uint32_t events = 0;
+
+  if (ec->finishing || ec->polling)
+    return;
+
+  if (read_quota (ec) > 0)
+    events |= EPOLLIN;
+  if (ec->want_out)
+    events |= EPOLLOUT;
+
+  /* Leaving extra events armed is harmless. */
+  if ((events & ~ec->armed) == 0)
+    return;
+
+  ev.events = events | EPOLLONESHOT;
+  if (epoll_ctl (epfd, EPOLL_CTL_MOD, ec->conn->sockin, &ev) == -1) {
+    nbdkit_error ("epoll_ctl: %m");
+    ec->closing = true;
+    return;
+  }
+  ec->armed = events;
+}
+
+/* Call with lock held.  Returns true if the caller must finish the
+ * connection.  Output still waiting to be sent is dropped only when
+ * nbdkit is quitting.
+ */
+static bool
+maybe_finish (struct engine_conn *ec)
+{
+  if (!ec->closing || ec->reading || ec->polling || ec->inflight > 0 ||
+      ec->finishing || (ec->want_out && !quit))
+    return false;
+  ec->finishing = true;
+  return true;
+}
+
+/* Call with lock held.  If there is a request to decode and nobody is
+ * decoding, queue a job for it.
+ */
+static void
+maybe_decode (struct engine_conn *ec)
+{
+  if (!ec->reading && !ec->closing && ec->reqs_head) {
+    ec->reading = true;
+    queue_job (ec);
+  }
+}
+
+static void
+free_reqs (struct engine_req *req)
+{
+  struct engine_req *next;
+
+  for (; req != NULL; req = next) {
+    next = req->next;
+    free (req);
+  }
+}
+
+/* Call with conn->write_lock held. */
+static void
+discard_output (struct engine_conn *ec)
+{
+  struct engine_out *out, *next;
+
+  for (out = ec->out_head; out != NULL; out = next) {
+    next = out->next;
+    free (out);
+  }
+  ec->out_head = ec->out_tail = NULL;
+  ec->out_bytes = 0;
+}
+
+/* Call without lock held.  Runs the plugin .finalize and .close
+ * callbacks and frees the connection.
+ */
+static void
+finish (struct engine_conn *ec)
+{
+  struct connection *conn = ec->conn;
+  struct engine_conn **p;
+  int flags;
+
+  threadlocal_set_conn (conn);
+  threadlocal_set_instance_num (ec->instance_num);
+  debug ("engine: finishing connection");
+
+  /* This must be done before the socket is closed, otherwise epoll
+   * may keep a stale registration for the file description.
+   */
+  epoll_ctl (epfd, EPOLL_CTL_DEL, conn->sockin, NULL);
+
+  /* Replies to asynchronous requests may still be sent while the
+   * connection is finished, so go back to the normal blocking
+   * functions.
+   */
+  pthread_mutex_lock (&conn->write_lock);
+  discard_output (ec);
+  flags = fcntl (conn->sockin, F_GETFL);
+  if (flags >= 0)
+    fcntl (conn->sockin, F_SETFL, flags & ~O_NONBLOCK);
+  conn->recv = ec->saved_recv;
+  conn->send = ec->saved_send;
+  conn->sendv = ec->saved_sendv;
+  conn->sendfile = ec->saved_sendfile;
+  conn->engine = NULL;
+  pthread_mutex_unlock (&conn->write_lock);
+
+  free_reqs (ec->reqs_head);
+  free_reqs (ec->partial);
+  free (ec->cur);
+
+  finish_connection (conn);
+
+  /* The poller may still be holding ec from an earlier batch of
+   * events, so it is the poller which frees it.
+   */
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  for (p = &conns; *p != ec; p = &(*p)->next)
+    ;
+  *p = ec->next;
+  ec->conn = NULL;
+  ec->next = dead;
+  dead = ec;
+  nr_conns--;
+  pthread_cond_broadcast (&conns_cond);
+}
+
+/* Call with lock held. */
+static void
+update_status (struct engine_conn *ec)
+{
+  if (quit || connection_get_status () <= STATUS_CLIENT_DONE)
+    ec->closing = true;
+}
+
+/* Replaces conn->recv.  Reads from the request being decoded, which
+ * the poller has already received completely.
+ */
+static int
+engine_recv (void *buf, size_t len)
+{
+  GET_CONN;
+  struct engine_req *req = conn->engine->cur;
+
+  assert (req != NULL);
+  if (req->len == 0) {
+    if (req->err == 0)
+      return 0;
+    errno = req->err;
+    return -1;
+  }
+  /* The poller only frames payloads that protocol_recv_request will
+   * read, so this should not happen.
+   */
+  if (len > req->len - req->pos) {
+    errno = EBADMSG;
+    return -1;
+  }
+  memcpy (buf, &req->data[req->pos], len);
+  req->pos += len;
+  return 1;
+}
+
+/* Call with conn->write_lock held.  Update the flags which depend on
+ * the output queue.
+ */
+static void
+output_changed (struct engine_conn *ec)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  ec->want_out = ec->out_head != NULL;
+  ec->out_full = ec->out_bytes > OUT_LIMIT;
+  maybe_arm (ec);
+}
+
+/* Call with conn->write_lock held.  Allocate an output buffer of len
+ * bytes and append it to the output queue.
+ */
+static struct engine_out *
+append_output (struct engine_conn *ec, size_t len)
+{
+  struct engine_out *out;
+
+  out = malloc (sizeof *out + len);
+  if (out == NULL)
+    return NULL;
+  out->next = NULL;
+  out->len = len;
+  out->pos = 0;
+  if (ec->out_tail)
+    ec->out_tail->next = out;
+  else
+    ec->out_head = out;
+  ec->out_tail = out;
+  ec->out_bytes += len;
+  return out;
+}
+
+/* Call with conn->write_lock held.  Send as much of the output queue
+ * as the socket will take.  Returns -1 on error.
+ */
+static int
+send_output (struct engine_conn *ec)
+{
+  struct connection *conn = ec->conn;
+  struct engine_out *out;
+  ssize_t r;
+
+  if (conn->sockout < 0) {
+    errno = EBADF;
+    return -1;
+  }
+
+  while ((out = ec->out_head) != NULL) {
+    r = send (conn->sockout, &out->data[out->pos], out->len - out->pos,
+              MSG_DONTWAIT);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      return -1;
+    }
+    out->pos += r;
+    ec->out_bytes -= r;
+    if (out->pos == out->len) {
+      ec->out_head = out->next;
+      if (ec->out_head == NULL)
+        ec->out_tail = NULL;
+      free (out);
+    }
+  }
+  return 0;
+}
+
+/* Replaces conn->sendv, called with conn->write_lock held.  Anything
+ * which cannot be sent without blocking is copied to the output
+ * queue.
+ */
+static int
+engine_sendv (const struct send_iov *iov, size_t n, int flags)
+{
+  GET_CONN;
+  struct engine_conn *ec = conn->engine;
+  struct iovec vec[SEND_IOV_MAX], *v = vec;
+  struct engine_out *out;
+  struct msghdr msg;
+  size_t i, total = 0;
+  int nv = 0;
+  ssize_t r;
+  int f = MSG_DONTWAIT;
+
+  assert (n <= SEND_IOV_MAX);
+
+  if (ec->out_error || conn->sockout < 0) {
+    errno = EPIPE;
+    return -1;
+  }
+#ifdef MSG_MORE
+  if (flags & SEND_MORE)
+    f |= MSG_MORE;
+#endif
+
+  for (i = 0; i < n; ++i) {
+    if (iov[i].len == 0)
+      continue;
+    v[nv].iov_base = (void *) iov[i].base;
+    v[nv].iov_len = iov[i].len;
+    total += iov[i].len;
+    nv++;
+  }
+
+  /* If output is already queued we must not overtake it. */
+  if (ec->out_head == NULL) {
+    while (nv > 0) {
+      memset (&msg, 0, sizeof msg);
+      msg.msg_iov = v;
+      msg.msg_iovlen = nv;
+      r = sendmsg (conn->sockout, &msg, f);
+      if (r == -1) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          break;
+        return -1;
+      }
+      total -= r;
+      while (nv > 0 && (size_t) r >= v[0].iov_len) {
+        r -= v[0].iov_len;
+        v++;
+        nv--;
+      }
+      if (nv > 0) {
+        v[0].iov_base = (char *) v[0].iov_base + r;
+        v[0].iov_len -= r;
+      }
+    }
+    if (nv == 0)
+      return 0;
+  }
+
+  out = append_output (ec, total);
+  if (out == NULL)
+    return -1;
+  for (i = 0; i < (size_t) nv; ++i) {
+    memcpy (&out->data[out->pos], v[i].iov_base, v[i].iov_len);
+    out->pos += v[i].iov_len;
+  }
+  out->pos = 0;
+  output_changed (ec);
+  return 0;
+}
+
+/* Replaces conn->send, called with conn->write_lock held. */
+static int
+engine_send (const void *buf, size_t len, int flags)
+{
+  const struct send_iov iov = { .base = buf, .len = len };
+
+  return engine_sendv (&iov, 1, flags);
+}
+
+/* Replaces conn->sendfile, called with conn->write_lock held.  If the
+ * socket is full the rest of the data is read into the output queue.
+ */
+static int
+engine_sendfile (int fd, uint64_t offset, size_t len)
+{
+  GET_CONN;
+  struct engine_conn *ec = conn->engine;
+  struct engine_out *out;
+  off_t off = offset;
+  ssize_t r;
+
+  if (ec->out_error || conn->sockout < 0) {
+    errno = EPIPE;
+    return -1;
+  }
+
+  if (ec->out_head == NULL) {
+    while (len > 0) {
+      r = sendfile (conn->sockout, fd, &off, len);
+      if (r == -1) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          break;
+        return -1;
+      }
+      if (r == 0) {
+        /* The file is shorter than the plugin said. */
+        errno = EIO;
+        return -1;
+      }
+      len -= r;
+    }
+    if (len == 0)
+      return 0;
+  }
+
+  out = append_output (ec, len);
+  if (out == NULL)
+    return -1;
+  while (out->pos < len) {
+    r = pread (fd, &out->data[out->pos], len - out->pos, off);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      goto err;
+    }
+    if (r == 0) {
+      errno = EIO;
+      goto err;
+    }
+    out->pos += r;
+    off += r;
+  }
+  out->pos = 0;
+  output_changed (ec);
+  return 0;
+
+ err:
+  /* Remove the partially filled buffer, which is last in the queue. */
+  {
+    int err = errno;
+
+    discard_output (ec);
+    ec->out_error = true;
+    output_changed (ec);
+    errno = err;
+    return -1;
+  }
+}
+
+/* Called by the poller without lock held when the socket is
+ * writable.
+ */
+static void
+flush_output (struct engine_conn *ec)
+{
+  struct connection *conn = ec->conn;
+
+  pthread_mutex_lock (&conn->write_lock);
+  if (ec->out_head && send_output (ec) == -1) {
+    debug ("engine: send: %m");
+    discard_output (ec);
+    ec->out_error = true;
+  }
+  output_changed (ec);
+  pthread_mutex_unlock (&conn->write_lock);
+}
+
+/* Returns the length of the payload following the request header in
+ * ec->hdr, using the same rules as protocol_recv_request.  Payloads
+ * which protocol_recv_request would refuse to read are not framed.
+ */
+static uint64_t
+payload_length (struct engine_conn *ec)
+{
+  uint32_t magic;
+  uint16_t flags, type;
+  uint64_t count;
+  bool has_payload;
+
+  if (ec->conn->extended_headers) {
+    struct nbd_request_ext request;
+
+    memcpy (&request, ec->hdr, sizeof request);
+    magic = be32toh (request.magic);
+    flags = be16toh (request.flags);
+    type = be16toh (request.type);
+    count = be64toh (request.count);
+    has_payload = magic == NBD_EXTENDED_REQUEST_MAGIC &&
+      (type == NBD_CMD_WRITE || (flags & NBD_CMD_FLAG_PAYLOAD_LEN));
+  }
+  else {
+    struct nbd_request request;
+
+    memcpy (&request, ec->hdr, sizeof request);
+    magic = be32toh (request.magic);
+    type = be16toh (request.type);
+    count = be32toh (request.count);
+    has_payload = magic == NBD_REQUEST_MAGIC && type == NBD_CMD_WRITE;
+  }
+
+  if (!has_payload || count > MAX_REQUEST_SIZE * 2)
+    return 0;
+  return count;
+}
+
+/* Called by the poller without lock held.  Read from the socket
+ * without blocking and return up to quota complete requests in the
+ * list *head.  If EOF or an error was seen, the last request in the
+ * list is the end of input marker.
+ */
+static unsigned
+read_input (struct engine_conn *ec, unsigned quota, struct engine_req **head)
+{
+  struct connection *conn = ec->conn;
+  const size_t hdr_size = conn->extended_headers
+    ? sizeof (struct nbd_request_ext) : sizeof (struct nbd_request);
+  struct engine_req **tail = head;
+  struct engine_req *req;
+  unsigned nr = 0;
+  ssize_t r;
+  int err;
+
+  while (nr < quota) {
+    /* Read the header. */
+    while (ec->partial == NULL) {
+      r = recv (conn->sockin, &ec->hdr[ec->hdr_len], hdr_size - ec->hdr_len,
+                MSG_DONTWAIT);
+      if (r == -1 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        goto eof_or_error;
+      ec->hdr_len += r;
+      if (ec->hdr_len < hdr_size)
+        continue;
+
+      req = malloc (sizeof *req + hdr_size + payload_length (ec));
+      if (req == NULL) {
+        err = errno;
+        goto end_of_input;
+      }
+      req->next = NULL;
+      req->len = hdr_size + payload_length (ec);
+      req->err = 0;
+      memcpy (req->data, ec->hdr, hdr_size);
+      req->pos = hdr_size;
+      ec->hdr_len = 0;
+      ec->partial = req;
+    }
+
+    /* Read the payload. */
+    req = ec->partial;
+    while (req->pos < req->len) {
+      r = recv (conn->sockin, &req->data[req->pos], req->len - req->pos,
+                MSG_DONTWAIT);
+      if (r == -1 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        goto eof_or_error;
+      req->pos += r;
+    }
+
+    req->pos = 0;
+    ec->partial = NULL;
+    *tail = req;
+    tail = &req->next;
+    nr++;
+  }
+  return nr;
+
+ eof_or_error:
+  if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return nr;
+  if (r == -1)
+    err = errno;
+  else if (ec->partial || ec->hdr_len > 0)
+    err = EBADMSG;              /* EOF in the middle of a request. */
+  else
+    err = 0;
+
+ end_of_input:
+  free_reqs (ec->partial);
+  ec->partial = NULL;
+  ec->hdr_len = 0;
+  req = calloc (1, sizeof *req);
+  if (req == NULL)
+    abort ();
+  req->err = err;
+  *tail = req;
+  return nr + 1;
+}
+
+/* Decode the request in ec->cur and process it. */
+static void
+do_request (struct engine_conn *ec)
+{
+  struct connection *conn = ec->conn;
+  struct request req;
+  bool fin;
+  int r;
+
+  threadlocal_set_conn (conn);
+  threadlocal_set_instance_num (ec->instance_num);
+
+  r = protocol_recv_request (&req);
+  free (ec->cur);
+  ec->cur = NULL;
+  if (r == -1) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
+    conn->close (SHUT_WR);
+  }
+
+  /* Let another worker decode the next request while this one is
+   * processed.
+   */
+  pthread_mutex_lock (&lock);
+  ec->reading = false;
+  if (r == 1)
+    ec->inflight++;
+  update_status (ec);
+  maybe_decode (ec);
+  maybe_arm (ec);
+  fin = maybe_finish (ec);
+  pthread_mutex_unlock (&lock);
+
+  if (r == 1) {
+    if (protocol_handle_request_send_reply (&req)) {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
+      conn->close (SHUT_WR);
+    }
+
+    pthread_mutex_lock (&lock);
+    ec->inflight--;
+    update_status (ec);
+    maybe_arm (ec);
+    fin = maybe_finish (ec);
+    pthread_mutex_unlock (&lock);
+  }
+
+  threadlocal_set_conn (NULL);
+  if (fin)
+    finish (ec);
+}
+
+static void *
+worker_thread (void *data)
+{
+  char *name = data;
+  struct engine_conn *ec;
+
+  threadlocal_new_server_thread ();
+  threadlocal_set_name (name);
+  free (name);
+
+  for (;;) {
+    pthread_mutex_lock (&lock);
+    while (!stopping && jobs_head == NULL)
+      pthread_cond_wait (&job_cond, &lock);
+    if (jobs_head == NULL) {
+      pthread_mutex_unlock (&lock);
+      break;
+    }
+    ec = jobs_head;
+    jobs_head = ec->next_job;
+    if (jobs_head == NULL)
+      jobs_tail = NULL;
+
+    if (ec->finishing) {
+      pthread_mutex_unlock (&lock);
+      finish (ec);
+    }
+    else if (ec->closing) {
+      /* The connection started closing while the decode job was
+       * queued.
+       */
+      ec->reading = false;
+      if (maybe_finish (ec)) {
+        pthread_mutex_unlock (&lock);
+        finish (ec);
+      }
+      else
+        pthread_mutex_unlock (&lock);
+    }
+    else {
+      ec->cur = ec->reqs_head;
+      ec->reqs_head = ec->cur->next;
+      if (ec->reqs_head == NULL)
+        ec->reqs_tail = NULL;
+      ec->nr_reqs--;
+      pthread_mutex_unlock (&lock);
+      do_request (ec);
+    }
+  }
+
+  debug ("exiting engine worker thread %s", threadlocal_get_name ());
+  return NULL;
+}
+
+/* Handle an event on a client socket.  Called by the poller without
+ * lock held.
+ */
+static void
+poll_connection (struct engine_conn *ec, uint32_t events)
+{
+  struct engine_req *reqs = NULL, *req;
+  unsigned quota, nr = 0;
+
+  pthread_mutex_lock (&lock);
+  ec->armed = 0;
+  if (ec->finishing) {
+    pthread_mutex_unlock (&lock);
+    return;
+  }
+  ec->polling = true;
+  quota = read_quota (ec);
+  pthread_mutex_unlock (&lock);
+
+  if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+    flush_output (ec);
+  if (quota > 0 && (events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+    nr = read_input (ec, quota, &reqs);
+
+  pthread_mutex_lock (&lock);
+  ec->polling = false;
+  if (nr > 0) {
+    if (ec->reqs_tail)
+      ec->reqs_tail->next = reqs;
+    else
+      ec->reqs_head = reqs;
+    for (req = reqs; req->next != NULL; req = req->next)
+      ;
+    ec->reqs_tail = req;
+    ec->nr_reqs += nr;
+    if (req->len == 0)
+      ec->input_done = true;
+  }
+  maybe_decode (ec);
+  maybe_arm (ec);
+  if (maybe_finish (ec))
+    queue_job (ec);
+  pthread_mutex_unlock (&lock);
+}
+
+static void *
+poller_thread (void *data)
+{
+  struct epoll_event events[64];
+  struct engine_conn *ec;
+  int i, n;
+
+  threadlocal_new_server_thread ();
+  threadlocal_set_name ("engine");
+
+  for (;;) {
+    /* Anything on the dead list was removed from epoll before this
+     * call, so cannot appear in the next batch of events.
+     */
+    pthread_mutex_lock (&lock);
+    while (dead) {
+      ec = dead;
+      dead = ec->next;
+      free (ec);
+    }
+    if (stopping) {
+      pthread_mutex_unlock (&lock);
+      break;
+    }
+    pthread_mutex_unlock (&lock);
+
+    n = epoll_wait (epfd, events, sizeof events / sizeof events[0], -1);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      nbdkit_error ("epoll_wait: %m");
+      break;
+    }
+
+    for (i = 0; i < n; ++i) {
+      if (events[i].data.ptr == &quit_tag) {
+        /* Close idle connections.  Busy ones close when their last
+         * request finishes.
+         */
+        pthread_mutex_lock (&lock);
+        for (ec = conns; ec != NULL; ec = ec->next) {
+          ec->closing = true;
+          if (maybe_finish (ec))
+            queue_job (ec);
+        }
+        pthread_mutex_unlock (&lock);
+        continue;
+      }
+
+      poll_connection (events[i].data.ptr, events[i].events);
+    }
+  }
+
+  return NULL;
+}
+
+/* Call with lock held. */
+static int
+start_engine (void)
+{
+  struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT,
+                            .data.ptr = &quit_tag };
+  const char *plugin_name = top->plugin_name (top);
+  long ncpus;
+  size_t i;
+  int err;
+
+  ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+  nr_workers = ncpus > 2 ? 2 * ncpus : 4;
+
+  epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (epfd == -1) {
+    nbdkit_error ("epoll_create1: %m");
+    return -1;
+  }
+  if (epoll_ctl (epfd, EPOLL_CTL_ADD, quit_fd, &ev) == -1) {
+    nbdkit_error ("epoll_ctl: %m");
+    goto err1;
+  }
+
+  workers = calloc (nr_workers, sizeof *workers);
+  if (workers == NULL) {
+    nbdkit_error ("calloc: %m");
+    goto err1;
+  }
+
+  for (i = 0; i < nr_workers; ++i) {
+    char *name;
+
+    if (asprintf (&name, "%s.%zu", plugin_name, i) == -1) {
+      nbdkit_error ("asprintf: %m");
+      break;
+    }
+    err = pthread_create (&workers[i], NULL, worker_thread, name);
+    if (err) {
+      errno = err;
+      nbdkit_error ("pthread_create: %m");
+      free (name);
+      break;
+    }
+  }
+  if (i == 0)
+    goto err2;
+  nr_workers = i;
+
+  err = pthread_create (&poller, NULL, poller_thread, NULL);
+  if (err) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    /* The workers exit once they can take the lock.  Leaving stopping
+     * set means all later connections use the threads engine.
+     */
+    stopping = true;
+    pthread_cond_broadcast (&job_cond);
+    for (i = 0; i < nr_workers; ++i)
+      pthread_detach (workers[i]);
+    goto err2;
+  }
+
+  debug ("engine: started epoll engine with %zu worker threads", nr_workers);
+  started = true;
+  return 0;
+
+ err2:
+  free (workers);
+  workers = NULL;
+ err1:
+  close (epfd);
+  epfd = -1;
+  return -1;
+}
+
+bool
+engine_add_connection (struct connection *conn)
+{
+  struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT };
+  struct engine_conn *ec;
+  int flags;
+
+  if (engine != ENGINE_EPOLL || conn->using_tls ||
+      conn->sockin != conn->sockout || conn->nworkers == 0)
+    return false;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  if (quit || stopping)
+    return false;
+  if (!started && start_engine () == -1)
+    return false;
+
+  ec = calloc (1, sizeof *ec);
+  if (ec == NULL) {
+    nbdkit_error ("calloc: %m");
+    return false;
+  }
+  ec->conn = conn;
+  ec->instance_num = threadlocal_get_instance_num ();
+
+  flags = fcntl (conn->sockin, F_GETFL);
+  if (flags == -1 ||
+      fcntl (conn->sockin, F_SETFL, flags | O_NONBLOCK) == -1) {
+    nbdkit_error ("fcntl: %m");
+    free (ec);
+    return false;
+  }
+
+  ev.data.ptr = ec;
+  if (epoll_ctl (epfd, EPOLL_CTL_ADD, conn->sockin, &ev) == -1) {
+    nbdkit_error ("epoll_ctl: %m");
+    fcntl (conn->sockin, F_SETFL, flags);
+    free (ec);
+    return false;
+  }
+  ec->armed = EPOLLIN;
+
+  /* Output which cannot be sent immediately is copied, so there is
+   * no point in MSG_ZEROCOPY.
+   */
+  pthread_mutex_lock (&conn->zc_lock);
+  conn->zerocopy = false;
+  pthread_mutex_unlock (&conn->zc_lock);
+
+  ec->saved_recv = conn->recv;
+  ec->saved_send = conn->send;
+  ec->saved_sendv = conn->sendv;
+  ec->saved_sendfile = conn->sendfile;
+  conn->engine = ec;
+  conn->recv = engine_recv;
+  conn->send = engine_send;
+  conn->sendv = engine_sendv;
+  if (conn->sendfile)
+    conn->sendfile = engine_sendfile;
+
+  ec->next = conns;
+  conns = ec;
+  nr_conns++;
+
+  debug ("handshake complete, handing connection to the epoll engine");
+  threadlocal_set_conn (NULL);
+  return true;
+}
+
+void
+engine_drain (void)
+{
+  struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT,
+                            .data.ptr = &quit_tag };
+  size_t i;
+
+  pthread_mutex_lock (&lock);
+  if (!started) {
+    pthread_mutex_unlock (&lock);
+    return;
+  }
+  while (nr_conns > 0)
+    pthread_cond_wait (&conns_cond, &lock);
+  stopping = true;
+  pthread_cond_broadcast (&job_cond);
+  pthread_mutex_unlock (&lock);
+
+  /* quit_fd is still readable, so re-arming it wakes the poller. */
+  epoll_ctl (epfd, EPOLL_CTL_MOD, quit_fd, &ev);
+
+  pthread_join (poller, NULL);
+  for (i = 0; i < nr_workers; ++i)
+    pthread_join (workers[i], NULL);
+  free (workers);
+  close (epfd);
+}
+
+#else /* !__linux__ */
+
+bool
+engine_add_connection (struct connection *conn)
+{
+  return false;
+}
+
+void
+engine_drain (void)
+{
+}
+
+#endif /* !__linux__ */
@@ -74,10 +74,7 @@ filter_thread_model (struct backend *b)
       exit (EXIT_FAILURE);
   }
 
-  if (filter_thread_model < model) /* more serialized */
-    model = filter_thread_model;
-
-  return model;
+  return thread_model_min (filter_thread_model, model);
 }
 
 /* This is actually passing the request through to the final plugin,
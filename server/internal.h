@@ -125,6 +125,11 @@ enum log_to {
   LOG_TO_NULL,           /* --log=null forced on the command line */
 };
 
+enum engine {
+  ENGINE_THREADS,        /* --engine=threads (default) */
+  ENGINE_EPOLL,          /* --engine=epoll */
+};
+
 enum service_mode {
   /* These two modes cannot form an NBD URI: */
   SERVICE_MODE_SOCKET_ACTIVATION, /* socket activation. */
@@ -138,21 +143,25 @@ extern const char *service_mode_string (enum service_mode);
 
 extern int tcpip_sock_af;
 extern struct debug_flag *debug_flags;
+extern enum engine engine;
 extern const char *export_name;
 extern bool foreground;
 extern const char *ipaddr;
 extern bool keepalive;
 extern enum log_to log_to;
 extern unsigned mask_handshake;
+extern char *metrics_file;
 extern bool newstyle;
 extern bool no_mc;
 extern bool no_sr;
+extern bool no_zerocopy;
 extern const char *port;
 extern bool print_uri;
 extern bool read_only;
 extern const char *run;
 extern bool listen_stdin;
 extern const char *selinux_label;
+extern bool sparse_reads;
 extern unsigned threads;
 extern unsigned timeout_secs, timeout_nsecs;
 extern int tls;
@@ -208,6 +217,28 @@ extern void run_command (void);
 #define FIRST_SOCKET_ACTIVATION_FD 3 /* defined by systemd ABI */
 extern unsigned int get_socket_activation (void);
 
+/* metrics.c */
+enum metrics_op {
+  METRICS_PREAD,
+  METRICS_PWRITE,
+  METRICS_FLUSH,
+  METRICS_TRIM,
+  METRICS_ZERO,
+  METRICS_EXTENTS,
+  METRICS_CACHE,
+  NR_METRICS_OPS
+};
+struct backend;
+struct timespec;
+extern void metrics_init (void);
+extern void metrics_start_thread (void);
+extern void metrics_stop (void);
+extern void metrics_start (struct timespec *start)
+  __attribute__ ((__nonnull__ (1)));
+extern void metrics_record (struct backend *b, enum metrics_op op,
+                            const struct timespec *start, int r)
+  __attribute__ ((__nonnull__ (1, 3)));
+
 /* timeout.c */
 struct connection;
 extern int start_timeout (struct connection *conn)
@@ -223,9 +254,20 @@ extern char *make_uri (void);
 
 /* connections.c */
 
-/* Flags for connection_send_function */
+/* Flags for connection_send_function and connection_sendv_function */
 enum {
   SEND_MORE = 1, /* Hint to use MSG_MORE/corking to group send()s */
+  SEND_ZEROCOPY = 2, /* The last buffer may be sent with
+                      * MSG_ZEROCOPY, see struct zerocopy_ref.
+                      */
+};
+
+/* Maximum number of buffers passed to connection_sendv_function. */
+#define SEND_IOV_MAX 4
+
+struct send_iov {
+  const void *base;
+  size_t len;
 };
 
 typedef int (*connection_recv_function) (void *buf, size_t len)
@@ -233,8 +275,39 @@ typedef int (*connection_recv_function) (void *buf, size_t len)
 typedef int (*connection_send_function) (const void *buf, size_t len,
                                          int flags)
   __attribute__ ((__nonnull__ (1)));
+typedef int (*connection_sendv_function) (const struct send_iov *iov,
+                                          size_t n, int flags)
+  __attribute__ ((__nonnull__ (1)));
+typedef int (*connection_sendfile_function) (int fd, uint64_t offset,
+                                             size_t len);
 typedef void (*connection_close_function) (int how);
 
+/* A range of MSG_ZEROCOPY sends reported complete by the kernel. */
+struct zc_range {
+  uint32_t lo, hi;
+};
+DEFINE_VECTOR_TYPE (zc_range_vector, struct zc_range);
+
+/* A buffer waiting to be freed until the kernel has finished sending
+ * it with MSG_ZEROCOPY.
+ */
+struct zc_buffer {
+  void *ptr;
+  uint32_t zc_sent;
+};
+DEFINE_VECTOR_TYPE (zc_buffer_vector, struct zc_buffer);
+
+/* After data is sent with MSG_ZEROCOPY the kernel keeps reading the
+ * buffer until it reports completion, so the buffer must not be
+ * reused or freed before then.  The reply functions fill this in
+ * with the value of conn->zc_sent after the send if (and only if)
+ * zerocopy was used.
+ */
+struct zerocopy_ref {
+  bool pending;
+  uint32_t zc_sent;
+};
+
 /* struct context stores data per connection and backend.  Primarily
  * this is the filter or plugin handle, but other state is also stored
  * here.
@@ -290,9 +363,45 @@ struct connection {
    */
   pthread_mutex_t request_lock; /* Forces serialization of requests */
   pthread_mutex_t read_lock; /* Read entire client payload off wire */
+  pthread_mutex_t retire_lock; /* Order replies for serialize_retirement */
   pthread_mutex_t write_lock; /* Protect sockout, write response to wire */
   pthread_mutex_t status_lock; /* Track current status of client */
 
+  pthread_cond_t retire_cond;
+  uint64_t recv_seq;    /* Sequence number of next request, under read_lock */
+  uint64_t retire_seq;  /* Sequence number of next reply, under retire_lock */
+
+  /* Count of requests handed to asynchronous plugin callbacks which
+   * have not yet been completed.  Protected by async_lock.
+   */
+  pthread_mutex_t async_lock;
+  pthread_cond_t async_cond;
+  unsigned async_inflight;
+
+  /* Worker threads are started on demand up to nworkers, and exit
+   * again after being idle for a while.  Protected by workers_lock.
+   */
+  pthread_mutex_t workers_lock;
+  pthread_cond_t workers_cond;
+  unsigned nthreads;            /* Running workers, including the first. */
+  unsigned nidle;               /* Workers not handling a request. */
+  unsigned next_worker;         /* Used to name new workers. */
+  bool reading;                 /* A worker is reading the next request. */
+
+  /* MSG_ZEROCOPY sends.  zerocopy may be cleared by any thread.
+   * zc_sent counts the zerocopy sends made so far and is protected by
+   * write_lock.  The other fields track completions reported by the
+   * kernel and are protected by zc_lock.
+   */
+  _Atomic bool zerocopy;
+  uint32_t zc_sent;
+  pthread_mutex_t zc_lock;
+  pthread_cond_t zc_cond;
+  uint32_t zc_done;             /* All sends before this have completed. */
+  bool zc_reading;              /* A thread is reading the error queue. */
+  zc_range_vector zc_pending;   /* Completions received out of order. */
+  zc_buffer_vector zc_free;     /* Buffers to free on completion. */
+
   conn_status status;
   int status_pipe[2]; /* track status changes via poll when nworkers > 1 */
   void *crypto_session;
@@ -310,6 +419,7 @@ struct connection {
 #endif
   bool using_tls;
   bool structured_replies;
+  bool extended_headers;
   bool meta_context_base_allocation;
 
   string_vector interns;
@@ -321,12 +431,32 @@ struct connection {
   connection_recv_function recv;
   /* If nworkers > 1, only call these while write_lock is held */
   connection_send_function send;
+  connection_sendv_function sendv;
+  /* NULL if data cannot be sent directly from a file descriptor */
+  connection_sendfile_function sendfile;
   connection_close_function close;
+
+  /* Set if the connection is handled by the epoll engine. */
+  struct engine_conn *engine;
 };
 
 extern void handle_single_connection (int sockin, int sockout);
+extern void finish_connection (struct connection *conn)
+  __attribute__ ((__nonnull__ (1)));
 extern conn_status connection_get_status (void);
 extern bool connection_set_status (conn_status value);
+extern int connection_sendv_emulated (const struct send_iov *iov, size_t n,
+                                      int flags)
+  __attribute__ ((__nonnull__ (1)));
+extern bool connection_zerocopy_done (uint32_t zc_sent);
+extern void connection_wait_zerocopy (uint32_t zc_sent);
+extern void connection_free_after_zerocopy (void *buf,
+                                            const struct zerocopy_ref *zc);
+
+/* engine.c */
+extern bool engine_add_connection (struct connection *conn)
+  __attribute__ ((__nonnull__ (1)));
+extern void engine_drain (void);
 
 /* protocol-handshake.c */
 extern int protocol_handshake (void);
@@ -341,7 +471,52 @@ extern int protocol_handshake_oldstyle (void);
 extern int protocol_handshake_newstyle (void);
 
 /* protocol.c */
+struct request {
+  uint64_t cookie;              /* Opaque handle, in network byte order. */
+  uint64_t seq;                 /* Order of the request on the connection. */
+  uint64_t offset;
+  uint64_t count;
+  uint16_t cmd;
+  uint16_t flags;
+  uint32_t error;               /* If non-zero, request failed validation. */
+  char *buf;                    /* Data buffer for read and write requests. */
+  struct nbdkit_extents *extents; /* Extents list for block status. */
+  bool async;                   /* Use the plugin async callbacks; if set,
+                                   buf is allocated and owned by req. */
+  bool in_place;                /* Write data was received into a buffer
+                                   from .prepare_pwrite. */
+};
+
+/* Passed to the plugin .async_pread and .async_pwrite callbacks, and
+ * handed back through nbdkit_request_complete.
+ */
+struct nbdkit_request {
+  /* If conn is NULL, a thread is waiting for the request to complete
+   * (see plugins.c).  Otherwise the reply is sent to conn.
+   */
+  struct connection *conn;
+  uint64_t cookie;
+  uint64_t offset;
+  uint32_t count;
+  uint16_t cmd;
+  uint16_t flags;
+  char *buf;
+
+  /* For --metrics, set by backend_async_pread/backend_async_pwrite. */
+  struct backend *b;
+  struct timespec start;
+
+  pthread_mutex_t lock;         /* Used only when conn is NULL. */
+  pthread_cond_t cond;
+  bool done;
+  int err;
+};
+extern int protocol_recv_request (struct request *req)
+  __attribute__ ((__nonnull__ (1)));
+extern bool protocol_handle_request_send_reply (struct request *req)
+  __attribute__ ((__nonnull__ (1)));
 extern bool protocol_recv_request_send_reply (void);
+extern void protocol_wait_for_async_requests (void);
 
 /* The context ID of base:allocation.  As far as I can tell it doesn't
  * matter what this is as long as nbdkit always returns the same
@@ -464,6 +639,27 @@ struct backend {
                   struct nbdkit_extents *extents, int *err);
   int (*cache) (struct context *,
                 uint32_t count, uint64_t offset, uint32_t flags, int *err);
+
+  /* These are NULL unless the backend is a plugin which provides the
+   * asynchronous callbacks.  They return 0 if the request was started,
+   * and the plugin will call nbdkit_request_complete later.
+   */
+  int (*async_pread) (struct context *,
+                      void *buf, uint32_t count, uint64_t offset,
+                      uint32_t flags, struct nbdkit_request *req, int *err);
+  int (*async_pwrite) (struct context *,
+                       const void *buf, uint32_t count, uint64_t offset,
+                       uint32_t flags, struct nbdkit_request *req, int *err);
+
+  /* NULL unless the backend is a plugin which provides .pread_fd. */
+  int (*pread_fd) (struct context *,
+                   uint32_t count, uint64_t offset, uint32_t flags,
+                   int *fd, uint64_t *fd_offset, int *err);
+
+  /* NULL unless the backend is a plugin which provides .prepare_pwrite. */
+  int (*prepare_pwrite) (struct context *,
+                         uint32_t count, uint64_t offset, uint32_t flags,
+                         void **buf, int *err);
 };
 
 extern void backend_init (struct backend *b, struct backend *next, size_t index,
@@ -495,7 +691,7 @@ extern int backend_finalize (struct context *c)
 extern void backend_close (struct context *c)
   __attribute__ ((__nonnull__ (1)));
 extern bool backend_valid_range (struct context *c,
-                                 uint64_t offset, uint32_t count)
+                                 uint64_t offset, uint64_t count)
   __attribute__ ((__nonnull__ (1)));
 
 extern const char *backend_export_description (struct context *c)
@@ -538,6 +734,24 @@ extern int backend_pwrite (struct context *c,
 extern int backend_flush (struct context *c,
                           uint32_t flags, int *err)
   __attribute__ ((__nonnull__ (1, 3)));
+extern int backend_async_pread (struct context *c,
+                                void *buf, uint32_t count, uint64_t offset,
+                                uint32_t flags, struct nbdkit_request *req,
+                                int *err)
+  __attribute__ ((__nonnull__ (1, 2, 6, 7)));
+extern int backend_async_pwrite (struct context *c,
+                                 const void *buf, uint32_t count,
+                                 uint64_t offset, uint32_t flags,
+                                 struct nbdkit_request *req, int *err)
+  __attribute__ ((__nonnull__ (1, 2, 6, 7)));
+extern int backend_pread_fd (struct context *c,
+                             uint32_t count, uint64_t offset, uint32_t flags,
+                             int *fd, uint64_t *fd_offset, int *err)
+  __attribute__ ((__nonnull__ (1, 5, 6, 7)));
+extern int backend_prepare_pwrite (struct context *c,
+                                   uint32_t count, uint64_t offset,
+                                   uint32_t flags, void **buf, int *err)
+  __attribute__ ((__nonnull__ (1, 5, 6)));
 extern int backend_trim (struct context *c,
                          uint32_t count, uint64_t offset, uint32_t flags,
                          int *err)
@@ -573,10 +787,13 @@ extern struct backend *filter_register (struct backend *next, size_t index,
 extern unsigned thread_model;
 extern void lock_init_thread_model (void);
 extern const char *name_of_thread_model (int model);
+extern int thread_model_min (int model1, int model2);
 extern void lock_connection (void);
 extern void unlock_connection (void);
 extern void lock_request (void);
 extern void unlock_request (void);
+extern void lock_retirement (uint64_t seq);
+extern void unlock_retirement (void);
 extern void lock_unload (void);
 extern void unlock_unload (void);
 
@@ -591,6 +808,7 @@ extern void accept_incoming_connections (const sockets *socks)
 /* threadlocal.c */
 extern void threadlocal_init (void);
 extern void threadlocal_new_server_thread (void);
+extern void threadlocal_new_foreign_thread (void);
 extern void threadlocal_set_name (const char *name)
   __attribute__ ((__nonnull__ (1)));
 extern const char *threadlocal_get_name (void);
@@ -602,6 +820,9 @@ extern void threadlocal_set_last_error (char *msg);
 extern void threadlocal_clear_last_error (void);
 extern const char *threadlocal_get_last_error (void);
 extern void *threadlocal_buffer (size_t size);
+extern void threadlocal_buffer_sent (const void *buf,
+                                     const struct zerocopy_ref *zc);
+extern void threadlocal_wait_zerocopy (void);
 extern void threadlocal_set_conn (struct connection *conn);
 extern struct connection *threadlocal_get_conn (void);
 extern struct context *threadlocal_get_context (void);
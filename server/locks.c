@@ -59,6 +59,8 @@ name_of_thread_model (int model)
     return "serialize_all_requests";
   case NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS:
     return "serialize_requests";
+  case NBDKIT_THREAD_MODEL_SERIALIZE_RETIREMENT:
+    return "serialize_retirement";
   case NBDKIT_THREAD_MODEL_PARALLEL:
     return "parallel";
   }
@@ -66,12 +68,31 @@ name_of_thread_model (int model)
   return buf;
 }
 
+/* SERIALIZE_RETIREMENT was added after PARALLEL, so the numeric
+ * values of the thread models no longer sort from most to least
+ * serialized.  Use this to pick the more serialized of two models.
+ */
+static int
+thread_model_rank (int model)
+{
+  if (model == NBDKIT_THREAD_MODEL_SERIALIZE_RETIREMENT)
+    return NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS * 2 + 1;
+  return model * 2;
+}
+
+int
+thread_model_min (int model1, int model2)
+{
+  return thread_model_rank (model1) <= thread_model_rank (model2)
+    ? model1 : model2;
+}
+
 void
 lock_init_thread_model (void)
 {
   thread_model = top->thread_model (top);
   debug ("using thread model: %s", name_of_thread_model (thread_model));
-  assert (thread_model <= NBDKIT_THREAD_MODEL_PARALLEL);
+  assert (thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_RETIREMENT);
 }
 
 void
@@ -124,6 +145,47 @@ unlock_request (void)
     abort ();
 }
 
+/* With the serialize_retirement thread model, requests on a
+ * connection are processed in parallel but replies must be sent in
+ * the order the requests were received.  Wait until the replies to
+ * all earlier requests have been sent.
+ */
+void
+lock_retirement (uint64_t seq)
+{
+  GET_CONN;
+
+  if (thread_model != NBDKIT_THREAD_MODEL_SERIALIZE_RETIREMENT ||
+      !conn->nworkers)
+    return;
+
+  if (pthread_mutex_lock (&conn->retire_lock))
+    abort ();
+  while (conn->retire_seq != seq)
+    if (pthread_cond_wait (&conn->retire_cond, &conn->retire_lock))
+      abort ();
+  if (pthread_mutex_unlock (&conn->retire_lock))
+    abort ();
+}
+
+void
+unlock_retirement (void)
+{
+  GET_CONN;
+
+  if (thread_model != NBDKIT_THREAD_MODEL_SERIALIZE_RETIREMENT ||
+      !conn->nworkers)
+    return;
+
+  if (pthread_mutex_lock (&conn->retire_lock))
+    abort ();
+  conn->retire_seq++;
+  if (pthread_cond_broadcast (&conn->retire_cond))
+    abort ();
+  if (pthread_mutex_unlock (&conn->retire_lock))
+    abort ();
+}
+
 void
 lock_unload (void)
 {
@@ -94,6 +94,7 @@ static void winsock_init (void);
 
 int tcpip_sock_af = AF_UNSPEC;  /* -4, -6 */
 struct debug_flag *debug_flags; /* -D */
+enum engine engine;             /* --engine */
 bool exit_with_parent;          /* --exit-with-parent */
 const char *export_name;        /* -e */
 bool foreground;                /* -f */
@@ -101,9 +102,11 @@ const char *ipaddr;             /* -i */
 bool keepalive;                 /* --keepalive */
 enum log_to log_to = LOG_TO_DEFAULT; /* --log */
 unsigned mask_handshake = ~0U;  /* --mask-handshake */
+char *metrics_file;             /* --metrics */
 bool newstyle = true;           /* false = -o, true = -n */
 bool no_mc;                     /* --no-meta-contexts */
 bool no_sr;                     /* --no-sr */
+bool no_zerocopy;               /* --no-zerocopy */
 char *pidfile;                  /* -P */
 const char *port;               /* -p */
 bool print_uri;                 /* --print-uri */
@@ -111,6 +114,7 @@ bool read_only;                 /* -r */
 const char *run;                /* --run */
 bool listen_stdin;              /* -s */
 const char *selinux_label;      /* --selinux-label */
+bool sparse_reads;              /* --sparse-reads */
 bool swap;                      /* --swap */
 unsigned threads;               /* -t */
 unsigned timeout_secs, timeout_nsecs; /* --timeout */
@@ -322,6 +326,25 @@ main (int argc, char *argv[])
       dump_plugin = true;
       break;
 
+    case ENGINE_OPTION:
+      if (strcmp (optarg, "threads") == 0)
+        engine = ENGINE_THREADS;
+      else if (strcmp (optarg, "epoll") == 0) {
+#ifdef __linux__
+        engine = ENGINE_EPOLL;
+#else
+        fprintf (stderr, "%s: --engine=epoll is only supported on Linux\n",
+                 program_name);
+        exit (EXIT_FAILURE);
+#endif
+      }
+      else {
+        fprintf (stderr, "%s: --engine must be \"threads\" or \"epoll\"\n",
+                 program_name);
+        exit (EXIT_FAILURE);
+      }
+      break;
+
     case EXIT_WITH_PARENT_OPTION:
       if (can_exit_with_parent ()) {
         exit_with_parent = true;
@@ -388,6 +411,13 @@ main (int argc, char *argv[])
         exit (EXIT_FAILURE);
       break;
 
+    case METRICS_OPTION:
+      free (metrics_file);
+      metrics_file = nbdkit_absolute_path (optarg);
+      if (metrics_file == NULL)
+        exit (EXIT_FAILURE);
+      break;
+
     case NO_MC_OPTION:
       no_mc = true;
       break;
@@ -396,6 +426,10 @@ main (int argc, char *argv[])
       no_sr = true;
       break;
 
+    case NO_ZEROCOPY_OPTION:
+      no_zerocopy = true;
+      break;
+
     case PRINT_URI:
       print_uri = true;
       break;
@@ -421,6 +455,10 @@ main (int argc, char *argv[])
       }
       exit (EXIT_SUCCESS);
 
+    case SPARSE_READS_OPTION:
+      sparse_reads = true;
+      break;
+
     case SWAP_OPTION:
       swap = 1;
       break;
@@ -861,6 +899,8 @@ main (int argc, char *argv[])
    */
   top->get_ready (top);
 
+  metrics_init ();
+
   /* Print the URI.  Do it just before we close stdio, especially
    * before setting 'configured' to true which makes nbdkit_stdio_safe
    * false.
@@ -882,12 +922,14 @@ main (int argc, char *argv[])
 
   start_serving ();
 
+  metrics_stop ();
   top->cleanup (top);
   top->free (top);
   top = NULL;
 
   free (unixsocket);
   free (pidfile);
+  free (metrics_file);
   free (uri);
 
   if (random_fifo) {
@@ -1158,6 +1200,7 @@ start_serving (void)
     change_user ();
     write_pidfile ();
     top->after_fork (top);
+    metrics_start_thread ();
     accept_incoming_connections (&socks);
     break;
 
@@ -1166,6 +1209,7 @@ start_serving (void)
     change_user ();
     write_pidfile ();
     top->after_fork (top);
+    metrics_start_thread ();
     threadlocal_new_server_thread ();
     handle_single_connection (saved_stdin, saved_stdout);
     break;
@@ -1189,6 +1233,7 @@ start_serving (void)
     fork_into_background ();
     write_pidfile ();
     top->after_fork (top);
+    metrics_start_thread ();
     accept_incoming_connections (&socks);
     break;
 
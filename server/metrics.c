@@ -0,0 +1,351 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/* Request latency histograms, written in Prometheus text format to
+ * the file named by --metrics.
+ *
+ * Every plugin and filter layer has a histogram for each data
+ * command, which is updated when that layer's callback returns, so
+ * the time for a filter includes the time spent in the layers below
+ * it.  Emulated operations (eg. zero emulated with pwrite) are
+ * counted as the operations used to emulate them.
+ *
+ * To avoid any locks on the data path, counters are relaxed atomics,
+ * and each layer has several copies ("shards") of its counters so
+ * that threads running on different CPUs do not fight over the same
+ * cache lines.  The shards are only added together when the file is
+ * written out.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+
+#include <pthread.h>
+
+#include "internal.h"
+#include "cleanup.h"
+
+/* How often (in seconds) the metrics file is rewritten. */
+#define METRICS_INTERVAL 1
+
+/* Buckets are powers of 2 microseconds, from 1us up to about 33s,
+ * plus a final +Inf bucket.
+ */
+#define NR_BUCKETS 27
+
+#define NR_SHARDS 16
+
+static const char *op_names[NR_METRICS_OPS] = {
+  [METRICS_PREAD] = "pread",
+  [METRICS_PWRITE] = "pwrite",
+  [METRICS_FLUSH] = "flush",
+  [METRICS_TRIM] = "trim",
+  [METRICS_ZERO] = "zero",
+  [METRICS_EXTENTS] = "extents",
+  [METRICS_CACHE] = "cache",
+};
+
+struct histogram {
+  _Atomic uint64_t buckets[NR_BUCKETS];
+  _Atomic uint64_t sum_usecs;
+  _Atomic uint64_t errors;
+};
+
+struct shard {
+  struct histogram ops[NR_METRICS_OPS];
+} __attribute__ ((__aligned__ (64)));
+
+struct layer {
+  struct shard shards[NR_SHARDS];
+};
+
+/* One entry per backend, indexed by backend->i. */
+static struct layer *layers;
+static size_t nr_layers;
+
+static pthread_t thread;
+static bool thread_running;
+static bool stop;
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+
+void
+metrics_init (void)
+{
+  if (!metrics_file)
+    return;
+
+  nr_layers = top->i + 1;
+  layers = calloc (nr_layers, sizeof *layers);
+  if (layers == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+}
+
+void
+metrics_start (struct timespec *start)
+{
+  if (layers)
+    clock_gettime (CLOCK_MONOTONIC, start);
+}
+
+static unsigned
+bucket_of (uint64_t usecs)
+{
+  unsigned i;
+
+  /* Bucket i holds durations <= 2^i microseconds. */
+  if (usecs <= 1)
+    return 0;
+  i = 64 - __builtin_clzll (usecs - 1);
+  return i < NR_BUCKETS - 1 ? i : NR_BUCKETS - 1;
+}
+
+static unsigned
+current_shard (void)
+{
+#ifdef __linux__
+  int cpu = sched_getcpu ();
+
+  if (cpu >= 0)
+    return cpu % NR_SHARDS;
+#endif
+  return 0;
+}
+
+void
+metrics_record (struct backend *b, enum metrics_op op,
+                const struct timespec *start, int r)
+{
+  struct timespec end;
+  struct histogram *h;
+  int64_t usecs;
+
+  if (!layers)
+    return;
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  usecs = (end.tv_sec - start->tv_sec) * INT64_C (1000000) +
+    (end.tv_nsec - start->tv_nsec) / 1000;
+
+  h = &layers[b->i].shards[current_shard ()].ops[op];
+  atomic_fetch_add_explicit (&h->buckets[bucket_of (usecs)], 1,
+                             memory_order_relaxed);
+  atomic_fetch_add_explicit (&h->sum_usecs, usecs, memory_order_relaxed);
+  if (r == -1)
+    atomic_fetch_add_explicit (&h->errors, 1, memory_order_relaxed);
+}
+
+/* Add up the shards of one histogram. */
+static void
+sum_histogram (const struct layer *layer, enum metrics_op op,
+               uint64_t *buckets, uint64_t *sum_usecs, uint64_t *errors)
+{
+  size_t i, j;
+
+  memset (buckets, 0, NR_BUCKETS * sizeof *buckets);
+  *sum_usecs = *errors = 0;
+  for (i = 0; i < NR_SHARDS; ++i) {
+    const struct histogram *h = &layer->shards[i].ops[op];
+
+    for (j = 0; j < NR_BUCKETS; ++j)
+      buckets[j] += atomic_load_explicit (&h->buckets[j],
+                                          memory_order_relaxed);
+    *sum_usecs += atomic_load_explicit (&h->sum_usecs, memory_order_relaxed);
+    *errors += atomic_load_explicit (&h->errors, memory_order_relaxed);
+  }
+}
+
+static void
+write_metrics (FILE *fp)
+{
+  struct backend *b;
+  uint64_t buckets[NR_BUCKETS], sum_usecs, errors, count;
+  size_t i;
+  int op;
+
+  fprintf (fp,
+           "# HELP nbdkit_request_duration_seconds "
+           "Time taken by each plugin and filter to handle requests.\n"
+           "# TYPE nbdkit_request_duration_seconds histogram\n");
+  for (b = top; b != NULL; b = b->next) {
+    for (op = 0; op < NR_METRICS_OPS; ++op) {
+      sum_histogram (&layers[b->i], op, buckets, &sum_usecs, &errors);
+      count = 0;
+      for (i = 0; i < NR_BUCKETS; ++i) {
+        count += buckets[i];
+        fprintf (fp,
+                 "nbdkit_request_duration_seconds_bucket"
+                 "{layer=\"%zu\",type=\"%s\",name=\"%s\",op=\"%s\",",
+                 b->i, b->type, b->name, op_names[op]);
+        if (i < NR_BUCKETS - 1)
+          fprintf (fp, "le=\"%.6f\"} %" PRIu64 "\n",
+                   (UINT64_C (1) << i) / 1000000.0, count);
+        else
+          fprintf (fp, "le=\"+Inf\"} %" PRIu64 "\n", count);
+      }
+      fprintf (fp,
+               "nbdkit_request_duration_seconds_sum"
+               "{layer=\"%zu\",type=\"%s\",name=\"%s\",op=\"%s\"} %.6f\n"
+               "nbdkit_request_duration_seconds_count"
+               "{layer=\"%zu\",type=\"%s\",name=\"%s\",op=\"%s\"} %" PRIu64
+               "\n",
+               b->i, b->type, b->name, op_names[op], sum_usecs / 1000000.0,
+               b->i, b->type, b->name, op_names[op], count);
+    }
+  }
+
+  fprintf (fp,
+           "# HELP nbdkit_request_errors_total "
+           "Number of requests which failed in each plugin and filter.\n"
+           "# TYPE nbdkit_request_errors_total counter\n");
+  for (b = top; b != NULL; b = b->next) {
+    for (op = 0; op < NR_METRICS_OPS; ++op) {
+      sum_histogram (&layers[b->i], op, buckets, &sum_usecs, &errors);
+      fprintf (fp,
+               "nbdkit_request_errors_total"
+               "{layer=\"%zu\",type=\"%s\",name=\"%s\",op=\"%s\"} %" PRIu64
+               "\n",
+               b->i, b->type, b->name, op_names[op], errors);
+    }
+  }
+}
+
+/* Write the metrics to a temporary file and rename it over the
+ * metrics file, so that readers never see a partial file.
+ */
+static void
+update_metrics_file (void)
+{
+  CLEANUP_FREE char *tmpfile = NULL;
+  FILE *fp;
+
+  if (asprintf (&tmpfile, "%s.tmp", metrics_file) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return;
+  }
+  fp = fopen (tmpfile, "w");
+  if (fp == NULL) {
+    nbdkit_error ("%s: %m", tmpfile);
+    return;
+  }
+  write_metrics (fp);
+  if (fclose (fp) == EOF) {
+    nbdkit_error ("%s: %m", tmpfile);
+    unlink (tmpfile);
+    return;
+  }
+  if (rename (tmpfile, metrics_file) == -1) {
+    nbdkit_error ("rename: %s: %m", metrics_file);
+    unlink (tmpfile);
+  }
+}
+
+static void *
+metrics_thread (void *vp)
+{
+  struct timespec ts;
+
+  threadlocal_new_server_thread ();
+  threadlocal_set_name ("metrics");
+
+  pthread_mutex_lock (&stop_lock);
+  while (!stop) {
+    pthread_mutex_unlock (&stop_lock);
+    update_metrics_file ();
+    pthread_mutex_lock (&stop_lock);
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += METRICS_INTERVAL;
+    while (!stop &&
+           pthread_cond_timedwait (&stop_cond, &stop_lock, &ts) != ETIMEDOUT)
+      ;
+  }
+  pthread_mutex_unlock (&stop_lock);
+  return NULL;
+}
+
+/* Start the thread which periodically writes the metrics file.  This
+ * is called after forking into the background.
+ */
+void
+metrics_start_thread (void)
+{
+  int err;
+
+  if (!layers)
+    return;
+
+  err = pthread_create (&thread, NULL, metrics_thread, NULL);
+  if (err != 0) {
+    errno = err;
+    perror ("pthread_create");
+    exit (EXIT_FAILURE);
+  }
+  thread_running = true;
+}
+
+/* Stop the thread and write the final metrics.  This must be called
+ * before the backends are freed.
+ */
+void
+metrics_stop (void)
+{
+  if (!layers)
+    return;
+
+  if (thread_running) {
+    pthread_mutex_lock (&stop_lock);
+    stop = true;
+    pthread_cond_signal (&stop_cond);
+    pthread_mutex_unlock (&stop_lock);
+    pthread_join (thread, NULL);
+    thread_running = false;
+  }
+  update_metrics_file ();
+
+  free (layers);
+  layers = NULL;
+}
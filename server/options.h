@@ -42,18 +42,22 @@ enum {
   HELP_OPTION = CHAR_MAX + 1,
   DUMP_CONFIG_OPTION,
   DUMP_PLUGIN_OPTION,
+  ENGINE_OPTION,
   EXIT_WITH_PARENT_OPTION,
   FILTER_OPTION,
   KEEPALIVE_OPTION,
   LOG_OPTION,
   LONG_OPTIONS_OPTION,
   MASK_HANDSHAKE_OPTION,
+  METRICS_OPTION,
   NO_MC_OPTION,
   NO_SR_OPTION,
+  NO_ZEROCOPY_OPTION,
   PRINT_URI,
   RUN_OPTION,
   SELINUX_LABEL_OPTION,
   SHORT_OPTIONS_OPTION,
+  SPARSE_READS_OPTION,
   SWAP_OPTION,
   TIMEOUT_OPTION,
   TLS_OPTION,
@@ -70,6 +74,7 @@ static const struct option long_options[] = {
   { "debug",            required_argument, NULL, 'D' },
   { "dump-config",      no_argument,       NULL, DUMP_CONFIG_OPTION },
   { "dump-plugin",      no_argument,       NULL, DUMP_PLUGIN_OPTION },
+  { "engine",           required_argument, NULL, ENGINE_OPTION },
   { "exit-with-parent", no_argument,       NULL, EXIT_WITH_PARENT_OPTION },
   { "export",           required_argument, NULL, 'e' },
   { "export-name",      required_argument, NULL, 'e' },
@@ -86,12 +91,14 @@ static const struct option long_options[] = {
   { "log",              required_argument, NULL, LOG_OPTION },
   { "long-options",     no_argument,       NULL, LONG_OPTIONS_OPTION },
   { "mask-handshake",   required_argument, NULL, MASK_HANDSHAKE_OPTION },
+  { "metrics",          required_argument, NULL, METRICS_OPTION },
   { "new-style",        no_argument,       NULL, 'n' },
   { "newstyle",         no_argument,       NULL, 'n' },
   { "no-mc",            no_argument,       NULL, NO_MC_OPTION },
   { "no-meta-contexts", no_argument,       NULL, NO_MC_OPTION },
   { "no-sr",            no_argument,       NULL, NO_SR_OPTION },
   { "no-structured-replies", no_argument,  NULL, NO_SR_OPTION },
+  { "no-zerocopy",      no_argument,       NULL, NO_ZEROCOPY_OPTION },
   { "old-style",        no_argument,       NULL, 'o' },
   { "oldstyle",         no_argument,       NULL, 'o' },
   { "pid-file",         required_argument, NULL, 'P' },
@@ -108,6 +115,7 @@ static const struct option long_options[] = {
   { "show-url",         no_argument,       NULL, PRINT_URI },
   { "single",           no_argument,       NULL, 's' },
   { "stdin",            no_argument,       NULL, 's' },
+  { "sparse-reads",     no_argument,       NULL, SPARSE_READS_OPTION },
   { "swap",             no_argument,       NULL, SWAP_OPTION },
   { "threads",          required_argument, NULL, 't' },
   { "timeout",          required_argument, NULL, TIMEOUT_OPTION },
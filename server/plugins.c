@@ -84,8 +84,7 @@ plugin_thread_model (struct backend *b)
     r = p->plugin.thread_model ();
     if (r == -1)
       exit (EXIT_FAILURE);
-    if (r < model)
-      model = r;
+    model = thread_model_min (r, model);
   }
 
   return model;
@@ -188,6 +187,10 @@ plugin_dump_fields (struct backend *b)
 
   HAS (pread);
   HAS (pwrite);
+  HAS (async_pread);
+  HAS (async_pwrite);
+  HAS (pread_fd);
+  HAS (prepare_pwrite);
   HAS (flush);
   HAS (trim);
   HAS (zero);
@@ -487,7 +490,7 @@ plugin_can_write (struct context *c)
   if (p->plugin.can_write)
     return normalize_bool (p->plugin.can_write (c->handle));
   else
-    return p->plugin.pwrite || p->plugin._pwrite_v1;
+    return p->plugin.pwrite || p->plugin._pwrite_v1 || p->plugin.async_pwrite;
 }
 
 static int
@@ -647,6 +650,40 @@ get_errno (struct backend_plugin *p)
   return ret ? ret : EIO;
 }
 
+/* Used when a plugin only has the asynchronous form of a callback, to
+ * wait for the request started by the callback to complete.  r is
+ * the return value of the callback.
+ */
+static void
+init_sync_request (struct nbdkit_request *req)
+{
+  memset (req, 0, sizeof *req);
+  pthread_mutex_init (&req->lock, NULL);
+  pthread_cond_init (&req->cond, NULL);
+}
+
+static int
+wait_for_sync_request (struct backend_plugin *p, struct nbdkit_request *req,
+                       int r, int *err)
+{
+  if (r == -1)
+    *err = get_errno (p);
+  else {
+    pthread_mutex_lock (&req->lock);
+    while (!req->done)
+      pthread_cond_wait (&req->cond, &req->lock);
+    pthread_mutex_unlock (&req->lock);
+    if (req->err) {
+      *err = req->err;
+      r = -1;
+    }
+  }
+
+  pthread_mutex_destroy (&req->lock);
+  pthread_cond_destroy (&req->cond);
+  return r;
+}
+
 static int
 plugin_pread (struct context *c,
               void *buf, uint32_t count, uint64_t offset, uint32_t flags,
@@ -654,14 +691,80 @@ plugin_pread (struct context *c,
 {
   struct backend *b = c->b;
   struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  struct nbdkit_request req;
   int r;
 
-  assert (p->plugin.pread || p->plugin._pread_v1);
+  assert (p->plugin.pread || p->plugin._pread_v1 || p->plugin.async_pread);
 
   if (p->plugin.pread)
     r = p->plugin.pread (c->handle, buf, count, offset, 0);
-  else
+  else if (p->plugin._pread_v1)
     r = p->plugin._pread_v1 (c->handle, buf, count, offset);
+  else {
+    init_sync_request (&req);
+    r = p->plugin.async_pread (c->handle, buf, count, offset, 0, &req);
+    return wait_for_sync_request (p, &req, r, err);
+  }
+  if (r == -1)
+    *err = get_errno (p);
+  return r;
+}
+
+static int
+plugin_async_pread (struct context *c,
+                    void *buf, uint32_t count, uint64_t offset,
+                    uint32_t flags, struct nbdkit_request *req, int *err)
+{
+  struct backend *b = c->b;
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  int r;
+
+  r = p->plugin.async_pread (c->handle, buf, count, offset, flags, req);
+  if (r == -1)
+    *err = get_errno (p);
+  return r;
+}
+
+static int
+plugin_pread_fd (struct context *c,
+                 uint32_t count, uint64_t offset, uint32_t flags,
+                 int *fd, uint64_t *fd_offset, int *err)
+{
+  struct backend *b = c->b;
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  int r;
+
+  r = p->plugin.pread_fd (c->handle, count, offset, flags, fd, fd_offset);
+  if (r == -1)
+    *err = get_errno (p);
+  return r;
+}
+
+static int
+plugin_prepare_pwrite (struct context *c,
+                       uint32_t count, uint64_t offset, uint32_t flags,
+                       void **buf, int *err)
+{
+  struct backend *b = c->b;
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  int r;
+
+  r = p->plugin.prepare_pwrite (c->handle, count, offset, flags, buf);
+  if (r == -1)
+    *err = get_errno (p);
+  return r;
+}
+
+static int
+plugin_async_pwrite (struct context *c,
+                     const void *buf, uint32_t count, uint64_t offset,
+                     uint32_t flags, struct nbdkit_request *req, int *err)
+{
+  struct backend *b = c->b;
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  int r;
+
+  r = p->plugin.async_pwrite (c->handle, buf, count, offset, flags, req);
   if (r == -1)
     *err = get_errno (p);
   return r;
@@ -698,6 +801,7 @@ plugin_pwrite (struct context *c,
   struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
   bool fua = flags & NBDKIT_FLAG_FUA;
   bool need_flush = false;
+  struct nbdkit_request req;
 
   if (fua && backend_can_fua (c) != NBDKIT_FUA_NATIVE) {
     flags &= ~NBDKIT_FLAG_FUA;
@@ -707,6 +811,11 @@ plugin_pwrite (struct context *c,
     r = p->plugin.pwrite (c->handle, buf, count, offset, flags);
   else if (p->plugin._pwrite_v1)
     r = p->plugin._pwrite_v1 (c->handle, buf, count, offset);
+  else if (p->plugin.async_pwrite) {
+    init_sync_request (&req);
+    r = p->plugin.async_pwrite (c->handle, buf, count, offset, flags, &req);
+    r = wait_for_sync_request (p, &req, r, err);
+  }
   else {
     *err = EROFS;
     return -1;
@@ -902,6 +1011,10 @@ static struct backend plugin_functions = {
   .zero = plugin_zero,
   .extents = plugin_extents,
   .cache = plugin_cache,
+  .async_pread = plugin_async_pread,
+  .async_pwrite = plugin_async_pwrite,
+  .pread_fd = plugin_pread_fd,
+  .prepare_pwrite = plugin_prepare_pwrite,
 };
 
 /* Register and load a plugin. */
@@ -965,12 +1078,23 @@ plugin_register (size_t index, const char *filename,
              program_name, filename);
     exit (EXIT_FAILURE);
   }
-  if (p->plugin.pread == NULL && p->plugin._pread_v1 == NULL) {
+  if (p->plugin.pread == NULL && p->plugin._pread_v1 == NULL &&
+      p->plugin.async_pread == NULL) {
     fprintf (stderr, "%s: %s: plugin must have a .pread callback\n",
              program_name, filename);
     exit (EXIT_FAILURE);
   }
 
+  /* The server only uses the asynchronous callbacks if they exist. */
+  if (p->plugin.async_pread == NULL)
+    p->backend.async_pread = NULL;
+  if (p->plugin.async_pwrite == NULL)
+    p->backend.async_pwrite = NULL;
+  if (p->plugin.pread_fd == NULL)
+    p->backend.pread_fd = NULL;
+  if (p->plugin.prepare_pwrite == NULL)
+    p->backend.prepare_pwrite = NULL;
+
   backend_load (&p->backend, p->plugin.name, p->plugin.load);
 
   return (struct backend *) p;
@@ -563,6 +563,7 @@ negotiate_handshake_newstyle_options (void)
         debug ("using TLS on this connection");
         /* Wipe out any cached state. */
         conn->structured_replies = false;
+        conn->extended_headers = false;
         free (conn->exportname_from_set_meta_context);
         conn->exportname_from_set_meta_context = NULL;
         conn->meta_context_base_allocation = false;
@@ -777,6 +778,18 @@ negotiate_handshake_newstyle_options (void)
         break;
       }
 
+      /* Extended headers imply structured replies, and the NBD spec
+       * says the client must not go back to the compact headers.
+       */
+      if (conn->extended_headers) {
+        if (send_newstyle_option_reply (option,
+                                        NBD_REP_ERR_EXT_HEADER_REQD) == -1)
+          return -1;
+        debug ("newstyle negotiation: %s: extended headers already in use",
+               name_of_nbd_opt (option));
+        break;
+      }
+
       if (conn->structured_replies) {
         if (send_newstyle_option_reply (option, NBD_REP_ERR_INVALID) == -1)
           return -1;
@@ -791,6 +804,51 @@ negotiate_handshake_newstyle_options (void)
       conn->structured_replies = true;
       break;
 
+    case NBD_OPT_EXTENDED_HEADERS:
+      if (optlen != 0) {
+        debug ("ignoring request, client sent unexpected payload: %s",
+               name_of_nbd_opt (option));
+        if (send_newstyle_option_reply (option, NBD_REP_ERR_INVALID)
+            == -1)
+          return -1;
+        if (conn_recv_full (data, optlen,
+                            "read: %s: %m", name_of_nbd_opt (option)) == -1)
+          return -1;
+        continue;
+      }
+
+      debug ("newstyle negotiation: %s: client requested extended headers",
+             name_of_nbd_opt (option));
+
+      /* Extended headers are a superset of structured replies, so
+       * --no-sr disables them too.
+       */
+      if (no_sr) {
+        if (send_newstyle_option_reply (option, NBD_REP_ERR_UNSUP) == -1)
+          return -1;
+        debug ("newstyle negotiation: %s: extended headers are disabled",
+               name_of_nbd_opt (option));
+        break;
+      }
+
+      if (conn->extended_headers) {
+        if (send_newstyle_option_reply (option, NBD_REP_ERR_INVALID) == -1)
+          return -1;
+        debug ("newstyle negotiation: %s: extended headers already in use",
+               name_of_nbd_opt (option));
+        break;
+      }
+
+      if (send_newstyle_option_reply (option, NBD_REP_ACK) == -1)
+        return -1;
+
+      /* It is permitted to negotiate extended headers after
+       * structured replies, in which case they supersede them.
+       */
+      conn->extended_headers = true;
+      conn->structured_replies = true;
+      break;
+
     case NBD_OPT_LIST_META_CONTEXT:
     case NBD_OPT_SET_META_CONTEXT:
       {
@@ -42,14 +42,34 @@
 #include <errno.h>
 #include <assert.h>
 
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
+
 #include "internal.h"
 #include "byte-swapping.h"
+#include "iszero.h"
 #include "minmax.h"
 #include "nbd-protocol.h"
 #include "protostrings.h"
 
+/* The backend API only deals with 32 bit counts, but once extended
+ * headers are negotiated the client can send 64 bit effect lengths
+ * for trim, zero, cache and block status.  Such requests are split
+ * into chunks of at most this size, which is a multiple of the
+ * largest minimum block size that a plugin may advertise.
+ */
+#define MAX_BACKEND_CHUNK (UINT32_MAX & ~UINT32_C (65535))
+
+/* With --sparse-reads, when structured replies are in use, read
+ * replies are scanned in blocks of this size (aligned to the export
+ * offset) and runs of zero blocks are sent as
+ * NBD_REPLY_TYPE_OFFSET_HOLE chunks instead of data.
+ */
+#define SPARSE_READ_BLOCK 4096
+
 static bool
-validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
+validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint64_t count,
                   uint32_t *error)
 {
   GET_CONN;
@@ -75,7 +95,7 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
     if (!backend_valid_range (conn->top_context, offset, count)) {
       /* XXX Allow writes to extend the disk? */
       nbdkit_error ("invalid request: %s: offset and count are out of range: "
-                    "offset=%" PRIu64 " count=%" PRIu32,
+                    "offset=%" PRIu64 " count=%" PRIu64,
                     name_of_nbd_cmd (cmd), offset, count);
       *error = (cmd == NBD_CMD_WRITE ||
                 cmd == NBD_CMD_WRITE_ZEROES) ? ENOSPC : EINVAL;
@@ -102,11 +122,21 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
   /* Validate flags */
   if (flags & ~(NBD_CMD_FLAG_FUA | NBD_CMD_FLAG_NO_HOLE |
                 NBD_CMD_FLAG_DF | NBD_CMD_FLAG_REQ_ONE |
-                NBD_CMD_FLAG_FAST_ZERO)) {
+                NBD_CMD_FLAG_FAST_ZERO |
+                (conn->extended_headers ? NBD_CMD_FLAG_PAYLOAD_LEN : 0))) {
     nbdkit_error ("invalid request: unknown flag (0x%x)", flags);
     *error = EINVAL;
     return false;
   }
+  /* We don't advertise block status payloads, so the only command
+   * which may carry this flag is NBD_CMD_WRITE, where it is ignored.
+   */
+  if ((flags & NBD_CMD_FLAG_PAYLOAD_LEN) &&
+      cmd != NBD_CMD_WRITE) {
+    nbdkit_error ("invalid request: PAYLOAD_LEN flag needs WRITE request");
+    *error = EINVAL;
+    return false;
+  }
   if ((flags & NBD_CMD_FLAG_NO_HOLE) &&
       cmd != NBD_CMD_WRITE_ZEROES) {
     nbdkit_error ("invalid request: NO_HOLE flag needs WRITE_ZEROES request");
@@ -149,7 +179,7 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
   /* Refuse over-large read and write requests. */
   if ((cmd == NBD_CMD_WRITE || cmd == NBD_CMD_READ) &&
       count > MAX_REQUEST_SIZE) {
-    nbdkit_error ("invalid request: %s: data request is too large (%" PRIu32
+    nbdkit_error ("invalid request: %s: data request is too large (%" PRIu64
                   " > %d)",
                   name_of_nbd_cmd (cmd), count, MAX_REQUEST_SIZE);
     *error = ENOMEM;
@@ -210,13 +240,73 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
   return true;                     /* Command validates. */
 }
 
+/* Sub-function of handle_request for NBD_CMD_BLOCK_STATUS.
+ *
+ * A 64 bit request may be larger than one backend call can cover, so
+ * keep querying from the end of the previous answer until the whole
+ * request is covered.  Each query fills its own extents list (which
+ * must start at the offset being queried) and the results are then
+ * appended to the list that will be sent to the client.
+ */
+static int
+handle_extents (struct context *c, uint64_t count, uint64_t offset,
+                uint32_t flags, struct nbdkit_extents *extents, int *err)
+{
+  const uint64_t end = offset + count;
+  int64_t size;
+
+  if (count <= MAX_BACKEND_CHUNK || (flags & NBDKIT_FLAG_REQ_ONE))
+    return backend_extents (c, MIN (count, MAX_BACKEND_CHUNK), offset, flags,
+                            extents, err);
+
+  size = backend_get_size (c);
+  assert (size >= 0);           /* Cached during negotiation. */
+
+  while (offset < end) {
+    CLEANUP_EXTENTS_FREE struct nbdkit_extents *chunk = NULL;
+    struct nbdkit_extent e, last;
+    size_t i, n;
+
+    chunk = nbdkit_extents_new (offset, size);
+    if (chunk == NULL) {
+      *err = errno;
+      return -1;
+    }
+    if (backend_extents (c, MIN (end - offset, MAX_BACKEND_CHUNK), offset,
+                         flags, chunk, err) == -1)
+      return -1;
+
+    n = nbdkit_extents_count (chunk);
+    if (n == 0)
+      break;
+    for (i = 0; i < n; ++i) {
+      e = nbdkit_get_extent (chunk, i);
+      if (nbdkit_add_extent (extents, e.offset, e.length, e.type) == -1) {
+        *err = errno;
+        return -1;
+      }
+    }
+    offset = e.offset + e.length;
+
+    /* If the final list did not grow as far as this chunk then it is
+     * full, so there is no point asking for more.
+     */
+    last = nbdkit_get_extent (extents, nbdkit_extents_count (extents) - 1);
+    if (last.offset + last.length < offset)
+      break;
+  }
+
+  return 0;
+}
+
 /* This is called with the request lock held to actually execute the
  * request (by calling the plugin).  Note that the request fields have
  * been validated already in 'validate_request' so we don't have to
  * check them again.
  *
  * 'buf' is either the data to be written or the data to be returned,
- * and points to a buffer of size 'count' bytes.
+ * and points to a buffer of size 'count' bytes.  For other commands
+ * 'count' may exceed 32 bits if extended headers were negotiated.
  *
  * 'extents' is an empty extents list used for block status requests
  * only.
@@ -226,7 +316,7 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
  * for success).
  */
 static uint32_t
-handle_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
+handle_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint64_t count,
                 void *buf, struct nbdkit_extents *extents)
 {
   GET_CONN;
@@ -265,13 +355,25 @@ handle_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
   case NBD_CMD_TRIM:
     if (flags & NBD_CMD_FLAG_FUA)
       f |= NBDKIT_FLAG_FUA;
-    if (backend_trim (c, count, offset, f, &err) == -1)
-      return err;
+    while (count > 0) {
+      const uint32_t n = MIN (count, MAX_BACKEND_CHUNK);
+
+      if (backend_trim (c, n, offset, f, &err) == -1)
+        return err;
+      offset += n;
+      count -= n;
+    }
     break;
 
   case NBD_CMD_CACHE:
-    if (backend_cache (c, count, offset, 0, &err) == -1)
-      return err;
+    while (count > 0) {
+      const uint32_t n = MIN (count, MAX_BACKEND_CHUNK);
+
+      if (backend_cache (c, n, offset, 0, &err) == -1)
+        return err;
+      offset += n;
+      count -= n;
+    }
     break;
 
   case NBD_CMD_WRITE_ZEROES:
@@ -281,15 +383,20 @@ handle_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
       f |= NBDKIT_FLAG_FUA;
     if (flags & NBD_CMD_FLAG_FAST_ZERO)
       f |= NBDKIT_FLAG_FAST_ZERO;
-    if (backend_zero (c, count, offset, f, &err) == -1)
-      return err;
+    while (count > 0) {
+      const uint32_t n = MIN (count, MAX_BACKEND_CHUNK);
+
+      if (backend_zero (c, n, offset, f, &err) == -1)
+        return err;
+      offset += n;
+      count -= n;
+    }
     break;
 
   case NBD_CMD_BLOCK_STATUS:
     if (flags & NBD_CMD_FLAG_REQ_ONE)
       f |= NBDKIT_FLAG_REQ_ONE;
-    if (backend_extents (c, count, offset, f,
-                         extents, &err) == -1)
+    if (handle_extents (c, count, offset, f, extents, &err) == -1)
       return err;
     break;
 
@@ -301,10 +408,12 @@ handle_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
 }
 
 static int
-skip_over_write_buffer (int sock, size_t count)
+skip_over_write_buffer (uint64_t count)
 {
+  GET_CONN;
   char buf[BUFSIZ];
-  ssize_t r;
+  size_t n;
+  int r;
 
   if (count > MAX_REQUEST_SIZE * 2) {
     nbdkit_error ("write request too large to skip");
@@ -312,7 +421,8 @@ skip_over_write_buffer (int sock, size_t count)
   }
 
   while (count > 0) {
-    r = read (sock, buf, count > BUFSIZ ? BUFSIZ : count);
+    n = count > BUFSIZ ? BUFSIZ : count;
+    r = conn->recv (buf, n);
     if (r == -1) {
       nbdkit_error ("skipping write buffer: %m");
       return -1;
@@ -322,7 +432,7 @@ skip_over_write_buffer (int sock, size_t count)
       errno = EBADMSG;
       return -1;
     }
-    count -= r;
+    count -= n;
   }
   return 0;
 }
@@ -371,100 +481,300 @@ nbd_errno (int error, uint16_t flags)
 static bool
 send_simple_reply (uint64_t cookie, uint16_t cmd, uint16_t flags,
                    const char *buf, uint32_t count,
-                   uint32_t error)
+                   uint32_t error, struct zerocopy_ref *zc)
 {
   GET_CONN;
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
   struct nbd_simple_reply reply;
-  int r;
-  int f = (cmd == NBD_CMD_READ && !error) ? SEND_MORE : 0;
+  struct send_iov iov[2];
+  size_t n = 1;
+  uint32_t zc_sent;
+
+  assert (!conn->extended_headers);
 
   reply.magic = htobe32 (NBD_SIMPLE_REPLY_MAGIC);
   reply.cookie = cookie;
   reply.error = htobe32 (nbd_errno (error, flags));
 
-  r = conn->send (&reply, sizeof reply, f);
-  if (r == -1) {
+  /* Send the reply header and read data buffer together. */
+  iov[0].base = &reply;
+  iov[0].len = sizeof reply;
+  if (cmd == NBD_CMD_READ && !error) {
+    iov[1].base = buf;
+    iov[1].len = count;
+    n = 2;
+  }
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
+  zc_sent = conn->zc_sent;
+  if (conn->sendv (iov, n, SEND_ZEROCOPY) == -1) {
     nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
     return connection_set_status (STATUS_DEAD);
   }
-
-  /* Send the read data buffer. */
-  if (cmd == NBD_CMD_READ && !error) {
-    r = conn->send (buf, count, 0);
-    if (r == -1) {
-      nbdkit_error ("write data: %s: %m", name_of_nbd_cmd (cmd));
-      return connection_set_status (STATUS_DEAD);
-    }
+  if (conn->zc_sent != zc_sent) {
+    zc->pending = true;
+    zc->zc_sent = conn->zc_sent;
   }
   return false;
 }
 
+/* The header of a structured reply chunk, in either format. */
+union structured_reply_header {
+  struct nbd_structured_reply compact;
+  struct nbd_extended_reply extended;
+};
+
+/* Fill in the header of a structured reply chunk and return its
+ * length.  If extended headers were negotiated this uses the extended
+ * reply format, which also echoes the client's offset.  'length' is
+ * the length of the chunk payload that follows.
+ */
+static size_t
+make_structured_reply_header (union structured_reply_header *reply,
+                              uint64_t cookie, uint16_t flags, uint16_t type,
+                              uint64_t offset, uint64_t length)
+{
+  GET_CONN;
+
+  if (conn->extended_headers) {
+    reply->extended.magic = htobe32 (NBD_EXTENDED_REPLY_MAGIC);
+    reply->extended.cookie = cookie;
+    reply->extended.flags = htobe16 (flags);
+    reply->extended.type = htobe16 (type);
+    reply->extended.offset = htobe64 (offset);
+    reply->extended.length = htobe64 (length);
+    return sizeof reply->extended;
+  }
+  else {
+    assert (length <= UINT32_MAX);
+    reply->compact.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
+    reply->compact.cookie = cookie;
+    reply->compact.flags = htobe16 (flags);
+    reply->compact.type = htobe16 (type);
+    reply->compact.length = htobe32 (length);
+    return sizeof reply->compact;
+  }
+}
+
+/* Send the header of a structured reply chunk.  'length' is the
+ * length of the chunk payload that the caller will send next.  Must
+ * be called with the write lock held.
+ */
+static int
+send_structured_reply_header (uint64_t cookie, uint16_t flags, uint16_t type,
+                              uint64_t offset, uint64_t length, int f)
+{
+  GET_CONN;
+  union structured_reply_header reply;
+  size_t len;
+
+  len = make_structured_reply_header (&reply, cookie, flags, type,
+                                      offset, length);
+  return conn->send (&reply, len, f);
+}
+
+/* With extended headers there are no simple replies, so commands
+ * which return no data are acknowledged with an empty final chunk.
+ */
 static bool
-send_structured_reply_read (uint64_t cookie, uint16_t cmd,
-                            const char *buf, uint32_t count, uint64_t offset)
+send_structured_reply_none (uint64_t cookie, uint16_t cmd, uint64_t offset)
 {
   GET_CONN;
-  /* Once we are really using structured replies and sending data back
-   * in chunks, we'll be able to grab the write lock for each chunk,
-   * allowing other threads to interleave replies.  As we're not doing
-   * that yet we acquire the lock for the whole function.
-   */
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
-  struct nbd_structured_reply reply;
-  struct nbd_chunk_offset_data offset_data;
   int r;
 
-  assert (cmd == NBD_CMD_READ);
-
-  reply.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
-  reply.cookie = cookie;
-  reply.flags = htobe16 (NBD_REPLY_FLAG_DONE);
-  reply.type = htobe16 (NBD_REPLY_TYPE_OFFSET_DATA);
-  reply.length = htobe32 (count + sizeof offset_data);
-
-  r = conn->send (&reply, sizeof reply, SEND_MORE);
+  r = send_structured_reply_header (cookie, NBD_REPLY_FLAG_DONE,
+                                    NBD_REPLY_TYPE_NONE, offset, 0, 0);
   if (r == -1) {
     nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
     return connection_set_status (STATUS_DEAD);
   }
+  return false;
+}
 
-  /* Send the offset + read data buffer. */
-  offset_data.offset = htobe64 (offset);
-  r = conn->send (&offset_data, sizeof offset_data, SEND_MORE);
-  if (r == -1) {
-    nbdkit_error ("write data: %s: %m", name_of_nbd_cmd (cmd));
-    return connection_set_status (STATUS_DEAD);
+/* Send one NBD_REPLY_TYPE_OFFSET_DATA or NBD_REPLY_TYPE_OFFSET_HOLE
+ * chunk of a read reply.  'offset' is the client's request offset
+ * (echoed in extended headers), 'chunk_offset' is the offset of this
+ * chunk.  The caller must hold the write lock.
+ */
+static int
+send_read_chunk (uint64_t cookie, uint16_t flags, uint16_t type,
+                 uint64_t offset, uint64_t chunk_offset,
+                 const char *buf, uint32_t len)
+{
+  GET_CONN;
+  union structured_reply_header reply;
+  struct nbd_chunk_offset_data offset_data;
+  struct nbd_chunk_offset_hole offset_hole;
+  struct send_iov iov[3];
+  int send_flags = flags & NBD_REPLY_FLAG_DONE ? 0 : SEND_MORE;
+
+  iov[0].base = &reply;
+  if (type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+    iov[0].len = make_structured_reply_header (&reply, cookie, flags, type,
+                                               offset, sizeof offset_hole);
+    offset_hole.offset = htobe64 (chunk_offset);
+    offset_hole.length = htobe32 (len);
+    iov[1].base = &offset_hole;
+    iov[1].len = sizeof offset_hole;
+    return conn->sendv (iov, 2, send_flags);
+  }
+
+  assert (type == NBD_REPLY_TYPE_OFFSET_DATA);
+  iov[0].len = make_structured_reply_header (&reply, cookie, flags, type,
+                                             offset,
+                                             len + sizeof offset_data);
+  offset_data.offset = htobe64 (chunk_offset);
+  iov[1].base = &offset_data;
+  iov[1].len = sizeof offset_data;
+  iov[2].base = buf;
+  iov[2].len = len;
+  return conn->sendv (iov, 3, send_flags | SEND_ZEROCOPY);
+}
+
+/* A chunk of a read reply. */
+struct read_chunk {
+  uint16_t type;                /* NBD_REPLY_TYPE_OFFSET_DATA or _HOLE */
+  uint32_t start, len;          /* Relative to the read buffer. */
+};
+DEFINE_VECTOR_TYPE (read_chunks, struct read_chunk);
+
+/* Split the read buffer into chunks, with runs of zero blocks as
+ * holes.  This is done before taking the write lock because scanning
+ * a large buffer takes a while.  Returns -1 on allocation failure.
+ */
+static int
+find_read_chunks (const char *buf, uint32_t count, uint64_t offset,
+                  read_chunks *chunks)
+{
+  uint32_t data_start = 0, pos = 0;
+
+  while (pos < count) {
+    uint32_t hole_start = pos, hole_end = pos, n;
+
+    /* Extend the run of zero blocks starting at pos as far as it goes. */
+    for (;;) {
+      n = SPARSE_READ_BLOCK - (offset + hole_end) % SPARSE_READ_BLOCK;
+      n = MIN (n, count - hole_end);
+      if (n == 0 || !is_zero (&buf[hole_end], n))
+        break;
+      hole_end += n;
+    }
+
+    /* Zero runs shorter than a block are not worth a separate chunk,
+     * so leave them in the surrounding data and skip over the
+     * non-zero block which ended the run.
+     */
+    if (hole_end - hole_start < SPARSE_READ_BLOCK) {
+      pos = hole_end + n;
+      continue;
+    }
+
+    if (data_start < hole_start &&
+        read_chunks_append (chunks,
+                            (struct read_chunk) {
+                              .type = NBD_REPLY_TYPE_OFFSET_DATA,
+                              .start = data_start,
+                              .len = hole_start - data_start }) == -1)
+      return -1;
+    if (read_chunks_append (chunks,
+                            (struct read_chunk) {
+                              .type = NBD_REPLY_TYPE_OFFSET_HOLE,
+                              .start = hole_start,
+                              .len = hole_end - hole_start }) == -1)
+      return -1;
+    data_start = pos = hole_end;
+  }
+
+  if (data_start < count &&
+      read_chunks_append (chunks,
+                          (struct read_chunk) {
+                            .type = NBD_REPLY_TYPE_OFFSET_DATA,
+                            .start = data_start,
+                            .len = count - data_start }) == -1)
+    return -1;
+  return 0;
+}
+
+static bool
+send_structured_reply_read (uint64_t cookie, uint16_t cmd, uint16_t flags,
+                            const char *buf, uint32_t count, uint64_t offset,
+                            struct zerocopy_ref *zc)
+{
+  GET_CONN;
+  read_chunks chunks = empty_vector;
+  uint32_t zc_sent;
+  size_t i;
+  int r = 0;
+
+  assert (cmd == NBD_CMD_READ);
+
+  /* If the client set NBD_CMD_FLAG_DF it wants the whole reply in a
+   * single chunk, so we cannot elide holes.  If the scan fails we can
+   * still send the data.
+   */
+  if (sparse_reads && !(flags & NBD_CMD_FLAG_DF) &&
+      count >= SPARSE_READ_BLOCK &&
+      find_read_chunks (buf, count, offset, &chunks) == -1)
+    read_chunks_reset (&chunks);
+
+  {
+    /* The chunks of one reply are sent together under the write lock,
+     * so replies to other requests are never interleaved with them.
+     */
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
+    zc_sent = conn->zc_sent;
+    if (chunks.len == 0)
+      r = send_read_chunk (cookie, NBD_REPLY_FLAG_DONE,
+                           NBD_REPLY_TYPE_OFFSET_DATA, offset, offset,
+                           buf, count);
+    for (i = 0; r == 0 && i < chunks.len; ++i) {
+      const struct read_chunk *chunk = &chunks.ptr[i];
+
+      r = send_read_chunk (cookie,
+                           i == chunks.len - 1 ? NBD_REPLY_FLAG_DONE : 0,
+                           chunk->type, offset, offset + chunk->start,
+                           &buf[chunk->start], chunk->len);
+    }
+    if (conn->zc_sent != zc_sent) {
+      zc->pending = true;
+      zc->zc_sent = conn->zc_sent;
+    }
   }
 
-  r = conn->send (buf, count, 0);
+  read_chunks_reset (&chunks);
   if (r == -1) {
-    nbdkit_error ("write data: %s: %m", name_of_nbd_cmd (cmd));
+    nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
     return connection_set_status (STATUS_DEAD);
   }
   return false;
 }
 
-/* Convert a list of extents into NBD_REPLY_TYPE_BLOCK_STATUS blocks.
- * The rules here are very complicated.  Read the spec carefully!
+/* Convert a list of extents into block descriptors for either
+ * NBD_REPLY_TYPE_BLOCK_STATUS or NBD_REPLY_TYPE_BLOCK_STATUS_EXT.
+ * The descriptors are returned in host byte order, and the caller
+ * converts them to the wire format.  The rules here are very
+ * complicated.  Read the spec carefully!
  */
-static struct nbd_block_descriptor_32 *
+static struct nbd_block_descriptor_64 *
 extents_to_block_descriptors (struct nbdkit_extents *extents,
                               uint16_t flags,
-                              uint32_t count, uint64_t offset,
+                              uint64_t count, uint64_t offset,
                               size_t *nr_blocks)
 {
+  GET_CONN;
   const bool req_one = flags & NBD_CMD_FLAG_REQ_ONE;
   const size_t nr_extents = nbdkit_extents_count (extents);
+  /* Compact block descriptors are limited to 32 bit lengths. */
+  const uint64_t max_length = conn->extended_headers ? UINT64_MAX : UINT32_MAX;
   size_t i;
-  struct nbd_block_descriptor_32 *blocks;
+  struct nbd_block_descriptor_64 *blocks;
 
   /* This is checked in server/plugins.c. */
   assert (nr_extents >= 1);
 
   /* We may send fewer than nr_extents blocks, but never more. */
   blocks = calloc (req_one ? 1 : nr_extents,
-                   sizeof (struct nbd_block_descriptor_32));
+                   sizeof (struct nbd_block_descriptor_64));
   if (blocks == NULL) {
     nbdkit_error ("calloc: %m");
     return NULL;
@@ -479,7 +789,7 @@ extents_to_block_descriptors (struct nbdkit_extents *extents,
     *nr_blocks = 1;
 
     /* Must not exceed count of the original request. */
-    blocks[0].length = MIN (e.length, (uint64_t) count);
+    blocks[0].length = MIN (e.length, count);
     blocks[0].status_flags = e.type & 3;
   }
   else {
@@ -493,8 +803,7 @@ extents_to_block_descriptors (struct nbdkit_extents *extents,
       if (i == 0)
         assert (e.offset == offset);
 
-      /* Must not exceed UINT32_MAX. */
-      blocks[i].length = length = MIN (e.length, UINT32_MAX);
+      blocks[i].length = length = MIN (e.length, max_length);
       blocks[i].status_flags = e.type & 3;
       (*nr_blocks)++;
 
@@ -503,10 +812,9 @@ extents_to_block_descriptors (struct nbdkit_extents *extents,
         break;
 
       /* If we reach here then we must have consumed this whole
-       * extent.  This is currently true because the server only sends
-       * 32 bit requests, but if we move to 64 bit requests we will
-       * need to revisit this code so it can split extents into
-       * multiple blocks.  XXX
+       * extent.  This is true because compact requests have 32 bit
+       * counts, and extended block descriptors have 64 bit lengths,
+       * so we never need to split an extent into multiple blocks.
        */
       assert (e.length <= length);
     }
@@ -514,31 +822,24 @@ extents_to_block_descriptors (struct nbdkit_extents *extents,
 
 #if 0
   for (i = 0; i < *nr_blocks; ++i)
-    debug ("block status: sending block %" PRIu32 " type %" PRIu32,
+    debug ("block status: sending block %" PRIu64 " type %" PRIu64,
            blocks[i].length, blocks[i].status_flags);
 #endif
 
-  /* Convert to big endian for the protocol. */
-  for (i = 0; i < *nr_blocks; ++i) {
-    blocks[i].length = htobe32 (blocks[i].length);
-    blocks[i].status_flags = htobe32 (blocks[i].status_flags);
-  }
-
   return blocks;
 }
 
 static bool
 send_structured_reply_block_status (uint64_t cookie,
                                     uint16_t cmd, uint16_t flags,
-                                    uint32_t count, uint64_t offset,
+                                    uint64_t count, uint64_t offset,
                                     struct nbdkit_extents *extents)
 {
   GET_CONN;
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
-  struct nbd_structured_reply reply;
-  CLEANUP_FREE struct nbd_block_descriptor_32 *blocks = NULL;
+  CLEANUP_FREE struct nbd_block_descriptor_64 *blocks = NULL;
   size_t nr_blocks;
-  uint32_t context_id;
+  uint64_t length;
   size_t i;
   int r;
 
@@ -550,31 +851,60 @@ send_structured_reply_block_status (uint64_t cookie,
   if (blocks == NULL)
     return connection_set_status (STATUS_DEAD);
 
-  reply.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
-  reply.cookie = cookie;
-  reply.flags = htobe16 (NBD_REPLY_FLAG_DONE);
-  reply.type = htobe16 (NBD_REPLY_TYPE_BLOCK_STATUS);
-  reply.length = htobe32 (sizeof context_id +
-                          nr_blocks * sizeof (struct nbd_block_descriptor_32));
-
-  r = conn->send (&reply, sizeof reply, SEND_MORE);
+  if (conn->extended_headers)
+    length = sizeof (struct nbd_chunk_block_status_64) +
+      nr_blocks * sizeof (struct nbd_block_descriptor_64);
+  else
+    length = sizeof (struct nbd_chunk_block_status_32) +
+      nr_blocks * sizeof (struct nbd_block_descriptor_32);
+
+  r = send_structured_reply_header (cookie, NBD_REPLY_FLAG_DONE,
+                                    conn->extended_headers
+                                    ? NBD_REPLY_TYPE_BLOCK_STATUS_EXT
+                                    : NBD_REPLY_TYPE_BLOCK_STATUS,
+                                    offset, length, SEND_MORE);
   if (r == -1) {
     nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
     return connection_set_status (STATUS_DEAD);
   }
 
-  /* Send the base:allocation context ID. */
-  context_id = htobe32 (base_allocation_id);
-  r = conn->send (&context_id, sizeof context_id, SEND_MORE);
+  /* Send the base:allocation context ID (and descriptor count). */
+  if (conn->extended_headers) {
+    struct nbd_chunk_block_status_64 chunk;
+
+    chunk.context_id = htobe32 (base_allocation_id);
+    chunk.count = htobe32 (nr_blocks);
+    r = conn->send (&chunk, sizeof chunk, SEND_MORE);
+  }
+  else {
+    struct nbd_chunk_block_status_32 chunk;
+
+    chunk.context_id = htobe32 (base_allocation_id);
+    r = conn->send (&chunk, sizeof chunk, SEND_MORE);
+  }
   if (r == -1) {
     nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
     return connection_set_status (STATUS_DEAD);
   }
 
-  /* Send each block descriptor. */
+  /* Send each block descriptor, converted to big endian. */
   for (i = 0; i < nr_blocks; ++i) {
-    r = conn->send (&blocks[i], sizeof blocks[i],
-                    i == nr_blocks - 1 ? 0 : SEND_MORE);
+    const int f = i == nr_blocks - 1 ? 0 : SEND_MORE;
+
+    if (conn->extended_headers) {
+      struct nbd_block_descriptor_64 block;
+
+      block.length = htobe64 (blocks[i].length);
+      block.status_flags = htobe64 (blocks[i].status_flags);
+      r = conn->send (&block, sizeof block, f);
+    }
+    else {
+      struct nbd_block_descriptor_32 block;
+
+      block.length = htobe32 (blocks[i].length);
+      block.status_flags = htobe32 (blocks[i].status_flags);
+      r = conn->send (&block, sizeof block, f);
+    }
     if (r == -1) {
       nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
       return connection_set_status (STATUS_DEAD);
@@ -585,21 +915,18 @@ send_structured_reply_block_status (uint64_t cookie,
 
 static bool
 send_structured_reply_error (uint64_t cookie, uint16_t cmd, uint16_t flags,
-                             uint32_t error)
+                             uint64_t offset, uint32_t error)
 {
   GET_CONN;
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
-  struct nbd_structured_reply reply;
   struct nbd_chunk_error error_data;
   int r;
 
-  reply.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
-  reply.cookie = cookie;
-  reply.flags = htobe16 (NBD_REPLY_FLAG_DONE);
-  reply.type = htobe16 (NBD_REPLY_TYPE_ERROR);
-  reply.length = htobe32 (0 /* no human readable error */ + sizeof error_data);
-
-  r = conn->send (&reply, sizeof reply, SEND_MORE);
+  r = send_structured_reply_header (cookie, NBD_REPLY_FLAG_DONE,
+                                    NBD_REPLY_TYPE_ERROR, offset,
+                                    0 /* no human readable error */
+                                    + sizeof error_data,
+                                    SEND_MORE);
   if (r == -1) {
     nbdkit_error ("write error reply: %m");
     return connection_set_status (STATUS_DEAD);
@@ -617,115 +944,325 @@ send_structured_reply_error (uint64_t cookie, uint16_t cmd, uint16_t flags,
   return false;
 }
 
-/* Do a recv/send sequence. Return true if the caller should shutdown. */
-bool
-protocol_recv_request_send_reply (void)
+/* Return true if the whole write payload of 'count' bytes has
+ * already arrived, so that receiving it cannot be cut short by the
+ * client.  With the epoll engine the poller only hands over complete
+ * requests.  Otherwise ask the kernel how much data is waiting, which
+ * is not possible with TLS.  Call with read_lock held.
+ */
+static bool
+payload_arrived (uint64_t count)
+{
+  GET_CONN;
+#if defined (HAVE_SYS_IOCTL_H) && defined (FIONREAD)
+  int n;
+#endif
+
+  if (conn->engine)
+    return true;
+#if defined (HAVE_SYS_IOCTL_H) && defined (FIONREAD)
+  if (!conn->using_tls && conn->sockin >= 0 &&
+      ioctl (conn->sockin, FIONREAD, &n) == 0 && n >= 0 &&
+      (uint64_t) n >= count)
+    return true;
+#endif
+  return false;
+}
+
+/* Ask the plugin for a buffer to receive write data into.  Calling
+ * into the plugin here happens under read_lock, so it is only allowed
+ * for thread models where lock_request does not take request_lock,
+ * which must not be acquired after read_lock.
+ *
+ * Data received into the plugin's buffer changes the disk straight
+ * away and cannot be undone, so the buffer is only used when the
+ * whole payload has already arrived.  protocol_handle_request_send_reply
+ * then always completes the write.
+ *
+ * Leaves req->buf NULL if nbdkit should use its own buffer.  On error
+ * sets req->error and returns -1.
+ */
+static int
+prepare_write_buffer (struct request *req)
+{
+  GET_CONN;
+  void *buf = NULL;
+  int err = 0;
+  int r;
+
+  if (thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS ||
+      !payload_arrived (req->count))
+    return 0;
+
+  lock_request ();
+  r = backend_prepare_pwrite (conn->top_context, req->count, req->offset, 0,
+                              &buf, &err);
+  unlock_request ();
+  if (r == -1) {
+    req->error = err;
+    return -1;
+  }
+  req->buf = buf;
+  req->in_place = buf != NULL;
+  return 0;
+}
+
+/* Read the next request (and any write payload) from the client into
+ * 'req'.  Returns 1 if a request was read and must be passed to
+ * protocol_handle_request_send_reply.  Returns 0 if there is no
+ * request because the connection is closing, or -1 if additionally
+ * the caller should shutdown the write side of the connection.
+ *
+ * Requests which fail validation are still returned with req->error
+ * set, so that the caller sends the error reply.
+ */
+int
+protocol_recv_request (struct request *req)
 {
   GET_CONN;
   int r;
-  conn_status cs;
-  struct nbd_request request;
-  uint16_t cmd, flags;
-  uint32_t magic, count, error = 0;
-  uint64_t offset;
-  char *buf = NULL;
-  CLEANUP_EXTENTS_FREE struct nbdkit_extents *extents = NULL;
+  union {
+    struct nbd_request compact;
+    struct nbd_request_ext extended;
+  } request;
+  uint32_t magic;
+  bool has_payload;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->read_lock);
+
+  memset (req, 0, sizeof *req);
 
   /* Read the request packet. */
-  {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->read_lock);
-    r = conn->recv (&request, sizeof request);
-    cs = connection_get_status ();
-    if (cs <= STATUS_CLIENT_DONE)
-      return false;
-    if (r == -1) {
-      nbdkit_error ("read request: %m");
-      return connection_set_status (STATUS_DEAD);
-    }
-    if (r == 0) {
-      debug ("client closed input socket, closing connection");
-      return connection_set_status (STATUS_CLIENT_DONE); /* disconnect */
+  if (conn->extended_headers)
+    r = conn->recv (&request.extended, sizeof request.extended);
+  else
+    r = conn->recv (&request.compact, sizeof request.compact);
+  if (connection_get_status () <= STATUS_CLIENT_DONE)
+    return 0;
+  if (r == -1) {
+    nbdkit_error ("read request: %m");
+    return connection_set_status (STATUS_DEAD) ? -1 : 0;
+  }
+  if (r == 0) {
+    debug ("client closed input socket, closing connection");
+    /* disconnect */
+    return connection_set_status (STATUS_CLIENT_DONE) ? -1 : 0;
+  }
+
+  if (conn->extended_headers) {
+    magic = be32toh (request.extended.magic);
+    if (magic != NBD_EXTENDED_REQUEST_MAGIC) {
+      nbdkit_error ("invalid request: 'magic' field is incorrect (0x%x)",
+                    magic);
+      return connection_set_status (STATUS_DEAD) ? -1 : 0;
     }
 
-    magic = be32toh (request.magic);
+    req->flags = be16toh (request.extended.flags);
+    req->cmd = be16toh (request.extended.type);
+    req->cookie = request.extended.cookie;
+
+    req->offset = be64toh (request.extended.offset);
+    req->count = be64toh (request.extended.count);
+  }
+  else {
+    magic = be32toh (request.compact.magic);
     if (magic != NBD_REQUEST_MAGIC) {
       nbdkit_error ("invalid request: 'magic' field is incorrect (0x%x)",
                     magic);
-      return connection_set_status (STATUS_DEAD);
+      return connection_set_status (STATUS_DEAD) ? -1 : 0;
     }
 
-    flags = be16toh (request.flags);
-    cmd = be16toh (request.type);
+    req->flags = be16toh (request.compact.flags);
+    req->cmd = be16toh (request.compact.type);
+    req->cookie = request.compact.cookie;
+
+    req->offset = be64toh (request.compact.offset);
+    req->count = be32toh (request.compact.count);
+  }
 
-    offset = be64toh (request.offset);
-    count = be32toh (request.count);
+  if (req->cmd == NBD_CMD_DISC) {
+    debug ("client sent %s, closing connection", name_of_nbd_cmd (req->cmd));
+    /* disconnect */
+    return connection_set_status (STATUS_CLIENT_DONE) ? -1 : 0;
+  }
 
-    if (cmd == NBD_CMD_DISC) {
-      debug ("client sent %s, closing connection", name_of_nbd_cmd (cmd));
-      return connection_set_status (STATUS_CLIENT_DONE); /* disconnect */
-    }
+  /* Every request from here on gets a reply, so takes a slot in the
+   * reply order.
+   */
+  req->seq = conn->recv_seq++;
 
-    /* Validate the request. */
-    if (!validate_request (cmd, flags, offset, count, &error)) {
-      if (cmd == NBD_CMD_WRITE &&
-          skip_over_write_buffer (conn->sockin, count) < 0) {
-        return connection_set_status (STATUS_DEAD);
-      }
-      goto send_reply;
-    }
+  /* With extended headers any command may in theory carry a payload
+   * if the client sets NBD_CMD_FLAG_PAYLOAD_LEN.  We reject those
+   * requests, but still have to read the payload off the wire.
+   */
+  has_payload = req->cmd == NBD_CMD_WRITE ||
+    (conn->extended_headers && (req->flags & NBD_CMD_FLAG_PAYLOAD_LEN));
+
+  /* Validate the request. */
+  if (!validate_request (req->cmd, req->flags, req->offset, req->count,
+                         &req->error)) {
+    if (has_payload &&
+        skip_over_write_buffer (req->count) < 0)
+      return connection_set_status (STATUS_DEAD) ? -1 : 0;
+    return 1;
+  }
 
-    /* Get the data buffer used for either read or write requests.
-     * This is a common per-thread data buffer, it must not be freed.
-     */
-    if (cmd == NBD_CMD_READ || cmd == NBD_CMD_WRITE) {
-      buf = threadlocal_buffer ((size_t) count);
-      if (buf == NULL) {
-        error = ENOMEM;
-        if (cmd == NBD_CMD_WRITE &&
-            skip_over_write_buffer (conn->sockin, count) < 0) {
-          return connection_set_status (STATUS_DEAD);
-        }
-        goto send_reply;
-      }
+  /* Reads and writes may be handed to the plugin's asynchronous
+   * callbacks.  This is only done when the plugin is not behind any
+   * filters (which lack async callbacks) and it allows parallel
+   * requests with replies in any order.
+   */
+  req->async = thread_model == NBDKIT_THREAD_MODEL_PARALLEL &&
+    conn->nworkers > 0 &&
+    ((req->cmd == NBD_CMD_READ && top->async_pread) ||
+     (req->cmd == NBD_CMD_WRITE && top->async_pwrite));
+
+  /* Get the data buffer used for either read or write requests.
+   * This is usually a common per-thread data buffer which must not be
+   * freed.  Async requests outlive the worker, so they need their own
+   * buffer.  Zero it for reads so that we don't leak heap data.
+   */
+  /* The plugin may want write data to be received straight into its
+   * own buffer.
+   */
+  if (req->cmd == NBD_CMD_WRITE && !req->async && top->prepare_pwrite &&
+      prepare_write_buffer (req) == -1) {
+    if (skip_over_write_buffer (req->count) < 0)
+      return connection_set_status (STATUS_DEAD) ? -1 : 0;
+    return 1;
+  }
+  if (req->cmd == NBD_CMD_READ || req->cmd == NBD_CMD_WRITE) {
+    if (req->buf != NULL)
+      ;                         /* Buffer provided by the plugin. */
+    else if (!req->async)
+      req->buf = threadlocal_buffer ((size_t) req->count);
+    else if (req->cmd == NBD_CMD_READ)
+      req->buf = calloc (1, req->count);
+    else
+      req->buf = malloc (req->count);
+    if (req->buf == NULL) {
+      if (req->async)
+        nbdkit_error ("malloc: %m");
+      req->error = ENOMEM;
+      if (req->cmd == NBD_CMD_WRITE &&
+          skip_over_write_buffer (req->count) < 0)
+        return connection_set_status (STATUS_DEAD) ? -1 : 0;
+      return 1;
     }
+  }
 
-    /* Allocate the extents list for block status only. */
-    if (cmd == NBD_CMD_BLOCK_STATUS) {
-      extents = nbdkit_extents_new (offset,
-                                    backend_get_size (conn->top_context));
-      if (extents == NULL) {
-        error = ENOMEM;
-        goto send_reply;
-      }
+  /* Allocate the extents list for block status only. */
+  if (req->cmd == NBD_CMD_BLOCK_STATUS) {
+    req->extents = nbdkit_extents_new (req->offset,
+                                       backend_get_size (conn->top_context));
+    if (req->extents == NULL) {
+      req->error = ENOMEM;
+      return 1;
     }
+  }
 
-    /* Receive the write data buffer. */
-    if (cmd == NBD_CMD_WRITE) {
-      r = conn->recv (buf, count);
-      if (r == 0) {
-        errno = EBADMSG;
-        r = -1;
-      }
-      if (r == -1) {
-        nbdkit_error ("read data: %s: %m", name_of_nbd_cmd (cmd));
-        return connection_set_status (STATUS_DEAD);
-      }
+  /* Receive the write data buffer. */
+  if (req->cmd == NBD_CMD_WRITE) {
+    r = conn->recv (req->buf, req->count);
+    if (r == 0) {
+      errno = EBADMSG;
+      r = -1;
+    }
+    if (r == -1) {
+      nbdkit_error ("read data: %s: %m", name_of_nbd_cmd (req->cmd));
+      if (req->async)
+        free (req->buf);
+      return connection_set_status (STATUS_DEAD) ? -1 : 0;
     }
   }
 
-  /* Perform the request.  Only this part happens inside the request lock. */
-  if (quit || cs < STATUS_ACTIVE) {
-    error = ESHUTDOWN;
+  return 1;
+}
+
+/* Hand a read or write request to the plugin's asynchronous callback.
+ * Returns true if the plugin started the request, in which case the
+ * plugin now owns the data buffer and nbdkit_request_complete will
+ * send the reply.  Otherwise *error is set if the request failed, or
+ * left as 0 if it must be handled synchronously after all.
+ */
+static bool
+start_async_request (struct request *req, uint32_t *error)
+{
+  GET_CONN;
+  struct context *c = conn->top_context;
+  struct nbdkit_request *areq;
+  uint32_t f = 0;
+  int err = 0;
+  int r;
+
+  /* Emulating FUA needs a flush after the write completes. */
+  if (req->cmd == NBD_CMD_WRITE && (req->flags & NBD_CMD_FLAG_FUA)) {
+    if (backend_can_fua (c) != NBDKIT_FUA_NATIVE)
+      return false;
+    f |= NBDKIT_FLAG_FUA;
   }
-  else {
-    lock_request ();
-    error = handle_request (cmd, flags, offset, count, buf, extents);
-    assert ((int) error >= 0);
-    unlock_request ();
+
+  areq = calloc (1, sizeof *areq);
+  if (areq == NULL) {
+    *error = ENOMEM;
+    return false;
   }
+  areq->conn = conn;
+  areq->cookie = req->cookie;
+  areq->offset = req->offset;
+  areq->count = req->count;
+  areq->cmd = req->cmd;
+  areq->flags = req->flags;
+  areq->buf = req->buf;
+
+  /* Each outstanding request holds a buffer of up to 64M, so limit
+   * how many there can be on a connection to the number of worker
+   * threads.  Blocking here holds up this worker, which stops more
+   * requests being read from the client until one completes.
+   */
+  pthread_mutex_lock (&conn->async_lock);
+  while (conn->async_inflight >= (unsigned) conn->nworkers)
+    pthread_cond_wait (&conn->async_cond, &conn->async_lock);
+  conn->async_inflight++;
+  pthread_mutex_unlock (&conn->async_lock);
+
+  threadlocal_set_errno (0);
+  threadlocal_clear_last_error ();
+
+  lock_request ();
+  if (req->cmd == NBD_CMD_READ)
+    r = backend_async_pread (c, req->buf, req->count, req->offset, 0,
+                             areq, &err);
+  else
+    r = backend_async_pwrite (c, req->buf, req->count, req->offset, f,
+                              areq, &err);
+  unlock_request ();
+
+  if (r == -1) {
+    free (areq);
+    pthread_mutex_lock (&conn->async_lock);
+    conn->async_inflight--;
+    pthread_cond_broadcast (&conn->async_cond);
+    pthread_mutex_unlock (&conn->async_lock);
+    *error = err;
+    return false;
+  }
+
+  return true;
+}
+
+/* Send the reply to a request.  Return true if the caller should
+ * shutdown.  If the read data in buf was sent with MSG_ZEROCOPY, *zc
+ * is set and the caller must not reuse or free buf until the send
+ * has completed.
+ */
+static bool
+send_reply (uint16_t cmd, uint16_t flags, uint64_t cookie, uint64_t offset,
+            uint64_t count, uint32_t error, char *buf,
+            struct nbdkit_extents *extents, struct zerocopy_ref *zc)
+{
+  GET_CONN;
 
-  /* Send the reply packet. */
- send_reply:
   if (connection_get_status () < STATUS_CLIENT_DONE)
     return false;
 
@@ -740,22 +1277,222 @@ protocol_recv_request_send_reply (void)
 
   /* Currently we prefer to send simple replies for everything except
    * where we have to (ie. NBD_CMD_READ and NBD_CMD_BLOCK_STATUS when
-   * structured_replies have been negotiated).  However this prevents
+   * structured_replies have been negotiated, and every command when
+   * extended headers have been negotiated).  However this prevents
    * us from sending human-readable error messages to the client, so
    * we should reconsider this in future.
    */
-  if (!conn->structured_replies ||
-      (cmd != NBD_CMD_READ && cmd != NBD_CMD_BLOCK_STATUS))
-    return send_simple_reply (request.cookie, cmd, flags, buf, count, error);
+  if (!conn->extended_headers &&
+      (!conn->structured_replies ||
+       (cmd != NBD_CMD_READ && cmd != NBD_CMD_BLOCK_STATUS)))
+    return send_simple_reply (cookie, cmd, flags, buf, count, error, zc);
 
   if (error)
-    return send_structured_reply_error (request.cookie, cmd, flags, error);
+    return send_structured_reply_error (cookie, cmd, flags, offset, error);
 
   if (cmd == NBD_CMD_READ)
-    return send_structured_reply_read (request.cookie, cmd, buf, count,
-                                       offset);
+    return send_structured_reply_read (cookie, cmd, flags, buf, count,
+                                       offset, zc);
+
+  if (cmd == NBD_CMD_BLOCK_STATUS)
+    return send_structured_reply_block_status (cookie, cmd, flags,
+                                               count, offset, extents);
+
+  return send_structured_reply_none (cookie, cmd, offset);
+}
+
+/* Send the reply to a successful NBD_CMD_READ where the plugin
+ * .pread_fd callback has said that the data can be sent directly from
+ * a file descriptor.  Errors from the file descriptor are only seen
+ * after the reply header has been sent, so they are fatal for the
+ * connection.  Return true if the caller should shutdown.
+ */
+static bool
+send_reply_read_fd (uint64_t cookie, uint64_t offset, uint32_t count,
+                    int fd, uint64_t fd_offset)
+{
+  GET_CONN;
+  struct nbd_simple_reply simple;
+  union structured_reply_header reply;
+  struct nbd_chunk_offset_data offset_data;
+  struct send_iov iov[2];
+  size_t n;
+
+  if (connection_get_status () < STATUS_CLIENT_DONE)
+    return false;
+
+  if (!conn->extended_headers && !conn->structured_replies) {
+    simple.magic = htobe32 (NBD_SIMPLE_REPLY_MAGIC);
+    simple.cookie = cookie;
+    simple.error = 0;
+    iov[0].base = &simple;
+    iov[0].len = sizeof simple;
+    n = 1;
+  }
+  else {
+    iov[0].base = &reply;
+    iov[0].len = make_structured_reply_header (&reply, cookie,
+                                               NBD_REPLY_FLAG_DONE,
+                                               NBD_REPLY_TYPE_OFFSET_DATA,
+                                               offset,
+                                               count + sizeof offset_data);
+    offset_data.offset = htobe64 (offset);
+    iov[1].base = &offset_data;
+    iov[1].len = sizeof offset_data;
+    n = 2;
+  }
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
+  if (conn->sendv (iov, n, SEND_MORE) == -1) {
+    nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (NBD_CMD_READ));
+    return connection_set_status (STATUS_DEAD);
+  }
+  if (conn->sendfile (fd, fd_offset, count) == -1) {
+    nbdkit_error ("sendfile: %s: %m", name_of_nbd_cmd (NBD_CMD_READ));
+    return connection_set_status (STATUS_DEAD);
+  }
+  return false;
+}
+
+/* Perform a request read by protocol_recv_request (unless it already
+ * failed validation) and send the reply.  This consumes 'req'.
+ * Return true if the caller should shutdown.
+ */
+bool
+protocol_handle_request_send_reply (struct request *req)
+{
+  GET_CONN;
+  CLEANUP_EXTENTS_FREE struct nbdkit_extents *extents = req->extents;
+  const uint16_t cmd = req->cmd, flags = req->flags;
+  const uint64_t cookie = req->cookie, offset = req->offset;
+  const uint64_t count = req->count;
+  uint32_t error = req->error;
+  char *buf = req->buf;
+  int fd = -1, err = 0;
+  uint64_t fd_offset = 0;
+  struct zerocopy_ref zc = { .pending = false };
+  bool r;
+
+  /* Perform the request.  Only this part happens inside the request
+   * lock.  A write received in place has already changed the disk, so
+   * it is completed even if the server is shutting down.
+   */
+  if (!error) {
+    if (!req->in_place &&
+        (quit || connection_get_status () < STATUS_ACTIVE)) {
+      error = ESHUTDOWN;
+    }
+    else if (req->async && start_async_request (req, &error)) {
+      /* The reply is sent by nbdkit_request_complete. */
+      return false;
+    }
+    else if (!error) {
+      lock_request ();
+      /* If the plugin can point us at the data in a file, send it
+       * from there without copying it through buf.  This is only
+       * possible without filters (which may modify the data) and TLS.
+       */
+      if (cmd == NBD_CMD_READ && top->pread_fd && conn->sendfile &&
+          backend_pread_fd (conn->top_context, count, offset, 0,
+                            &fd, &fd_offset, &err) == -1)
+        error = err;
+      else if (fd == -1)
+        error = handle_request (cmd, flags, offset, count, buf, extents);
+      assert ((int) error >= 0);
+      unlock_request ();
+    }
+  }
+
+  /* Send the reply packet.  For the serialize_retirement thread
+   * model this waits for all earlier replies to be sent first.
+   */
+  lock_retirement (req->seq);
+  if (fd >= 0 && !error)
+    r = send_reply_read_fd (cookie, offset, count, fd, fd_offset);
+  else
+    r = send_reply (cmd, flags, cookie, offset, count, error, buf, extents,
+                    &zc);
+  unlock_retirement ();
+  if (req->async)
+    connection_free_after_zerocopy (buf, &zc);
+  else
+    threadlocal_buffer_sent (buf, &zc);
+  return r;
+}
+
+/* Called by the plugin when a request started by one of the
+ * asynchronous callbacks has finished.  This may be called from any
+ * thread, including threads created by the plugin, and it sends the
+ * reply to the client.
+ */
+NBDKIT_DLL_PUBLIC void
+nbdkit_request_complete (struct nbdkit_request *req, int err)
+{
+  struct connection *conn = req->conn;
+  struct connection *saved_conn;
+  struct zerocopy_ref zc = { .pending = false };
+
+  /* A thread in plugins.c is waiting for this request. */
+  if (conn == NULL) {
+    pthread_mutex_lock (&req->lock);
+    req->err = err;
+    req->done = true;
+    pthread_cond_signal (&req->cond);
+    pthread_mutex_unlock (&req->lock);
+    return;
+  }
 
-  /* NBD_CMD_BLOCK_STATUS */
-  return send_structured_reply_block_status (request.cookie, cmd, flags,
-                                             count, offset, extents);
+  threadlocal_new_foreign_thread ();
+  saved_conn = threadlocal_get_conn ();
+  threadlocal_set_conn (conn);
+
+  if (err < 0) {
+    nbdkit_debug ("nbdkit_request_complete: negative error value, "
+                  "using EIO");
+    err = EIO;
+  }
+  metrics_record (req->b,
+                  req->cmd == NBD_CMD_READ ? METRICS_PREAD : METRICS_PWRITE,
+                  &req->start, err ? -1 : 0);
+  if (send_reply (req->cmd, req->flags, req->cookie, req->offset,
+                  req->count, err, req->buf, NULL, &zc)) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
+    conn->close (SHUT_WR);
+  }
+  connection_free_after_zerocopy (req->buf, &zc);
+  free (req);
+
+  pthread_mutex_lock (&conn->async_lock);
+  conn->async_inflight--;
+  pthread_cond_broadcast (&conn->async_cond);
+  pthread_mutex_unlock (&conn->async_lock);
+
+  threadlocal_set_conn (saved_conn);
+}
+
+/* Wait until the plugin has completed all asynchronous requests on
+ * the current connection.  Called before the connection is closed.
+ */
+void
+protocol_wait_for_async_requests (void)
+{
+  GET_CONN;
+
+  pthread_mutex_lock (&conn->async_lock);
+  while (conn->async_inflight > 0)
+    pthread_cond_wait (&conn->async_cond, &conn->async_lock);
+  pthread_mutex_unlock (&conn->async_lock);
+}
+
+/* Do a recv/send sequence. Return true if the caller should shutdown. */
+bool
+protocol_recv_request_send_reply (void)
+{
+  struct request req;
+
+  switch (protocol_recv_request (&req)) {
+  case -1: return true;
+  case 0: return false;
+  default: return protocol_handle_request_send_reply (&req);
+  }
 }
@@ -591,6 +591,9 @@ accept_incoming_connections (const sockets *socks)
   }
   pthread_mutex_unlock (&count_mutex);
 
+  /* Wait for connections handed over to the epoll engine. */
+  engine_drain ();
+
   for (i = 0; i < socks->len; ++i)
     closesocket (socks->ptr[i]);
   free (socks->ptr);
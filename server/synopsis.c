@@ -2,17 +2,19 @@
 
 const char *synopsis =
     "nbdkit [-4|--ipv4-only] [-6|--ipv6-only]\n"
-    "       [-D|--debug PLUGIN|FILTER|nbdkit.FLAG=N]\n"
+    "       [-D|--debug PLUGIN|FILTER|nbdkit.FLAG=N] [--engine=threads|epoll]\n"
     "       [--exit-with-parent] [-e|--exportname EXPORTNAME]\n"
     "       [--filter=FILTER ...] [-f|--foreground]\n"
     "       [-g|--group GROUP] [-i|--ipaddr IPADDR] [--keepalive]\n"
     "       [--log=stderr|syslog|null] [--mask-handshake=MASK]\n"
+    "       [--metrics=FILE]\n"
     "       [-n|--newstyle] [--no-mc|--no-meta-contexts]\n"
-    "       [--no-sr|--no-structured-replies] [-o|--oldstyle]\n"
+    "       [--no-sr|--no-structured-replies] [--no-zerocopy]\n"
+    "       [-o|--oldstyle]\n"
     "       [-P|--pidfile PIDFILE] [-p|--port PORT] [--print-uri]\n"
     "       [-r|--readonly] [--run 'COMMAND ARGS ...']\n"
-    "       [--selinux-label=LABEL] [-s|--single] [--swap]\n"
-    "       [-t|--threads THREADS] [--timeout=TIMEOUT]\n"
+    "       [--selinux-label=LABEL] [-s|--single] [--sparse-reads]\n"
+    "       [--swap] [-t|--threads THREADS] [--timeout=TIMEOUT]\n"
     "       [--tls=off|on|require]\n"
     "       [--tls-certificates=/path/to/certificates]\n"
     "       [--tls-psk=/path/to/pskfile] [--tls-verify-peer]\n"
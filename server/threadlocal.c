@@ -42,6 +42,8 @@
 #include <pthread.h>
 
 #include "internal.h"
+#include "posix_memalign.h"
+#include "sysconf.h"
 
 /* Note that most thread-local storage data is informational, used for
  * smart error and debug messages on the server side.  However, error
@@ -52,13 +54,22 @@
  * *unless* it is serving a request (the '-s' option).
  */
 
+/* A pread/pwrite buffer, and the MSG_ZEROCOPY send which must
+ * complete before it can be reused.
+ */
+struct thread_buffer {
+  void *ptr;                    /* Can be NULL. */
+  size_t size;
+  struct zerocopy_ref zc;
+};
+
 struct threadlocal {
   char *name;                   /* Can be NULL. */
   size_t instance_num;          /* Can be 0. */
   int err;
   char *last_error;             /* Can be NULL. */
-  void *buffer;                 /* Can be NULL. */
-  size_t buffer_size;
+  struct thread_buffer buffers[2]; /* See threadlocal_buffer. */
+  unsigned current;             /* Index of the buffer last returned. */
   struct connection *conn;      /* Can be NULL. */
   struct context *ctx;          /* Can be NULL. */
 };
@@ -72,7 +83,8 @@ free_threadlocal (void *threadlocalv)
 
   free (threadlocal->name);
   free (threadlocal->last_error);
-  free (threadlocal->buffer);
+  free (threadlocal->buffers[0].ptr);
+  free (threadlocal->buffers[1].ptr);
   free (threadlocal);
 }
 
@@ -108,6 +120,18 @@ threadlocal_new_server_thread (void)
   }
 }
 
+/* Plugins may call into the server from threads which they created
+ * themselves (see nbdkit_request_complete).  Give such a thread its
+ * own thread-local storage the first time, which is freed when the
+ * thread exits.
+ */
+void
+threadlocal_new_foreign_thread (void)
+{
+  if (pthread_getspecific (threadlocal_key) == NULL)
+    threadlocal_new_server_thread ();
+}
+
 void
 threadlocal_set_name (const char *name)
 {
@@ -216,8 +240,14 @@ threadlocal_get_last_error (void)
   return threadlocal ? threadlocal->last_error : NULL;
 }
 
-/* Return the single pread/pwrite buffer for this thread.  The buffer
- * size is increased to ‘size’ bytes if required.
+/* Return a pread/pwrite buffer for this thread.  The buffer size is
+ * increased to ‘size’ bytes if required.  It is page aligned so that
+ * plugins using O_DIRECT can usually pass it straight to the kernel.
+ *
+ * Normally there is only one buffer per thread.  But if a read reply
+ * was sent from the buffer with MSG_ZEROCOPY the kernel may still be
+ * reading it, so while that send is outstanding we use a second
+ * buffer, and only wait if both are still busy.
  *
  * The buffer starts out as zeroes but after use may contain data from
  * previous requests.  This is fine because: (a) Correctly written
@@ -230,24 +260,83 @@ extern void *
 threadlocal_buffer (size_t size)
 {
   struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+  struct thread_buffer *buffer, *other;
 
   if (!threadlocal)
     abort ();
 
-  if (threadlocal->buffer_size < size) {
-    void *ptr;
+  buffer = &threadlocal->buffers[threadlocal->current];
+  if (buffer->zc.pending && !connection_zerocopy_done (buffer->zc.zc_sent)) {
+    other = &threadlocal->buffers[!threadlocal->current];
+    /* The other buffer was sent from earlier, so waiting for it is
+     * quicker.
+     */
+    if (other->zc.pending)
+      connection_wait_zerocopy (other->zc.zc_sent);
+    other->zc.pending = false;
+    threadlocal->current = !threadlocal->current;
+    buffer = other;
+  }
+  buffer->zc.pending = false;
 
-    ptr = realloc (threadlocal->buffer, size);
-    if (ptr == NULL) {
-      nbdkit_error ("threadlocal_buffer: realloc: %m");
+  if (buffer->size < size) {
+    void *ptr;
+    long pagesize;
+    int r;
+
+    pagesize = sysconf (_SC_PAGESIZE);
+    assert (pagesize > 1);
+    r = posix_memalign (&ptr, pagesize, size);
+    if (r != 0) {
+      errno = r;
+      nbdkit_error ("threadlocal_buffer: posix_memalign: %m");
       return NULL;
     }
     memset (ptr, 0, size);
-    threadlocal->buffer = ptr;
-    threadlocal->buffer_size = size;
+    free (buffer->ptr);
+    buffer->ptr = ptr;
+    buffer->size = size;
   }
 
-  return threadlocal->buffer;
+  return buffer->ptr;
+}
+
+/* Called after a reply has been sent from 'buf'.  If it is the
+ * buffer returned by threadlocal_buffer and was sent with
+ * MSG_ZEROCOPY, it is not reused until the send has completed.
+ */
+void
+threadlocal_buffer_sent (const void *buf, const struct zerocopy_ref *zc)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+  struct thread_buffer *buffer;
+
+  if (!threadlocal || !zc->pending)
+    return;
+
+  buffer = &threadlocal->buffers[threadlocal->current];
+  if (buf == buffer->ptr)
+    buffer->zc = *zc;
+}
+
+/* Wait for any MSG_ZEROCOPY sends from this thread's buffers.  This
+ * must be called before the thread stops serving the connection.
+ */
+void
+threadlocal_wait_zerocopy (void)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+  size_t i;
+
+  if (!threadlocal)
+    return;
+
+  for (i = 0; i < 2; ++i) {
+    if (threadlocal->buffers[i].zc.pending) {
+      connection_wait_zerocopy (threadlocal->buffers[i].zc.zc_sent);
+      threadlocal->buffers[i].zc.pending = false;
+    }
+  }
 }
 
 /* Set (or clear) the connection that is using the current thread */
@@ -0,0 +1,123 @@
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Helpers for tests which make many concurrent, overlapping requests
+# from several connections and compare the data read back with a
+# model of the disk.
+
+import random
+
+import nbd
+
+# Writes in round r store pattern(r, offset, n) at offset, so that
+# overlapping writes in the same round agree about the data whatever
+# order they run in.
+base = bytes(i % 251 for i in range(251 + 256 * 1024))
+
+
+def pattern(r, offset, n):
+    i = (offset + r * 31) % 251
+    return base[i:i+n]
+
+
+# Return a shuffled list of requests (op, offset, n) between offset
+# and end, where op is chosen from ops ("w", "z", "t" or "r").  The
+# byte ranges do not overlap, but are packed closely so they share
+# blocks or pages, and some writes are repeated (with the same data)
+# to overlap other writes.  Since nothing else overlaps, reads see
+# the data from before the round.
+def make_requests(offset, end, sizes, gaps, ops):
+    requests = []
+    while True:
+        n = random.choice(sizes)
+        if offset + n > end:
+            break
+        op = random.choice(ops)
+        requests.append((op, offset, n))
+        if op == "w" and random.random() < 0.3:
+            i = random.randrange(0, n)
+            j = random.randrange(i, n) + 1
+            requests.append(("w", offset + i, j - i))
+        offset += n + random.choice(gaps)
+    random.shuffle(requests)
+    return requests
+
+
+# Send a request made by make_requests in round r on connection c,
+# and update the model.  model holds the data of the disk starting at
+# model_offset.  The request is added to the list of cookies.
+def send_request(r, c, request, model, cookies, model_offset=0):
+    (op, offset, n) = request
+    m = offset - model_offset
+    expected = None
+    if op == "w":
+        buf = pattern(r, offset, n)
+        cookie = c.aio_pwrite(nbd.Buffer.from_bytearray(bytearray(buf)),
+                              offset)
+        model[m:m+n] = buf
+    elif op == "z":
+        cookie = c.aio_zero(n, offset)
+        model[m:m+n] = bytes(n)
+    elif op == "t":
+        cookie = c.aio_trim(n, offset)
+        model[m:m+n] = bytes(n)
+    else:
+        buf = nbd.Buffer(n)
+        cookie = c.aio_pread(buf, offset)
+        expected = (buf, bytes(model[m:m+n]))
+    cookies.append((c, cookie, expected))
+
+
+# Wait for all the requests to finish, and check that they succeeded
+# and that reads returned the expected data.
+def wait(conns, cookies):
+    for c in conns:
+        while c.aio_in_flight() > 0:
+            c.poll(-1)
+    for (c, cookie, expected) in cookies:
+        assert c.aio_command_completed(cookie)
+        if expected is not None:
+            (buf, data) = expected
+            assert buf.to_bytearray() == data
+    cookies.clear()
+
+
+# Check that the disk starting at model_offset matches the model.
+def check(c, model, what, model_offset=0):
+    for m in range(0, len(model), 1024 * 1024):
+        n = min(1024 * 1024, len(model) - m)
+        buf = c.pread(n, model_offset + m)
+        if buf != model[m:m+n]:
+            for i in range(n):
+                if buf[i] != model[m+i]:
+                    break
+            print("%s: bad data at offset %d" % (what, model_offset + m + i))
+            assert False
@@ -0,0 +1,236 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test plugin for the asynchronous .async_pread and .async_pwrite
+ * callbacks.  Requests are queued and completed later by a background
+ * thread, newest first, so that the server sees completions arriving
+ * out of order and from a thread which it did not create.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define NBDKIT_API_VERSION 2
+
+#include <nbdkit-plugin.h>
+
+#define SIZE (1024*1024)
+
+static char disk[SIZE];
+
+/* Requests are held for this many microseconds before completion. */
+static unsigned delay = 10000;
+
+/* If non-zero, fail requests if nbdkit starts more than this many. */
+static unsigned max_inflight = 0;
+
+struct op {
+  struct op *next;
+  struct nbdkit_request *req;
+  bool is_write;
+  void *rbuf;
+  const void *wbuf;
+  uint32_t count;
+  uint64_t offset;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct op *queue;
+static unsigned inflight;
+static bool stop;
+static pthread_t thread;
+static bool thread_started;
+
+static int
+async_config (const char *key, const char *value)
+{
+  if (strcmp (key, "delay") == 0)
+    return nbdkit_parse_unsigned (key, value, &delay);
+  if (strcmp (key, "max-inflight") == 0)
+    return nbdkit_parse_unsigned (key, value, &max_inflight);
+  nbdkit_error ("unknown parameter '%s'", key);
+  return -1;
+}
+
+static void *
+completion_thread (void *arg)
+{
+  struct op *op;
+
+  for (;;) {
+    pthread_mutex_lock (&lock);
+    while (!stop && queue == NULL)
+      pthread_cond_wait (&cond, &lock);
+    if (queue == NULL) {
+      pthread_mutex_unlock (&lock);
+      return NULL;
+    }
+    pthread_mutex_unlock (&lock);
+
+    /* Give other requests a chance to pile up behind this one. */
+    usleep (delay);
+
+    pthread_mutex_lock (&lock);
+    op = queue;
+    queue = op->next;
+    inflight--;
+    pthread_mutex_unlock (&lock);
+
+    if (op->is_write)
+      memcpy (&disk[op->offset], op->wbuf, op->count);
+    else
+      memcpy (op->rbuf, &disk[op->offset], op->count);
+    nbdkit_request_complete (op->req, 0);
+    free (op);
+  }
+}
+
+static int
+async_after_fork (void)
+{
+  int err;
+
+  err = pthread_create (&thread, NULL, completion_thread, NULL);
+  if (err) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return -1;
+  }
+  thread_started = true;
+  return 0;
+}
+
+static void
+async_cleanup (void)
+{
+  if (!thread_started)
+    return;
+
+  pthread_mutex_lock (&lock);
+  stop = true;
+  pthread_cond_signal (&cond);
+  pthread_mutex_unlock (&lock);
+  pthread_join (thread, NULL);
+}
+
+static void *
+async_open (int readonly)
+{
+  return NBDKIT_HANDLE_NOT_NEEDED;
+}
+
+static int64_t
+async_get_size (void *handle)
+{
+  return SIZE;
+}
+
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
+
+static int
+queue_op (struct op *op)
+{
+  pthread_mutex_lock (&lock);
+  if (max_inflight > 0 && inflight >= max_inflight) {
+    pthread_mutex_unlock (&lock);
+    nbdkit_error ("more than %u requests in flight", max_inflight);
+    free (op);
+    return -1;
+  }
+  inflight++;
+  op->next = queue;
+  queue = op;
+  pthread_cond_signal (&cond);
+  pthread_mutex_unlock (&lock);
+  return 0;
+}
+
+static int
+async_async_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
+                   uint32_t flags, struct nbdkit_request *req)
+{
+  struct op *op;
+
+  op = calloc (1, sizeof *op);
+  if (op == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  op->req = req;
+  op->rbuf = buf;
+  op->count = count;
+  op->offset = offset;
+  return queue_op (op);
+}
+
+static int
+async_async_pwrite (void *handle, const void *buf, uint32_t count,
+                    uint64_t offset, uint32_t flags,
+                    struct nbdkit_request *req)
+{
+  struct op *op;
+
+  op = calloc (1, sizeof *op);
+  if (op == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  op->req = req;
+  op->is_write = true;
+  op->wbuf = buf;
+  op->count = count;
+  op->offset = offset;
+  return queue_op (op);
+}
+
+static struct nbdkit_plugin plugin = {
+  .name              = "async",
+  .version           = PACKAGE_VERSION,
+  .config            = async_config,
+  .after_fork        = async_after_fork,
+  .cleanup           = async_cleanup,
+  .open              = async_open,
+  .get_size          = async_get_size,
+  .async_pread       = async_async_pread,
+  .async_pwrite      = async_async_pwrite,
+};
+
+NBDKIT_REGISTER_PLUGIN (plugin)
@@ -0,0 +1,92 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+# PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the .async_pread and .async_pwrite callbacks.  The test plugin
+# completes requests from its own thread in reverse order.  Running
+# the same test behind a filter checks the synchronous fallback.
+
+source ./functions.sh
+set -x
+
+requires_single_mode
+requires nbdsh --version
+
+plugin=.libs/test-async-plugin.$SOEXT
+requires test -f $plugin
+
+script='
+buf1 = b"1" * 65536
+buf2 = b"2" * 65536
+
+# Issue several commands without waiting for the replies.
+c1 = h.aio_pwrite(buf1, 0)
+c2 = h.aio_pwrite(buf2, 65536)
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+assert h.aio_command_completed(c1)
+assert h.aio_command_completed(c2)
+
+b1 = nbd.Buffer(65536)
+b2 = nbd.Buffer(65536)
+c1 = h.aio_pread(b1, 0)
+c2 = h.aio_pread(b2, 65536)
+c3 = h.aio_pwrite(buf1, 131072)
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+assert h.aio_command_completed(c1)
+assert h.aio_command_completed(c2)
+assert h.aio_command_completed(c3)
+assert b1.to_bytearray() == buf1
+assert b2.to_bytearray() == buf2
+assert h.pread(65536, 131072) == buf1
+'
+
+# Without filters the async path is used.
+nbdsh -c "h.connect_command([\"nbdkit\", \"-s\", \"-v\", \"$plugin\"])" \
+      -c "$script"
+
+# Filters only use the synchronous callbacks, which nbdkit emulates.
+nbdsh -c "h.connect_command([\"nbdkit\", \"-s\", \"-v\",
+                             \"--filter=noextents\", \"$plugin\"])" \
+      -c "$script"
+
+# nbdkit must not start more asynchronous requests on a connection
+# than there are worker threads.
+nbdsh -c "h.connect_command([\"nbdkit\", \"-s\", \"-v\", \"-t\", \"2\",
+                             \"$plugin\", \"max-inflight=2\"])" \
+      -c '
+cookies = [h.aio_pread(nbd.Buffer(65536), i * 65536) for i in range(16)]
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+for c in cookies:
+    assert h.aio_command_completed(c)
+'
@@ -0,0 +1,71 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Check that with cache-dirty-expire, writes reach the plugin in the
+# background without the client flushing.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter cache
+requires_plugin file
+requires nbdsh --version
+
+disk=cache-dirty-expire.img
+files="$disk"
+rm -f $files
+cleanup_fn rm -f $files
+
+truncate -s 16M $disk
+
+export disk
+nbdsh -c '
+import os
+import time
+
+h.connect_command(["nbdkit", "-s", "--filter=cache",
+                   "file", os.environ["disk"], "cache-dirty-expire=2"])
+
+h.pwrite(b"\x55" * (1024 * 1024), 4 * 1024 * 1024)
+
+# Without a flush the data should be written back within 2 seconds
+# (plus the time taken by the background thread to wake up).
+with open(os.environ["disk"], "rb") as f:
+    for i in range(10):
+        time.sleep(1)
+        f.seek(4 * 1024 * 1024)
+        if f.read(1024 * 1024) == b"\x55" * (1024 * 1024):
+            break
+    else:
+        assert False, "data was not written back"
+'
@@ -0,0 +1,82 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Check that cache-file keeps the cache across restarts.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_run
+requires_filter cache
+requires_plugin file
+requires nbdsh --version
+
+disk=cache-file.img
+cache=cache-file.cache
+files="$disk $cache $cache.meta"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Cache the first 1M of a disk containing 0x01 bytes.
+printf '\001%.0s' {1..1048576} > $disk
+truncate -s 4M $disk
+nbdkit -U - --filter=cache file $disk \
+       cache-file=$cache cache-on-read=true \
+       --run 'nbdsh -u "$uri" -c "assert h.pread(1024, 0) == b\"\\x01\" * 1024"'
+test -f $cache.meta
+
+# Change the disk behind nbdkit's back.  If the cache is reused then
+# we still see the old data.
+dd if=/dev/zero of=$disk bs=1M count=1 conv=notrunc
+nbdkit -U - --filter=cache file $disk \
+       cache-file=$cache cache-on-read=true \
+       --run 'nbdsh -u "$uri" -c "assert h.pread(1024, 0) == b\"\\x01\" * 1024"'
+
+# With a different cache-file-id the cache is discarded.
+nbdkit -U - --filter=cache file $disk \
+       cache-file=$cache cache-file-id=2 cache-on-read=true \
+       --run 'nbdsh -u "$uri" -c "assert h.pread(1024, 0) == bytes(1024)"'
+
+# A writethrough rewrite of a block which is already clean must still
+# be kept across restarts.
+nbdkit -U - --filter=cache file $disk \
+       cache-file=$cache cache-on-read=true cache=writethrough \
+       --run 'nbdsh -u "$uri" -c "
+assert h.pread(1024, 0) == bytes(1024)
+h.pwrite(b\"\\x02\" * 1024, 0)
+h.flush()
+"'
+dd if=/dev/zero of=$disk bs=1M count=1 conv=notrunc
+nbdkit -U - --filter=cache file $disk \
+       cache-file=$cache cache-on-read=true cache=writethrough \
+       --run 'nbdsh -u "$uri" -c "assert h.pread(1024, 0) == b\"\\x02\" * 1024"'
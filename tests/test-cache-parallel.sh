@@ -0,0 +1,68 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Check that cache misses to different parts of the disk are sent to
+# the plugin in parallel, and do not hold up cache hits.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter cache
+requires_filter delay
+requires_plugin memory
+requires nbdsh --version
+
+nbdsh -c '
+import time
+
+h.connect_command(["nbdkit", "-s", "--filter=cache", "--filter=delay",
+                   "memory", "64M", "cache-on-read=true", "rdelay=2"])
+
+# Populate the cache for the first block.
+h.pread(4096, 0)
+
+# 8 misses 4M apart take about 2 seconds in total, not 16.
+start = time.monotonic()
+bufs = [nbd.Buffer(4096) for i in range(8)]
+for i in range(8):
+    h.aio_pread(bufs[i], (i+1) * 4 * 1024 * 1024)
+
+# A hit is not blocked by the misses in flight.
+hit_start = time.monotonic()
+h.pread(4096, 0)
+assert time.monotonic() - hit_start < 1
+
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+assert time.monotonic() - start < 8
+'
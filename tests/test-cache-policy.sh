@@ -0,0 +1,83 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Check that cache-policy=2q keeps the working set cached while a
+# large part of the disk is read once, and test cache-stats.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_run
+requires_filter cache
+requires_plugin memory
+requires nbdsh --version
+# The cache directory must support FALLOC_FL_PUNCH_HOLE for
+# cache-max-size to work.
+requires_linux_kernel_version 3.5
+
+d=cache-policy.d
+rm -rf $d
+mkdir -p $d
+cleanup_fn rm -rf $d
+TMPDIR=$d
+export TMPDIR
+
+# Read a working set of 16 blocks, scan 60 blocks, read the working
+# set again, then scan 400 blocks.  The cache holds 64 blocks.  With
+# LRU the second scan pushes the working set out of the cache, but
+# with 2Q the working set stays cached.
+nbdkit -U - --filter=cache memory 64M \
+       cache-min-block-size=64K cache-max-size=4M cache-on-read=true \
+       cache-policy=2q cache-stats=$d/stats \
+       --run 'nbdsh -u "$uri" -c "
+bs = 65536
+def scan(start, n):
+    for i in range(start, start + n):
+        h.pread(bs, i * bs)
+scan(0, 16)
+scan(128, 60)
+scan(0, 16)
+scan(256, 400)
+scan(0, 16)
+"'
+cat $d/stats
+
+grep '^hits:' $d/stats
+grep '^misses:' $d/stats
+grep '^hit rate:' $d/stats
+grep '^evictions:' $d/stats
+
+# The final reads of the working set must all be hits.
+hits=$( grep '^hits:' $d/stats | $CUT -d: -f2 )
+test "$hits" -ge 16
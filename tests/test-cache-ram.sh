@@ -0,0 +1,74 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test the in-memory tier of the cache filter (cache-ram-size).
+
+source ./functions.sh
+set -e
+set -x
+
+requires_run
+requires_filter cache
+requires_plugin memory
+requires nbdsh --version
+
+d=cache-ram.d
+rm -rf $d
+mkdir -p $d
+cleanup_fn rm -rf $d
+TMPDIR=$d
+export TMPDIR
+
+# The RAM tier holds 4 blocks.  Read and write the first 4 blocks,
+# then read all 8 blocks so that blocks are evicted from RAM, and
+# check that we always see the latest data.
+nbdkit -U - --filter=cache memory 1M \
+       cache-min-block-size=64K cache-ram-size=256K cache-on-read=true \
+       cache-stats=$d/stats \
+       --run 'nbdsh -u "$uri" -c "
+bs = 65536
+expected = [bytes(bs)] * 8
+for n in range(4):
+    for i in range(4):
+        assert h.pread(bs, i * bs) == expected[i]
+    expected[n] = bytes([n + 1]) * bs
+    h.pwrite(expected[n], n * bs)
+for n in range(2):
+    for i in range(8):
+        assert h.pread(bs, i * bs) == expected[i]
+"'
+cat $d/stats
+
+# Some of the reads must have come from RAM.
+ram_hits=$( grep '^ram hits:' $d/stats | $CUT -d: -f2 )
+test "$ram_hits" -gt 0
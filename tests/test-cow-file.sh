@@ -0,0 +1,93 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the cow filter with cow-file, which stores the overlay in a
+# qcow2 file that persists between runs.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_run
+requires_filter cow
+requires_filter qcow2dec
+requires_plugin memory
+requires nbdsh --version
+
+if is_windows; then
+   echo "$0: the cow filter needs to be fixed to work on Windows"
+   exit 77
+fi
+
+d=cow-file.d
+rm -rf $d
+mkdir -p $d
+cleanup_fn rm -rf $d
+
+# Write to the overlay, creating the file.
+nbdkit -U - --filter=cow memory 1M cow-file=$d/overlay.qcow2 \
+       --run 'nbdsh -u "$uri" -c "
+h.pwrite(b\"1\" * 65536, 0)
+h.pwrite(b\"2\" * 1000, 200000)
+h.trim(65536, 524288)
+"'
+
+# Because the plugin is the memory plugin, all data comes from the
+# overlay in the second run.
+nbdkit -U - --filter=cow memory 1M cow-file=$d/overlay.qcow2 \
+       --run 'nbdsh -u "$uri" -c "
+assert h.pread(65536, 0) == b\"1\" * 65536
+assert h.pread(1000, 200000) == b\"2\" * 1000
+assert h.pread(1000, 199000) == bytes(1000)
+assert h.pread(65536, 524288) == bytes(65536)
+h.pwrite(b\"3\" * 4096, 1044480)
+"'
+
+# The file can be read by other programs as a qcow2 file.
+nbdkit -U - --filter=qcow2dec file $d/overlay.qcow2 \
+       --run 'nbdsh -u "$uri" -c "
+assert h.get_size() == 1048576
+assert h.pread(65536, 0) == b\"1\" * 65536
+assert h.pread(1000, 200000) == b\"2\" * 1000
+assert h.pread(4096, 1044480) == b\"3\" * 4096
+"'
+
+if qemu-img --version >/dev/null 2>&1; then
+    qemu-img check $d/overlay.qcow2
+fi
+
+# Reopening the file for a disk of a different size must fail.
+if nbdkit -U - --filter=cow memory 2M cow-file=$d/overlay.qcow2 \
+          --run 'nbdsh -u "$uri" -c "h.pread(512, 0)"'; then
+    echo "$0: expected reopening with a different size to fail"
+    exit 1
+fi
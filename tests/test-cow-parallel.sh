@@ -0,0 +1,137 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the cow filter with many concurrent, overlapping writes and
+# trims from several connections, and with the size of the
+# underlying file changing while requests are in flight.  The data
+# read back is compared with a model of the disk.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter cow
+requires_plugin file
+requires_nbdsh_uri
+
+# On Windows, calling ftruncate in the cow filter fails with:
+# nbdkit: memory[1]: error: ftruncate: File too large
+if is_windows; then
+   echo "$0: the cow filter needs to be fixed to work on Windows"
+   exit 77
+fi
+
+sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+data=cow-parallel.data
+files="cow-parallel.pid $sock $data"
+rm -f $files
+cleanup_fn rm -f $files
+
+: > $data
+
+# Use a small block size so that many requests share blocks, and
+# cow-on-read so that blocks are copied from the plugin while they are
+# being written.
+start_nbdkit -P cow-parallel.pid -U $sock \
+             --filter=cow file $data \
+             cow-block-size=4K cow-on-read=true
+
+export data sock
+nbdsh -c '
+import os
+import random
+import sys
+
+sys.path.insert(0, os.environ.get("srcdir", "."))
+from parallel_io import pattern, make_requests, send_request, wait, check
+
+data = os.environ["data"]
+sock = os.environ["sock"]
+random.seed(1)
+
+# The underlying file starts with non-zero data, so that trims can be
+# seen.
+size = 4 * 1024 * 1024
+with open(data, "wb") as f:
+    f.write(pattern(1000, 0, 256 * 1024) * (size // (256 * 1024)))
+with open(data, "rb") as f:
+    model = bytearray(f.read())
+
+def connect():
+    c = nbd.NBD()
+    c.connect_unix(sock)
+    assert c.get_size() == size
+    return c
+
+# Make a round of writes and trims, packed closely so that they share
+# cow blocks.
+def send_round(r, conns, limit):
+    requests = make_requests(random.randrange(0, 64 * 1024), limit,
+                             [1, 512, 4095, 4096, 4097, 10000, 65536],
+                             [0, 0, 0, 1, 100, 8192],
+                             ["w", "w", "w", "t"])
+    for i, request in enumerate(requests):
+        send_request(r, conns[i % len(conns)], request, model, cookies)
+
+cookies = []
+conns = [connect() for i in range(4)]
+for r in range(10):
+    send_round(r, conns, size)
+    wait(conns, cookies)
+    check(conns[r % len(conns)], model, "round %d" % r)
+
+# Change the size of the file while requests are in flight.  Requests
+# from the old connections stay within the smaller of the two sizes.
+# The overlay keeps the data below the new size, and above it the
+# data comes from the file.
+for (r, new_size) in [(10, 3 * 1024 * 1024), (11, 5 * 1024 * 1024),
+                      (12, 5 * 1024 * 1024 + 65536)]:
+    send_round(r, conns, min(size, new_size))
+    os.truncate(data, new_size)
+    if new_size < size:
+        del model[new_size:]
+    else:
+        model += bytes(new_size - size)
+    size = new_size
+    new_conn = connect()
+    wait(conns, cookies)
+    for c in conns:
+        c.shutdown()
+    conns = [new_conn] + [connect() for i in range(3)]
+    check(conns[0], model, "after resizing to %d" % size)
+    send_round(r + 100, conns, size)
+    wait(conns, cookies)
+    check(conns[1], model, "round %d after resizing to %d" % (r + 100, size))
+
+for c in conns:
+    c.shutdown()
+'
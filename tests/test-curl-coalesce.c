@@ -0,0 +1,219 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test that the curl plugin combines parallel reads into range
+ * requests correctly.  The reads are adjacent, overlapping or
+ * separated by gaps of various sizes, so some are combined and some
+ * are not, and the data returned for each must be the same as in the
+ * file.  In the second half of the test the web server ignores large
+ * ranges, so the plugin has to retry combined reads separately.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <libnbd.h>
+
+#include "array-size.h"
+#include "cleanup.h"
+#include "web-server.h"
+
+#include "requires.h"
+#include "test.h"
+
+#define NR_ROUNDS 20
+#define NR_READS 16
+
+/* Sizes of the reads and the gaps after them.  A gap of -512 means
+ * the next read overlaps this one.  The curl plugin fills gaps up to
+ * 64K.
+ */
+static const uint32_t sizes[] = { 512, 4096, 1000, 65536, 3, 8192 };
+static const int64_t gaps[] = { 0, 0, 1, -512, 100, 8192, 65536, 70000 };
+
+static unsigned nr_requests;
+
+static void
+check_request (const char *request)
+{
+  if (strncmp (request, "GET ", 4) == 0)
+    nr_requests++;
+}
+
+int
+main (int argc, char *argv[])
+{
+  const char *sockpath;
+  struct nbd_handle *nbd;
+  CLEANUP_FREE char *usp_param = NULL;
+  int fd;
+  int64_t size;
+  char *bufs[NR_READS], *expected;
+  uint64_t offsets[NR_READS];
+  uint32_t counts[NR_READS];
+  int64_t cookies[NR_READS];
+  unsigned round, i, n = 0;
+
+#ifndef HAVE_CURLOPT_UNIX_SOCKET_PATH
+  skip_because ("curl does not support CURLOPT_UNIX_SOCKET_PATH");
+#endif
+
+  sockpath = web_server ("disk", check_request, false);
+  if (sockpath == NULL) {
+    fprintf (stderr, "%s: could not start web server thread\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  fd = open ("disk", O_RDONLY);
+  if (fd == -1) {
+    perror ("disk");
+    exit (EXIT_FAILURE);
+  }
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Start nbdkit. */
+  if (asprintf (&usp_param, "unix-socket-path=%s", sockpath) == -1) {
+    perror ("asprintf");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd,
+                           (char *[]) {
+                             "nbdkit", "-s", "--exit-with-parent", "-v",
+                             "curl",
+                             "-D", "curl.worker=1",
+                             "http://localhost/disk",
+                             "connections=4",
+                             usp_param, /* unix-socket-path=... */
+                             NULL }) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  size = nbd_get_size (nbd);
+  if (size == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < NR_READS; ++i) {
+    bufs[i] = malloc (65536);
+    if (bufs[i] == NULL) {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+  }
+  expected = malloc (65536);
+  if (expected == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+
+  for (round = 0; round < NR_ROUNDS; ++round) {
+    uint64_t offset = (uint64_t) round * 1024 * 1024 + round;
+
+    /* No reads are in flight, so this is safe. */
+    if (round == NR_ROUNDS / 2)
+      web_server_max_range = 65536;
+
+    /* Issue all the reads before waiting for any of them, so that
+     * the plugin sees them at the same time.
+     */
+    for (i = 0; i < NR_READS; ++i, ++n) {
+      offsets[i] = offset;
+      counts[i] = sizes[n % ARRAY_SIZE (sizes)];
+      if (offsets[i] + counts[i] > (uint64_t) size) {
+        fprintf (stderr, "%s: disk is too small for this test\n",
+                 program_name);
+        exit (EXIT_FAILURE);
+      }
+      cookies[i] = nbd_aio_pread (nbd, bufs[i], counts[i], offsets[i],
+                                  NBD_NULL_COMPLETION, 0);
+      if (cookies[i] == -1) {
+        fprintf (stderr, "%s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+      offset += counts[i] + gaps[n % ARRAY_SIZE (gaps)];
+    }
+
+    while (nbd_aio_in_flight (nbd) > 0) {
+      if (nbd_poll (nbd, -1) == -1) {
+        fprintf (stderr, "%s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+
+    for (i = 0; i < NR_READS; ++i) {
+      if (nbd_aio_command_completed (nbd, cookies[i]) != 1) {
+        fprintf (stderr, "%s: read %" PRIu32 " bytes at offset %" PRIu64
+                 ": %s\n",
+                 program_name, counts[i], offsets[i], nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+      if (pread (fd, expected, counts[i], offsets[i]) != counts[i]) {
+        perror ("pread: disk");
+        exit (EXIT_FAILURE);
+      }
+      if (memcmp (bufs[i], expected, counts[i]) != 0) {
+        fprintf (stderr, "%s: read %" PRIu32 " bytes at offset %" PRIu64
+                 ": unexpected data\n",
+                 program_name, counts[i], offsets[i]);
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  /* Whether reads are combined depends on timing, so this is not an
+   * error, but it is useful to know when looking at the test log.
+   */
+  fprintf (stderr, "%s: %u reads were made using %u requests\n",
+           program_name, n, nr_requests);
+
+  for (i = 0; i < NR_READS; ++i)
+    free (bufs[i]);
+  free (expected);
+  close (fd);
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,335 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test the pool of curl handles.  Several clients make parallel reads
+ * through one nbdkit process, so that handles are returned to the
+ * pool and reused for later requests.  We check that the pool does
+ * not allocate more handles than it needs, and that the headers and
+ * cookies from header-script and cookie-script are applied to every
+ * request made with a reused handle, including after the scripts
+ * have been re-run.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <libnbd.h>
+
+#include "cleanup.h"
+#include "web-server.h"
+
+#include "requires.h"
+#include "test.h"
+
+#define NR_CLIENTS 2
+#define NR_THREADS "2"          /* nbdkit threads per client */
+#define CONNECTIONS 4           /* = NR_CLIENTS * NR_THREADS */
+#define NR_PHASES 3
+#define NR_ROUNDS 4
+#define NR_READS 8
+#define READ_SIZE 4096
+
+#define HEADER_SCRIPT "echo X-Iteration: $iteration"
+#define COOKIE_SCRIPT "echo iteration=$iteration"
+
+/* The lowest $iteration that the scripts may have been called with
+ * when a request is made.  The scripts are re-run at most every
+ * second, but a phase may take longer than that, so requests can
+ * carry a higher value.
+ */
+static unsigned iteration;
+
+static unsigned nr_requests;
+
+/* Set if check_request finds a problem.  We cannot exit from the web
+ * server thread because nbdkit would wait forever for the reply while
+ * the test is cleaning up.
+ */
+static bool bad_request;
+
+static int disk_fd;
+
+static void
+check_value (const char *request, const char *prefix, const char *what)
+{
+  const char *p;
+  unsigned v;
+
+  p = strcasestr (request, prefix);
+  if (p == NULL || sscanf (p + strlen (prefix), "%u", &v) != 1) {
+    fprintf (stderr, "%s: no %s in request\n", program_name, what);
+    bad_request = true;
+    return;
+  }
+  if (strcasestr (p + strlen (prefix), prefix) != NULL) {
+    fprintf (stderr, "%s: %s sent more than once in request\n",
+             program_name, what);
+    bad_request = true;
+  }
+  if (v < iteration) {
+    fprintf (stderr, "%s: stale %s in request: "
+             "expected iteration >= %u but found %u\n",
+             program_name, what, iteration, v);
+    bad_request = true;
+  }
+}
+
+static void
+check_request (const char *request)
+{
+  check_value (request, "\r\nX-Iteration: ", "X-Iteration header");
+  check_value (request, "\r\nCookie: iteration=", "iteration cookie");
+
+  if (strncmp (request, "GET ", 4) == 0)
+    nr_requests++;
+}
+
+struct client {
+  unsigned id;
+  struct nbd_handle *nbd;
+};
+
+static void *
+start_client (void *arg)
+{
+  struct client *client = arg;
+  char bufs[NR_READS][READ_SIZE], expected[READ_SIZE];
+  uint64_t offsets[NR_READS];
+  int64_t cookies[NR_READS];
+  unsigned round, i;
+
+  for (round = 0; round < NR_ROUNDS; ++round) {
+    /* The reads are far enough apart that the plugin does not
+     * combine them, so each one is a separate request.
+     */
+    for (i = 0; i < NR_READS; ++i) {
+      offsets[i] = (uint64_t) (client->id * NR_READS + i) * 1024 * 1024
+        + round * READ_SIZE;
+      cookies[i] = nbd_aio_pread (client->nbd, bufs[i], READ_SIZE, offsets[i],
+                                  NBD_NULL_COMPLETION, 0);
+      if (cookies[i] == -1) {
+        fprintf (stderr, "%s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+
+    while (nbd_aio_in_flight (client->nbd) > 0) {
+      if (nbd_poll (client->nbd, -1) == -1) {
+        fprintf (stderr, "%s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+
+    for (i = 0; i < NR_READS; ++i) {
+      if (nbd_aio_command_completed (client->nbd, cookies[i]) != 1) {
+        fprintf (stderr, "%s: client %u: read at offset %" PRIu64 ": %s\n",
+                 program_name, client->id, offsets[i], nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+      if (pread (disk_fd, expected, READ_SIZE, offsets[i]) != READ_SIZE) {
+        perror ("pread: disk");
+        exit (EXIT_FAILURE);
+      }
+      if (memcmp (bufs[i], expected, READ_SIZE) != 0) {
+        fprintf (stderr, "%s: client %u: read at offset %" PRIu64
+                 ": unexpected data\n",
+                 program_name, client->id, offsets[i]);
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+  const char *sockpath;
+  CLEANUP_FREE char *usp_param = NULL;
+  char log_file[] = "/tmp/nbdkitXXXXXX";
+  int log_fd, orig_stderr, r;
+  struct client clients[NR_CLIENTS];
+  pthread_t threads[NR_CLIENTS];
+  unsigned phase, i, nr_allocated = 0, nr_freed = 0;
+  FILE *fp;
+  CLEANUP_FREE char *line = NULL;
+  size_t len = 0;
+
+#ifndef HAVE_CURLOPT_UNIX_SOCKET_PATH
+  skip_because ("curl does not support CURLOPT_UNIX_SOCKET_PATH");
+#endif
+
+  requires_exists ("disk");
+
+  sockpath = web_server ("disk", check_request, false);
+  if (sockpath == NULL) {
+    fprintf (stderr, "%s: could not start web server thread\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  disk_fd = open ("disk", O_RDONLY);
+  if (disk_fd == -1) {
+    perror ("disk");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Start nbdkit, sending its debug messages to a temporary file so
+   * we can count how many handles it allocated.
+   */
+  if (asprintf (&usp_param, "unix-socket-path=%s", sockpath) == -1) {
+    perror ("asprintf");
+    exit (EXIT_FAILURE);
+  }
+  log_fd = mkstemp (log_file);
+  if (log_fd == -1) {
+    perror ("mkstemp");
+    exit (EXIT_FAILURE);
+  }
+  orig_stderr = dup (STDERR_FILENO);
+  if (orig_stderr == -1 || dup2 (log_fd, STDERR_FILENO) == -1) {
+    perror ("dup");
+    exit (EXIT_FAILURE);
+  }
+  r = test_start_nbdkit ("-t", NR_THREADS,
+                         "curl",
+                         "-D", "curl.pool=1",
+                         "http://localhost/disk",
+                         "connections=4", /* = CONNECTIONS */
+                         "header-script=" HEADER_SCRIPT,
+                         "header-script-renew=1",
+                         "cookie-script=" COOKIE_SCRIPT,
+                         "cookie-script-renew=1",
+                         usp_param, /* unix-socket-path=... */
+                         NULL);
+  dup2 (orig_stderr, STDERR_FILENO);
+  close (orig_stderr);
+  close (log_fd);
+  if (r == -1)
+    exit (EXIT_FAILURE);
+
+  /* Connecting causes a HEAD request for each client.  $iteration
+   * will be 0.
+   */
+  iteration = 0;
+  for (i = 0; i < NR_CLIENTS; ++i) {
+    clients[i].id = i;
+    clients[i].nbd = nbd_create ();
+    if (clients[i].nbd == NULL ||
+        nbd_connect_unix (clients[i].nbd, sock) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  for (phase = 0; phase < NR_PHASES; ++phase) {
+    /* Wait so the scripts are re-run before the next request. */
+    if (phase > 0) {
+      sleep (2);
+      iteration = phase;
+    }
+
+    for (i = 0; i < NR_CLIENTS; ++i) {
+      r = pthread_create (&threads[i], NULL, start_client, &clients[i]);
+      if (r != 0) {
+        errno = r;
+        perror ("pthread_create");
+        exit (EXIT_FAILURE);
+      }
+    }
+    for (i = 0; i < NR_CLIENTS; ++i) {
+      r = pthread_join (threads[i], NULL);
+      if (r != 0) {
+        errno = r;
+        perror ("pthread_join");
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  for (i = 0; i < NR_CLIENTS; ++i)
+    nbd_close (clients[i].nbd);
+  close (disk_fd);
+
+  /* Copy the nbdkit log to stderr and count the handles allocated
+   * and freed by the pool.
+   */
+  fp = fopen (log_file, "r");
+  if (fp == NULL) {
+    perror (log_file);
+    exit (EXIT_FAILURE);
+  }
+  while (getline (&line, &len, fp) != -1) {
+    fputs (line, stderr);
+    if (strstr (line, "pool: no idle handles") != NULL)
+      nr_allocated++;
+    if (strstr (line, "pool: pool is full") != NULL)
+      nr_freed++;
+  }
+  fclose (fp);
+  unlink (log_file);
+
+  fprintf (stderr, "%s: %u requests were made using %u handles\n",
+           program_name, nr_requests, nr_allocated);
+
+  if (bad_request)
+    exit (EXIT_FAILURE);
+
+  /* There are never more than CONNECTIONS requests at the same time,
+   * so all the handles fit in the pool and none should be freed.
+   */
+  if (nr_allocated == 0 || nr_allocated > CONNECTIONS || nr_freed > 0) {
+    fprintf (stderr, "%s: expected between 1 and %d handles to be "
+             "allocated and none to be freed, "
+             "but %u were allocated and %u were freed\n",
+             program_name, CONNECTIONS, nr_allocated, nr_freed);
+    exit (EXIT_FAILURE);
+  }
+  if (nr_requests < NR_PHASES * NR_CLIENTS * NR_ROUNDS * NR_READS) {
+    fprintf (stderr, "%s: expected at least %d requests but saw %u\n",
+             program_name, NR_PHASES * NR_CLIENTS * NR_ROUNDS * NR_READS,
+             nr_requests);
+    exit (EXIT_FAILURE);
+  }
+
+  exit (EXIT_SUCCESS);
+}
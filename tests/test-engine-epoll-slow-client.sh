@@ -0,0 +1,70 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test that with --engine=epoll, clients which do not read their
+# replies do not stall other clients.
+
+source ./functions.sh
+set -e
+set -x
+
+requires test "$(uname)" = "Linux"
+requires_nbdsh_uri
+requires timeout 60s true
+
+sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="engine-epoll-slow-client.pid $sock"
+rm -f $files
+cleanup_fn rm -f $files
+
+start_nbdkit -P engine-epoll-slow-client.pid --engine=epoll \
+             -U $sock pattern 1G
+
+# Open more connections than there are worker threads in the shared
+# pool.  Each one requests more data than fits in the socket buffer
+# and never reads the replies.  Then check that another client can
+# still make requests.
+timeout 60s nbdsh -c '
+lazy = []
+for i in range(64):
+    h = nbd.NBD()
+    h.connect_unix("'"$sock"'")
+    buf = nbd.Buffer(2*1024*1024)
+    h.aio_pread(buf, 0)
+    lazy.append((h, buf))
+
+h = nbd.NBD()
+h.connect_unix("'"$sock"'")
+for i in range(100):
+    buf = h.pread(512, i * 4096)
+    assert buf[0:8] == (i * 4096).to_bytes(8, "big")
+'
@@ -0,0 +1,86 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the NBD extended headers extension, which allows trim, zero
+# and block status requests to use 64 bit lengths.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_run
+requires_plugin memory
+requires_nbdsh_uri
+requires nbdsh -c 'exit(not h.get_request_extended_headers())'
+
+export script='
+T = 1024**4
+assert h.get_extended_headers_negotiated()
+assert h.get_structured_replies_negotiated()
+
+entries = []
+def f(metacontext, offset, e, err):
+    if metacontext == nbd.CONTEXT_BASE_ALLOCATION:
+        entries.extend(e)
+
+# Write some data beyond the 32 bit boundary.
+h.pwrite(b"hello", 4*T)
+assert h.pread(5, 4*T) == b"hello"
+
+# A single block status request can describe the whole disk, using
+# extents longer than 32 bits.
+h.block_status_64(8*T, 0, f)
+print(entries)
+assert entries[0][0] == 4*T
+assert entries[0][1] == nbd.STATE_HOLE | nbd.STATE_ZERO
+assert sum(e[0] for e in entries) >= 8*T
+
+# Zero and trim requests larger than 4G are split by the server.
+h.zero(8*T, 0)
+assert h.pread(5, 4*T) == bytearray(5)
+entries = []
+h.block_status_64(8*T, 0, f)
+print(entries)
+assert entries[0][0] >= 8*T
+
+h.pwrite(b"hello", 4*T)
+h.trim(8*T, 0)
+assert h.pread(5, 4*T) == bytearray(5)
+'
+
+nbdkit memory 16T --run 'nbdsh -u "$uri" -c "$script"'
+
+# Extended headers are disabled by --no-sr.
+nbdkit --no-sr memory 1M \
+       --run 'nbdsh -u "$uri" \
+                    -c "assert not h.get_extended_headers_negotiated()" \
+                    -c "assert not h.get_structured_replies_negotiated()"'
@@ -0,0 +1,100 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the file plugin with cache=direct.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_run
+requires_plugin file
+requires_nbdsh_uri
+requires $TRUNCATE --version
+requires $STAT --version
+
+if ! nbdkit file --dump-plugin | grep -sq "^file_o_direct=yes"; then
+    echo "$0: cache=direct is not supported in this build"
+    exit 77
+fi
+
+files="file-cache-direct.img"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Use a size which is not a multiple of the block size.
+$TRUNCATE -s 1048676 file-cache-direct.img
+
+# The filesystem containing the test directory may not support
+# O_DIRECT.
+if ! nbdkit file file-cache-direct.img cache=direct \
+     --run 'nbdsh -u "$uri" -c "pass"'; then
+    echo "$0: O_DIRECT is not supported here"
+    exit 77
+fi
+
+nbdkit file file-cache-direct.img cache=direct \
+       --run 'nbdsh -u "$uri" -c "
+# The O_DIRECT alignment is advertised as the minimum block size.
+minimum = h.get_block_size(nbd.SIZE_MINIMUM)
+assert minimum >= 512
+
+buf0 = bytearray(minimum)
+buf1 = b\"1\" * minimum
+buf2 = b\"2\" * minimum
+
+# Aligned requests.
+h.pwrite(buf1 + buf2, minimum)
+assert h.pread(4 * minimum, 0) == buf0 + buf1 + buf2 + buf0
+
+# Unaligned requests go through the bounce buffer.
+h.pwrite(b\"3\" * 100, minimum - 50)
+assert h.pread(4 * minimum, 0) == \
+    buf0[:-50] + b\"3\" * 100 + buf1[50:] + buf2 + buf0
+h.zero(200, minimum + 100, nbd.CMD_FLAG_FUA)
+assert h.pread(4 * minimum, 0) == \
+    buf0[:-50] + b\"3\" * 100 + buf1[50:100] + buf0[:200] + buf1[300:] + \
+    buf2 + buf0
+
+big = bytes(range(256)) * 2048
+h.pwrite(big, 300000)
+assert h.pread(len(big), 300000) == big
+assert h.pread(3, 300001) == bytes([1, 2, 3])
+
+# The end of the file is not aligned.
+size = h.get_size()
+h.pwrite(b\"4\" * 10, size - 10, nbd.CMD_FLAG_FUA)
+assert h.pread(10, size - 10) == b\"4\" * 10
+"'
+
+# Writing the partial block at the end must not extend the file.
+test "$($STAT -c %s file-cache-direct.img)" -eq 1048676
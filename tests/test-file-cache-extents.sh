@@ -0,0 +1,105 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the file plugin with cache-extents=true.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_run
+requires_plugin file
+requires_nbdsh_uri
+requires $TRUNCATE --version
+
+# The file plugin must support reading file extents.
+requires sh -c 'nbdkit file --dump-plugin | grep file_extents=yes'
+
+files="file-cache-extents.img"
+rm -f $files
+cleanup_fn rm -f $files
+
+$TRUNCATE -s 1M file-cache-extents.img
+
+# Whatever the filesystem, the extents must always match the data:
+# anything reported as zero must read as zero, and anything we have
+# written must be reported as data.  Two connections share the cache.
+nbdkit file file-cache-extents.img cache-extents=true \
+       --run 'nbdsh -c "
+h2 = nbd.NBD()
+h2.add_meta_context(nbd.CONTEXT_BASE_ALLOCATION)
+h2.connect_uri(\"$uri\")
+h.add_meta_context(nbd.CONTEXT_BASE_ALLOCATION)
+h.connect_uri(\"$uri\")
+
+def extents(h, count, offset):
+    ret = []
+    def f(metacontext, off, entries, err):
+        if metacontext == nbd.CONTEXT_BASE_ALLOCATION:
+            for i in range(0, len(entries), 2):
+                ret.append((entries[i], entries[i+1]))
+    h.block_status(count, offset, f)
+    return ret
+
+def check(h):
+    buf = h.pread(1024*1024, 0)
+    offset = 0
+    for (length, flags) in extents(h, 1024*1024, 0):
+        if flags & nbd.STATE_ZERO:
+            assert buf[offset:offset+length] == bytes(length)
+        offset += length
+    assert offset == 1024*1024
+
+check(h)
+h.pwrite(b\"1\" * 65536, 131072)
+for (length, flags) in extents(h2, 65536, 131072):
+    assert flags & nbd.STATE_ZERO == 0
+check(h2)
+h2.pwrite(b\"2\" * 1000, 500000)
+for (length, flags) in extents(h, 1000, 500000):
+    assert flags & nbd.STATE_ZERO == 0
+check(h)
+
+h.zero(32768, 147456)
+check(h2)
+h2.zero(1000, 500000)
+check(h)
+if h.can_trim():
+    h.trim(65536, 131072)
+    check(h2)
+h.pwrite(b\"3\" * 100, 131100)
+for (length, flags) in extents(h2, 100, 131100):
+    assert flags & nbd.STATE_ZERO == 0
+check(h2)
+
+h2.shutdown()
+"'
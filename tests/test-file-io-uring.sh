@@ -0,0 +1,87 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the file plugin with io=uring.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_run
+requires_plugin file
+requires_nbdsh_uri
+requires $TRUNCATE --version
+
+if ! nbdkit file --dump-plugin | grep -sq "^file_io_uring=yes"; then
+    echo "$0: io=uring is not supported in this build"
+    exit 77
+fi
+
+files="file-io-uring.img"
+rm -f $files
+cleanup_fn rm -f $files
+
+$TRUNCATE -s 16M file-io-uring.img
+
+# The kernel may not support io_uring, or it may be disabled.
+if ! nbdkit file file-io-uring.img io=uring --run true; then
+    echo "$0: io_uring is not available"
+    exit 77
+fi
+
+# Requests larger than 128K are split into several operations.
+nbdkit file file-io-uring.img io=uring \
+       --run 'nbdsh -u "$uri" -c "
+buf0 = bytearray(1024)
+buf1 = b\"1\" * 1024
+buf2 = b\"2\" * 1024
+h.pwrite(buf1 + buf2 + buf1 + buf2, 1024)
+buf = h.pread(8192, 0)
+assert buf == buf0 + buf1 + buf2 + buf1 + buf2 + buf0*3
+
+big = bytes(range(256)) * 16384
+h.pwrite(big, 1048576, nbd.CMD_FLAG_FUA)
+assert h.pread(len(big), 1048576) == big
+h.flush()
+
+if h.can_trim():
+    h.trim(1024, 1024)
+    buf = h.pread(8192, 0)
+    assert buf == buf0*2 + buf2 + buf1 + buf2 + buf0*3
+
+h.zero(4096, 1024)
+assert h.pread(8192, 0) == buf0*8
+
+# The last request in the file.
+h.pwrite(buf2, 16*1024*1024 - 1024)
+assert h.pread(1024, 16*1024*1024 - 1024) == buf2
+"'
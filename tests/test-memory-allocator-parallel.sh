@@ -0,0 +1,120 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test the allocators with many concurrent, overlapping reads, writes,
+# zeroes and trims from several connections.  The requests are spread
+# over a few windows of the disk, and the data read back is compared
+# with a model of the windows.  The sparse and zstd allocators are
+# also tested on a very large disk, where new L1 directory entries are
+# added concurrently too.  With zstd, requests to different parts of
+# the same page race on the page lock, and requests to different pages
+# compress and decompress in parallel.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_nbdsh_uri
+
+allocators="sparse malloc"
+
+# Test if the zstd allocator is supported in this build.
+if nbdkit memory --dump-plugin | grep -sq "zstd=yes"; then
+    allocators="$allocators zstd"
+fi
+
+export script='
+import os
+import random
+import sys
+
+sys.path.insert(0, os.environ.get("srcdir", "."))
+from parallel_io import make_requests, send_request, wait, check
+
+sock = os.environ["sock"]
+random.seed(1)
+
+conns = []
+for i in range(4):
+    c = nbd.NBD()
+    c.connect_unix(sock)
+    conns.append(c)
+size = conns[0].get_size()
+
+# Eight 1M windows spread evenly over the disk, aligned to a page so
+# that whole pages are freed by zeroing.
+window_size = 1024 * 1024
+step = size // 8 // 32768 * 32768
+windows = { i * step: bytearray(window_size) for i in range(8) }
+
+cookies = []
+for r in range(10):
+    requests = []
+    for start in windows:
+        requests += [(start, request) for request in
+                     make_requests(start + random.randrange(0, 4096),
+                                   start + window_size,
+                                   [1, 512, 4095, 32768, 32769, 65536,
+                                    100000],
+                                   [0, 0, 0, 1, 100, 32768],
+                                   ["w", "w", "w", "z", "t", "r"])]
+    random.shuffle(requests)
+
+    for i, (start, request) in enumerate(requests):
+        send_request(r, conns[i % len(conns)], request, windows[start],
+                     cookies, start)
+    wait(conns, cookies)
+
+    c = conns[r % len(conns)]
+    for (start, model) in windows.items():
+        check(c, model, "round %d" % r, start)
+
+for c in conns:
+    c.shutdown()
+'
+
+for allocator in $allocators; do
+    sizes="64M"
+    if [ "$allocator" != "malloc" ]; then
+        sizes="$sizes 1T"
+    fi
+    for size in $sizes; do
+        pid=memory-allocator-parallel-$allocator-$size.pid
+        sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+        rm -f $pid $sock
+        cleanup_fn rm -f $pid $sock
+
+        start_nbdkit -P $pid -U $sock memory $size allocator=$allocator
+        sock=$sock nbdsh -c "$script"
+    done
+done
@@ -0,0 +1,113 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test how zeroing affects the pages of the sparse allocator.  Only a
+# zero covering a whole page frees it.  A partial zero leaves the page
+# allocated, even if the whole page is now zero.  Allocated pages of
+# zeroes are reported as zero but not as a hole.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_nbdsh_uri
+requires nbdsh --base-allocation
+
+sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="memory-allocator-sparse-zero.pid $sock"
+rm -f $files
+cleanup_fn rm -f $files
+
+start_nbdkit -P memory-allocator-sparse-zero.pid -U $sock \
+             memory 1M allocator=sparse
+
+nbdsh --base-allocation --connect "nbd+unix://?socket=$sock" \
+      -c '
+# The size of the pages in the sparse array.
+page = 32768
+
+# Return the list of (length, flags) extents, merging adjacent
+# extents with the same flags.
+def extents():
+    entries = []
+    def f(metacontext, offset, e, err):
+        assert metacontext == nbd.CONTEXT_BASE_ALLOCATION
+        for length, flags in zip(*[iter(e)] * 2):
+            if entries and flags == entries[-1][1]:
+                entries[-1] = (entries[-1][0] + length, flags)
+            else:
+                entries.append((length, flags))
+    offset = 0
+    while offset < 8 * page:
+        before = sum(length for (length, flags) in entries)
+        h.block_status(8 * page - offset, offset, f)
+        offset = sum(length for (length, flags) in entries)
+        assert offset > before
+    return entries
+
+zero = nbd.STATE_ZERO
+hole = nbd.STATE_HOLE | nbd.STATE_ZERO
+
+# Allocate pages 0 to 3.
+h.pwrite(b"1" * 100, 0)
+h.pwrite(b"2" * (2 * page), page + 100)
+h.pwrite(b"3" * 100, 4 * page - 100)
+assert extents() == [(4 * page, 0), (4 * page, hole)]
+
+# Zeroing part of page 0 leaves it allocated, even though it is now
+# all zero.
+h.zero(512, 0)
+assert h.pread(page, 0) == bytes(page)
+assert extents() == [(page, zero), (3 * page, 0), (4 * page, hole)]
+
+# Zeroing the whole of page 0 frees it.
+h.zero(page, 0)
+assert extents() == [(page, hole), (3 * page, 0), (4 * page, hole)]
+
+# A zero from part way through page 1 to part way through page 3
+# frees page 2 but not pages 1 and 3, and the data outside the zeroed
+# range is kept.
+h.zero(2 * page, page + 200)
+assert extents() == [(page, hole), (page, 0), (page, hole),
+                     (page, 0), (4 * page, hole)]
+assert h.pread(100, page + 100) == b"2" * 100
+assert h.pread(page - 200, page + 200) == bytes(page - 200)
+assert h.pread(200, 3 * page) == bytes(200)
+assert h.pread(100, 4 * page - 100) == b"3" * 100
+
+# Trimming is the same as zeroing.
+h.trim(200, page)
+assert extents() == [(page, hole), (page, zero), (page, hole),
+                     (page, 0), (4 * page, hole)]
+h.trim(page, page)
+assert extents() == [(3 * page, hole), (page, 0), (4 * page, hole)]
+'
@@ -0,0 +1,88 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# Test that a write whose data is not completely sent by the client
+# does not change the disk, even though the memory plugin asks nbdkit
+# to receive write data straight into the disk image when
+# allocator=malloc.
+
+source ./functions.sh
+set -e
+set -x
+
+requires nbdsh --version
+
+sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="memory-write-in-place.pid $sock"
+rm -f $files
+cleanup_fn rm -f $files
+
+start_nbdkit -P memory-write-in-place.pid -U $sock \
+             memory 1M allocator=malloc
+
+export sock
+nbdsh -c '
+import os
+import socket
+import struct
+import time
+
+# Connect without libnbd so we can send part of a write request.
+s = socket.socket(socket.AF_UNIX)
+s.connect(os.environ["sock"])
+
+def recv_all(n):
+    buf = b""
+    while len(buf) < n:
+        b = s.recv(n - len(buf))
+        assert b
+        buf += b
+    return buf
+
+# Newstyle handshake, selecting the default export with
+# NBD_OPT_EXPORT_NAME.
+magic, opt_magic, gflags = struct.unpack(">8s8sH", recv_all(18))
+assert magic == b"NBDMAGIC"
+assert gflags & 2                            # NBD_FLAG_NO_ZEROES
+s.sendall(struct.pack(">I", 3))
+s.sendall(opt_magic + struct.pack(">II", 1, 0))
+size, eflags = struct.unpack(">QH", recv_all(10))
+assert size == 1024*1024
+
+# Send a 64K write to offset 0 but only half of the data, then
+# disconnect.
+s.sendall(struct.pack(">IHHQQI", 0x25609513, 0, 1, 1, 0, 65536))
+s.sendall(b"\xff" * 32768)
+time.sleep(1)
+s.close()
+
+# None of the data must have reached the disk.
+h.connect_unix(os.environ["sock"])
+assert h.pread(65536, 0) == bytearray(65536)
+'
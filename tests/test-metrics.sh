@@ -0,0 +1,88 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+# PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the --metrics option.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_run
+requires_plugin memory
+requires_plugin file
+requires_filter noextents
+requires nbdsh --version
+
+out=test-metrics.prom
+disk=test-metrics.img
+rm -f $out $disk
+cleanup_fn rm -f $out $out.tmp $disk
+
+nbdkit -U - --metrics=$out --filter=noextents memory 1M \
+       --run 'nbdsh -u "$uri" -c "
+h.pwrite(b\"1\" * 512, 0)
+for i in range(10):
+    h.pread(512, i * 512)
+h.flush()
+"'
+cat $out
+
+# Both layers see every read.
+grep '^nbdkit_request_duration_seconds_count{layer="1",type="filter",name="noextents",op="pread"} 10$' $out
+grep '^nbdkit_request_duration_seconds_count{layer="0",type="plugin",name="memory",op="pread"} 10$' $out
+grep '^nbdkit_request_duration_seconds_bucket{layer="0",type="plugin",name="memory",op="pread",le="+Inf"} 10$' $out
+grep '^nbdkit_request_duration_seconds_count{layer="0",type="plugin",name="memory",op="pwrite"} 1$' $out
+grep '^nbdkit_request_errors_total{layer="0",type="plugin",name="memory",op="pread"} 0$' $out
+
+# The file plugin sends reads directly from the file.
+truncate -s 1M $disk
+nbdkit -U - --metrics=$out file $disk \
+       --run 'nbdsh -u "$uri" -c "
+for i in range(10):
+    h.pread(512, i * 512)
+"'
+cat $out
+grep '^nbdkit_request_duration_seconds_count{layer="0",type="plugin",name="file",op="pread"} 10$' $out
+
+# This plugin handles reads and writes asynchronously.
+plugin=.libs/test-async-plugin.$SOEXT
+if test -f $plugin; then
+    nbdkit -U - --metrics=$out $plugin \
+           --run 'nbdsh -u "$uri" -c "
+h.pwrite(b\"1\" * 512, 0)
+for i in range(10):
+    h.pread(512, i * 512)
+"'
+    cat $out
+    grep '^nbdkit_request_duration_seconds_count{layer="0",type="plugin",name="async",op="pread"} 10$' $out
+    grep '^nbdkit_request_duration_seconds_count{layer="0",type="plugin",name="async",op="pwrite"} 1$' $out
+fi
@@ -0,0 +1 @@
+script=test-old-plugins-i686-Linux-v1.0.0-fs.sh exec $srcdir/test-old-plugins.sh i686-Linux-v1.0.0-fs
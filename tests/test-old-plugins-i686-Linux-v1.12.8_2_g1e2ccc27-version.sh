@@ -0,0 +1 @@
+script=test-old-plugins-i686-Linux-v1.12.8_2_g1e2ccc27-version.sh exec $srcdir/test-old-plugins.sh i686-Linux-v1.12.8_2_g1e2ccc27-version
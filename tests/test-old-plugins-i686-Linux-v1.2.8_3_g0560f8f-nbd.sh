@@ -0,0 +1 @@
+script=test-old-plugins-i686-Linux-v1.2.8_3_g0560f8f-nbd.sh exec $srcdir/test-old-plugins.sh i686-Linux-v1.2.8_3_g0560f8f-nbd
@@ -0,0 +1 @@
+script=test-old-plugins-i686-Linux-v1.38.4-dump.sh exec $srcdir/test-old-plugins.sh i686-Linux-v1.38.4-dump
@@ -0,0 +1 @@
+script=test-old-plugins-i686-Linux-v1.8.4_3_g11f5a90d-fs.sh exec $srcdir/test-old-plugins.sh i686-Linux-v1.8.4_3_g11f5a90d-fs
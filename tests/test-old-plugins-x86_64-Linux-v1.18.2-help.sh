@@ -0,0 +1 @@
+script=test-old-plugins-x86_64-Linux-v1.18.2-help.sh exec $srcdir/test-old-plugins.sh x86_64-Linux-v1.18.2-help
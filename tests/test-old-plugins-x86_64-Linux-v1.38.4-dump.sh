@@ -0,0 +1 @@
+script=test-old-plugins-x86_64-Linux-v1.38.4-dump.sh exec $srcdir/test-old-plugins.sh x86_64-Linux-v1.38.4-dump
@@ -76,6 +76,19 @@ wrote 512/512 bytes at offset 512"; then
   exit 1
 fi
 
+# With --filter=noparallel serialize=retirement, the requests run in
+# parallel but the write reply is still sent first
+nbdkit -v --filter=noparallel --filter=delay file test-parallel-file.data \
+  serialize=retirement wdelay=2 rdelay=1 \
+  --run 'timeout 60s </dev/null qemu-io -f raw \
+    -c "aio_write -P 2 512 512" -c "aio_read -P 1 0 512" -c aio_flush "$uri"' |
+    tee test-parallel-file.out
+if test "$(grep '512/512' test-parallel-file.out)" != \
+"wrote 512/512 bytes at offset 512
+read 512/512 bytes at offset 0"; then
+  exit 1
+fi
+
 # With --filter=noparallel, the write should complete first because it was issued first
 nbdkit -v --filter=noparallel --filter=delay file test-parallel-file.data \
   wdelay=2 rdelay=1 --run 'timeout 60s </dev/null qemu-io -f raw \
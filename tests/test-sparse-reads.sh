@@ -0,0 +1,77 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+# PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Check that zero runs in read replies are sent as hole chunks when
+# structured replies are negotiated, and that the data round-trips.
+
+source ./functions.sh
+set -x
+
+requires_plugin memory
+requires nbdsh --version
+
+for sparse in 1 0; do
+    nbdsh -c '
+import sys
+sparse = int(sys.argv[1])
+h.connect_command(["nbdkit", "-s", "-v"] +
+                  (["--sparse-reads"] if sparse else []) +
+                  ["memory", "1M"])
+assert h.get_structured_replies_negotiated()
+
+h.pwrite(b"\x01" * 100, 65536 + 10)
+h.pwrite(b"\x02" * 8192, 200000)
+
+chunks = []
+def chunk(subbuf, offset, status, error):
+    chunks.append((offset, len(subbuf), status))
+    if status == nbd.READ_HOLE:
+        assert subbuf == bytearray(len(subbuf))
+    return 0
+
+buf = h.pread_structured(1048576, 0, chunk)
+assert buf[65536+10:65536+110] == b"\x01" * 100
+assert buf[200000:208192] == b"\x02" * 8192
+print(chunks)
+holes = [c for c in chunks if c[2] == nbd.READ_HOLE]
+if sparse:
+    assert len(holes) == 3
+    assert sum(c[1] for c in holes) == 1048576 - 4096 - 4096*3
+else:
+    assert chunks == [(0, 1048576, nbd.READ_DATA)]
+
+# NBD_CMD_FLAG_DF must always give a single data chunk.
+chunks = []
+h.pread_structured(65536 * 2, 0, chunk, nbd.CMD_FLAG.DF)
+assert chunks == [(0, 65536 * 2, nbd.READ_DATA)]
+' $sparse
+done
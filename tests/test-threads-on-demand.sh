@@ -0,0 +1,74 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+# PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Check that worker threads are only started when the client has
+# requests in flight in parallel.
+
+source ./functions.sh
+set -x
+
+requires_single_mode
+requires_plugin memory
+requires_filter delay
+requires nbdsh --version
+
+log=test-threads-on-demand.log
+rm -f $log
+cleanup_fn rm -f $log
+
+# A client which sends one request at a time needs at most one extra
+# thread, regardless of -t.
+nbdsh -c '
+h.connect_command(["nbdkit", "-s", "-v", "-t", "16", "memory", "1M"])
+for i in range(10):
+    h.pread(512, i * 512)
+' 2>$log
+cat $log
+test "$(grep -c 'starting worker thread' $log)" -le 1
+
+# A client with 8 requests in flight gets up to 8 threads, so the
+# delays overlap.
+nbdsh -c '
+import time
+h.connect_command(["nbdkit", "-s", "-v", "-t", "16",
+                   "--filter=delay", "memory", "1M", "rdelay=2"])
+start = time.monotonic()
+bufs = [nbd.Buffer(512) for i in range(8)]
+for i in range(8):
+    h.aio_pread(bufs[i], i * 512)
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+assert time.monotonic() - start < 8
+' 2>$log
+cat $log
+test "$(grep -c 'starting worker thread' $log)" -ge 2
+test "$(grep -c 'starting worker thread' $log)" -le 8
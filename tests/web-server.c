@@ -68,6 +68,7 @@ static struct stat statbuf;
 static char request[16384];
 static check_request_t check_request;
 static bool head_fails_with_403 = false;
+uint64_t web_server_max_range = 0;
 
 static void *start_web_server (void *arg);
 static void handle_requests (int s);
@@ -320,6 +321,7 @@ static void
 handle_file_request (int s, enum method method)
 {
   const bool headers_only = method == HEAD;
+  bool ignored_range = false;
   uint64_t offset, length, end;
   const char *p;
   const char response1_ok[] = "HTTP/1.1 200 OK\r\n";
@@ -352,7 +354,15 @@ handle_file_request (int s, enum method method)
      * byte beyond the end of the range.
      */
     length = end - offset;
-    xwrite (s, response1_partial, strlen (response1_partial));
+    if (web_server_max_range == 0 || length <= web_server_max_range)
+      xwrite (s, response1_partial, strlen (response1_partial));
+    else {
+      /* Ignore the range, see web_server_max_range. */
+      ignored_range = true;
+      offset = 0;
+      length = statbuf.st_size;
+      xwrite (s, response1_ok, strlen (response1_ok));
+    }
   }
 
   xwrite (s, response2, strlen (response2));
@@ -372,12 +382,13 @@ handle_file_request (int s, enum method method)
   }
 
   xpread (data, length, offset);
-  if (!head_fails_with_403 || offset != 0)
+  if ((!head_fails_with_403 || offset != 0) && !ignored_range)
     xwrite (s, data, length);
   else
     /* In the special case where we are testing the fallback from HEAD
      * request case, the curl plugin will issue a GET for the whole
-     * data, but not read it all.  Ignore EPIPE errors here.
+     * data, but not read it all.  Likewise if we ignored the range
+     * the client may stop reading.  Ignore EPIPE errors here.
      */
     xwrite_allow_epipe (s, data, length);
 
@@ -534,7 +545,7 @@ xwrite_allow_epipe (int s, const char *buf, size_t len)
   while (len > 0) {
     r = write (s, buf, len);
     if (r == -1) {
-      if (errno == EPIPE)
+      if (errno == EPIPE || errno == ECONNRESET)
         return;
       perror ("web server: write");
       exit (EXIT_FAILURE);
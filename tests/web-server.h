@@ -44,6 +44,7 @@
 #define NBDKIT_WEB_SERVER_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 /* Starts a web server in a background thread.  The web server will
  * serve 'filename' (only) - the URL in requests is ignored.
@@ -70,4 +71,11 @@ extern const char *web_server (const char *filename,
                                bool head_fails_with_403)
   __attribute__ ((__nonnull__ (1)));
 
+/* If this is set to a non-zero value then range requests for more
+ * bytes than this are answered with 200 and the whole file, to
+ * simulate a server which limits the size of ranges.  It may be
+ * changed while no requests are in flight.
+ */
+extern uint64_t web_server_max_range;
+
 #endif /* NBDKIT_WEB_SERVER_H */